@@ -313,7 +313,9 @@ ext_modules = [
     mx_Extension('mx.TextTools.mxTextTools.mxTextTools',
                  ['mx/TextTools/mxTextTools/mxTextTools.c',
                   'mx/TextTools/mxTextTools/mxte.c',
-                  'mx/TextTools/mxTextTools/mxbmse.c'],
+                  'mx/TextTools/mxTextTools/mxbmse.c',
+                  'mx/TextTools/mxTextTools/mxscan.c',
+                  'mx/TextTools/mxTextTools/mxacse.c'],
                  define_macros=[('MX_BUILDING_MXTEXTTOOLS', None)],
                  include_dirs=['mx/TextTools/mxTextTools']),
 
@@ -413,6 +415,8 @@ data_files = [
     'mx/TextTools/mxTextTools/mxTextTools.h',
     'mx/TextTools/mxTextTools/mxh.h',
     'mx/TextTools/mxTextTools/mxbmse.h',
+    'mx/TextTools/mxTextTools/mxacse.h',
+    'mx/TextTools/mxTextTools/mxscan.h',
     
     # mxTools
     'mx/Tools/Doc/mxTools.pdf',
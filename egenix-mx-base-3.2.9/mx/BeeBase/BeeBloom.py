@@ -0,0 +1,190 @@
+""" BeeBloom - Bloom filters for the BeeDict classes.
+
+    A Bloom filter answers the question "could this key be in the
+    dictionary ?" without touching the index: if it says no, the key
+    is definitely not there. False positives occur at a configurable
+    rate; they only cost the index lookup the filter was meant to
+    save.
+
+    Keys cannot be removed from a filter, so deleted keys are only
+    dropped when the filter is rebuilt.
+
+    File layout: a marshalled tuple (VERSION, capacity, k, count,
+    fingerprint, bits). The fingerprint is chosen by the user of the
+    file and allows detecting a filter that no longer matches the
+    data it was built for.
+
+    Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+    See the documentation for further information on copyrights,
+    or contact the author. All Rights Reserved.
+
+"""
+import array,marshal,math
+from mx.Log import *
+
+# Version of the file format
+VERSION = 1
+
+# False positive rate the filters are sized for by default
+FALSEPOSITIVES = 0.01
+
+# Minimal capacity of a filter in number of keys
+MINCAPACITY = 1024
+
+# Output debugging info
+_debug = 0
+
+### Helpers
+
+def probes(key,k,nbits,
+
+           MASK=0xFFFFFFFFFFFFFFFFL,StringType=type('')):
+
+    """ Return the list of the k bit numbers for key (a string or
+        integer) in a filter with nbits bits.
+
+        This is the Python version of the C implementation in
+        mxBeeBase.
+
+    """
+    if type(key) is StringType:
+        # 64-bit FNV-1a
+        hash = 0xcbf29ce484222325L
+        for c in key:
+            hash = ((hash ^ ord(c)) * 0x100000001b3L) & MASK
+    else:
+        hash = key & MASK
+    # Mix the bits (MurmurHash3 finalizer)
+    hash = ((hash ^ (hash >> 33)) * 0xff51afd7ed558ccdL) & MASK
+    hash = ((hash ^ (hash >> 33)) * 0xc4ceb9fe1a85ec53L) & MASK
+    hash = hash ^ (hash >> 33)
+    h1 = hash >> 32
+    h2 = (hash & 0xFFFFFFFFL) | 1
+    return [(h1 + i * h2) % nbits for i in range(k)]
+
+# The bit operations are done in C by mxBeeBase, if available
+try:
+    from mxBeeBase import bloomadd,bloomcheck
+
+except ImportError:
+    def bloomadd(bits,k,key):
+
+        """ Set the k bits for key in the array bits.
+        """
+        for bit in probes(key,k,len(bits) * 8):
+            bits[bit >> 3] = bits[bit >> 3] | (1 << (bit & 7))
+
+    def bloomcheck(bits,k,key):
+
+        """ Return 1 if all k bits for key are set in the array bits,
+            0 otherwise.
+        """
+        for bit in probes(key,k,len(bits) * 8):
+            if not bits[bit >> 3] & (1 << (bit & 7)):
+                return 0
+        return 1
+
+### Classes
+
+class BloomFilter:
+
+    """ Bloom filter for string and integer keys.
+
+        The filter is sized for capacity keys at a false positive
+        rate of falsepositives. Adding more keys increases the rate;
+        .full() tells when the filter should be rebuilt with a larger
+        capacity.
+
+    """
+    capacity = 0                        # Number of keys the filter
+                                        # is sized for
+    k = 1                               # Number of bits per key
+    count = 0                           # Number of keys added
+    bits = None                         # array('B') of filter bits
+
+    def __init__(self,capacity,falsepositives=FALSEPOSITIVES,
+
+                 ln=math.log):
+
+        if capacity < 1:
+            capacity = 1
+        nbits = -capacity * ln(falsepositives) / ln(2) ** 2
+        nbytes = int(nbits + 7) / 8
+        self.capacity = capacity
+        self.k = max(1,int(round(nbytes * 8.0 / capacity * ln(2))))
+        self.bits = array.array('B',[0]) * nbytes
+
+    def __len__(self):
+
+        return self.count
+
+    def add(self,key,
+
+            bloomadd=bloomadd):
+
+        """ Add key, a string or integer, to the filter.
+        """
+        bloomadd(self.bits,self.k,key)
+        self.count = self.count + 1
+
+    def __contains__(self,key,
+
+                     bloomcheck=bloomcheck):
+
+        """ Return true if key may have been added, false if it
+            definitely was not.
+        """
+        return bloomcheck(self.bits,self.k,key)
+
+    # Alias
+    contains = __contains__
+
+    def full(self):
+
+        """ Return true if more keys were added than the filter was
+            sized for.
+        """
+        return self.count > self.capacity
+
+    def save(self,filename,fingerprint=None):
+
+        """ Write the filter to the file filename.
+
+            fingerprint is stored along with the filter and checked
+            by load().
+
+        """
+        f = open(filename,'wb')
+        try:
+            marshal.dump((VERSION,self.capacity,self.k,self.count,
+                          fingerprint,self.bits.tostring()),f)
+        finally:
+            f.close()
+
+def load(filename,fingerprint=None):
+
+    """ Load a filter written by BloomFilter.save() from the file
+        filename.
+
+        Returns None if the file cannot be read or was saved with a
+        different fingerprint.
+
+    """
+    try:
+        f = open(filename,'rb')
+        try:
+            version,capacity,k,count,saved,bits = marshal.load(f)
+        finally:
+            f.close()
+    except (IOError,EOFError,ValueError,TypeError):
+        return None
+    if version != VERSION or saved != fingerprint or not bits:
+        if _debug:
+            log(SYSTEM_DEBUG,'Bloom filter in %s is out of date',filename)
+        return None
+    bloom = BloomFilter(1)
+    bloom.capacity = capacity
+    bloom.k = k
+    bloom.count = count
+    bloom.bits = array.array('B',bits)
+    return bloom
@@ -2,8 +2,8 @@
 
 
 """
-import exceptions, os
-import BeeIndex,BeeStorage
+import exceptions, os, bisect, struct
+import BeeIndex,BeeStorage,BeeLog,BeeBloom
 from mx import Tools
 freeze = Tools.freeze
 from mx.Log import *
@@ -107,12 +107,34 @@ class BeeBaseDict:
     # Name of the index file; set in .__init__()
     index_name = name + '.idx'
 
+    # Name of the transaction log file; set in .__init__()
+    log_name = name + '.wal'
+
+    # Name of the Bloom filter file; set in .__init__()
+    bloom_name = name + '.blm'
+
     # Bee*Index object
     index = None
 
     # Bee*Storage object
     storage = None
 
+    # BeeLog object, in case the write-ahead log is used
+    wal = None
+
+    # Changes committed to the log, but not yet written to storage
+    # and index by a checkpoint; same format as the cache
+    logged = None
+
+    # Log size in bytes which triggers a checkpoint
+    wal_checkpointsize = 1048576
+
+    # BeeBloom.BloomFilter for the keys in the index, if enabled
+    bloom = None
+
+    # Does the Bloom filter file exist (and match the index) ?
+    bloom_saved = 0
+
     # Is the dictionary closed ?
     closed = 0
 
@@ -122,10 +144,21 @@ class BeeBaseDict:
     # Is the dictionary read-only ?
     readonly = 0
 
+    # Does the index use the snapshot format ?
+    snapshot = 0
+
     # Run in auto-commit mode ? This will perform a commit whenever
     # the cache gets to full.
     autocommit = 0                              
 
+    # Number of records processed by the incremental garbage collector
+    # on each .commit(); 0 disables it. See .collect_step().
+    autocollect = 0
+
+    # Fraction of the storage file size that has to be free before a
+    # new pass of the incremental garbage collector is started
+    autocollect_garbage = 0.25
+
     # Max. cache size in number of items to store in the in-memory
     # transaction cache
     maxcachesize = MAXCACHESIZE
@@ -136,7 +169,12 @@ class BeeBaseDict:
 
     def __init__(self, name, keysize=8, min_recordsize=0, readonly=0,
                  recover=0, autocommit=0, validate=0,
-                 index=BeeIndex.BeeIntegerIndex, maxcachesize=None):
+                 index=BeeIndex.BeeIntegerIndex, maxcachesize=None,
+                 index_cachesize=0, index_mmap=0, index_avgkeysize=0,
+                 index_sectorsize=0, wal=0, wal_groupcommit=8,
+                 wal_syncdelay=0.05, wal_checkpointsize=1048576,
+                 snapshot=0, autocollect=0, codec=None, bloom=0,
+                 sharedcache=0):
 
         """ Create an instance using name as basename for the
             data and index files.
@@ -172,13 +210,103 @@ class BeeBaseDict:
             maxcachesize defines the maximum size of the in-memory
             transaction cache. It defaults to MAXCACHESIZE if not
             given.
+
+            index_cachesize sets the size of the index node cache in
+            bytes. It is passed to the index constructor as cachesize.
+            The default of 0 uses the minimal cache needed by the
+            index implementation.
+
+            If index_mmap is true and the dictionary is opened
+            read-only, the index file is memory mapped and its nodes
+            are accessed in place. Processes reading the same
+            dictionary then share the OS page cache for the index.
+
+            index_avgkeysize is the expected average key size for
+            string indexes. If given, a newly created index uses the
+            prefix compressed node format, which fits more keys into
+            a node than the fixed keysize would allow. It is ignored
+            for existing indexes and for the numeric index types.
+
+            index_sectorsize sets the node size of the index in
+            bytes. It must be a multiple of 4 and may not exceed
+            BeeIndex.MAX_SECTOR_SIZE. Large nodes (16k-64k) result in
+            flatter trees and fewer disk accesses per lookup and
+            scan. The default of 0 uses the smallest size suitable
+            for the keysize. Note that the same value has to be used
+            whenever the index is opened.
+
+            If wal is true, .commit() appends the changes to a
+            write-ahead log <name>.wal instead of writing them to the
+            storage and index. These are only updated by a
+            .checkpoint(), which is done once the log has grown to
+            wal_checkpointsize bytes and when closing the dictionary.
+            Several commits share one fsync() of the log: it is done
+            after wal_groupcommit commits or when the oldest unsynced
+            commit is older than wal_syncdelay seconds. .flush()
+            syncs the log right away.
+
+            A log left behind by a crash is replayed when the
+            dictionary is opened again, even if wal is not set.
+            Read-only dictionaries use the changes found in the log
+            for key lookups, but cannot write the checkpoint needed
+            for cursors, .keys(), .values() and .items(); these raise
+            a ReadOnlyError until the log has been checkpointed by a
+            writer.
+
+            If snapshot is true, a newly created index uses the
+            snapshot format. Any number of processes can then open
+            the dictionary read-only while one writer keeps
+            committing: a reader sees the state of the last commit
+            before it was opened (or before its last .refresh()),
+            without blocking the writer. Records are no longer
+            updated in place in the storage file. The flag is ignored
+            for existing indexes, but the format cannot be combined
+            with index_avgkeysize.
+
+            If autocollect is set, the storage garbage collector is
+            run incrementally: once autocollect_garbage of the
+            storage file is free space, each .commit() (or
+            .checkpoint() when using the write-ahead log) runs a
+            .collect_step() processing autocollect records, until
+            the pass has reached the end of the file. This has no
+            effect for the snapshot format, since moving records
+            would break its readers.
+
+            codec names a BeeStorage codec, e.g. 'zlib', used to
+            compress the values written to the storage file. Values
+            whose pickle is smaller than
+            BeeStorage.COMPRESS_THRESHOLD bytes are stored
+            uncompressed. Existing records are read regardless of
+            the setting.
+
+            If bloom is true, a Bloom filter of the keys in the index
+            is checked before looking up a key on disk, so that most
+            lookups of missing keys do not touch the index at all.
+            The filter is kept up to date by .commit() and
+            .checkpoint() and saved to <name>.blm when the dictionary
+            is closed; if that file is missing or out of date, the
+            filter is rebuilt from the index when opening the
+            dictionary.
+
+            If sharedcache is set, the records read from the storage
+            file are kept in a cache of sharedcache bytes which is
+            shared by all processes opening the dictionary with the
+            option, so that a record is only read and decompressed
+            once. The cache lives in the file <name>.dat.shm; see
+            the SharedCache module for details. Records larger than
+            SharedCache.SLOTSIZE are not cached. All processes
+            writing to the dictionary have to use the option while
+            others have it open.
             
         """
         # Init instance vars
         self.name = name
         self.storage_name = name + '.dat'
         self.index_name = name + '.idx'
+        self.log_name = name + '.wal'
+        self.bloom_name = name + '.blm'
         self.cache = {}
+        self.logged = {}
         if maxcachesize is not None:
             self.maxcachesize = maxcachesize
         else:
@@ -191,7 +319,9 @@ class BeeBaseDict:
             cache=0,
             min_recordsize=min_recordsize,
             readonly=readonly,
-            recover=recover)
+            recover=recover,
+            codec=codec,
+            sharedcache=sharedcache)
         
         # Determine the filemode for the index
         if readonly:
@@ -212,29 +342,46 @@ class BeeBaseDict:
             # depending on the used constructor function
             if (index is BeeIndex.BeeStringIndex or
                 index is BeeIndex.BeeFixedLengthStringIndex):
-                # Calculate the right sectorsize
-                sectorsize = self._calc_sectorsize(keysize)
+                # Calculate the right sectorsize; existing files may
+                # use the address size of an older version
+                if filemode == 2:
+                    sectorsize = self._calc_sectorsize(keysize)
+                else:
+                    sectorsize = self._calc_sectorsize(
+                        keysize, self._index_addrsize())
+                if index_sectorsize > sectorsize:
+                    sectorsize = index_sectorsize
                 print ('Using keysize=%i with sectorsize=%i' %
                        (keysize, sectorsize))
                 self.index = index(self.index_name,
                                    keysize,
                                    dupkeys=0,
                                    filemode=filemode,
-                                   sectorsize=sectorsize)
+                                   sectorsize=sectorsize,
+                                   cachesize=index_cachesize,
+                                   mmap=index_mmap,
+                                   avgkeysize=index_avgkeysize,
+                                   snapshot=snapshot)
                 
             elif index is BeeIndex.BeeIntegerIndex:
                 # keysize is sizeof(long)
                 self.index = index(self.index_name,
                                    dupkeys=1,
                                    filemode=filemode,
-                                   sectorsize=256)
+                                   sectorsize=index_sectorsize or 256,
+                                   cachesize=index_cachesize,
+                                   mmap=index_mmap,
+                                   snapshot=snapshot)
 
             elif index is BeeIndex.BeeFloatIndex:
                 # keysize is sizeof(double)
                 self.index = index(self.index_name,
                                    dupkeys=1,
                                    filemode=filemode,
-                                   sectorsize=256)
+                                   sectorsize=index_sectorsize or 256,
+                                   cachesize=index_cachesize,
+                                   mmap=index_mmap,
+                                   snapshot=snapshot)
 
             else:
                 raise IndexError, 'unknown index type: %s' % repr(index)
@@ -247,19 +394,89 @@ class BeeBaseDict:
                   (index.__name__, name)
         self.readonly = readonly
         self.autocommit = autocommit
+        self.autocollect = autocollect
+
+        # Readers of a snapshot index may still reference the old
+        # version of a record, so the storage must not overwrite it
+        self.snapshot = self.index.snapshot
+        if self.snapshot:
+            self.storage.inplace = 0
+
+        # A Bloom filter file has to be removed before the index
+        # changes, even if the filter is not used
+        self.bloom_saved = os.path.exists(self.bloom_name)
+        if filemode == 2 and self.bloom_saved:
+            self.remove_bloom()
+
+        # Open the log and replay it; changes found in the log (only
+        # if the last session crashed) are written by a checkpoint
+        self.wal_checkpointsize = wal_checkpointsize
+        if wal or os.path.exists(self.log_name):
+            self.wal = BeeLog.BeeLog(self.log_name,
+                                     readonly=readonly,
+                                     groupcommit=wal_groupcommit,
+                                     syncdelay=wal_syncdelay)
+            logged = self.logged
+            for changes in self.wal.replay():
+                for key, state, value in changes:
+                    logged[key] = (state, value)
+            if not readonly and not recover:
+                self.checkpoint()
+                if not wal:
+                    self.wal.close()
+                    self.wal = None
+                    os.remove(self.log_name)
         
+        if bloom:
+            self.bloom = BeeBloom.load(self.bloom_name,len(self.index))
+            if self.bloom is None:
+                self.build_bloom()
+                self.bloom_saved = 0
+
         if validate:
             self.validate_index()
             self.validate_storage()
 
-    def _calc_sectorsize(self, keysize):
+    def _index_addrsize(self):
+
+        """ Return the size of the addresses stored in the existing
+            index file.
+
+            Files written by versions using 64-bit addresses on all
+            platforms are marked by a header flag. Older files use the
+            size of the writing platform's unsigned long, which is
+            assumed to be BeeIndex.sizeof_legacy_addr.
+
+        """
+        try:
+            f = open(self.index_name, 'rb')
+            try:
+                header = f.read(16)
+            finally:
+                f.close()
+        except IOError:
+            return BeeIndex.sizeof_bRecAddr
+        if len(header) < 16:
+            # Empty files are initialized as new ones
+            return BeeIndex.sizeof_bRecAddr
+        magic, version, flags = struct.unpack('=8sII', header)
+        if magic == 'mxBeeIdx' and flags & 0x0004:
+            return BeeIndex.sizeof_bRecAddr
+        return BeeIndex.sizeof_legacy_addr
+
+    def _calc_sectorsize(self, keysize, addrsize=None):
 
         """ Calculate the sectorsize given the keysize.
+
+            addrsize gives the size of the addresses stored in the
+            index and defaults to BeeIndex.sizeof_bRecAddr.
         
         """
+        if addrsize is None:
+            addrsize = BeeIndex.sizeof_bRecAddr
         # These values were determined using the helper
         # mxBeeBase/calc-sectorsize.py
-        if BeeIndex.sizeof_bRecAddr == 4:
+        if addrsize == 4:
             # These figures are good for 32-bit platforms and were
             # used for mxBeeBase <= 3.2.6 for all platforms, failing
             # for some keysizes when used on 64-bit platforms. Tested
@@ -274,10 +491,18 @@ class BeeBaseDict:
                 sectorsize = 2048
             elif keysize <= 670:
                 sectorsize = 4096
+            elif keysize <= 1353:
+                sectorsize = 8192
+            elif keysize <= 2718:
+                sectorsize = 16384
+            elif keysize <= 5449:
+                sectorsize = 32768
+            elif keysize <= 10910:
+                sectorsize = 65536
             else:
                 raise IndexError, 'keysize %i is too large' % keysize
 
-        elif BeeIndex.sizeof_bRecAddr == 8:
+        elif addrsize == 8:
             # 64-bit platforms need different sector sizes
             if keysize <= 19:
                 sectorsize = 256
@@ -289,13 +514,25 @@ class BeeBaseDict:
                 sectorsize = 2048
             elif keysize <= 659:
                 sectorsize = 4096
+            elif keysize <= 1341:
+                sectorsize = 8192
+            elif keysize <= 2707:
+                sectorsize = 16384
+            elif keysize <= 5437:
+                sectorsize = 32768
+            elif keysize <= 10899:
+                sectorsize = 65536
             else:
                 raise IndexError, 'keysize %i is too large' % keysize
             
         else:
             raise IndexError('incompatible platform: sizeof_bRecAddr=%i' %
-                             BeeIndex.sizeof_bRecAddr)
+                             addrsize)
 
+        if sectorsize > BeeIndex.MAX_SECTOR_SIZE:
+            raise IndexError('keysize %i is too large for the maximal '
+                             'sectorsize %i' %
+                             (keysize, BeeIndex.MAX_SECTOR_SIZE))
         return sectorsize
 
     def remove_files(self):
@@ -311,6 +548,12 @@ class BeeBaseDict:
         self.close()
         os.remove(self.storage_name)
         os.remove(self.index_name)
+        for filename in (self.log_name,
+                         self.storage_name + BeeStorage.FREESPACE_EXTENSION,
+                         self.storage_name + BeeStorage.SHAREDCACHE_EXTENSION,
+                         self.bloom_name):
+            if os.path.exists(filename):
+                os.remove(filename)
 
     def __len__(self):
 
@@ -321,6 +564,8 @@ class BeeBaseDict:
         if self.cache and self.changed():
             raise UncommittedDataError(
                 'uncommitted data exists; can\'t calculate length')
+        if self.logged:
+            self.checkpoint()
         return len(self.index)
 
     def close(self):
@@ -329,10 +574,21 @@ class BeeBaseDict:
 
             This issues a .rollback(), so the current transaction is
             rolled back. It also frees the lock on the used index.
+
+            Changes in the write-ahead log are written to storage and
+            index by a final .checkpoint().
             
         """
         if not self.closed:
             self.rollback()
+            if self.wal is not None:
+                if not self.readonly:
+                    self.checkpoint()
+                self.wal.close()
+            if self.bloom is not None and not self.readonly and \
+               not self.bloom_saved:
+                self.bloom.save(self.bloom_name,len(self.index))
+                self.bloom_saved = 1
             for obj in (self.index, self.storage):
                 if obj is not None:
                     # .rollback will have flushed the buffers
@@ -357,14 +613,59 @@ class BeeBaseDict:
     def flush(self):
 
         """ Flush buffers to disk.
+
+            When using the write-ahead log, this also syncs all
+            commits to disk.
         """
         if self.closed:
             # Nothing much to do
             return
         if self.storage is not None:
-            self.storage.flush()
+            if self.snapshot:
+                # The records must be on disk before the index
+                # publishes a version referencing them
+                self.storage.sync()
+            else:
+                self.storage.flush()
         if self.index is not None:
             self.index.flush()
+        if self.wal is not None and not self.readonly:
+            self.wal.sync()
+
+    def refresh(self):
+
+        """ Move a read-only dictionary in the snapshot format to
+            the latest version committed by the writer.
+
+            The cache is cleared. Returns 1 if anything changed, 0
+            otherwise. For writers the method does nothing and
+            returns 0.
+
+        """
+        if not self.readonly or self.closed:
+            return 0
+        if not self.snapshot:
+            raise Error('.refresh() needs an index in the snapshot format')
+        # Read the log first: a checkpoint publishes the new index
+        # version before truncating the log
+        logged = {}
+        if self.wal is not None:
+            self.wal.close()
+            self.wal = None
+        if os.path.exists(self.log_name):
+            self.wal = BeeLog.BeeLog(self.log_name, readonly=1)
+            for changes in self.wal.replay():
+                for key, state, value in changes:
+                    logged[key] = (state, value)
+        changed = self.index.refresh()
+        self.storage.refresh()
+        if changed and self.bloom is not None:
+            self.build_bloom()
+        if logged != self.logged:
+            self.logged = logged
+            changed = 1
+        self.cache.clear()
+        return changed
 
     def __repr__(self):
 
@@ -372,26 +673,164 @@ class BeeBaseDict:
                                                    self.name,
                                                    id(self))
 
-    def commit(self):
+    def commit(self,
 
-        """ Commit all changes and start a new transaction.
+               MODIFIED=MODIFIED,DELETED=DELETED):
 
-            This method does not implement any write operation, but
-            takes care of managing the cache and flushing the storage
-            and index buffers.
+        """ Commit all changes and start a new transaction.
 
-            You must override this method to have commit have any
-            writing effect. The base method must be called after the
-            cache has been processed.
+            The changes are written to storage and index using
+            .write_changes(), or appended to the write-ahead log if
+            it is enabled.
             
         """
+        cache = self.cache
+        if cache is None:
+            return
+
+        if self.wal is not None:
+            changes = []
+            for key,(state,value) in cache.items():
+                if state == MODIFIED or state == DELETED:
+                    changes.append((key, state, value))
+            if changes:
+                if self.readonly:
+                    raise ReadOnlyError('dict is read-only')
+                self.wal.append(changes)
+                logged = self.logged
+                for key, state, value in changes:
+                    logged[key] = (state, value)
+            cache.clear()
+            if self.wal.size() >= self.wal_checkpointsize:
+                self.checkpoint()
+            return
+
+        # Write the changes and end the storage transaction
+        self.update_bloom(cache)
+        self.write_changes(cache)
+        self.storage.end_transaction()
+        if self.bloom is not None and self.bloom.full():
+            self.build_bloom()
+        if self.autocollect:
+            self.autocollect_step()
+
         # Clear cache
-        if self.cache is not None:
-            self.cache.clear()
+        cache.clear()
                 
         # Flush storage and index
         self.flush()
 
+    def write_changes(self, changes, replay=0):
+
+        """ Write changes, a dictionary key:(state,value) using
+            the cache format, to storage and index.
+
+            replay is set when writing changes from the write-ahead
+            log. Deleted keys which are not found must then be
+            ignored, since a previous checkpoint may have already
+            written them.
+
+            You must override this method to have commit have any
+            writing effect. The base method does nothing.
+
+        """
+        return
+
+    def checkpoint(self):
+
+        """ Write the changes in the write-ahead log to storage and
+            index, force both to disk and truncate the log.
+
+            This is done automatically, but can be called explicitly
+            to keep the log and replay times short. Without the log,
+            the method does nothing.
+
+        """
+        if self.wal is None:
+            return
+        if self.readonly:
+            if self.logged:
+                raise ReadOnlyError('dict is read-only; the write-ahead '
+                                    'log needs a checkpoint')
+            return
+        if self.logged:
+            if _debug:
+                log(SYSTEM_DEBUG,'Checkpoint for "%s": %i changes',
+                    self.name, len(self.logged))
+            self.update_bloom(self.logged)
+            self.write_changes(self.logged, 1)
+            self.storage.end_transaction()
+            if self.bloom is not None and self.bloom.full():
+                self.build_bloom()
+        if self.autocollect:
+            self.autocollect_step()
+        # The log may only be truncated after the changes are on disk
+        self.storage.sync()
+        self.index.flush()
+        BeeLog.fsync(self.index_name)
+        self.logged.clear()
+        self.wal.truncate()
+
+    def update_bloom(self,changes,
+
+                     MODIFIED=MODIFIED):
+
+        """ Add the keys of changes, a dictionary in the cache
+            format which is about to be written by .write_changes(),
+            to the Bloom filter.
+
+            The Bloom filter file is removed, so that a crash cannot
+            leave a filter behind which misses keys.
+
+        """
+        if not changes or self.readonly:
+            return
+        if self.bloom_saved:
+            self.remove_bloom()
+        bloom = self.bloom
+        if bloom is not None:
+            bloom_key = self.bloom_key
+            for key,(state,value) in changes.items():
+                if state == MODIFIED:
+                    bloom.add(bloom_key(key))
+
+    def build_bloom(self):
+
+        """ (Re)build the Bloom filter from the keys in the index.
+
+            The filter is sized for twice the current number of keys.
+
+        """
+        keys = self.index.keys()
+        bloom = BeeBloom.BloomFilter(max(2 * len(keys),
+                                         BeeBloom.MINCAPACITY))
+        bloom_key = self.bloom_key
+        for key in keys:
+            bloom.add(bloom_key(key))
+        self.bloom = bloom
+
+    def remove_bloom(self):
+
+        """ Remove the Bloom filter file.
+        """
+        try:
+            os.remove(self.bloom_name)
+        except OSError:
+            pass
+        self.bloom_saved = 0
+
+    def bloom_key(self,key):
+
+        """ Return the string or integer used for key in the Bloom
+            filter.
+
+            It must be the same for key and the key stored in the
+            index for it, and in all processes. The default is to
+            use key itself.
+
+        """
+        return key
+
     def rollback(self):
 
         """ Take back all changes and start a new transaction.
@@ -467,6 +906,34 @@ class BeeBaseDict:
         """
         raise KeyError,'key not found'
 
+    def read_committed(self,key,checkonly=0,
+
+                       DELETED=DELETED,bloomcheck=BeeBloom.bloomcheck):
+
+        """ Read and return the committed value corresponding to
+            key.
+
+            This looks at the changes in the write-ahead log first
+            and then uses .read(), unless the Bloom filter tells
+            that the key is not in the index.
+
+        """
+        logged = self.logged
+        if logged:
+            try:
+                state,value = logged[key]
+            except KeyError:
+                pass
+            else:
+                if state == DELETED:
+                    raise KeyError,'key not found'
+                return value
+        bloom = self.bloom
+        if bloom is not None and \
+           not bloomcheck(bloom.bits,bloom.k,self.bloom_key(key)):
+            raise KeyError,'key not found'
+        return self.read(key,checkonly)
+
     def __setitem__(self,key,value,
 
                     MODIFIED=MODIFIED):
@@ -513,7 +980,7 @@ class BeeBaseDict:
                 raise KeyError,'key deleted'
 
         # Read from disk
-        value = self.read(key)
+        value = self.read_committed(key)
 
         # Cache the item
         if len(cache) > self.maxcachesize:
@@ -533,7 +1000,7 @@ class BeeBaseDict:
         """
         cache = self.cache
         if not cache.has_key(key):
-            self.read(key, 1)
+            self.read_committed(key, 1)
         cache[key] = (DELETED, None)
 
     def has_key(self,key,
@@ -556,7 +1023,7 @@ class BeeBaseDict:
 
         # Read from disk
         try:
-            value = self.read(key)
+            value = self.read_committed(key)
         except KeyError:
             return 0
 
@@ -589,7 +1056,7 @@ class BeeBaseDict:
 
         # Read from disk
         try:
-            value = self.read(key)
+            value = self.read_committed(key)
         except KeyError:
             return default
 
@@ -600,6 +1067,66 @@ class BeeBaseDict:
 
         return value
 
+    def get_many(self,keys,default=None,
+
+                 len=len,DELETED=DELETED):
+
+        """ Return a list with the values for all keys in the
+            sequence keys. default is used for keys which are not
+            found.
+
+            Items in the cache or the write-ahead log are taken from
+            there. The other keys are looked up in a single pass over
+            the index using .read_many(). These values are not added
+            to the cache.
+
+        """
+        cache = self.cache
+        logged = self.logged
+        bloom = self.bloom
+        result = [default] * len(keys)
+        missing = []
+        positions = []
+        for i in range(len(keys)):
+            key = keys[i]
+            try:
+                state,value = cache[key]
+            except KeyError:
+                if logged and logged.has_key(key):
+                    state,value = logged[key]
+                elif bloom is None or bloom.contains(self.bloom_key(key)):
+                    missing.append(key)
+                    positions.append(i)
+                    continue
+                else:
+                    continue
+            if state != DELETED:
+                result[i] = value
+        if missing:
+            values = self.read_many(missing, default)
+            for i in range(len(missing)):
+                result[positions[i]] = values[i]
+        return result
+
+    def read_many(self,keys,default=None):
+
+        """ Read the values for all keys in keys from disk and return
+            them as list. default is used for keys which are not
+            found.
+
+            Override this method with an implementation that looks
+            up all keys in one go. The default implementation uses
+            .read().
+
+        """
+        result = []
+        for key in keys:
+            try:
+                result.append(self.read(key))
+            except KeyError:
+                result.append(default)
+        return result
+
     def cursor(self, key=FirstKey, default=None):
 
         """ Return a cursor instance for this kind of dictionary.
@@ -619,6 +1146,8 @@ class BeeBaseDict:
         # Check for uncommitted changes
         if self.cache and self.changed():
             raise UncommittedDataError('uncommitted data exists')
+        if self.logged:
+            self.checkpoint()
         # Get the index cursor and create a dict cursor from it
         cursor = self.index.cursor(key,None)
         if cursor is None:
@@ -646,18 +1175,66 @@ class BeeBaseDict:
             This can take a while depending on the size of the
             dictionary.
 
+            The collector moves records in place, so for the snapshot
+            format no readers may have the dictionary open.
+
         """
         if self.readonly:
             raise UncommittedDataError('dict is read-only')
         # Check for uncommitted changes
         if self.cache and self.changed():
             raise UncommittedDataError('uncommitted data exists')
+        if self.logged:
+            self.checkpoint()
         self.flush()
         log(SYSTEM_INFO,'Collecting %s',self)
         # Run collector
         self.storage.collect(self.collect_callback)
         # End the storage transaction
         self.storage.end_transaction()
+        self.checkpoint()
+
+    def collect_step(self,maxrecords=BeeStorage.COLLECTSTEP):
+
+        """ Run one step of the incremental storage garbage
+            collector.
+
+            In contrast to .collect(), the dictionary stays usable
+            while a collection pass is running: each step processes
+            up to maxrecords records of the storage file and updates
+            the index for the ones it moves, and changes can be
+            committed between the steps. Returns 1 if the step
+            finished the pass (and truncated the storage file), 0
+            otherwise.
+
+            As for .collect(), no readers may have a dictionary in
+            the snapshot format open.
+
+        """
+        if self.readonly:
+            raise ReadOnlyError('dict is read-only')
+        done = self.storage.collect_step(self.collect_callback,maxrecords)
+        self.storage.end_transaction()
+        self.flush()
+        return done
+
+    def autocollect_step(self):
+
+        """ Run a step of the incremental garbage collector for
+            .autocollect, if a pass is running or one needs to be
+            started.
+        """
+        storage = self.storage
+        if storage.collect_source is None:
+            freespace = storage.freespace
+            if freespace is None or \
+               freespace.freesize < self.autocollect_garbage * storage.EOF:
+                return
+            if _debug:
+                log(SYSTEM_DEBUG,'Starting the incremental collector '
+                    'for "%s": %i bytes free',self.name,freespace.freesize)
+        storage.collect_step(self.collect_callback,self.autocollect)
+        storage.end_transaction()
 
     def collect_callback(self,old_position,new_position,raw_data):
 
@@ -670,17 +1247,87 @@ class BeeBaseDict:
         """
         raise Error('.collect_callback() not implemented')
 
+    def bulkload(self, items, fillfactor=0.9):
+
+        """ Load the empty dictionary from items, an iterable of
+            (key, value) tuples.
+
+            The records are appended to the storage and the index is
+            built bottom-up in one go, which is a lot faster than
+            adding the items one by one. See the subclasses for the
+            order in which the items have to be given. fillfactor
+            sets the fill level of the index nodes (0.5-1.0).
+
+            The dictionary must be empty, writeable and may not have
+            pending changes. In case of an error, the records written
+            so far are freed again and the dictionary stays empty.
+
+            Returns the number of items loaded.
+
+        """
+        if self.readonly:
+            raise ReadOnlyError('dict is read-only')
+        # Check for uncommitted changes
+        if self.cache and self.changed():
+            raise UncommittedDataError('uncommitted data exists')
+        if self.logged:
+            self.checkpoint()
+        if len(self.index):
+            raise Error('dict is not empty')
+        if self.bloom_saved:
+            self.remove_bloom()
+        storage = self.storage
+        start = storage.EOF
+        # The records must be appended, so that they can be found
+        # in case of an error
+        reuse = storage.reuse
+        storage.reuse = 0
+        try:
+            try:
+                count = self.bulkload_index(items, fillfactor)
+            except:
+                # Free the records written by the load
+                valid, old, invalid = storage.find_records(start)
+                for position, recordsize in valid:
+                    storage.free(position)
+                storage.end_transaction()
+                raise
+        finally:
+            storage.reuse = reuse
+        self.commit()
+        self.checkpoint()
+        if self.bloom is not None:
+            self.build_bloom()
+        return count
+
+    def bulkload_index(self, items, fillfactor):
+
+        """ Internal method used by .bulkload() to write the items to
+            the storage and load the index.
+
+            This method must be overridden to account for the
+            different indexing schemes.
+
+        """
+        raise Error('.bulkload_index() not implemented')
+
     def recover(self):
 
         """ Recover all valid records and recreate the index.
         """
         log(SYSTEM_INFO,'Recovering %s',self)
+        if self.bloom_saved:
+            self.remove_bloom()
         # Clear the index
         self.index.clear()
         # Run recovery and recreate the index through the callback
         self.storage.recover(self.recover_callback)
         # End the storage transaction
         self.storage.end_transaction()
+        # Reapply the changes from the write-ahead log
+        self.checkpoint()
+        if self.bloom is not None:
+            self.build_bloom()
         
     def recover_callback(self,old_position,new_position,raw_data):
 
@@ -735,6 +1382,7 @@ class BeeBaseDict:
 
         """
         self.rollback()
+        self.checkpoint()
         self.storage.backup(archive)
 
     def restore(self,archive):
@@ -992,6 +1640,11 @@ class BeeDict(BeeBaseDict):
 
     def __init__(self,name,min_recordsize=0,readonly=0,recover=0,
                  autocommit=0,validate=0, maxcachesize=None,
+                 index_cachesize=0, index_mmap=0,
+                 index_sectorsize=0, wal=0, wal_groupcommit=8,
+                 wal_syncdelay=0.05, wal_checkpointsize=1048576,
+                 snapshot=0, autocollect=0, codec=None, bloom=0,
+                 sharedcache=0,
 
                  basemethod=BeeBaseDict.__init__):
 
@@ -1021,13 +1674,48 @@ class BeeDict(BeeBaseDict):
             maxcachesize defines the maximum size of the in-memory
             transaction cache. It defaults to MAXCACHESIZE if not
             given.
+
+            index_cachesize sets the size of the index node cache in
+            bytes. index_mmap enables memory mapping of the index
+            file in read-only mode. index_sectorsize sets the node
+            size of the index.
+
+            wal enables the write-ahead log for commits.
+            wal_groupcommit, wal_syncdelay and wal_checkpointsize
+            configure it; see BeeBaseDict.__init__() for details.
+
+            snapshot creates the index in the snapshot format, which
+            lets readers work concurrently with one writer.
+
+            autocollect enables the incremental garbage collector;
+            see BeeBaseDict.__init__() for details.
+
+            codec enables the compression of the stored values.
+
+            bloom enables the Bloom filter for lookups of missing
+            keys.
+
+            sharedcache sets the size of the record cache shared
+            with other processes.
             
         """
         basemethod(self, name, min_recordsize=min_recordsize,
                    readonly=readonly, recover=recover,
                    autocommit=autocommit, validate=validate,
                    index=BeeIndex.BeeIntegerIndex,
-                   maxcachesize=maxcachesize)
+                   maxcachesize=maxcachesize,
+                   index_cachesize=index_cachesize,
+                   index_mmap=index_mmap,
+                   index_sectorsize=index_sectorsize,
+                   wal=wal,
+                   wal_groupcommit=wal_groupcommit,
+                   wal_syncdelay=wal_syncdelay,
+                   wal_checkpointsize=wal_checkpointsize,
+                   snapshot=snapshot,
+                   autocollect=autocollect,
+                   codec=codec,
+                   bloom=bloom,
+                   sharedcache=sharedcache)
 
     def find_address(self,cursor,hashvalue,key):
 
@@ -1072,13 +1760,11 @@ class BeeDict(BeeBaseDict):
                 return default
         return cursor
 
-    def commit(self,
+    def write_changes(self, changes, replay=0,
 
-               basemethod=BeeBaseDict.commit,MODIFIED=MODIFIED,DELETED=DELETED):
+                      MODIFIED=MODIFIED,DELETED=DELETED):
 
-        """ Commit all changes and start a new transaction.
-        """
-        # Write all changed entries in the cache to disk
+        # Write all changed entries to disk
         index = self.index
         index_cursor = index.cursor
         index_update = index.update
@@ -1091,9 +1777,9 @@ class BeeDict(BeeBaseDict):
         NotFound = None
         debug = _debug
         if debug:
-            log(SYSTEM_DEBUG,'Committing all changes for "%s"...',self.name)
+            log(SYSTEM_DEBUG,'Writing all changes for "%s"...',self.name)
 
-        for key,(state,value) in self.cache.items():
+        for key,(state,value) in changes.items():
 
             if state == MODIFIED:
                 if debug:
@@ -1131,24 +1817,24 @@ class BeeDict(BeeBaseDict):
                 if readonly:
                     raise ReadOnlyError('dict is read-only')
                 hashvalue = hash(key)
-                cursor = index_cursor(hashvalue)
+                cursor = index_cursor(hashvalue, NotFound)
+                if cursor is NotFound:
+                    if replay:
+                        continue
+                    raise KeyError,'key not found'
                 # Check that we have really found the key
                 address = cursor.value
                 if key != storage_read_key(address):
                     # Ah, a collision
                     address = self.find_address(cursor, hashvalue, key)
                     if address is NotFound:
+                        if replay:
+                            continue
                         raise KeyError,'key not found'
                 storage_delete(address)
                 # Update index
                 index_delete(hashvalue, address)
 
-        # End the storage transaction
-        storage.end_transaction()
-
-        # Call basemethod
-        basemethod(self)
-
     def read(self,key,checkonly=0):
 
         # Load from disk
@@ -1167,6 +1853,30 @@ class BeeDict(BeeBaseDict):
         else:
             return self.storage.read(address)[1]
 
+    def read_many(self,keys,default=None):
+
+        # Look up the hash values in one pass over the index and read
+        # the records in file order
+        addresses = self.index.get_many(map(hash, keys))
+        todo = []
+        for i in range(len(keys)):
+            if addresses[i] is not None:
+                todo.append((addresses[i], i))
+        todo.sort()
+        result = [default] * len(keys)
+        storage_read = self.storage.read
+        for address, i in todo:
+            key, value = storage_read(address)
+            if key == keys[i]:
+                result[i] = value
+            else:
+                # Ah, a collision
+                try:
+                    result[i] = self.read(keys[i])
+                except KeyError:
+                    pass
+        return result
+
     def keys(self,
 
              DELETED=DELETED):
@@ -1177,6 +1887,8 @@ class BeeDict(BeeBaseDict):
             take notice of uncommitted changes.
 
         """
+        if self.logged:
+            self.checkpoint()
         l = []
         read_key = self.storage.read_key
         # First the cache entries that are not yet committed
@@ -1201,6 +1913,8 @@ class BeeDict(BeeBaseDict):
             take notice of uncommitted changes.
 
         """
+        if self.logged:
+            self.checkpoint()
         l = []
         read = self.storage.read
         # First the cache entries that are not yet committed
@@ -1225,6 +1939,8 @@ class BeeDict(BeeBaseDict):
             take notice of uncommitted changes.
 
         """
+        if self.logged:
+            self.checkpoint()
         l = []
         read = self.storage.read
         # First the cache entries that are not yet committed
@@ -1257,6 +1973,8 @@ class BeeDict(BeeBaseDict):
         # Check for uncommitted changes
         if self.cache and self.changed():
             raise UncommittedDataError('uncommitted data exists')
+        if self.logged:
+            self.checkpoint()
         # Get the index cursor and create a dict cursor from it
         cursor = self.index_cursor(key,None)
         if cursor is None:
@@ -1288,6 +2006,48 @@ class BeeDict(BeeBaseDict):
             
         """
         self.index[hash(self.storage.decode_key(raw_data))] = new_position
+
+    def bloom_key(self, key):
+
+        # Same as the index key
+        return hash(key)
+
+    def bulkload_index(self, items, fillfactor,
+
+                       bisect_left=bisect.bisect_left):
+
+        """ Internal method used by .bulkload().
+
+            The items may be given in any order. Since the index
+            is keyed by hash values, all (hash value, address) pairs
+            are collected and sorted before loading the index.
+
+        """
+        storage = self.storage
+        storage_write = storage.write
+        pairs = []
+        append = pairs.append
+        for key, value in items:
+            append((hash(key), storage_write(key, value)))
+        pairs.sort()
+        # The index compares hash values as unsigned integers, so
+        # negative hash values go last
+        i = bisect_left(pairs, (0,))
+        pairs = pairs[i:] + pairs[:i]
+        # Check hash collisions for duplicate keys
+        storage_read_key = storage.read_key
+        for i in xrange(1, len(pairs)):
+            hashvalue, address = pairs[i]
+            if hashvalue != pairs[i-1][0]:
+                continue
+            self.collisions = self.collisions + 1
+            key = storage_read_key(address)
+            j = i - 1
+            while j >= 0 and pairs[j][0] == hashvalue:
+                if key == storage_read_key(pairs[j][1]):
+                    raise KeyError('duplicate key: %r' % (key,))
+                j = j - 1
+        return self.index.bulkload(pairs, fillfactor)
         
 ###
 
@@ -1350,6 +2110,11 @@ class BeeStringDict(BeeBaseDict):
     """
     def __init__(self,name,keysize=10,min_recordsize=0,readonly=0,recover=0,
                  autocommit=0,validate=0, maxcachesize=None,
+                 index_cachesize=0, index_mmap=0, index_avgkeysize=0,
+                 index_sectorsize=0, wal=0, wal_groupcommit=8,
+                 wal_syncdelay=0.05, wal_checkpointsize=1048576,
+                 snapshot=0, autocollect=0, codec=None, bloom=0,
+                 sharedcache=0,
 
                  basemethod=BeeBaseDict.__init__):
 
@@ -1380,6 +2145,30 @@ class BeeStringDict(BeeBaseDict):
             maxcachesize defines the maximum size of the in-memory
             transaction cache. It defaults to MAXCACHESIZE if not
             given.
+
+            index_cachesize sets the size of the index node cache in
+            bytes. index_mmap enables memory mapping of the index
+            file in read-only mode. index_sectorsize sets the node
+            size of the index. index_avgkeysize enables the
+            prefix compressed index node format for new indexes.
+
+            wal enables the write-ahead log for commits.
+            wal_groupcommit, wal_syncdelay and wal_checkpointsize
+            configure it; see BeeBaseDict.__init__() for details.
+
+            snapshot creates the index in the snapshot format, which
+            lets readers work concurrently with one writer.
+
+            autocollect enables the incremental garbage collector;
+            see BeeBaseDict.__init__() for details.
+
+            codec enables the compression of the stored values.
+
+            bloom enables the Bloom filter for lookups of missing
+            keys.
+
+            sharedcache sets the size of the record cache shared
+            with other processes.
             
             XXX Save keysize in storage file header.
             
@@ -1388,15 +2177,26 @@ class BeeStringDict(BeeBaseDict):
                    readonly=readonly, recover=recover,
                    autocommit=autocommit, validate=validate,
                    index=BeeIndex.BeeStringIndex,
-                   maxcachesize=maxcachesize)
-
-    def commit(self,
-
-               basemethod=BeeBaseDict.commit,DELETED=DELETED,MODIFIED=MODIFIED):
-
-        """ Commit all changes and start a new transaction.
-        """
-        # Write all changed entries in the cache to disk
+                   maxcachesize=maxcachesize,
+                   index_cachesize=index_cachesize,
+                   index_mmap=index_mmap,
+                   index_avgkeysize=index_avgkeysize,
+                   index_sectorsize=index_sectorsize,
+                   wal=wal,
+                   wal_groupcommit=wal_groupcommit,
+                   wal_syncdelay=wal_syncdelay,
+                   wal_checkpointsize=wal_checkpointsize,
+                   snapshot=snapshot,
+                   autocollect=autocollect,
+                   codec=codec,
+                   bloom=bloom,
+                   sharedcache=sharedcache)
+
+    def write_changes(self, changes, replay=0,
+
+                      DELETED=DELETED,MODIFIED=MODIFIED):
+
+        # Write all changed entries to disk
         index = self.index
         index_get = index.get
         storage = self.storage
@@ -1406,9 +2206,9 @@ class BeeStringDict(BeeBaseDict):
         NotFound = None
         debug = _debug
         if debug:
-            log(SYSTEM_DEBUG,'Committing all changes for "%s"...',self.name)
+            log(SYSTEM_DEBUG,'Writing all changes for "%s"...',self.name)
 
-        for key,(state,value) in self.cache.items():
+        for key,(state,value) in changes.items():
 
             if state == MODIFIED:
                 if debug:
@@ -1438,15 +2238,9 @@ class BeeStringDict(BeeBaseDict):
                     storage_delete(address)
                     # Update Index
                     del index[key]
-                else:
+                elif not replay:
                     raise KeyError,'key not found'
 
-        # End the storage transaction
-        storage.end_transaction()
-
-        # Call basemethod
-        basemethod(self)
-
     def read(self,key,checkonly=0):
 
         address = self.index[key]
@@ -1455,6 +2249,22 @@ class BeeStringDict(BeeBaseDict):
         else:
             return self.storage.read(address)[1]
 
+    def read_many(self,keys,default=None):
+
+        # Look up the keys in one pass over the index and read the
+        # records in file order
+        addresses = self.index.get_many(keys)
+        todo = []
+        for i in range(len(keys)):
+            if addresses[i] is not None:
+                todo.append((addresses[i], i))
+        todo.sort()
+        result = [default] * len(keys)
+        storage_read = self.storage.read
+        for address, i in todo:
+            result[i] = storage_read(address)[1]
+        return result
+
     def keys(self):
 
         """ Return a list of keys.
@@ -1466,6 +2276,8 @@ class BeeStringDict(BeeBaseDict):
         """
         if self.cache and self.changed():
             raise UncommittedDataError('uncommitted data exists')
+        if self.logged:
+            self.checkpoint()
         return self.index.keys()
 
     def values(self):
@@ -1479,6 +2291,8 @@ class BeeStringDict(BeeBaseDict):
         """
         if self.cache and self.changed():
             raise UncommittedDataError('uncommitted data exists')
+        if self.logged:
+            self.checkpoint()
         l = []
         read = self.storage.read
         for address in self.index.values():
@@ -1496,6 +2310,8 @@ class BeeStringDict(BeeBaseDict):
         """
         if self.cache and self.changed():
             raise UncommittedDataError('uncommitted data exists')
+        if self.logged:
+            self.checkpoint()
         l = []
         read = self.storage.read
         for address in self.index.values():
@@ -1520,6 +2336,8 @@ class BeeStringDict(BeeBaseDict):
         # Check for uncommitted changes
         if self.cache and self.changed():
             raise UncommittedDataError('uncommitted data exists')
+        if self.logged:
+            self.checkpoint()
         # Get the index cursor and create a dict cursor from it
         cursor = self.index.cursor(key,None)
         if cursor is None:
@@ -1554,6 +2372,19 @@ class BeeStringDict(BeeBaseDict):
             
         """
         self.index[self.storage.decode_key(raw_data)] = new_position
+
+    def bulkload_index(self, items, fillfactor):
+
+        """ Internal method used by .bulkload().
+
+            The items must be given in ascending key order.
+
+        """
+        storage_write = self.storage.write
+        def index_items(items=items, storage_write=storage_write):
+            for key, value in items:
+                yield key, storage_write(key, value)
+        return self.index.bulkload(index_items(), fillfactor)
         
 freeze(BeeStringDict)
 
@@ -1571,6 +2402,11 @@ class BeeFixedLengthStringDict(BeeStringDict):
     """
     def __init__(self,name,keysize=10,min_recordsize=0,readonly=0,recover=0,
                  autocommit=0,validate=0, maxcachesize=None,
+                 index_cachesize=0, index_mmap=0, index_avgkeysize=0,
+                 index_sectorsize=0, wal=0, wal_groupcommit=8,
+                 wal_syncdelay=0.05, wal_checkpointsize=1048576,
+                 snapshot=0, autocollect=0, codec=None, bloom=0,
+                 sharedcache=0,
 
                  basemethod=BeeBaseDict.__init__):
 
@@ -1601,6 +2437,30 @@ class BeeFixedLengthStringDict(BeeStringDict):
             maxcachesize defines the maximum size of the in-memory
             transaction cache. It defaults to MAXCACHESIZE if not
             given.
+
+            index_cachesize sets the size of the index node cache in
+            bytes. index_mmap enables memory mapping of the index
+            file in read-only mode. index_sectorsize sets the node
+            size of the index. index_avgkeysize enables the
+            prefix compressed index node format for new indexes.
+
+            wal enables the write-ahead log for commits.
+            wal_groupcommit, wal_syncdelay and wal_checkpointsize
+            configure it; see BeeBaseDict.__init__() for details.
+
+            snapshot creates the index in the snapshot format, which
+            lets readers work concurrently with one writer.
+
+            autocollect enables the incremental garbage collector;
+            see BeeBaseDict.__init__() for details.
+
+            codec enables the compression of the stored values.
+
+            bloom enables the Bloom filter for lookups of missing
+            keys.
+
+            sharedcache sets the size of the record cache shared
+            with other processes.
             
             XXX Save keysize in storage file header.
             
@@ -1609,7 +2469,20 @@ class BeeFixedLengthStringDict(BeeStringDict):
                    readonly=readonly, recover=recover,
                    autocommit=autocommit, validate=validate,
                    index=BeeIndex.BeeFixedLengthStringIndex,
-                   maxcachesize=maxcachesize)
+                   maxcachesize=maxcachesize,
+                   index_cachesize=index_cachesize,
+                   index_mmap=index_mmap,
+                   index_avgkeysize=index_avgkeysize,
+                   index_sectorsize=index_sectorsize,
+                   wal=wal,
+                   wal_groupcommit=wal_groupcommit,
+                   wal_syncdelay=wal_syncdelay,
+                   wal_checkpointsize=wal_checkpointsize,
+                   snapshot=snapshot,
+                   autocollect=autocollect,
+                   codec=codec,
+                   bloom=bloom,
+                   sharedcache=sharedcache)
 
 freeze(BeeFixedLengthStringDict)
 
@@ -17,3 +17,25 @@
 # Import the needed parts from the C extension
 from mxBeeBase import *
 from mxBeeBase import __version__
+
+### Composite key indexes
+
+def BeeIntegerPairIndex(filename,**kws):
+
+    """ Index using tuples of two 64-bit integers as keys, e.g.
+        (tenant_id, timestamp).
+
+        The keyword arguments are passed to BeeCompositeIndex().
+
+    """
+    return BeeCompositeIndex(filename,'qq',**kws)
+
+def BeeStringFloatIndex(filename,keysize,**kws):
+
+    """ Index using tuples (string, float) as keys. The strings may
+        have up to keysize bytes.
+
+        The keyword arguments are passed to BeeCompositeIndex().
+
+    """
+    return BeeCompositeIndex(filename,'%isd' % keysize,**kws)
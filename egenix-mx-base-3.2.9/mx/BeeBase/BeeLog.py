@@ -0,0 +1,310 @@
+""" BeeLog - Write-ahead transaction log with group commit.
+
+    The log is used by the BeeDict classes to make commits durable
+    without writing the storage and index files in place. Each commit
+    appends one record to the log; the storage and index are only
+    updated by a checkpoint, which then truncates the log again.
+
+    File layout:
+
+    * [Fileheader] (length FILEHEADERSIZE)
+    * ...[record]...
+
+    Record layout:
+
+    * [ID] (1 byte)
+    * [length of the data] (4 bytes, little endian)
+    * [CRC-32 of the data] (4 bytes, little endian)
+    * [data: pickled list of (key, state, value) tuples]
+
+    A record that is incomplete or fails the CRC check marks the end
+    of the log. This is what a crash in the middle of an append
+    leaves behind; the record was never acknowledged as committed.
+
+    Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+    See the documentation for further information on copyrights,
+    or contact the author. All Rights Reserved.
+
+"""
+import cPickle,struct,exceptions,os,re,time,zlib
+from mx.Log import *
+
+# File header size
+FILEHEADERSIZE = 64
+
+# Record header: ID, length, CRC-32
+RECORDHEADER = '<cLL'
+RECORDHEADERSIZE = struct.calcsize(RECORDHEADER)
+
+# Codes
+ID = '\333'
+
+# Output debugging info
+_debug = 0
+
+### Errors
+
+class Error(exceptions.StandardError):
+
+    """ Baseclass for Errors related to this module.
+    """
+    pass
+
+### Helpers
+
+def fsync(filename):
+
+    """ Force the data written to the file filename to disk.
+
+        This works for files written through other file objects or
+        extensions, since the OS keeps the dirty pages per file.
+
+    """
+    fd = os.open(filename, os.O_RDWR)
+    try:
+        os.fsync(fd)
+    finally:
+        os.close(fd)
+
+### Classes
+
+class BeeLog:
+
+    """ Append-only transaction log with group commit.
+
+        Records are appended using .append(). Each append is flushed
+        to the OS right away, so a crash of the process does not lose
+        committed transactions. To reduce the number of (expensive)
+        fsync() calls, several commits share one: the log is synced
+        once groupcommit records have been appended, or when a commit
+        finds the oldest unsynced record older than syncdelay
+        seconds. .sync() forces pending records to disk.
+
+    """
+    version = '1.0'                     # Version number; increase whenever
+                                        # the layout changes
+
+    filename = None                     # Filename of the log
+    file = None                         # Open file
+    EOF = FILEHEADERSIZE                # EOF address
+    readonly = 0                        # Operate in read-only mode ?
+    groupcommit = 8                     # Number of records per fsync()
+    syncdelay = 0.05                    # Max. age of an unsynced record
+    pending = 0                         # Number of unsynced records
+    pending_since = 0                   # Time of the oldest unsynced record
+
+    # Statistics
+    appends = 0
+    syncs = 0
+
+    def __init__(self,filename,readonly=0,groupcommit=8,syncdelay=0.05):
+
+        """ Open the log in filename, creating it if needed.
+
+            readonly opens an existing log for replay only. A missing
+            log is then treated as empty.
+
+            groupcommit gives the maximal number of records to append
+            before the log is synced to disk. syncdelay gives the
+            maximal time in seconds an appended record may stay
+            unsynced, checked whenever a record is appended. Use
+            groupcommit=1 to sync every single commit.
+
+        """
+        self.filename = filename
+        self.readonly = readonly
+        self.groupcommit = max(groupcommit, 1)
+        self.syncdelay = syncdelay
+        if readonly:
+            try:
+                self.file = open(filename, 'rb')
+            except IOError:
+                return
+            if os.path.getsize(filename) == 0:
+                self.file.close()
+                self.file = None
+                return
+        elif os.path.exists(filename) and os.path.getsize(filename) > 0:
+            self.file = open(filename, 'r+b')
+        else:
+            if _debug:
+                log(SYSTEM_INFO,'Creating a new log file %s' % filename)
+            self.file = open(filename, 'w+b')
+            self.write_fileheader()
+            self.file.flush()
+            os.fsync(self.file.fileno())
+            # Make the new directory entry durable as well
+            try:
+                fd = os.open(os.path.dirname(os.path.abspath(filename)),
+                             os.O_RDONLY)
+            except OSError:
+                pass
+            else:
+                try:
+                    os.fsync(fd)
+                except OSError:
+                    pass
+                os.close(fd)
+        self.check_fileheader()
+        self.file.seek(0, 2)
+        self.EOF = self.file.tell()
+
+    def write_fileheader(self):
+
+        """ Write a new header to the log file.
+        """
+        fileheader = '%s version %s\n' % (self.__class__.__name__,
+                                          self.version)
+        fileheader = fileheader + \
+                     ' ' * (FILEHEADERSIZE - len(fileheader) - 1) + '\n'
+        self.file.seek(0)
+        self.file.write(fileheader)
+
+    header_check = re.compile('(\w+) version ([\w.]+)\n')
+
+    def check_fileheader(self):
+
+        """ Check the header of the log file.
+        """
+        self.file.seek(0)
+        fileheader = self.file.read(FILEHEADERSIZE)
+        if len(fileheader) != FILEHEADERSIZE:
+            raise Error,'header is damaged: "%s"' % fileheader
+        m = self.header_check.match(fileheader)
+        if m is None:
+            raise Error,'wrong header format: "%s"' % fileheader
+        name, version = m.groups()
+        if name != self.__class__.__name__:
+            raise Error,'wrong log class: %s (expected %s)' % \
+                  (name,self.__class__.__name__)
+        if version > self.version:
+            raise Error,'wrong version: %s (expected %s)' % \
+                  (version,self.version)
+
+    def __repr__(self):
+
+        return '<%s instance for "%s" at 0x%x>' % (self.__class__.__name__,
+                                                   self.filename,
+                                                   id(self))
+
+    def size(self):
+
+        """ Return the number of bytes used by records in the log.
+        """
+        return self.EOF - FILEHEADERSIZE
+
+    def replay(self,
+
+               unpack=struct.unpack,crc32=zlib.crc32):
+
+        """ Return a list with the changes of all complete records in
+            the log, in the order in which they were appended.
+
+            A damaged record and anything following it is dropped
+            (and cut from the log, unless it was opened read-only).
+
+        """
+        file = self.file
+        if file is None:
+            return []
+        transactions = []
+        position = FILEHEADERSIZE
+        file.seek(position)
+        while 1:
+            header = file.read(RECORDHEADERSIZE)
+            if len(header) < RECORDHEADERSIZE:
+                break
+            id, length, crc = unpack(RECORDHEADER, header)
+            if id != ID:
+                break
+            data = file.read(length)
+            if len(data) < length or crc32(data) & 0xffffffffL != crc:
+                break
+            transactions.append(cPickle.loads(data))
+            position = position + RECORDHEADERSIZE + length
+        if position < self.EOF:
+            log(SYSTEM_WARNING,
+                'Dropping %i bytes of incomplete records from the log %s',
+                self.EOF - position, self.filename)
+            if not self.readonly:
+                file.seek(position)
+                file.truncate()
+                file.flush()
+                os.fsync(file.fileno())
+            self.EOF = position
+        return transactions
+
+    def append(self,changes,
+
+               pack=struct.pack,crc32=zlib.crc32,dumps=cPickle.dumps,
+               time=time.time):
+
+        """ Append a record with changes, a list of (key, state, value)
+            tuples, to the log.
+
+            The record is flushed to the OS. It is synced to disk
+            according to the group commit settings.
+
+        """
+        if self.readonly:
+            raise Error,'log is read-only'
+        data = dumps(changes, 2)
+        file = self.file
+        file.seek(self.EOF)
+        file.write(pack(RECORDHEADER, ID, len(data),
+                        crc32(data) & 0xffffffffL))
+        file.write(data)
+        file.flush()
+        self.EOF = self.EOF + RECORDHEADERSIZE + len(data)
+        self.appends = self.appends + 1
+        now = time()
+        if not self.pending:
+            self.pending_since = now
+        self.pending = self.pending + 1
+        if self.pending >= self.groupcommit or \
+           now - self.pending_since >= self.syncdelay:
+            self.sync()
+
+    def sync(self):
+
+        """ Force all appended records to disk.
+        """
+        if self.pending:
+            os.fsync(self.file.fileno())
+            self.pending = 0
+            self.syncs = self.syncs + 1
+
+    def truncate(self):
+
+        """ Remove all records from the log.
+
+            This must only be done after the changes in the log have
+            been written to the storage and index and synced to disk.
+
+        """
+        if self.readonly:
+            raise Error,'log is read-only'
+        if self.EOF == FILEHEADERSIZE:
+            return
+        file = self.file
+        file.seek(FILEHEADERSIZE)
+        file.truncate()
+        file.flush()
+        os.fsync(file.fileno())
+        self.EOF = FILEHEADERSIZE
+        self.pending = 0
+
+    def close(self):
+
+        """ Sync and close the log.
+        """
+        if self.file is not None:
+            if not self.readonly:
+                self.sync()
+            self.file.close()
+            self.file = None
+
+    def __del__(self):
+
+        if self.file is not None:
+            self.close()
@@ -13,12 +13,21 @@
     or contact the author. All Rights Reserved.
 
 """
-import cPickle,cStringIO,struct,exceptions,types,sys,marshal,re
-import FileLock,Cache
+import cPickle,cStringIO,struct,exceptions,types,sys,marshal,re,os,zlib
+import FileLock,Cache,SharedCache
 from mx import Tools
 freeze = Tools.freeze
 from mx.Log import *
 
+# The record I/O is done in C by mxBeeBase, if available; the Python
+# implementation below is used as fallback and for reporting errors
+try:
+    from mxBeeBase import readheader,readrecord,writerecord,\
+         findrecords,collectrecords
+except ImportError:
+    readheader = readrecord = writerecord = None
+    findrecords = collectrecords = None
+
 # Blocksize used to improve alignment of records (NOTE: Don't change this
 # parameter, or the implementation will corrupt any existing storage file
 # using a different block size !!!
@@ -52,6 +61,69 @@ HOT_MARKER =    '*hot****'
 HOT = 1
 COLD = 0
 
+# Free space management: records with up to this many blocks each
+# get a size class of their own, larger ones share one class per
+# power of two
+FREESPACE_SMALLCLASSES = 16
+
+# Version of the free space map file format
+FREESPACE_VERSION = 1
+
+# Extension appended to the storage filename for the free space map file
+FREESPACE_EXTENSION = '.fsm'
+
+# Default number of records processed by one step of the incremental
+# garbage collector
+COLLECTSTEP = 256
+
+# Encoded data smaller than this number of bytes is not compressed
+COMPRESS_THRESHOLD = 128
+
+# Extension appended to the storage filename for the shared cache file
+SHAREDCACHE_EXTENSION = '.shm'
+
+### Codecs
+
+# Codecs used for compressing the encoded record data: codec name
+# -> (marker,compress,decompress). A compressed data area holds the
+# codec's marker byte followed by the compressed data. Markers are
+# control characters, which never start pickle or marshal data, so
+# uncompressed records (e.g. from existing files) can still be told
+# apart.
+CODECS = {}
+
+# Map of marker byte -> decompress function
+CODEC_MARKERS = {}
+
+def register_codec(name,marker,compress,decompress):
+
+    """ Register a codec for the record compression under name.
+
+        marker must be a control character other than '\0' which is
+        not used by another codec. compress(data) and
+        decompress(data) have to return the compressed and
+        decompressed string. decompress() is passed the whole data
+        area, which may include padding after the compressed data.
+
+    """
+    if len(marker) != 1 or not '\001' <= marker < ' ':
+        raise ValueError('codec marker must be a control character')
+    other = CODEC_MARKERS.get(marker)
+    if other is not None and other is not decompress:
+        raise ValueError('codec marker %r is already in use' % marker)
+    CODECS[name] = (marker,compress,decompress)
+    CODEC_MARKERS[marker] = decompress
+
+def zlib_decompress(data,
+
+                    decompressobj=zlib.decompressobj):
+
+    # The decompressor stops at the end of the compressed stream, so
+    # the padding is ignored
+    return decompressobj().decompress(data)
+
+register_codec('zlib','\001',zlib.compress,zlib_decompress)
+
 # Output debugging info
 _debug = 0
 
@@ -83,6 +155,127 @@ def dummy_callback(old_position,new_position,raw_data):
     """
     return
         
+class FreeSpaceMap:
+
+    """ Map of the free (OLD) records in a storage file.
+
+        The records are kept in buckets by size class: one class per
+        number of blocks for small records and one per power of two
+        for larger ones. Adjacent free records are merged; this is
+        only done in memory, since a record written to the start of
+        a merged area (see BeeStorage.write_record()) makes the file
+        consistent again.
+
+    """
+    def __init__(self,slots=None):
+
+        """ Create a map. slots may be given as dictionary
+            position:size of free records, e.g. as returned by
+            .dump().
+        """
+        self.slots = {}         # position: size
+        self.ends = {}          # end position: position
+        self.buckets = {}       # size class: {position: size}
+        self.freesize = 0       # Total number of free bytes
+        if slots:
+            for position,size in slots.items():
+                self.add(position,size)
+
+    def __len__(self):
+
+        return len(self.slots)
+
+    def sizeclass(self,size):
+
+        """ Return the size class for size.
+        """
+        blocks = size / BLOCKSIZE
+        if blocks <= FREESPACE_SMALLCLASSES:
+            return blocks
+        sizeclass = FREESPACE_SMALLCLASSES
+        blocks = blocks / FREESPACE_SMALLCLASSES
+        while blocks:
+            sizeclass = sizeclass + 1
+            blocks = blocks >> 1
+        return sizeclass
+
+    def add(self,position,size):
+
+        """ Add the free record at position with size bytes to the
+            map, merging it with adjacent free records.
+        """
+        slots = self.slots
+        end = position + size
+        if slots.has_key(end):
+            size = size + self.remove(end)
+        start = self.ends.get(position)
+        if start is not None:
+            size = size + self.remove(start)
+            position = start
+        slots[position] = size
+        self.ends[position + size] = position
+        sizeclass = self.sizeclass(size)
+        bucket = self.buckets.get(sizeclass)
+        if bucket is None:
+            self.buckets[sizeclass] = bucket = {}
+        bucket[position] = size
+        self.freesize = self.freesize + size
+
+    def remove(self,position):
+
+        """ Remove the free record at position from the map and
+            return its size.
+        """
+        size = self.slots[position]
+        del self.slots[position]
+        del self.ends[position + size]
+        sizeclass = self.sizeclass(size)
+        bucket = self.buckets[sizeclass]
+        del bucket[position]
+        if not bucket:
+            del self.buckets[sizeclass]
+        self.freesize = self.freesize - size
+        return size
+
+    def allocate(self,size):
+
+        """ Take a free record of at least size bytes out of the map
+            and return it as tuple (position, size).
+
+            Returns None in case no such record is available.
+
+        """
+        if not self.slots:
+            return None
+        sizeclass = self.sizeclass(size)
+        bucket = self.buckets.get(sizeclass)
+        if bucket:
+            if sizeclass <= FREESPACE_SMALLCLASSES:
+                # All records in the bucket have the same size
+                for position in bucket:
+                    return position,self.remove(position)
+            # First fit
+            for position,slotsize in bucket.iteritems():
+                if slotsize >= size:
+                    break
+            else:
+                position = None
+            if position is not None:
+                return position,self.remove(position)
+        # All records in larger classes fit
+        sizeclasses = [c for c in self.buckets.keys() if c > sizeclass]
+        if not sizeclasses:
+            return None
+        for position in self.buckets[min(sizeclasses)]:
+            return position,self.remove(position)
+
+    def dump(self):
+
+        """ Return the map as dictionary position:size of free
+            records.
+        """
+        return self.slots.copy()
+
 class BeeStorage:
 
     """ Baseclass for flatfile data storage facilities.
@@ -104,6 +297,13 @@ class BeeStorage:
          [CODE] (1 bytes)
          [raw data]
         
+        Freed records are kept in a free space map and reused for new
+        or grown records once the transaction which freed them has
+        ended (see FreeSpaceMap). The map is saved to the file
+        filename + FREESPACE_EXTENSION when the storage is closed; if
+        that file is missing or out of date, the map is rebuilt by
+        scanning the storage file.
+
         XXX Todo:
 
         * Implement write cache.
@@ -124,13 +324,46 @@ class BeeStorage:
     state = None                        # State in which the file is in
     is_new = 0                          # Was the file created by the
                                         # constructor, or just reopened ?
+    inplace = 1                         # Update records in place ? If
+                                        # not, changed records are always
+                                        # appended (needed by snapshot
+                                        # readers)
+    reuse = 1                           # Reuse freed records ? Only
+                                        # done if inplace is set
+    freespace = None                    # FreeSpaceMap instance; loaded
+                                        # when the file is marked HOT
+                                        # and inplace is set
+    freed = None                        # List of (position,size) of
+                                        # the records freed in the
+                                        # current transaction
+    freespace_name = None               # Filename of the saved map
+    freespace_saved = 0                 # Is the saved map up to date ?
+    collect_source = None               # Position of the next record
+                                        # to be processed by the
+                                        # incremental collector; None
+                                        # if no pass is running
+    collect_dest = None                 # Position the incremental
+                                        # collector moves the next
+                                        # VALID record to
+    codec = None                        # Name of the codec used to
+                                        # compress new records; None
+                                        # disables compression
+    compress_threshold = COMPRESS_THRESHOLD # Minimal size of the
+                                        # encoded data to compress
+    sharedcache = None                  # SharedCache instance, if
+                                        # enabled
+    sharedcache_name = None             # Filename of the shared cache
+    sharedcache_pending = None          # List of the positions to
+                                        # invalidate again once the
+                                        # file is flushed; None
+                                        # stands for all positions
     
     # Caches
     header_cache = None
     record_cache = None
 
     def __init__(self,filename,lock=0,cache=0,min_recordsize=MINRECORDSIZE,
-                 readonly=0,recover=0):
+                 readonly=0,recover=0,codec=None,sharedcache=0):
 
         """ Create an instance using filename as data file.
         
@@ -153,9 +386,27 @@ class BeeStorage:
             if a previous normal opening failed with a hint to run
             recovery.
 
+            codec names a codec from CODECS, e.g. 'zlib', to have
+            the encoded data of new records compressed. Records
+            whose data is smaller than .compress_threshold or does
+            not get smaller are stored uncompressed. Compressed
+            records are read back independently of this setting.
+
+            If sharedcache is given, the records read are cached in
+            the file filename + SHAREDCACHE_EXTENSION, which is
+            created with sharedcache bytes, if needed. All processes
+            opening the storage with a shared cache use the same
+            cache (see the SharedCache module). Writers must enable
+            the cache as well, so that it gets updated: a writer
+            opening the storage without the cache removes the file.
+
         """#'
 
         self.readonly = readonly
+        if codec is not None:
+            if not CODECS.has_key(codec):
+                raise Error,'unknown codec: %r' % (codec,)
+            self.codec = codec
 
         if _debug:
             log.call(SYSTEM_DEBUG)
@@ -186,10 +437,16 @@ class BeeStorage:
             mode = 'rb'
         else:
             mode = 'r+b'
+        if readonly and sharedcache:
+            # Readers must not add the possibly outdated contents of
+            # their file buffers to the shared cache
+            buffering = 0
+        else:
+            buffering = -1
         self.filename = filename
         try:
             # Existing file
-            self.file = file = open(filename,mode)
+            self.file = file = open(filename,mode,buffering)
             file.seek(0,2)
             self.EOF = EOF = file.tell()
 
@@ -239,6 +496,24 @@ class BeeStorage:
         # Set state to COLD
         self.state = COLD
 
+        # Free space management
+        self.freed = []
+        self.freespace_name = filename + FREESPACE_EXTENSION
+        if self.is_new and os.path.exists(self.freespace_name):
+            # Left behind by a removed storage file
+            os.remove(self.freespace_name)
+
+        # Shared cache
+        self.sharedcache_name = filename + SHAREDCACHE_EXTENSION
+        if sharedcache:
+            self.open_sharedcache(sharedcache)
+            if self.sharedcache is not None and \
+               (self.is_new or recover) and not readonly:
+                self.sharedcache.clear()
+        elif not readonly and os.path.exists(self.sharedcache_name):
+            # The cache would get out of date
+            os.remove(self.sharedcache_name)
+
         # Header check
         self.check_fileheader(file)
 
@@ -261,6 +536,17 @@ class BeeStorage:
             return
         if self.readonly:
             raise Error,'storage is read-only'
+        if state == HOT:
+            # The saved free space map gets out of date with the
+            # first change
+            if self.freespace is None and self.inplace:
+                self.load_freespace()
+            if self.freespace_saved:
+                try:
+                    os.remove(self.freespace_name)
+                except OSError:
+                    pass
+                self.freespace_saved = 0
         if _debug:
             log(SYSTEM_DEBUG,
                 'Marking the file "%s": %s',
@@ -302,9 +588,142 @@ class BeeStorage:
                         COLD=COLD):
 
         """ End a sequence of storage manipulation commands.
+
+            The records freed during the sequence can be reused
+            from now on.
         """
+        self.release_freed()
         self.mark(COLD)
 
+    def release_freed(self):
+
+        """ Add the records freed in the current transaction to the
+            free space map.
+        """
+        freed = self.freed
+        if not freed:
+            return
+        freespace = self.freespace
+        if freespace is not None:
+            dest = self.collect_dest
+            for position,size in freed:
+                # Records not yet passed by a running incremental
+                # collection are left for the collector
+                if dest is None or position < dest:
+                    freespace.add(position,size)
+        del freed[:]
+
+    def load_freespace(self,
+
+                       load=marshal.load):
+
+        """ Load the free space map saved by the last .close().
+
+            If it is missing or out of date, the map is rebuilt from
+            the OLD records found in the file.
+
+        """
+        self.freespace = None
+        if self.state == COLD and os.path.exists(self.freespace_name):
+            try:
+                f = open(self.freespace_name,'rb')
+                try:
+                    version,EOF,slots = load(f)
+                finally:
+                    f.close()
+                if version == FREESPACE_VERSION and EOF == self.EOF:
+                    self.freespace = FreeSpaceMap(slots)
+                    self.freespace_saved = 1
+            except (IOError,EOFError,ValueError,TypeError):
+                pass
+        if self.freespace is None:
+            if _debug:
+                log(SYSTEM_INFO,'Rebuilding the free space map for %s',
+                    self.filename)
+            freespace = FreeSpaceMap()
+            valid,old,invalid = self.find_records()
+            for position,size in old:
+                freespace.add(position,size)
+            self.freespace = freespace
+
+    def save_freespace(self,
+
+                       dump=marshal.dump):
+
+        """ Save the free space map, so that the next session does
+            not have to rebuild it.
+        """
+        if self.freespace is None or self.freespace_saved:
+            return
+        if self.collect_source is not None:
+            # The map does not include the free records behind the
+            # running incremental collection; have the next session
+            # rebuild it
+            return
+        f = open(self.freespace_name,'wb')
+        try:
+            dump((FREESPACE_VERSION,self.EOF,self.freespace.dump()),f)
+        finally:
+            f.close()
+        self.freespace_saved = 1
+
+    def open_sharedcache(self,size):
+
+        """ Open the shared cache, creating it with size bytes if
+            needed.
+
+            Problems are logged; the storage then works without the
+            cache.
+
+        """
+        try:
+            self.sharedcache = SharedCache.SharedCache(self.sharedcache_name,
+                                                       size)
+        except (IOError,OSError,SharedCache.Error),why:
+            log(SYSTEM_WARNING,'Shared cache %s is not available: %s',
+                self.sharedcache_name,why)
+            return
+        self.sharedcache_pending = []
+
+    def invalidate_shared(self,position):
+
+        """ Invalidate the record at position in the shared cache.
+
+            Other processes may still read the old data from the file
+            and add it to the cache until the file is flushed, so the
+            record is invalidated once more by .flush_shared().
+
+        """
+        self.sharedcache.invalidate(position)
+        self.sharedcache_pending.append(position)
+
+    def clear_shared(self):
+
+        """ Invalidate all records in the shared cache.
+        """
+        if self.sharedcache is not None:
+            self.sharedcache.clear()
+            self.sharedcache_pending[:] = [None]
+
+    def flush_shared(self):
+
+        """ Repeat the invalidations done since the last call.
+
+            Must be called after flushing the file.
+
+        """
+        pending = self.sharedcache_pending
+        if not pending:
+            return
+        sharedcache = self.sharedcache
+        if None in pending:
+            sharedcache.clear()
+        else:
+            invalidate = sharedcache.invalidate
+            for position in pending:
+                invalidate(position)
+        del pending[:]
+
     def write_fileheader(self,file):
 
         """ Write a new header to the open file.
@@ -386,6 +805,37 @@ class BeeStorage:
         """
         raise Error,'.decode() needs to be overridden'
 
+    def compress(self,data,
+
+                 CODECS=CODECS):
+
+        """ Compress the encoded data using .codec, if enabled.
+
+            The data is returned unchanged if it is smaller than
+            .compress_threshold or compression does not save space.
+            Encodings using this method must make sure that their
+            data never starts with a control character.
+
+        """
+        if self.codec is None or len(data) < self.compress_threshold:
+            return data
+        marker,compress,decompress = CODECS[self.codec]
+        compressed = compress(data)
+        if len(compressed) + 1 >= len(data):
+            return data
+        return marker + compressed
+
+    def decompress(self,data,
+
+                   CODEC_MARKERS=CODEC_MARKERS):
+
+        """ Undo .compress(). data may include the record's padding.
+        """
+        decompress = CODEC_MARKERS.get(data[:1])
+        if decompress is None:
+            return data
+        return decompress(data[1:])
+
     def clear_cache(self):
 
         """ Clears the caches used (flushing any data not yet
@@ -406,9 +856,16 @@ class BeeStorage:
             method_mapply(self.caches,'clear',())
         if self.file:
             # Mark COLD
-            if not self.readonly and self.state != COLD:
-                self.mark(COLD)
+            if not self.readonly:
+                self.release_freed()
+                if self.state != COLD:
+                    self.mark(COLD)
+                self.save_freespace()
             del self.file
+        if self.sharedcache is not None:
+            self.flush_shared()
+            self.sharedcache.close()
+            del self.sharedcache
         if self.filelock:
             self.filelock.unlock()
             del self.filelock
@@ -424,7 +881,32 @@ class BeeStorage:
 
         """ Flush all buffers.
         """
-        return
+        if self.file and not self.readonly:
+            self.file.flush()
+            if self.sharedcache_pending:
+                self.flush_shared()
+
+    def sync(self):
+
+        """ Flush the file buffers and force the data to disk.
+        """
+        if self.file and not self.readonly:
+            self.file.flush()
+            os.fsync(self.file.fileno())
+            if self.sharedcache_pending:
+                self.flush_shared()
+
+    def refresh(self):
+
+        """ Pick up the records appended by a writer since the file
+            was opened.
+
+            Only useful in read-only mode; the caches are cleared.
+        """
+        if self.file and self.readonly:
+            self.file.seek(0,2)
+            self.EOF = self.file.tell()
+            self.clear_cache()
 
     def __repr__(self):
 
@@ -435,7 +917,7 @@ class BeeStorage:
     def read_header(self,position,
 
                     unpack=struct.unpack,BLOCKSIZE=BLOCKSIZE,
-                    ID=ID,headertypes=(OLD,VALID)):
+                    ID=ID,headertypes=(OLD,VALID),readheader=readheader):
 
         """ Read the header located at position and return
             a tuple (record size, statebyte, data area size).
@@ -455,6 +937,14 @@ class BeeStorage:
                 self.file.seek(position+6)
                 return header
 
+        if readheader is not None:
+            header = readheader(self.file,position,self.EOF)
+            if header is not None:
+                if self.caching:
+                    self.header_cache.put(position,header)
+                return header
+            # Let the code below report the error
+
         # Sanity check
         if position % BLOCKSIZE != 0 or \
            position > self.EOF:
@@ -499,11 +989,13 @@ class BeeStorage:
         
         if self.caching:
             self.header_cache.put(position,(recordsize,rtype,recordsize-6))
+        if self.sharedcache is not None:
+            self.invalidate_shared(position)
 
     def write_record(self,data,position,minsize=0,rtype=VALID,
 
                      BLOCKSIZE=BLOCKSIZE,pack=struct.pack,
-                     ID=ID,HOT=HOT):
+                     ID=ID,HOT=HOT,writerecord=writerecord):
 
         """ Write a record of given rtype (defaults to VALID)
             containing data to position.
@@ -530,7 +1022,7 @@ class BeeStorage:
         datasize = None
         if position < EOF:
             recordsize,rt,datasize = self.read_header(position)
-            if datasize < datalen:
+            if datasize < datalen or not self.inplace:
                 # Mark valid record as old
                 if rt == VALID:
                     if _debug:
@@ -556,21 +1048,41 @@ class BeeStorage:
                 recordsize = self.min_recordsize
             if recordsize % BLOCKSIZE != 0:
                 recordsize = (recordsize / BLOCKSIZE + 1) * BLOCKSIZE
+
+            # Reuse a free record, if possible
+            if self.freespace is not None and self.reuse and self.inplace:
+                slot = self.freespace.allocate(recordsize)
+                if slot is not None:
+                    position,slotsize = slot
+                    if slotsize - recordsize >= self.min_recordsize:
+                        # Split the free record; the rest stays free
+                        self.write_header(position + recordsize,
+                                          slotsize - recordsize,OLD)
+                        self.freespace.add(position + recordsize,
+                                           slotsize - recordsize)
+                    else:
+                        recordsize = slotsize
             datasize = recordsize - 6
 
         # Write the header + data + padding
-        file.seek(position)
-        file.write(''.join(
-            (ID,pack('<l', recordsize), rtype,     # Header
-             data,                                 # Data
-             '\0' * (datasize - datalen)           # Padding
-             )))
+        if writerecord is not None:
+            end = writerecord(file, position, recordsize, rtype, data)
+        else:
+            file.seek(position)
+            file.write(''.join(
+                (ID,pack('<l', recordsize), rtype,     # Header
+                 data,                                 # Data
+                 '\0' * (datasize - len(data))         # Padding
+                 )))
+            end = file.tell()
         if self.caching:
             self.header_cache.put(position, (recordsize, rtype, datasize))
+        if self.sharedcache is not None and position < EOF:
+            self.invalidate_shared(position)
 
         # Update EOF
         if position >= EOF:
-            self.EOF = file.tell()
+            self.EOF = end
             if _debug:
                 log(SYSTEM_DEBUG,'New EOF = %i',self.EOF)
         if _debug:
@@ -579,7 +1091,9 @@ class BeeStorage:
 
         return position
 
-    def read_record(self,position,rtype=VALID):
+    def read_record(self,position,rtype=VALID,
+
+                    readrecord=readrecord):
 
         """ Read the raw data from record position having the given
             rtype (defaults to VALID).
@@ -589,6 +1103,15 @@ class BeeStorage:
             caches are not used.
             
         """
+        if readrecord is not None:
+            record = readrecord(self.file,position,self.EOF)
+            if record is not None:
+                rt,data = record
+                if rtype != rt:
+                    raise Error(
+                        'record has wrong type, expected %r, found %r' %
+                        (rtype, rt))
+                return data
         file = self.file
         recordsize,rt,datasize = self.read_header(position)
         if rtype != rt:
@@ -611,12 +1134,18 @@ class BeeStorage:
         """
         if self.state != HOT:
             self.mark(HOT)
+        if self.freespace is not None and self.inplace:
+            recordsize,rtype,datasize = self.read_header(position)
+            if rtype == VALID:
+                self.freed.append((position,recordsize))
         file = self.file
         file.seek(position + 5)
         file.write(OLD)
 
         if self.caching:
             Tools.method_mapply(self.caches,'delete',(position,))
+        if self.sharedcache is not None:
+            self.invalidate_shared(position)
 
     # Aliases
     delete = free
@@ -659,7 +1188,7 @@ class BeeStorage:
 
     def read(self,position,
 
-             NotCached=Cache.NotCached):
+             NotCached=Cache.NotCached,readrecord=readrecord):
 
         """ Load an object from the file at the given position.
         """
@@ -668,10 +1197,27 @@ class BeeStorage:
             if data is not NotCached:
                 return self.decode(data)
 
-        file = self.file
-        recordsize,rtype,datasize = self.read_header(position)
-        data = file.read(datasize)
+        sharedcache = self.sharedcache
+        if sharedcache is not None:
+            data = sharedcache.get(position)
+            if data is not None:
+                return self.decode(data)
+            version = sharedcache.version(position)
 
+        record = None
+        if readrecord is not None:
+            record = readrecord(self.file,position,self.EOF)
+        if record is not None:
+            data = record[1]
+        else:
+            file = self.file
+            recordsize,rtype,datasize = self.read_header(position)
+            data = file.read(datasize)
+
+        if sharedcache is not None:
+            # Share the decompressed data
+            data = self.decompress(data)
+            sharedcache.put(position,data,version)
         if self.caching:
             self.record_cache.put(position,data)
 
@@ -680,7 +1226,9 @@ class BeeStorage:
     # Alias
     __getitem__ = read
         
-    def find_records(self,start=STARTOFDATA,stop=sys.maxint):
+    def find_records(self,start=STARTOFDATA,stop=sys.maxint,
+
+                     findrecords=findrecords):
 
         """ Scans the data file for valid, old and invalid records and
             returns a list of positions to these records.
@@ -695,6 +1243,12 @@ class BeeStorage:
         if stop > EOF:
             stop = EOF
         position = start
+        # Adjust position to next block boundary
+        if position % BLOCKSIZE != 0:
+            position = (position / BLOCKSIZE + 1) * BLOCKSIZE
+        if findrecords is not None:
+            return findrecords(self.file,position,stop)
+
         valid = []
         invalid = []
         old = []
@@ -702,10 +1256,6 @@ class BeeStorage:
         old_append = old.append
         valid_append = valid.append
         invalid_append = invalid.append
-        # Adjust position to next block boundary
-        if position % BLOCKSIZE != 0:
-            position = (position / BLOCKSIZE + 1) * BLOCKSIZE
-
         while position < stop:
             try:
                 recordsize,rtype,datasize = read_header(position)
@@ -722,7 +1272,9 @@ class BeeStorage:
 
         return valid,old,invalid
 
-    def statistics(self):
+    def statistics(self,
+
+                   findrecords=findrecords):
 
         """ Scans the data file for valid, old and invalid records and
             returns a tuple valid, old, invalid indicating the number
@@ -730,6 +1282,11 @@ class BeeStorage:
         """
         position = STARTOFDATA
         EOF = self.EOF
+        if findrecords is not None:
+            return tuple([sum([size for position,size in records])
+                          for records in findrecords(self.file,
+                                                     position,EOF)])
+
         valid = 0
         invalid = 0
         old = 0
@@ -750,7 +1307,9 @@ class BeeStorage:
 
         return valid,old,invalid
 
-    def collect(self,callback=dummy_callback,recover=0):
+    def collect(self,callback=dummy_callback,recover=0,
+
+                collectrecords=collectrecords):
 
         """ Collect garbage that accumulated since the last .collect()
             run.
@@ -791,23 +1350,133 @@ class BeeStorage:
         if caching:
             self.clear_cache()
             self.caching = 0
+        self.clear_shared()
+
+        # No free records are left after collecting; a running
+        # incremental collection is superseded
+        del self.freed[:]
+        if self.inplace:
+            self.freespace = FreeSpaceMap()
+        self.collect_source = self.collect_dest = None
 
         # Mark HOT
         if self.state != HOT:
             self.mark(HOT)
 
         # First align all VALID records to the "left"
-        while source < EOF:
+        if collectrecords is not None:
+            dest,skipped = collectrecords(file,source,EOF,callback,recover)
+            if not recover:
+                for source in skipped:
+                    log(SYSTEM_WARNING,
+                        'Skipping unallocated/misaligned block at %i',source)
+        else:
+            while source < EOF:
+                try:
+                    recordsize,rtype,datasize = read_header(source)
+                except Error:
+                    # Unallocated space: skip
+                    source = source + BLOCKSIZE
+                    if not recover:
+                        log(SYSTEM_WARNING,
+                            'Skipping unallocated/misaligned block at %i',
+                            source)
+                    continue
+
+                if rtype == VALID:
+                    if source != dest:
+                        # Move record (informing caller via callback)
+                        file.seek(source)
+                        record = file.read(recordsize)
+                        file.seek(dest)
+                        file.write(record)
+                        callback(source,dest,record[6:])
+                    elif recover:
+                        # Inform caller of all valid records found
+                        file.seek(source)
+                        record = file.read(recordsize)
+                        callback(source,dest,record[6:])
+                    dest = dest + recordsize
+
+                elif rtype == OLD:
+                    # Skip record
+                    pass
+            
+                # Process next record
+                source = source + recordsize
+
+        # Everything behind dest is now considered free space
+        self.truncate(dest,EOF)
+        EOF = dest
+        if EOF % BLOCKSIZE != 0:
+            if recover:
+                # In recover mode we simply pad the file to align
+                # the file's end to BLOCKSIZE
+                file.seek(EOF)
+                padsize = BLOCKSIZE - EOF % BLOCKSIZE
+                file.write('\0' * padsize)
+                EOF = EOF + padsize
+            else:
+                raise Error,'EOF malaligned after collect()'
+        self.EOF = EOF
+            
+        # Reenable caching
+        if caching:
+            self.caching = 1
+
+    def collect_step(self,callback=dummy_callback,maxrecords=COLLECTSTEP,
+
+                     OLD=OLD,VALID=VALID):
+
+        """ Run one step of the incremental garbage collector.
+
+            The collector works like .collect(), but only processes
+            up to maxrecords records per call, so that other changes
+            can be written between the steps. A pass starts with the
+            first call and ends when the end of the file is reached,
+            which is then truncated. Returns 1 if the step finished
+            the pass, 0 otherwise.
+
+            The space between the records moved so far and the
+            unprocessed rest of the file is kept as one OLD record,
+            so the file stays consistent after each step. Records
+            freed in the unprocessed part are not reused, but left to
+            the collector.
+
+            callback is called as for .collect(). The step starts a
+            new transaction (if not already marked HOT); it is up to
+            the caller to end it.
+
+        """
+        file = self.file
+        read_header = self.read_header
+
+        # Mark HOT
+        if self.state != HOT:
+            self.mark(HOT)
+
+        if self.collect_source is None:
+            # Start a new pass
+            if _debug:
+                log(SYSTEM_DEBUG,'Starting an incremental collection of %s',
+                    self.filename)
+            if self.inplace:
+                self.freespace = FreeSpaceMap()
+            self.collect_source = self.collect_dest = STARTOFDATA
+        source = self.collect_source
+        dest = self.collect_dest
+        EOF = self.EOF
+
+        records = 0
+        while source < EOF and records < maxrecords:
             try:
                 recordsize,rtype,datasize = read_header(source)
             except Error:
                 # Unallocated space: skip
                 source = source + BLOCKSIZE
-                if not recover:
-                    log(SYSTEM_WARNING,
-                        'Skipping unallocated/misaligned block at %i',source)
+                log(SYSTEM_WARNING,
+                    'Skipping unallocated/misaligned block at %i',source)
                 continue
-
             if rtype == VALID:
                 if source != dest:
                     # Move record (informing caller via callback)
@@ -815,48 +1484,61 @@ class BeeStorage:
                     record = file.read(recordsize)
                     file.seek(dest)
                     file.write(record)
-                    callback(source,dest,record[6:])
-                elif recover:
-                    # Inform caller of all valid records found
-                    file.seek(source)
-                    record = file.read(recordsize)
+                    if self.sharedcache is not None:
+                        self.invalidate_shared(source)
+                        self.invalidate_shared(dest)
                     callback(source,dest,record[6:])
                 dest = dest + recordsize
-
-            elif rtype == OLD:
-                # Skip record
-                pass
-            
-            # Process next record
             source = source + recordsize
+            records = records + 1
 
-        # Everything behind dest is now considered free space
+        # Records freed in the current transaction are dropped once
+        # the collector has passed them
+        self.freed[:] = [(position,size)
+                         for position,size in self.freed
+                         if position < self.collect_source or
+                            position >= source]
+
+        # The moved records invalidate cached positions
+        if self.caching:
+            self.clear_cache()
+
+        if source < EOF:
+            # Cover the gap with an OLD record
+            if dest < source:
+                self.write_header(dest,source - dest,OLD)
+            self.collect_source = source
+            self.collect_dest = dest
+            return 0
+
+        # Pass complete: everything behind dest is free space
+        self.truncate(dest,EOF)
+        self.EOF = dest
+        self.collect_source = self.collect_dest = None
+        if _debug:
+            log(SYSTEM_DEBUG,'Incremental collection of %s done, EOF = %i',
+                self.filename,dest)
+        return 1
+
+    def truncate(self,position,EOF):
+
+        """ Truncate the file at position; EOF must be the current
+            end of the file.
+
+            This method is intended for internal use only.
+
+        """
+        file = self.file
         try:
-            file.truncate(dest)
+            file.truncate(position)
         except AttributeError:
             # Truncate is not supported: clear out the remaining
             # space to make it invalid and continue processing as if
             # the file were truncated.
-            file.seek(dest)
-            while dest < EOF:
+            file.seek(position)
+            while position < EOF:
                 file.write('\0'*BLOCKSIZE)
-                dest = dest + BLOCKSIZE
-        EOF = dest
-        if EOF % BLOCKSIZE != 0:
-            if recover:
-                # In recover mode we simply pad the file to align
-                # the file's end to BLOCKSIZE
-                file.seek(EOF)
-                padsize = BLOCKSIZE - EOF % BLOCKSIZE
-                file.write('\0' * padsize)
-                EOF = EOF + padsize
-            else:
-                raise Error,'EOF malaligned after collect()'
-        self.EOF = EOF
-            
-        # Reenable caching
-        if caching:
-            self.caching = 1
+                position = position + BLOCKSIZE
 
     def backup(self,archive=None,buffersize=8192):
 
@@ -895,7 +1577,7 @@ class PickleMixin:
 
     """ Pickle encoding.
 
-        Uses binary pickles.
+        Uses binary pickles, compressed by the storage's .codec.
     """
     def encode(self,object,
 
@@ -906,7 +1588,7 @@ class PickleMixin:
             This method can be overloaded in order to implement
             other encoding schemes.
         """
-        return dumps(object,1)
+        return self.compress(dumps(object,1))
 
     def decode(self,object,
 
@@ -917,7 +1599,7 @@ class PickleMixin:
             This method can be overloaded in order to implement
             other encoding schemes.
         """
-        return loads(object)
+        return loads(self.decompress(object))
 
 class BeePickleStorage(PickleMixin,BeeStorage):
 
@@ -931,6 +1613,8 @@ freeze(BeePickleStorage)
 class MarshalMixin:
 
     """ Marshal encoding.
+
+        The data is compressed by the storage's .codec.
     """
 
     def encode(self,object,
@@ -942,7 +1626,7 @@ class MarshalMixin:
             This method can be overloaded in order to implement
             other encoding schemes.
         """
-        return dumps(object)
+        return self.compress(dumps(object))
 
     def decode(self,object,
 
@@ -953,7 +1637,7 @@ class MarshalMixin:
             This method can be overloaded in order to implement
             other encoding schemes.
         """
-        return loads(object)
+        return loads(self.decompress(object))
 
 class BeeMarshalStorage(MarshalMixin,BeeStorage):
 
@@ -976,7 +1660,8 @@ class BeeKeyValueStorage(BeeStorage):
         requested.
 
         NOTE: The .en/decode methods are NOT used. Uses binary
-        pickles.
+        pickles. Only the value pickle is compressed by the .codec,
+        so that keys can still be read without decompressing.
 
     """
     key_cache = None
@@ -999,7 +1684,7 @@ class BeeKeyValueStorage(BeeStorage):
             one.
         """
         # Pack key and value into two separate pickles
-        data = dumps(key,1) + dumps(value,1)
+        data = dumps(key,1) + self.compress(dumps(value,1))
 
         # Write the record
         if position is None:
@@ -1026,7 +1711,8 @@ class BeeKeyValueStorage(BeeStorage):
 
     def read_key(self,position,
 
-                 load=cPickle.load,NotCached=Cache.NotCached):
+                 load=cPickle.load,NotCached=Cache.NotCached,
+                 StringIO=cStringIO.StringIO):
 
         """ Load the key part of an object from the file at the given
             position.
@@ -1036,9 +1722,15 @@ class BeeKeyValueStorage(BeeStorage):
             if key is not NotCached:
                 return key
 
-        # Position file reader and only read the key part
-        self.read_header(position)
-        key = load(self.file)
+        record = None
+        if self.sharedcache is not None:
+            record = self.sharedcache.get(position)
+        if record is not None:
+            key = load(StringIO(record))
+        else:
+            # Position file reader and only read the key part
+            self.read_header(position)
+            key = load(self.file)
 
         if self.caching:
             self.key_cache.put(position,key)
@@ -1047,34 +1739,57 @@ class BeeKeyValueStorage(BeeStorage):
         
     def read(self,position,
 
-             load=cPickle.load,StringIO=cStringIO.StringIO,
-             NotCached=Cache.NotCached):
+             load=cPickle.load,loads=cPickle.loads,
+             StringIO=cStringIO.StringIO,NotCached=Cache.NotCached,
+             readrecord=readrecord,CODEC_MARKERS=CODEC_MARKERS):
 
         """ Load an object from the file at the given position and
             return it as tuple (key,value).
         """
+        record = None
         if self.caching:
             record = self.record_cache.get(position,NotCached)
-            if record is not NotCached:
-                file = StringIO(record)
-                key = load(file)
-                data = load(file)
-                return key,data
-
-        # Read the header and position the file over the data area
-        recordsize,rtype,datasize = self.read_header(position)
-
+            if record is NotCached:
+                record = None
+
+        # version is set if the record is to be added to the shared
+        # cache
+        version = None
+        sharedcache = self.sharedcache
+        if record is None and sharedcache is not None:
+            record = sharedcache.get(position)
+            if record is None:
+                version = sharedcache.version(position)
+
+        if record is None:
+            if readrecord is not None:
+                record = readrecord(self.file,position,self.EOF)
+            if record is not None:
+                record = record[1]
+            else:
+                # Read the header and position the file over the data area
+                recordsize,rtype,datasize = self.read_header(position)
+                record = self.file.read(datasize)
+            if self.caching:
+                self.record_cache.put(position,record)
+
+        file = StringIO(record)
+        key = load(file)
         if self.caching:
-            record = file.read(datasize)
-            file = StringIO(record)
-            key = load(file)
-            data = load(file)
-            self.record_cache.put(position,record)
             self.key_cache.put(position,key)
-        else:
-            file = self.file
-            key = load(file)
+        offset = file.tell()
+        decompress = CODEC_MARKERS.get(record[offset:offset+1])
+        if decompress is None:
             data = load(file)
+            if version is not None:
+                # Share the record without the padding
+                sharedcache.put(position,record[:file.tell()],version)
+        else:
+            value = decompress(record[offset+1:])
+            data = loads(value)
+            if version is not None:
+                # Share the record with the value decompressed
+                sharedcache.put(position,record[:offset] + value,version)
 
         return key,data
 
@@ -0,0 +1,185 @@
+""" SharedCache - Record cache shared by several processes.
+
+    The cache lives in a file which all processes using it map into
+    memory, so that a record read (and decompressed) by one process
+    can be reused by all others. It is keyed by the record's position
+    in the storage file and has a fixed size given when the file is
+    created: records are stored in slots of SLOTSIZE bytes, with the
+    least recently accessed slot of a set of four being evicted when
+    a new record is added. Records which do not fit into a slot are
+    not cached.
+
+    Only the raw data is shared; each process still has to unpickle
+    it.
+
+    The segment is managed by the sharedcache*() functions of
+    mxBeeBase, which use atomic operations instead of locks.
+
+    Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+    See the documentation for further information on copyrights,
+    or contact the author. All Rights Reserved.
+
+"""
+import os,mmap,exceptions
+from mx.Log import *
+from mxBeeBase import sharedcacheinit,sharedcacheget,sharedcacheput,\
+     sharedcacheversion,sharedcacheinvalidate,sharedcacheclear,\
+     sharedcachestats
+
+# Default size of a new cache file in bytes
+SIZE = 16777216
+
+# Size of a slot in bytes; includes a 24 byte slot header
+SLOTSIZE = 1024
+
+# Output debugging info
+_debug = 0
+
+### Errors
+
+class Error(exceptions.StandardError):
+    pass
+
+### Classes
+
+class SharedCache:
+
+    """ Cache for the raw data of storage records, shared with all
+        processes opening the same file.
+
+        The file is created with size bytes and slots of slotsize
+        bytes, if it does not exist. Otherwise the settings of the
+        existing file are used.
+
+        Data must be stored using .put() together with the
+        .version() fetched before the data was read from the
+        storage, so that an .invalidate() issued meanwhile is not
+        lost.
+
+    """
+    filename = None
+    map = None                          # mmap object of the file
+
+    def __init__(self,filename,size=SIZE,slotsize=SLOTSIZE):
+
+        self.filename = filename
+        if not os.path.exists(filename):
+            self.create(size,slotsize)
+        file = open(filename,'r+b')
+        try:
+            try:
+                self.map = mmap.mmap(file.fileno(),0)
+            except (ValueError,EnvironmentError),why:
+                raise Error('cannot map %s: %s' % (filename,why))
+        finally:
+            file.close()
+        try:
+            sharedcachestats(self.map)
+        except ValueError:
+            self.close()
+            raise Error('%s is not a shared cache file' % filename)
+
+    def create(self,size,slotsize):
+
+        """ Create the file with a new, empty segment.
+
+            The segment is initialized in a temporary file which is
+            then linked to the filename, so that processes never see
+            a partially initialized file.
+
+        """
+        filename = self.filename
+        tempname = '%s.%i.tmp' % (filename,os.getpid())
+        file = open(tempname,'w+b')
+        try:
+            file.truncate(size)
+            map = mmap.mmap(file.fileno(),size)
+            try:
+                sharedcacheinit(map,slotsize)
+            finally:
+                map.close()
+        finally:
+            file.close()
+        if _debug:
+            log(SYSTEM_DEBUG,'Created shared cache %s (%i bytes)',
+                filename,size)
+        try:
+            link = os.link
+        except AttributeError:
+            # No hard links: this is not safe against other processes
+            # creating the file at the same time
+            if not os.path.exists(filename):
+                os.rename(tempname,filename)
+                return
+        else:
+            try:
+                link(tempname,filename)
+            except OSError:
+                # Created by another process
+                pass
+        os.remove(tempname)
+
+    def get(self,position,
+
+            sharedcacheget=sharedcacheget):
+
+        """ Return the data cached for the record at position, or
+            None.
+        """
+        return sharedcacheget(self.map,position)
+
+    def version(self,position,
+
+                sharedcacheversion=sharedcacheversion):
+
+        """ Return the version to pass to .put() for data about to
+            be read for the record at position.
+        """
+        return sharedcacheversion(self.map,position)
+
+    def put(self,position,data,version,
+
+            sharedcacheput=sharedcacheput):
+
+        """ Store data for the record at position. Returns 1 if the
+            data was stored, 0 if not.
+        """
+        return sharedcacheput(self.map,position,data,version)
+
+    def invalidate(self,position):
+
+        """ Drop the data cached for the record at position in all
+            processes.
+        """
+        sharedcacheinvalidate(self.map,position)
+
+    def clear(self):
+
+        """ Drop all cached data in all processes.
+        """
+        sharedcacheclear(self.map)
+
+    def statistics(self):
+
+        """ Return a dictionary with the number of slots, the slot
+            size and the (approximate) number of hits and misses of
+            all processes using the cache.
+        """
+        slots,slotsize,hits,misses = sharedcachestats(self.map)
+        return {'slots': slots,
+                'slotsize': slotsize,
+                'hits': hits,
+                'misses': misses}
+
+    def close(self):
+
+        """ Unmap the file. The file itself is left in place for the
+            other processes.
+        """
+        if self.map is not None:
+            self.map.close()
+            self.map = None
+
+    def __del__(self):
+
+        self.close()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+
+""" bench-sectorsize - Compare BeeIndex performance for various sector
+    sizes.
+
+    The script creates an index for each sector size using the bulk
+    loader, then measures random lookups and a full cursor scan. The
+    disk read column gives the number of node reads per lookup; it
+    goes down as the tree gets flatter.
+
+    Usage: bench-sectorsize.py [<keys> [<lookups> [<dir> [<cachesize>]]]]
+
+    Put <dir> on the storage you want to test (e.g. an NVMe drive or
+    a tmpfs mount). <cachesize> is the node cache size in bytes and
+    defaults to the minimum cache.
+
+    Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+    See the documentation for further information on copyrights,
+    or contact the author. All Rights Reserved.
+
+"""
+import sys, os, time, random
+from mx.BeeBase import BeeIndex
+
+# Sector sizes to compare
+SECTOR_SIZES = [x for x in (256, 1024, 4096, 16384, 65536)
+                if x <= BeeIndex.MAX_SECTOR_SIZE]
+
+def bench(filename, sectorsize, keys, probes, cachesize):
+
+    index = BeeIndex.BeeIntegerIndex(filename, filemode=2,
+                                     sectorsize=sectorsize,
+                                     cachesize=cachesize)
+    index.bulkload([(key, key) for key in keys])
+    index.close()
+
+    index = BeeIndex.BeeIntegerIndex(filename, filemode=1,
+                                     sectorsize=sectorsize,
+                                     cachesize=cachesize)
+    maxct = index.format[2]
+    start_reads = index.statistics[7]
+    get = index.get
+    start = time.time()
+    for key in probes:
+        get(key)
+    lookup_time = time.time() - start
+    reads = index.statistics[7] - start_reads
+
+    start = time.time()
+    cursor = index.cursor(BeeIndex.FirstKey)
+    n = 1
+    next = cursor.next
+    while next():
+        n = n + 1
+    scan_time = time.time() - start
+    assert n == len(keys)
+    index.close()
+    size = os.path.getsize(filename)
+    os.remove(filename)
+    return (maxct, size,
+            len(probes) / max(lookup_time, 1e-6),
+            float(reads) / len(probes),
+            n / max(scan_time, 1e-6))
+
+def main(argv):
+
+    try:
+        nkeys = int(argv[1])
+    except IndexError:
+        nkeys = 100000
+    try:
+        nlookups = int(argv[2])
+    except IndexError:
+        nlookups = 100000
+    try:
+        dir = argv[3]
+    except IndexError:
+        dir = '.'
+    try:
+        cachesize = int(argv[4])
+    except IndexError:
+        cachesize = 0
+    filename = os.path.join(dir, 'bench-sectorsize.idx')
+
+    keys = range(0, nkeys * 2, 2)
+    probes = [random.choice(keys) for i in xrange(nlookups)]
+
+    print ('BeeIndex sector size benchmark: %i keys, %i lookups' %
+           (nkeys, nlookups))
+    print ('')
+    print ('%10s %7s %12s %12s %10s %12s' %
+           ('sectorsize', 'maxct', 'file size', 'lookups/s',
+            'reads/op', 'scan keys/s'))
+    for sectorsize in SECTOR_SIZES:
+        maxct, size, lookups, reads, scan = bench(filename, sectorsize,
+                                                  keys, probes, cachesize)
+        print ('%10i %7i %12i %12.0f %10.2f %12.0f' %
+               (sectorsize, maxct, size, lookups, reads, scan))
+
+if __name__ == '__main__':
+    main(sys.argv)
@@ -0,0 +1,452 @@
+#!/usr/bin/env python
+
+""" bench-workloads - Benchmark BeeIndex and BeeDict using a set of
+    reproducible workloads.
+
+    The following workloads are run for a BeeIntegerIndex ("index")
+    and a BeeStringDict ("dict") with n keys:
+
+    random_insert       insert the keys in random order into a new file
+    sequential_insert   insert the keys in ascending order
+    lookup_hit          look up keys which exist
+    lookup_miss         look up keys which don't exist
+    range_scan          read ranges of scanlength keys starting at
+                        random keys
+    update              change the values of random keys
+    commit              insert commitsize keys, then commit (flush);
+                        one operation is one such transaction
+
+    The lookup, range scan and update workloads use a file which was
+    bulk loaded with the keys before the measurement starts. Dict
+    workloads which change data commit every commitevery operations;
+    the commits are part of the measured operations.
+
+    All random choices are made using the given seed, so that runs
+    with the same parameters execute the same operations.
+
+    The results are written as JSON: an object with the parameters
+    and a list of results giving the number of operations, the run
+    time, operations per second, the median and 99th percentile of
+    the operation latencies in microseconds and the size of the
+    file(s) after the run in bytes.
+
+    Usage: bench-workloads.py [options]
+
+    -n <keys>           number of keys (default 100000)
+    -m <ops>            number of operations of the lookup, scan,
+                        update and commit workloads (default: keys)
+    -w <workloads>      comma separated list of workloads (default: all)
+    -t <targets>        comma separated list of targets (default:
+                        index,dict)
+    -d <dir>            directory for the files (default: .)
+    -o <file>           write the JSON output to file (default: stdout)
+    -s <seed>           random seed (default: 42)
+    -c <cachesize>      node cache size of the indexes in bytes
+                        (default: minimum cache)
+    -v <valuesize>      size of the dict values in bytes (default: 100)
+    -l <scanlength>     number of keys read per range scan (default: 100)
+    -C <commitevery>    dict commit interval in operations (default: 1000)
+    -T <commitsize>     number of inserts per commit workload
+                        transaction (default: 10)
+
+    Put <dir> on the storage you want to test (e.g. an NVMe drive or
+    a tmpfs mount).
+
+    Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+    See the documentation for further information on copyrights,
+    or contact the author. All Rights Reserved.
+
+"""
+import sys, os, time, random, getopt
+from mx.BeeBase import BeeIndex, BeeDict
+
+# Workloads in the order they are run
+WORKLOADS = ('random_insert', 'sequential_insert', 'lookup_hit',
+             'lookup_miss', 'range_scan', 'update', 'commit')
+
+# Targets in the order they are run
+TARGETS = ('index', 'dict')
+
+# Timer with the best resolution on the platform
+if sys.platform[:3] == 'win':
+    timer = time.clock
+else:
+    timer = time.time
+
+try:
+    import json
+    dumps = json.dumps
+
+except ImportError:
+    # Python < 2.6
+    def dumps(obj, indent=None,
+
+              StringTypes=(type(''), type(u'')),
+              DictType=type({}), ListTypes=(type([]), type(()))):
+
+        """ Minimal JSON encoder for the output of this script.
+        """
+        if obj is None:
+            return 'null'
+        elif type(obj) in StringTypes:
+            s = obj.replace('\\', '\\\\').replace('"', '\\"')
+            return '"%s"' % s.replace('\n', '\\n')
+        elif type(obj) is DictType:
+            items = obj.items()
+            items.sort()
+            return '{%s}' % ', '.join(['%s: %s' % (dumps(key), dumps(value))
+                                        for key, value in items])
+        elif type(obj) in ListTypes:
+            return '[%s]' % ', '.join([dumps(x) for x in obj])
+        else:
+            return repr(obj)
+
+### Targets
+
+class IndexTarget:
+
+    """ BeeIntegerIndex mapping keys to integers.
+    """
+    name = 'index'
+    index = None
+
+    def __init__(self, dir, options):
+
+        self.filename = os.path.join(dir, 'bench-workloads.idx')
+        self.cachesize = options['cachesize']
+
+    def key(self, i):
+
+        return i
+
+    def create(self):
+
+        self.index = BeeIndex.BeeIntegerIndex(self.filename, dupkeys=0,
+                                              filemode=2,
+                                              cachesize=self.cachesize)
+
+    def load(self, keys):
+
+        """ Create the file with keys using the bulk loader and open
+            it for updates.
+        """
+        self.create()
+        self.index.bulkload([(key, key) for key in keys])
+        self.index.close()
+        self.index = BeeIndex.BeeIntegerIndex(self.filename, dupkeys=0,
+                                              filemode=0,
+                                              cachesize=self.cachesize)
+
+    def insert(self, key):
+
+        self.index[key] = key
+
+    def lookup(self, key):
+
+        return self.index.get(key)
+
+    def scan(self, key, n):
+
+        return self.index.range(key, BeeIndex.LastKey, n)
+
+    def update(self, key):
+
+        self.index.update(key, key + 1)
+
+    def commit(self):
+
+        self.index.flush()
+
+    def close(self):
+
+        if self.index is not None:
+            self.index.close()
+            self.index = None
+
+    def size(self):
+
+        return os.path.getsize(self.filename)
+
+    def remove(self):
+
+        self.close()
+        if os.path.exists(self.filename):
+            os.remove(self.filename)
+
+class DictTarget:
+
+    """ BeeStringDict mapping string keys to string values.
+    """
+    name = 'dict'
+    dict = None
+
+    def __init__(self, dir, options):
+
+        self.basename = os.path.join(dir, 'bench-workloads')
+        self.cachesize = options['cachesize']
+        self.value = 'x' * options['valuesize']
+        # Room for the changes between two commits
+        self.maxcachesize = max(BeeDict.MAXCACHESIZE,
+                                options['commitevery'],
+                                options['commitsize'])
+
+    def key(self, i):
+
+        return '%010i' % i
+
+    def create(self):
+
+        self.dict = BeeDict.BeeStringDict(self.basename, keysize=10,
+                                          index_cachesize=self.cachesize,
+                                          maxcachesize=self.maxcachesize)
+        # Start with new files
+        if len(self.dict):
+            self.dict.remove_files()
+            self.dict = BeeDict.BeeStringDict(
+                self.basename, keysize=10, index_cachesize=self.cachesize,
+                maxcachesize=self.maxcachesize)
+
+    def load(self, keys):
+
+        """ Create the files with keys using the bulk loader.
+        """
+        self.create()
+        self.dict.bulkload([(key, self.value) for key in keys])
+
+    def insert(self, key):
+
+        self.dict[key] = self.value
+
+    def lookup(self, key):
+
+        return self.dict.get(key)
+
+    def scan(self, key, n):
+
+        cursor = self.dict.cursor(key)
+        items = [(cursor.key, cursor.read())]
+        while len(items) < n and cursor.next():
+            items.append((cursor.key, cursor.read()))
+        return items
+
+    def update(self, key):
+
+        self.dict[key] = self.value[:-1] + 'y'
+
+    def commit(self):
+
+        self.dict.commit()
+
+    def close(self):
+
+        if self.dict is not None:
+            self.dict.close()
+            self.dict = None
+
+    def size(self):
+
+        size = 0
+        for filename in (self.basename + '.idx', self.basename + '.dat',
+                         self.basename + '.dat.fsm'):
+            if os.path.exists(filename):
+                size = size + os.path.getsize(filename)
+        return size
+
+    def remove(self):
+
+        self.close()
+        BeeDict.BeeStringDict(self.basename, keysize=10).remove_files()
+
+### Workloads
+
+def measure(ops, operation, commit=None, commitevery=0):
+
+    """ Run operation(arg) for all args in ops and return the total
+        run time and the list of latencies.
+
+        If commit is given, it is called after every commitevery
+        operations as part of the operation.
+
+    """
+    latencies = [0.0] * len(ops)
+    i = 0
+    start = timer()
+    for arg in ops:
+        t = timer()
+        operation(arg)
+        i = i + 1
+        if commit is not None and i % commitevery == 0:
+            commit()
+        latencies[i - 1] = timer() - t
+    if commit is not None:
+        commit()
+    return timer() - start, latencies
+
+def run(target, workload, options):
+
+    """ Run workload on target and return the result dictionary.
+    """
+    n = options['keys']
+    m = options['ops'] or n
+    rnd = random.Random(options['seed'])
+    # Existing keys are even, missing ones odd
+    keys = [target.key(i * 2) for i in xrange(n)]
+    commit = None
+    commitevery = 0
+    if target.name == 'dict':
+        commit = target.commit
+        commitevery = options['commitevery']
+
+    if workload in ('random_insert', 'sequential_insert'):
+        ops = keys[:]
+        if workload == 'random_insert':
+            rnd.shuffle(ops)
+        target.create()
+        elapsed, latencies = measure(ops, target.insert,
+                                     commit or target.commit,
+                                     commitevery or len(ops) or 1)
+
+    elif workload == 'commit':
+        size = options['commitsize']
+        ops = [keys[i:i + size] for i in xrange(0, min(m * size, n), size)]
+        rnd.shuffle(ops)
+        def transaction(keys, insert=target.insert, commit=target.commit):
+            for key in keys:
+                insert(key)
+            commit()
+        target.create()
+        elapsed, latencies = measure(ops, transaction)
+
+    else:
+        target.load(keys)
+        if workload == 'lookup_hit':
+            ops = [rnd.choice(keys) for i in xrange(m)]
+            elapsed, latencies = measure(ops, target.lookup)
+        elif workload == 'lookup_miss':
+            ops = [target.key(rnd.randrange(n) * 2 + 1) for i in xrange(m)]
+            elapsed, latencies = measure(ops, target.lookup)
+        elif workload == 'range_scan':
+            length = options['scanlength']
+            ops = [rnd.choice(keys) for i in xrange(m)]
+            elapsed, latencies = measure(ops, lambda key, scan=target.scan,
+                                         length=length: scan(key, length))
+        elif workload == 'update':
+            ops = [rnd.choice(keys) for i in xrange(m)]
+            elapsed, latencies = measure(ops, target.update,
+                                         commit or target.commit,
+                                         commitevery or len(ops) or 1)
+        else:
+            raise ValueError('unknown workload: %r' % workload)
+
+    target.close()
+    latencies.sort()
+    return {'target': target.name,
+            'workload': workload,
+            'ops': len(latencies),
+            'seconds': elapsed,
+            'ops_per_sec': len(latencies) / max(elapsed, 1e-9),
+            'p50_us': percentile(latencies, 0.5) * 1e6,
+            'p99_us': percentile(latencies, 0.99) * 1e6,
+            'file_size': target.size()}
+
+def percentile(values, q):
+
+    """ Return the q-quantile of the sorted list values.
+    """
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, int(q * len(values)))]
+
+### Main
+
+def usage(msg=None):
+
+    if msg:
+        sys.stderr.write('%s\n\n' % msg)
+    sys.stderr.write(__doc__)
+    sys.exit(1)
+
+def main(argv):
+
+    options = {'keys': 100000,
+               'ops': 0,
+               'seed': 42,
+               'cachesize': 0,
+               'valuesize': 100,
+               'scanlength': 100,
+               'commitevery': 1000,
+               'commitsize': 10}
+    flags = {'-n': 'keys', '-m': 'ops', '-s': 'seed', '-c': 'cachesize',
+             '-v': 'valuesize', '-l': 'scanlength', '-C': 'commitevery',
+             '-T': 'commitsize'}
+    workloads = WORKLOADS
+    targets = TARGETS
+    dir = '.'
+    output = None
+    try:
+        opts, args = getopt.getopt(argv[1:], 'n:m:w:t:d:o:s:c:v:l:C:T:h')
+    except getopt.GetoptError, why:
+        usage(str(why))
+    for opt, value in opts:
+        if opt in flags:
+            try:
+                options[flags[opt]] = int(value)
+            except ValueError:
+                usage('%s needs an integer argument' % opt)
+        elif opt == '-w':
+            workloads = value.split(',')
+        elif opt == '-t':
+            targets = value.split(',')
+        elif opt == '-d':
+            dir = value
+        elif opt == '-o':
+            output = value
+        else:
+            usage()
+    for workload in workloads:
+        if workload not in WORKLOADS:
+            usage('unknown workload: %s' % workload)
+    for target in targets:
+        if target not in TARGETS:
+            usage('unknown target: %s' % target)
+    if options['keys'] < 1 or min(options['scanlength'],
+                                  options['commitevery'],
+                                  options['commitsize']) < 1:
+        usage('sizes must be positive')
+
+    # Keep stdout clean for the JSON output; BeeDict prints the index
+    # parameters it uses
+    stdout = sys.stdout
+    sys.stdout = sys.stderr
+    results = []
+    try:
+        for name in targets:
+            if name == 'index':
+                target = IndexTarget(dir, options)
+            else:
+                target = DictTarget(dir, options)
+            try:
+                for workload in workloads:
+                    results.append(run(target, workload, options))
+            finally:
+                target.remove()
+    finally:
+        sys.stdout = stdout
+
+    report = {'version': BeeIndex.__version__,
+              'python': sys.version.split()[0],
+              'platform': sys.platform,
+              'parameters': options,
+              'results': results}
+    data = dumps(report, indent=2)
+    if output:
+        f = open(output, 'w')
+        try:
+            f.write(data + '\n')
+        finally:
+            f.close()
+    else:
+        print data
+
+if __name__ == '__main__':
+    main(sys.argv)
@@ -25,8 +25,67 @@
 # define MAL_DEBUG_OUTPUTFILE "mxBeeBase.log"
 #endif
 
+/* Use open file description locks (F_OFD_SETLK) on Linux, if
+   available */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+
+/* Use 64-bit file offsets (off_t) on platforms with 32-bit longs */
+#ifndef _FILE_OFFSET_BITS
+# define _FILE_OFFSET_BITS 64
+#endif
+#ifndef _LARGEFILE_SOURCE
+# define _LARGEFILE_SOURCE
+#endif
+
 #include "mxstdlib.h"
 #include "btr.h"
+#include <stddef.h>
+
+/* Memory mapping is used for read-only index files, if available */
+#ifndef _WIN32
+# include <unistd.h>
+#endif
+#if defined(_POSIX_MAPPED_FILES) && (_POSIX_MAPPED_FILES > 0)
+# include <sys/mman.h>
+# define BTR_HAVE_MMAP
+#endif
+
+/* Nodes are read and written using positional I/O (pread(),
+   pwrite()) on POSIX systems; flushes write runs of adjacent nodes
+   using pwritev(), where available */
+#ifndef _WIN32
+# include <errno.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# define BTR_HAVE_PREAD
+# if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) \
+     || defined(__OpenBSD__) || defined(__DragonFly__)
+#  include <limits.h>
+#  include <sys/uio.h>
+#  define BTR_HAVE_PWRITEV
+# endif
+#endif
+
+/* Read-ahead hints for leaf scans are given using posix_fadvise(), if
+   available */
+#if defined(_POSIX_ADVISORY_INFO) && (_POSIX_ADVISORY_INFO > 0)
+# include <fcntl.h>
+# define BTR_HAVE_FADVISE
+#endif
+
+/* Readers of files in the snapshot format announce the version of
+   the tree they use with fcntl() locks */
+#ifndef _WIN32
+# include <fcntl.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# if defined(F_SETLK) && defined(F_GETLK)
+#  include <pthread.h>
+#  define BTR_HAVE_LOCKS
+# endif
+#endif
 
 /* --- Globals ------------------------------------------------------------ */
 
@@ -53,10 +112,34 @@ int bErrLineNo;
  *
  *    A LRR (least-recently-read) buffering scheme for nodes is used to
  *    simplify storage management, and, assuming some locality of reference,
- *    improve performance.
+ *    improve performance. The number of buffers is configurable; buffers
+ *    are found through a hash table keyed by node address, so that
+ *    large buffer lists can be used as page cache.
  *
  *    To simplify matters, both internal nodes and leafs contain the
  *    same fields.
+ *
+ *    File formats: format 1 files store the nodes as they are kept in
+ *    memory, the root at offset 0. Format 2 files start with a header
+ *    sector (bFileHeader) followed by the nodes; node address 0 (the
+ *    root) then refers to the first sector after the header. With
+ *    BTR_FLAG_COMPRESSED, the nodes are encoded on disk: a
+ *    bNodeHeader followed by varints for the node fields and for each
+ *    key the length of the prefix shared with the previous key, the
+ *    length of the rest of the key with trailing zero bytes removed,
+ *    the rest of the key, rec and childGE (internal nodes only).
+ *    Nodes use fixed size key slots in memory, so the algorithms
+ *    above are not affected. maxCt is chosen to fill a sector with
+ *    keys of an average size; encodings which don't fit into the
+ *    node's sector(s) continue in an overflow extent of whole
+ *    sectors. Format 3 files (BTR_FLAG_SNAPSHOT) never overwrite
+ *    published nodes; see the snapshot format section below.
+ *
+ *    Addresses (bIdxAddr, bRecAddr) are 64-bit integers. Files
+ *    written before this was the case used unsigned longs; new files
+ *    always have a header with BTR_FLAG_ADDR64 set. Files without
+ *    the flag which use 32-bit addresses are converted to and from
+ *    the in-memory layout when reading and writing (h->addr32).
  *   
  */
 
@@ -66,74 +149,1401 @@ int bErrLineNo;
 #define bAdr(p) *(bIdxAddr *)(p)
 #define eAdr(p) *(bRecAddr *)(p)
 
-/* based on k = &[key,rec,childGE] */
-#define childLT(k) bAdr((char *)k - sizeof(bIdxAddr))
-#define key(k) (k)
-#define rec(k) eAdr((char *)(k) + h->keySize)
-#define childGE(k) bAdr((char *)(k) + h->keySize + sizeof(bRecAddr))
+/* based on k = &[key,rec,childGE] */
+#define childLT(k) bAdr((char *)k - sizeof(bIdxAddr))
+#define key(k) (k)
+#define rec(k) eAdr((char *)(k) + h->keySize)
+#define childGE(k) bAdr((char *)(k) + h->keySize + sizeof(bRecAddr))
+
+/* based on b = &bBuffer */
+#define leaf(b) b->p->leaf
+#define ct(b) b->p->ct
+#define next(b) b->p->next
+#define prev(b) b->p->prev
+#define fkey(b) &b->p->fkey
+#define lkey(b) (fkey(b) + ks((ct(b) - 1)))
+#define p(b) (char *)(b->p)
+
+/* shortcuts */
+#define ks(ct) ((ct) * h->ks)
+#define error(rc) lineError(__LINE__, rc)
+
+static 
+bError lineError(int lineno, 
+		 bError rc) 
+{
+    if (rc == bErrIO || rc == bErrMemory)
+        if (!bErrLineNo) 
+            bErrLineNo = lineno;
+    return rc;
+}
+
+static 
+bIdxAddr allocAdr(bHandle *h) 
+{
+    bIdxAddr adr;
+    adr = h->nextFreeAdr;
+    h->nextFreeAdr += h->sectorSize;
+    return adr;
+}
+
+/* --- File format --- */
+
+#define BTR_MAGIC "mxBeeIdx"
+#define BTR_FORMAT_VERSION 2
+
+/* Format version of files using the snapshot format */
+#define BTR_SNAPSHOT_FORMAT_VERSION 3
+
+/* Flags used in the file header */
+#define BTR_FLAG_COMPRESSED 0x0001
+#define BTR_FLAG_SNAPSHOT 0x0002
+#define BTR_FLAG_ADDR64 0x0004
+
+typedef struct {
+    char magic[8];              /* BTR_MAGIC */
+    unsigned int version;       /* file format version */
+    unsigned int flags;         /* BTR_FLAG_* */
+    unsigned int sectorSize;    /* sector size */
+    unsigned int keySize;       /* key length */
+    unsigned int dupKeys;       /* 1 if duplicate keys are allowed */
+    unsigned int maxCt;         /* maximum # keys in node */
+} bFileHeader;
+
+typedef struct {                /* compressed node on disk */
+    unsigned int len;           /* length of the encoding in bytes */
+    unsigned int ovfCt;         /* size of overflow extent in sectors */
+    bIdxAddr ovfAdr;            /* address of overflow extent */
+    /* varint encoded node follows */
+} bNodeHeader;
+
+/* Layout of files with 32-bit addresses: sizes and offsets of the
+   structures as written by platforms with 32-bit longs */
+#define ADDR32_MAX ((bAddr64)0xFFFFFFFFUL)
+#define NODE32_SIZE 20          /* sizeof(bNode) */
+#define NODE32_FKEY 16          /* offset of fkey in bNode */
+#define NODEHDR32_SIZE 12       /* sizeof(bNodeHeader) */
+#define SNAPHDR32_SIZE 56       /* sizeof(bSnapHeader) */
+
+/* size of an address and of a bNodeHeader in the file */
+#define addrSize(h) ((h)->addr32 ? 4 : sizeof(bIdxAddr))
+#define nodeHdrSize(h) ((h)->addr32 ? NODEHDR32_SIZE : sizeof(bNodeHeader))
+
+/* file position of address adr */
+#define filePos(h, adr) ((h)->base + (adr))
+
+/* unknown file position */
+#define NOPOS ((bIdxAddr)-1)
+
+/* Maximum value for maxCt: ct is a 15 bit field and gbuf must be able
+   to hold 3*maxCt + 2 keys */
+#define MAX_CT 10921
+
+static
+bAddr64 getAddr32(const char *p)
+{
+    /* read a 32-bit address */
+    unsigned int v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static
+int putAddr32(char *p,
+	      bAddr64 v)
+{
+    /* write v as 32-bit address; returns -1 if it doesn't fit */
+    unsigned int x;
+
+    if (v > ADDR32_MAX)
+	return -1;
+    x = (unsigned int)v;
+    memcpy(p, &x, sizeof(x));
+    return 0;
+}
+
+/* --- Snapshot format --- */
+
+/*
+ *  Files in the snapshot format never overwrite a sector which is
+ *  part of a published version of the tree. Node addresses are
+ *  logical: the page map gives the file position of the current copy
+ *  of each logical sector. The first write of a sector after a
+ *  version was published goes to a newly allocated sector
+ *  (copy-on-write); later writes for the same version go to that
+ *  copy. bFlush() writes the changed page map entries and then
+ *  publishes the version by writing a header.
+ *
+ *  The page map is stored in map pages of one sector each holding
+ *  mapEnt file positions. Level 0 is the page map itself; level i+1
+ *  holds the file positions of the map pages of level i. The top
+ *  level has a single entry, which is stored in the header. Map
+ *  pages are written copy-on-write as well.
+ *
+ *  The header is kept in two slots (sectors 0 and 1), which are
+ *  written alternately. A slot holds the file header, the version
+ *  and the top map page position, protected by a checksum. Readers
+ *  use the valid slot with the highest version, so a crash while
+ *  publishing leaves the previous version intact.
+ *
+ *  Sectors which are no longer used by the version being built are
+ *  tagged with that version. Readers hold a shared lock on the byte
+ *  LOCK_BASE + version of the version they use; the writer only
+ *  reuses sectors whose tag is not newer than both the oldest
+ *  version in use and the last published version.
+ *
+ */
+
+typedef struct {                /* header slot of the snapshot format */
+    bFileHeader file;           /* same as in sector 0 */
+    bAddr64 version;            /* version of the tree */
+    bIdxAddr nextFreeAdr;       /* next free logical address */
+    bIdxAddr pages;             /* number of page map entries */
+    bIdxAddr top;               /* file position of the top map page */
+    unsigned int levels;        /* number of map page levels */
+    unsigned int checksum;      /* checksum of the fields above */
+} bSnapHeader;
+
+/* bit 0 of a page map entry marks sectors written for the version
+   being built; file positions are multiples of 4 */
+#define FRESH ((bIdxAddr)1)
+#define entryPos(e) ((e) & ~FRESH)
+
+/* maximum number of page map levels */
+#define MAP_LEVELS 16
+
+typedef struct {                /* one level of the page map */
+    bIdxAddr *pos;              /* entries */
+    size_t n;                   /* number of entries in use */
+    size_t alloc;               /* number of allocated entries */
+    unsigned char *dirty;       /* per map page: true if changed */
+    size_t dirtyAlloc;          /* number of allocated flags */
+} bMapLevel;
+
+typedef struct {                /* sector dropped by a version */
+    bIdxAddr pos;               /* file position */
+    unsigned long tag;          /* version which dropped it */
+} bFreeSector;
+
+typedef struct bSnapshotTag {
+    bMapLevel level[MAP_LEVELS];/* page map levels */
+    int levels;                 /* index of the top level */
+    size_t mapEnt;              /* entries per map page */
+    bIdxAddr physEnd;           /* end of the sectors in use */
+    char *page;                 /* buffer for one sector */
+    bool changed;               /* true if the tree changed since the
+				   last published version */
+
+    /* free space management (writer) */
+    bFreeSector *freed;         /* dropped sectors, by ascending tag */
+    size_t freedHead;           /* first entry in use */
+    size_t freedCt;             /* number of entries in use */
+    size_t freedAlloc;
+    bIdxAddr *spare;            /* sectors which were never published */
+    size_t spareCt;
+    size_t spareAlloc;
+    size_t *fresh;              /* entries marked FRESH, encoded as
+				   index * MAP_LEVELS + level */
+    size_t freshCt;
+    size_t freshAlloc;
+    unsigned long safeVersion;  /* sectors with tags up to this version
+				   may be reused */
+    bool safeValid;             /* true if safeVersion is up to date */
+
+    /* readers */
+    unsigned long locked;       /* version locked by a reader, 0 if
+				   none */
+#ifdef BTR_HAVE_LOCKS
+    dev_t dev;                  /* identity of the file */
+    ino_t ino;
+    struct bSnapshotTag *nextReader; /* registry of readers */
+#endif
+} bSnapshot;
+
+#ifdef BTR_HAVE_LOCKS
+/* Open file description locks don't get lost when another file
+   descriptor for the same file is closed and are visible to other
+   descriptors within the same process. */
+# ifdef F_OFD_SETLK
+#  define LOCK_SET F_OFD_SETLK
+#  define LOCK_GET F_OFD_GETLK
+# else
+#  define LOCK_SET F_SETLK
+#  define LOCK_GET F_GETLK
+# endif
+# define LOCK_BASE ((off_t)0x40000000L)
+# define LOCK_MASK 0x3fffffffUL
+
+/* Readers in this process; a process doesn't see its own locks with
+   F_GETLK. Handles may be used by different threads, so the registry
+   and the locked fields of its entries are protected by a mutex. */
+static bSnapshot *snapReaders = NULL;
+static pthread_mutex_t snapReadersMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* --- File I/O --- */
+
+/* 64-bit file positions; positions which don't fit into the
+   platform's file offset type are rejected instead of being
+   truncated */
+#ifdef _MSC_VER
+# define BTR_MAX_FILEPOS ((bIdxAddr)_I64_MAX)
+# define btr_fseek(fp, pos, whence) _fseeki64(fp, (__int64)(pos), whence)
+# define btr_ftell(fp) _ftelli64(fp)
+#else
+# define BTR_MAX_FILEPOS \
+    ((bIdxAddr)(((off_t)1 << (8 * sizeof(off_t) - 2)) - 1) * 2 + 1)
+# define btr_fseek(fp, pos, whence) fseeko(fp, (off_t)(pos), whence)
+# define btr_ftell(fp) ftello(fp)
+#endif
+
+/* Maximal number of buffers passed to one pwritev() call */
+#ifdef BTR_HAVE_PWRITEV
+# if defined(IOV_MAX) && IOV_MAX < 1024
+#  define BTR_IOV_MAX IOV_MAX
+# else
+#  define BTR_IOV_MAX 1024
+# endif
+#endif
+
+#ifndef BTR_HAVE_PREAD
+static
+int seekFile(bHandle *h,
+	     bIdxAddr pos)
+{
+    if (pos > BTR_MAX_FILEPOS)
+	return -1;
+    return btr_fseek(h->fp, pos, SEEK_SET);
+}
+#endif
+
+static
+bError fileSize(bHandle *h,
+		bIdxAddr *size)
+{
+    /* determine the size of the file */
+#ifdef BTR_HAVE_PREAD
+    struct stat st;
+
+    if (fstat(fileno(h->fp), &st)) return error(bErrIO);
+    *size = (bIdxAddr)st.st_size;
+#else
+    h->filePos = NOPOS;
+    if (btr_fseek(h->fp, 0, SEEK_END)) return error(bErrIO);
+    if ((*size = (bIdxAddr)btr_ftell(h->fp)) == NOPOS) 
+	return error(bErrIO);
+#endif
+    return bErrOk;
+}
+
+static
+int writeFile(bHandle *h,
+	      bIdxAddr pos,
+	      const void *p,
+	      size_t len)
+{
+    /* write len bytes to file position pos; returns 0 on success,
+       -1 on failure */
+#ifdef BTR_HAVE_PREAD
+    const char *s = (const char *)p;
+    ssize_t n;
+
+    if (pos > BTR_MAX_FILEPOS)
+	return -1;
+    while (len > 0) {
+	n = pwrite(fileno(h->fp), s, len, (off_t)pos);
+	if (n <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    return -1;
+	}
+	s += n;
+	pos += n;
+	len -= n;
+    }
+    return 0;
+#else
+    /* nodes are often written in ascending order; we only seek if
+       needed to let stdio combine the writes */
+    if (h->filePos != pos)
+	if (seekFile(h, pos)) {
+	    h->filePos = NOPOS;
+	    return -1;
+	}
+    if (fwrite(p, len, 1, h->fp) != 1) {
+	h->filePos = NOPOS;
+	return -1;
+    }
+    h->filePos = pos + len;
+    return 0;
+#endif
+}
+
+static
+int readFile(bHandle *h,
+	     bIdxAddr pos,
+	     void *p,
+	     size_t len)
+{
+    /* read len bytes from file position pos; returns 0 on success,
+       -1 on failure or if the file ends before */
+#ifdef BTR_HAVE_PREAD
+    char *s = (char *)p;
+    ssize_t n;
+
+    if (pos > BTR_MAX_FILEPOS)
+	return -1;
+    while (len > 0) {
+	n = pread(fileno(h->fp), s, len, (off_t)pos);
+	if (n <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    return -1;
+	}
+	s += n;
+	pos += n;
+	len -= n;
+    }
+    return 0;
+#else
+    h->filePos = NOPOS;
+    if (seekFile(h, pos)) return -1;
+    if (fread(p, len, 1, h->fp) != 1) return -1;
+    return 0;
+#endif
+}
+
+static
+void *growArray(void *p,
+		size_t *alloc,
+		size_t need,
+		size_t size)
+{
+    /* return p resized to hold at least need entries of size bytes
+       and update *alloc; new entries are zeroed. Returns NULL (and
+       leaves p alone) if out of memory. */
+    size_t n;
+    char *q;
+
+    n = *alloc ? *alloc : 16;
+    while (n < need)
+	n *= 2;
+    if ((q = realloc(p, n * size)) == NULL)
+	return NULL;
+    memset(q + *alloc * size, 0, (n - *alloc) * size);
+    *alloc = n;
+    return q;
+}
+
+/* --- Write-back batching --- */
+
+/*
+ *  flushAll() and snapCommit() collect their writes in a batch
+ *  instead of writing each node as it is flushed. The batch is
+ *  written out sorted by file position when it ends or holds
+ *  BTR_BATCH_SIZE bytes; runs of adjacent writes are passed to a
+ *  single pwritev() call, where available, and to stdio in
+ *  ascending order otherwise. Writes which overlap are done in the
+ *  order they were issued.
+ *
+ *  If writing fails, the batch keeps its contents, so that they are
+ *  written again with the next batch. Pending writes are always
+ *  done before any other read or write of the file.
+ *
+ */
+
+/* Maximal number of bytes collected by a batch before it is written
+   out; can be overridden at compile time */
+#ifndef BTR_BATCH_SIZE
+# define BTR_BATCH_SIZE 1048576
+#endif
+
+typedef struct {                /* write collected by a batch */
+    bIdxAddr pos;               /* file position */
+    size_t off;                 /* offset of the data in the batch */
+    size_t len;                 /* number of bytes */
+    size_t seq;                 /* issue order */
+} bWrite;
+
+typedef struct bBatchTag {
+    bool active;                /* true while writes are collected */
+    char *data;                 /* copies of the data to write,
+				   BTR_BATCH_SIZE bytes */
+    size_t dataSize;            /* number of bytes in use */
+    bWrite *w;                  /* collected writes */
+    size_t ct;                  /* number of writes */
+    size_t alloc;               /* number of allocated entries */
+    bBuffer **bufs;             /* modified buffers (flushAll()) */
+    size_t bufsAlloc;           /* number of allocated entries */
+} bBatch;
+
+static
+int compareWritePos(const void *a,
+		    const void *b)
+{
+    const bWrite *x = (const bWrite *)a;
+    const bWrite *y = (const bWrite *)b;
+
+    if (x->pos != y->pos)
+	return x->pos < y->pos ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static
+int compareWriteSeq(const void *a,
+		    const void *b)
+{
+    const bWrite *x = (const bWrite *)a;
+    const bWrite *y = (const bWrite *)b;
+
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static
+bError writeRun(bHandle *h,
+		const bWrite *w,
+		size_t ct)
+{
+    /* write ct writes which follow each other in the file */
+    bBatch *b = h->batch;
+#ifdef BTR_HAVE_PWRITEV
+    struct iovec iov[BTR_IOV_MAX];
+    size_t total = 0;
+    size_t done;
+    ssize_t n;
+#endif
+    size_t i;
+
+#ifdef BTR_HAVE_PWRITEV
+    if (ct > 1) {
+	for (i = 0; i < ct; i++) {
+	    iov[i].iov_base = b->data + w[i].off;
+	    iov[i].iov_len = w[i].len;
+	    total += w[i].len;
+	}
+	if (w[0].pos > BTR_MAX_FILEPOS) return error(bErrIO);
+	do {
+	    n = pwritev(fileno(h->fp), iov, (int)ct, (off_t)w[0].pos);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) return error(bErrIO);
+	if ((size_t)n == total)
+	    return bErrOk;
+
+	/* short write: write the rest one by one */
+	done = (size_t)n;
+	for (i = 0; i < ct; i++) {
+	    if (done >= w[i].len) {
+		done -= w[i].len;
+		continue;
+	    }
+	    if (writeFile(h, w[i].pos + done, b->data + w[i].off + done,
+			  w[i].len - done))
+		return error(bErrIO);
+	    done = 0;
+	}
+	return bErrOk;
+    }
+#endif
+    for (i = 0; i < ct; i++)
+	if (writeFile(h, w[i].pos, b->data + w[i].off, w[i].len))
+	    return error(bErrIO);
+    return bErrOk;
+}
+
+static
+bError batchWrite(bHandle *h)
+{
+    /* write out the collected writes */
+    bBatch *b = h->batch;
+    size_t i, j;
+    bError rc = bErrOk;
+
+    if (b->ct == 0)
+	return bErrOk;
+    qsort(b->w, b->ct, sizeof(bWrite), compareWritePos);
+    for (i = 1; i < b->ct; i++)
+	if (b->w[i].pos < b->w[i - 1].pos + b->w[i - 1].len)
+	    break;
+    if (i < b->ct) {
+	/* overlapping writes: the last one must win */
+	qsort(b->w, b->ct, sizeof(bWrite), compareWriteSeq);
+	for (i = 0; i < b->ct && rc == bErrOk; i++)
+	    rc = writeRun(h, b->w + i, 1);
+    }
+    else
+	for (i = 0; i < b->ct && rc == bErrOk; i = j) {
+	    for (j = i + 1; j < b->ct; j++) {
+#ifdef BTR_IOV_MAX
+		if (j - i == BTR_IOV_MAX)
+		    break;
+#endif
+		if (b->w[j].pos != b->w[j - 1].pos + b->w[j - 1].len)
+		    break;
+	    }
+	    rc = writeRun(h, b->w + i, j - i);
+	}
+    if (rc)
+	return rc;
+    b->ct = 0;
+    b->dataSize = 0;
+    return bErrOk;
+}
+
+static
+bError batchAdd(bHandle *h,
+		bIdxAddr pos,
+		const void *p,
+		size_t len)
+{
+    /* add a write to the batch */
+    bBatch *b = h->batch;
+    bWrite *w;
+    bError rc;
+
+    if (len > BTR_BATCH_SIZE - b->dataSize) {
+	if ((rc = batchWrite(h)) != 0) return rc;
+	if (len > BTR_BATCH_SIZE) {
+	    if (writeFile(h, pos, p, len)) return error(bErrIO);
+	    return bErrOk;
+	}
+    }
+    if (b->ct == b->alloc) {
+	if ((w = growArray(b->w, &b->alloc, b->ct + 1, 
+			   sizeof(bWrite))) == NULL)
+	    return error(bErrMemory);
+	b->w = w;
+    }
+    w = &b->w[b->ct];
+    w->pos = pos;
+    w->off = b->dataSize;
+    w->len = len;
+    w->seq = b->ct;
+    memcpy(b->data + b->dataSize, p, len);
+    b->dataSize += len;
+    b->ct++;
+    return bErrOk;
+}
+
+static
+bError batchBegin(bHandle *h)
+{
+    /* start collecting writes */
+    if (h->batch == NULL) {
+	if ((h->batch = calloc(sizeof(bBatch), 1)) == NULL)
+	    return error(bErrMemory);
+	if ((h->batch->data = malloc(BTR_BATCH_SIZE)) == NULL) {
+	    free(h->batch);
+	    h->batch = NULL;
+	    return error(bErrMemory);
+	}
+    }
+    h->batch->active = true;
+    return bErrOk;
+}
+
+static
+bError batchEnd(bHandle *h)
+{
+    /* write out the collected writes and stop collecting */
+    bError rc;
+
+    rc = batchWrite(h);
+    h->batch->active = false;
+    return rc;
+}
+
+static
+void batchFree(bHandle *h)
+{
+    bBatch *b = h->batch;
+
+    if (b == NULL)
+	return;
+    free(b->data);
+    free(b->w);
+    free(b->bufs);
+    free(b);
+    h->batch = NULL;
+}
+
+static
+bError writeBytes(bHandle *h,
+		  bIdxAddr pos,
+		  const void *p,
+		  size_t len)
+{
+    bError rc;
+
+    if (h->batch && h->batch->active)
+	return batchAdd(h, pos, p, len);
+    /* writes left over from a failed batch go first */
+    if (h->batch && h->batch->ct)
+	if ((rc = batchWrite(h)) != 0) return rc;
+    if (writeFile(h, pos, p, len)) return error(bErrIO);
+    return bErrOk;
+}
+
+static
+void checkMap(bHandle *h)
+{
+    /* drop the mapping if the file shrank below its size, e.g. since
+       another process recreated it: touching the missing pages would
+       raise SIGBUS. Buffers which point into the mapping (and the
+       cursors using them) become invalid; reads then go through
+       stdio, which reports missing data as an error. */
+#ifdef BTR_HAVE_MMAP
+    struct stat st;
+    bBuffer *buf;
+
+    if (h->map == NULL
+	|| (fstat(fileno(h->fp), &st) == 0
+	    && (bIdxAddr)st.st_size >= (bIdxAddr)h->mapSize))
+	return;
+    for (buf = h->bufList.next; buf != &h->bufList; buf = buf->next) {
+	buf->valid = false;
+	buf->p = buf->mem;
+    }
+    munmap(h->map, h->mapSize);
+    h->map = NULL;
+    h->mapSize = 0;
+#endif
+}
+
+static
+bError readBytes(bHandle *h,
+		 bIdxAddr pos,
+		 void *p,
+		 size_t len)
+{
+    bError rc;
+
+    if (h->map && pos + len <= h->mapSize) {
+	memcpy(p, h->map + pos, len);
+	return bErrOk;
+    }
+    /* the data may still be in the batch */
+    if (h->batch && h->batch->ct)
+	if ((rc = batchWrite(h)) != 0) return rc;
+    if (readFile(h, pos, p, len)) return error(bErrIO);
+    h->nDiskReads++;
+    return bErrOk;
+}
+
+/* --- Snapshot format: page map and free space --- */
+
+static
+bError mapResize(bSnapshot *s,
+		 int l,
+		 size_t n)
+{
+    /* make level l of the page map hold at least n entries */
+    bMapLevel *m = &s->level[l];
+    size_t pages = (n + s->mapEnt - 1) / s->mapEnt;
+    void *p;
+
+    if (n > m->alloc) {
+	if ((p = growArray(m->pos, &m->alloc, n, sizeof(bIdxAddr))) == NULL)
+	    return error(bErrMemory);
+	m->pos = p;
+    }
+    if (pages > m->dirtyAlloc) {
+	if ((p = growArray(m->dirty, &m->dirtyAlloc, pages, 1)) == NULL)
+	    return error(bErrMemory);
+	m->dirty = p;
+    }
+    if (n > m->n)
+	m->n = n;
+    return bErrOk;
+}
+
+static
+void mapFree(bSnapshot *s)
+{
+    int l;
+
+    for (l = 0; l < MAP_LEVELS; l++) {
+	if (s->level[l].pos) free(s->level[l].pos);
+	if (s->level[l].dirty) free(s->level[l].dirty);
+    }
+    memset(s->level, 0, sizeof(s->level));
+}
+
+#ifdef BTR_HAVE_LOCKS
+static
+int lockVersion(bHandle *h,
+		unsigned long version,
+		short type)
+{
+    /* set (F_RDLCK) or release (F_UNLCK) the reader lock for
+       version */
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = LOCK_BASE + (off_t)(version & LOCK_MASK);
+    fl.l_len = 1;
+    return fcntl(fileno(h->fp), LOCK_SET, &fl);
+}
+#endif
+
+static
+unsigned long safeVersion(bHandle *h)
+{
+    /* return the newest version whose dropped sectors may be
+       reused: readers still need the sectors dropped by versions
+       newer than the one they use */
+#ifdef BTR_HAVE_LOCKS
+    bSnapshot *s = h->snap, *r;
+    unsigned long safe = h->version;
+    struct flock fl;
+
+    pthread_mutex_lock(&snapReadersMutex);
+    for (r = snapReaders; r != NULL; r = r->nextReader)
+	if (r->dev == s->dev && r->ino == s->ino 
+	    && r->locked && r->locked < safe)
+	    safe = r->locked;
+    pthread_mutex_unlock(&snapReadersMutex);
+
+    /* look for locks on older versions until there are none */
+    while (safe & LOCK_MASK) {
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = LOCK_BASE;
+	fl.l_len = (off_t)(safe & LOCK_MASK);
+	if (fcntl(fileno(h->fp), LOCK_GET, &fl) == -1)
+	    return 0;
+	if (fl.l_type == F_UNLCK
+	    || fl.l_start < LOCK_BASE
+	    || (unsigned long)(fl.l_start - LOCK_BASE) >= safe)
+	    break;
+	safe = (unsigned long)(fl.l_start - LOCK_BASE);
+    }
+    return safe;
+#else
+    /* readers can't be detected: never reuse published sectors */
+    return 0;
+#endif
+}
+
+static
+bError snapAlloc(bHandle *h,
+		 bIdxAddr *pos)
+{
+    /* allocate a sector */
+    bSnapshot *s = h->snap;
+
+    if (s->spareCt) {
+	*pos = s->spare[--s->spareCt];
+	return bErrOk;
+    }
+    if (s->freedCt) {
+	bFreeSector *f = s->freed + s->freedHead;
+
+	if (f->tag > s->safeVersion && !s->safeValid) {
+	    s->safeVersion = safeVersion(h);
+	    s->safeValid = true;
+	}
+	if (f->tag <= s->safeVersion) {
+	    *pos = f->pos;
+	    s->freedHead++;
+	    s->freedCt--;
+	    return bErrOk;
+	}
+    }
+    *pos = s->physEnd;
+    s->physEnd += h->sectorSize;
+    return bErrOk;
+}
+
+static
+bError snapDrop(bHandle *h,
+		bIdxAddr e,
+		unsigned long tag)
+{
+    /* drop the sector of page map entry e; published sectors may
+       only be reused once no reader needs them anymore */
+    bSnapshot *s = h->snap;
+    void *p;
+
+    if (e == 0)
+	return bErrOk;
+    if (e & FRESH) {
+	if (s->spareCt == s->spareAlloc) {
+	    p = growArray(s->spare, &s->spareAlloc, s->spareCt + 1, 
+			  sizeof(bIdxAddr));
+	    if (p == NULL)
+		return error(bErrMemory);
+	    s->spare = p;
+	}
+	s->spare[s->spareCt++] = entryPos(e);
+	return bErrOk;
+    }
+    if (s->freedHead + s->freedCt == s->freedAlloc) {
+	if (s->freedHead > s->freedAlloc / 2) {
+	    /* compact the queue */
+	    memmove(s->freed, s->freed + s->freedHead,
+		    s->freedCt * sizeof(bFreeSector));
+	    memset(s->freed + s->freedCt, 0, 
+		   s->freedHead * sizeof(bFreeSector));
+	    s->freedHead = 0;
+	}
+	else {
+	    p = growArray(s->freed, &s->freedAlloc, s->freedAlloc + 1,
+			  sizeof(bFreeSector));
+	    if (p == NULL)
+		return error(bErrMemory);
+	    s->freed = p;
+	}
+    }
+    s->freed[s->freedHead + s->freedCt].pos = e;
+    s->freed[s->freedHead + s->freedCt].tag = tag;
+    s->freedCt++;
+    return bErrOk;
+}
+
+static
+bError snapPlace(bHandle *h,
+		 int l,
+		 size_t i,
+		 bIdxAddr *pos)
+{
+    /* return the file position to write entry i of page map level l
+       to, allocating a new sector if the current one is published */
+    bSnapshot *s = h->snap;
+    bMapLevel *m = &s->level[l];
+    bIdxAddr e = m->pos[i];
+    bError rc;
+    void *p;
+
+    if (e & FRESH) {
+	*pos = entryPos(e);
+	return bErrOk;
+    }
+    if (s->freshCt == s->freshAlloc) {
+	p = growArray(s->fresh, &s->freshAlloc, s->freshCt + 1, 
+		      sizeof(size_t));
+	if (p == NULL)
+	    return error(bErrMemory);
+	s->fresh = p;
+    }
+    if ((rc = snapAlloc(h, pos)) != 0) return rc;
+    if ((rc = snapDrop(h, e, h->version + 1)) != 0) return rc;
+    m->pos[i] = *pos | FRESH;
+    m->dirty[i / s->mapEnt] = 1;
+    s->fresh[s->freshCt++] = i * MAP_LEVELS + l;
+    s->changed = true;
+    return bErrOk;
+}
+
+static
+bError snapWrite(bHandle *h,
+		 bIdxAddr adr,
+		 const char *p,
+		 size_t len)
+{
+    /* write len bytes (whole sectors) to logical address adr */
+    size_t i = adr / h->sectorSize;
+    size_t end = i + len / h->sectorSize;
+    bIdxAddr pos;
+    bError rc;
+
+    if ((rc = mapResize(h->snap, 0, end)) != 0) return rc;
+    for (; i < end; i++, p += h->sectorSize) {
+	if ((rc = snapPlace(h, 0, i, &pos)) != 0) return rc;
+	if ((rc = writeBytes(h, pos, p, h->sectorSize)) != 0) return rc;
+    }
+    return bErrOk;
+}
+
+static
+bIdxAddr snapPos(bHandle *h,
+		 bIdxAddr adr)
+{
+    /* return the file position of logical address adr or 0 if the
+       sector is not mapped */
+    bMapLevel *m = &h->snap->level[0];
+    size_t i = adr / h->sectorSize;
+
+    if (i >= m->n)
+	return 0;
+    return entryPos(m->pos[i]);
+}
+
+static
+bError snapRead(bHandle *h,
+		bIdxAddr adr,
+		char *p,
+		size_t len)
+{
+    /* read len bytes (whole sectors) from logical address adr */
+    bIdxAddr pos;
+    bError rc;
+
+    for (; len > 0; len -= h->sectorSize) {
+	if ((pos = snapPos(h, adr)) == 0)
+	    return bErrFormat;
+	if ((rc = readBytes(h, pos, p, h->sectorSize)) != 0) return rc;
+	adr += h->sectorSize;
+	p += h->sectorSize;
+    }
+    return bErrOk;
+}
+
+static
+unsigned char *putVarint(unsigned char *s,
+			 bAddr64 v)
+{
+    while (v >= 0x80) {
+	*s++ = (unsigned char)(v | 0x80);
+	v >>= 7;
+    }
+    *s++ = (unsigned char)v;
+    return s;
+}
+
+static
+const unsigned char *getVarint(const unsigned char *s,
+			       const unsigned char *end,
+			       bAddr64 *v)
+{
+    bAddr64 value = 0;
+    int shift = 0;
+
+    while (s < end && shift < 8 * (int)sizeof(bAddr64)) {
+	value |= (bAddr64)(*s & 0x7f) << shift;
+	if (!(*s++ & 0x80)) {
+	    *v = value;
+	    return s;
+	}
+	shift += 7;
+    }
+    return NULL;
+}
+
+static
+int varintSize(bAddr64 v)
+{
+    int n = 1;
+
+    while (v >= 0x80) {
+	v >>= 7;
+	n++;
+    }
+    return n;
+}
+
+/* length of key k without trailing zero bytes */
+static
+int keyLen(bHandle *h,
+	   const bKey *k)
+{
+    int len = h->keySize;
+
+    while (len && k[len - 1] == 0)
+	len--;
+    return len;
+}
+
+/* length of the prefix shared by keys k1 and k2, at most len */
+static
+int prefixLen(const bKey *k1,
+	      const bKey *k2,
+	      int len)
+{
+    int i;
+
+    for (i = 0; i < len && k1[i] == k2[i]; i++)
+	;
+    return i;
+}
+
+static
+size_t encodeNode(bHandle *h,
+		  bNode *p)
+{
+    /* encode node p into h->encBuf; returns the length */
+    unsigned char *s;
+    bKey *k, *pk;
+    unsigned int i;
+    int len, pl;
+
+    s = (unsigned char *)h->encBuf + nodeHdrSize(h);
+    s = putVarint(s, ((bAddr64)p->ct << 1) | p->leaf);
+    s = putVarint(s, p->prev);
+    s = putVarint(s, p->next);
+    s = putVarint(s, p->childLT);
+    pk = NULL;
+    k = &p->fkey;
+    for (i = 0; i < p->ct; i++) {
+	len = keyLen(h, key(k));
+	pl = pk ? prefixLen(key(pk), key(k), len) : 0;
+	s = putVarint(s, pl);
+	s = putVarint(s, len - pl);
+	memcpy(s, key(k) + pl, len - pl);
+	s += len - pl;
+	s = putVarint(s, rec(k));
+	if (!p->leaf)
+	    s = putVarint(s, childGE(k));
+	pk = k;
+	k += ks(1);
+    }
+    return (char *)s - h->encBuf;
+}
+
+static
+bError decodeNode(bHandle *h,
+		  const char *data,
+		  size_t len,
+		  bNode *p,
+		  unsigned int maxCt)
+{
+    /* decode the encoding data of length len into node p, which has
+       room for maxCt keys */
+    const unsigned char *s = (const unsigned char *)data + nodeHdrSize(h);
+    const unsigned char *end = (const unsigned char *)data + len;
+    bAddr64 v, pl, sl;
+    bKey *k, *pk;
+    unsigned int i;
+
+    if ((s = getVarint(s, end, &v)) == NULL) return bErrFormat;
+    if ((v >> 1) > maxCt) return bErrFormat;
+    p->ct = v >> 1;
+    p->leaf = v & 1;
+    if ((s = getVarint(s, end, &v)) == NULL) return bErrFormat;
+    p->prev = v;
+    if ((s = getVarint(s, end, &v)) == NULL) return bErrFormat;
+    p->next = v;
+    if ((s = getVarint(s, end, &v)) == NULL) return bErrFormat;
+    p->childLT = v;
+    pk = NULL;
+    k = &p->fkey;
+    for (i = 0; i < p->ct; i++) {
+	if ((s = getVarint(s, end, &pl)) == NULL) return bErrFormat;
+	if ((s = getVarint(s, end, &sl)) == NULL) return bErrFormat;
+	if ((pk == NULL && pl) 
+	    || pl + sl > (bAddr64)h->keySize
+	    || sl > (bAddr64)(end - s)) 
+	    return bErrFormat;
+	if (pl) memcpy(key(k), key(pk), pl);
+	memcpy(key(k) + pl, s, sl);
+	memset(key(k) + pl + sl, 0, h->keySize - pl - sl);
+	s += sl;
+	if ((s = getVarint(s, end, &v)) == NULL) return bErrFormat;
+	rec(k) = v;
+	if (!p->leaf) {
+	    if ((s = getVarint(s, end, &v)) == NULL) return bErrFormat;
+	    childGE(k) = v;
+	}
+	else
+	    childGE(k) = 0;
+	pk = k;
+	k += ks(1);
+    }
+    return bErrOk;
+}
+
+/* --- Files with 32-bit addresses --- */
+
+static
+bError widenNode(bHandle *h,
+		 const char *data,
+		 size_t len,
+		 bNode *p,
+		 unsigned int maxCt)
+{
+    /* convert the node data of length len, which uses 32-bit
+       addresses, into node p, which has room for maxCt keys */
+    size_t es = h->keySize + 8;     /* size of an entry in data */
+    const char *s = data + NODE32_FKEY;
+    bKey *k;
+    unsigned int i;
+
+    memcpy(p, data, sizeof(unsigned int));      /* leaf, ct */
+    if (p->ct > maxCt || NODE32_FKEY + p->ct * es > len)
+	return bErrFormat;
+    p->prev = getAddr32(data + 4);
+    p->next = getAddr32(data + 8);
+    p->childLT = getAddr32(data + 12);
+    k = &p->fkey;
+    for (i = 0; i < p->ct; i++) {
+	memcpy(key(k), s, h->keySize);
+	rec(k) = getAddr32(s + h->keySize);
+	childGE(k) = getAddr32(s + h->keySize + 4);
+	s += es;
+	k += ks(1);
+    }
+    return bErrOk;
+}
+
+static
+bError narrowNode(bHandle *h,
+		  bNode *p,
+		  char *data,
+		  size_t len)
+{
+    /* convert node p into data of length len using 32-bit
+       addresses */
+    size_t es = h->keySize + 8;     /* size of an entry in data */
+    char *s = data + NODE32_FKEY;
+    bKey *k;
+    unsigned int i;
+
+    if (NODE32_FKEY + p->ct * es > len)
+	return bErrFormat;
+    memset(data, 0, len);
+    memcpy(data, p, sizeof(unsigned int));      /* leaf, ct */
+    if (putAddr32(data + 4, p->prev)
+	|| putAddr32(data + 8, p->next)
+	|| putAddr32(data + 12, p->childLT))
+	return bErrAddrRange;
+    k = &p->fkey;
+    for (i = 0; i < p->ct; i++) {
+	memcpy(s, key(k), h->keySize);
+	if (putAddr32(s + h->keySize, rec(k))
+	    || putAddr32(s + h->keySize + 4, childGE(k)))
+	    return bErrAddrRange;
+	s += es;
+	k += ks(1);
+    }
+    return bErrOk;
+}
+
+static
+void getNodeHeader(bHandle *h,
+		   const char *data,
+		   bNodeHeader *hdr)
+{
+    /* read the header of a compressed node */
+    if (!h->addr32) {
+	memcpy(hdr, data, sizeof(*hdr));
+	return;
+    }
+    memcpy(&hdr->len, data, sizeof(hdr->len));
+    memcpy(&hdr->ovfCt, data + 4, sizeof(hdr->ovfCt));
+    hdr->ovfAdr = getAddr32(data + 8);
+}
+
+static
+bError putNodeHeader(bHandle *h,
+		     const bNodeHeader *hdr,
+		     char *data)
+{
+    /* write the header of a compressed node */
+    if (!h->addr32) {
+	memcpy(data, hdr, sizeof(*hdr));
+	return bErrOk;
+    }
+    memcpy(data, &hdr->len, sizeof(hdr->len));
+    memcpy(data + 4, &hdr->ovfCt, sizeof(hdr->ovfCt));
+    if (putAddr32(data + 8, hdr->ovfAdr))
+	return bErrAddrRange;
+    return bErrOk;
+}
+
+/* --- Node I/O --- */
+
+static
+bError writeNode(bHandle *h,
+		 bIdxAddr adr,
+		 bNode *p,
+		 bIdxAddr *ovfAdr,
+		 unsigned int *ovfCt)
+{
+    /* write node p to adr; *ovfAdr and *ovfCt give the node's overflow
+       extent and are updated if a new extent has to be allocated */
+    size_t cap;                 /* number of bytes available at adr */
+    size_t len;
+    bNodeHeader hdr;
+    bError rc;
 
-/* based on b = &bBuffer */
-#define leaf(b) b->p->leaf
-#define ct(b) b->p->ct
-#define next(b) b->p->next
-#define prev(b) b->p->prev
-#define fkey(b) &b->p->fkey
-#define lkey(b) (fkey(b) + ks((ct(b) - 1)))
-#define p(b) (char *)(b->p)
+    cap = h->sectorSize;
+    if (adr == 0) cap *= 3;     /* root */
+    if (!h->compressed) {
+	const char *data = (const char *)p;
 
-/* shortcuts */
-#define ks(ct) ((ct) * h->ks)
-#define error(rc) lineError(__LINE__, rc)
+	if (h->addr32) {
+	    if ((rc = narrowNode(h, p, h->encBuf, cap)) != 0) return rc;
+	    data = h->encBuf;
+	}
+	if (h->snap)
+	    return snapWrite(h, adr, data, cap);
+	return writeBytes(h, filePos(h, adr), data, cap);
+    }
 
-static 
-bError lineError(int lineno, 
-		 bError rc) 
-{
-    if (rc == bErrIO || rc == bErrMemory)
-        if (!bErrLineNo) 
-            bErrLineNo = lineno;
-    return rc;
+    len = encodeNode(h, p);
+    if (len > cap) {
+	unsigned int ct = (len - cap + h->sectorSize - 1) / h->sectorSize;
+
+	if (ct > *ovfCt) {
+	    /* the old extent (if any) is too small; allocate a new one */
+	    *ovfAdr = h->nextFreeAdr;
+	    *ovfCt = ct;
+	    h->nextFreeAdr += ct * h->sectorSize;
+	}
+    }
+    else
+	memset(h->encBuf + len, 0, cap - len);
+    hdr.len = len;
+    hdr.ovfCt = *ovfCt;
+    hdr.ovfAdr = *ovfAdr;
+    if ((rc = putNodeHeader(h, &hdr, h->encBuf)) != 0) return rc;
+    if ((rc = writeBytes(h, filePos(h, adr), h->encBuf, cap)) != 0)
+	return rc;
+    if (len > cap)
+	if ((rc = writeBytes(h, filePos(h, *ovfAdr), 
+			     h->encBuf + cap, len - cap)) != 0)
+	    return rc;
+    return bErrOk;
 }
 
-static 
-bIdxAddr allocAdr(bHandle *h) 
+static
+bError readNode(bHandle *h,
+		bBuffer *buf)
 {
-    bIdxAddr adr;
-    adr = h->nextFreeAdr;
-    h->nextFreeAdr += h->sectorSize;
-    return adr;
+    /* read the node at buf->adr into buf */
+    size_t cap;                 /* number of bytes available at adr */
+    bNodeHeader hdr;
+    const char *data;
+    bIdxAddr pos;
+    bError rc;
+
+    cap = h->sectorSize;
+    if (buf->adr == 0) cap *= 3;        /* root */
+    if (h->snap) {
+	/* the sectors of the root need not be adjacent */
+	if (buf->adr == 0) {
+	    buf->p = buf->mem;
+	    if (!h->addr32)
+		return snapRead(h, 0, (char *)buf->p, cap);
+	    if ((rc = snapRead(h, 0, h->encBuf, cap)) != 0) return rc;
+	    return widenNode(h, h->encBuf, cap, buf->p, 3 * h->maxCt);
+	}
+	if ((pos = snapPos(h, buf->adr)) == 0)
+	    return bErrFormat;
+    }
+    else
+	pos = filePos(h, buf->adr);
+
+    if (!h->compressed && h->addr32) {
+	/* convert the node into buffer memory */
+	buf->p = buf->mem;
+	if (h->map && pos + cap <= h->mapSize)
+	    data = h->map + pos;
+	else {
+	    if ((rc = readBytes(h, pos, h->encBuf, cap)) != 0) return rc;
+	    data = h->encBuf;
+	}
+	return widenNode(h, data, cap, buf->p, 
+			 buf->adr == 0 ? 3 * h->maxCt : h->maxCt);
+    }
+    if (!h->compressed) {
+	if (h->map && pos + cap <= h->mapSize) {
+	    /* access the node in place; the root is copied, since it
+	       stays in memory for the lifetime of the handle */
+	    if (buf->adr == 0)
+		memcpy(buf->p, h->map + pos, cap);
+	    else
+		buf->p = (bNode *)(h->map + pos);
+	    return bErrOk;
+	}
+	buf->p = buf->mem;
+	return readBytes(h, pos, buf->p, cap);
+    }
+
+    /* compressed node: decode into buffer memory */
+    buf->p = buf->mem;
+    if (h->map && pos + cap <= h->mapSize)
+	data = h->map + pos;
+    else {
+	if ((rc = readBytes(h, pos, h->encBuf, cap)) != 0) return rc;
+	data = h->encBuf;
+    }
+    getNodeHeader(h, data, &hdr);
+    if (hdr.len < nodeHdrSize(h) || hdr.len > h->encSize)
+	return error(bErrFormat);
+    if (hdr.len > cap) {
+	if (data != h->encBuf)
+	    memcpy(h->encBuf, data, cap);
+	if ((rc = readBytes(h, filePos(h, hdr.ovfAdr), 
+			    h->encBuf + cap, hdr.len - cap)) != 0)
+	    return rc;
+	data = h->encBuf;
+    }
+    buf->ovfAdr = hdr.ovfAdr;
+    buf->ovfCt = hdr.ovfCt;
+    return decodeNode(h, data, hdr.len, buf->p, 
+		      buf->adr == 0 ? 3 * h->maxCt : h->maxCt);
 }
 
 static 
 bError flush(bHandle *h,
 	     bBuffer *buf) 
 {
-    int len;            /* number of bytes to write */
+    bError rc;
 
     /* flush buffer to disk */
-    len = h->sectorSize;
-    if (buf->adr == 0) len *= 3;        /* root */
-    if (fseek(h->fp, buf->adr, SEEK_SET)) return error(bErrIO);
-    if (fwrite(buf->p, len, 1, h->fp) != 1) return error(bErrIO);
+    if ((rc = writeNode(h, buf->adr, buf->p, 
+			&buf->ovfAdr, &buf->ovfCt)) != 0) 
+	return rc;
     buf->modified = false;
     h->nDiskWrites++;
     return bErrOk;
 }
 
+static
+int compareBuffers(const void *a,
+		   const void *b)
+{
+    bIdxAddr x = (*(const bBuffer **)a)->adr;
+    bIdxAddr y = (*(const bBuffer **)b)->adr;
+
+    return x < y ? -1 : (x > y);
+}
+
 static 
 bError flushAll(bHandle *h) 
 {
-    bError rc;                /* return code */
+    bError rc, rc2;             /* return code */
     bBuffer *buf;               /* buffer */
-
+    bBatch *b;
+    size_t i, n = 0;
+
+    /* write the modified buffers by ascending address as one batch */
+    if ((rc = batchBegin(h)) != 0) return rc;
+    b = h->batch;
+    if (b->bufsAlloc < (size_t)h->bufCt + 1) {
+	bBuffer **bufs;
+
+	if ((bufs = growArray(b->bufs, &b->bufsAlloc, h->bufCt + 1,
+			      sizeof(bBuffer *))) == NULL) {
+	    b->active = false;
+	    return error(bErrMemory);
+	}
+	b->bufs = bufs;
+    }
     if (h->root.modified)
-        if ((rc = flush(h,&h->root)) != 0) return rc;
-
-    buf = h->bufList.next;
-    while (buf != &h->bufList) {
+	b->bufs[n++] = &h->root;
+    for (buf = h->bufList.next; buf != &h->bufList; buf = buf->next)
         if (buf->modified)
-            if ((rc = flush(h,buf)) != 0) return rc;
-        buf = buf->next;
+	    b->bufs[n++] = buf;
+    qsort(b->bufs, n, sizeof(bBuffer *), compareBuffers);
+    for (i = 0; i < n; i++) {
+	buf = b->bufs[i];
+	if ((rc = writeNode(h, buf->adr, buf->p, 
+			    &buf->ovfAdr, &buf->ovfCt)) != 0) 
+	    break;
+    }
+    if ((rc2 = batchEnd(h)) != 0 && rc == bErrOk)
+	rc = rc2;
+    if (rc) return rc;
+
+    /* the buffers are clean only once the batch was written */
+    for (i = 0; i < n; i++) {
+	b->bufs[i]->modified = false;
+	h->nDiskWrites++;
     }
 
     /* Now make sure the data is really written to disk */
@@ -142,6 +1552,27 @@ bError flushAll(bHandle *h)
     return bErrOk;
 }
 
+/* hash table slot for adr */
+#define bufHash(h, adr) (((adr) / (h)->sectorSize) & (h)->bufHashMask)
+
+static
+void unhashBuf(bHandle *h,
+	       bBuffer *buf)
+{
+    /* remove buf from the hash table */
+    bBuffer **slot;
+
+    slot = &h->bufHash[bufHash(h, buf->adr)];
+    while (*slot) {
+	if (*slot == buf) {
+	    *slot = buf->hnext;
+	    break;
+	}
+	slot = &(*slot)->hnext;
+    }
+    buf->hnext = NULL;
+}
+
 static 
 bError assignBuf(bHandle *h,
 		 bIdxAddr adr, 
@@ -157,23 +1588,27 @@ bError assignBuf(bHandle *h,
     }
 
     /* search for buf with matching adr */
-    buf = h->bufList.next;
-    while (buf->next != &h->bufList) {
-        if (buf->valid && buf->adr == adr) break;
-        buf = buf->next;
-    }
-
-    /* either buf points to a match, or it's last one in list (LRR) */
-    if (buf->valid) {
-        if (buf->adr != adr) {
-            if (buf->modified) {
-                if ((rc = flush(h,buf)) != 0) return rc;
-            }
-            buf->adr = adr;
-            buf->valid = false;
-        }
-    } else {
-        buf->adr = adr;
+    buf = h->bufHash[bufHash(h, adr)];
+    while (buf != NULL && buf->adr != adr)
+	buf = buf->hnext;
+
+    /* if there's no match, reuse the last one in list (LRR) */
+    if (buf == NULL) {
+	buf = h->bufList.prev;
+	if (buf->valid) {
+	    if (buf->modified) {
+		if ((rc = flush(h,buf)) != 0) return rc;
+	    }
+	    buf->valid = false;
+	    h->nCacheEvictions++;
+	}
+	if (buf->adr)
+	    unhashBuf(h, buf);
+	buf->adr = adr;
+	buf->ovfAdr = 0;
+	buf->ovfCt = 0;
+	buf->hnext = h->bufHash[bufHash(h, adr)];
+	h->bufHash[bufHash(h, adr)] = buf;
     }
 
     /* remove from current position and place at front of list */
@@ -203,20 +1638,18 @@ bError readDisk(bHandle *h,
 		bBuffer **b) 
 {
     /* read data into buf */
-    int len;
     bBuffer *buf;               /* buffer */
     bError rc;                /* return code */
 
     if ((rc = assignBuf(h, adr, &buf)) != 0) return rc;
     if (!buf->valid) {
-        len = h->sectorSize;
-        if (adr == 0) len *= 3;         /* root */
-        if (fseek(h->fp, adr, SEEK_SET)) return error(bErrIO);
-        if (fread(buf->p, len, 1, h->fp) != 1) return error(bErrIO);
+	if ((rc = readNode(h, buf)) != 0) return rc;
         buf->modified = false;
         buf->valid = true;
-        h->nDiskReads++;
+	h->nCacheMisses++;
     }
+    else
+	h->nCacheHits++;
     *b = buf;
     return bErrOk;
 }
@@ -298,32 +1731,78 @@ int dump(bHandle *h,
 }
 #endif
 
+static
+int validateNode(bHandle *h,
+		 bBuffer *buf,
+		 char *visited,
+		 int level);
+
+/* compare two keys of the tree; for duplicate keys, the record
+   addresses decide */
+static
+int compareKeys(bHandle *h,
+		bKey *k1,
+		bKey *k2)
+{
+    int cc;
+
+    cc = h->comp(h->keySize, key(k1), key(k2));
+    if (cc == 0 && h->dupKeys) {
+	if (rec(k1) < rec(k2))
+	    cc = -1;
+	else if (rec(k1) > rec(k2))
+	    cc = 1;
+    }
+    return cc;
+}
+
 static
 int _validateTree(bHandle *h,
 		  bBuffer *b,
 		  char *visited,
 		  int level) 
 {
-    bKey *k;
-    bError rc;
-    unsigned int i;
-    char p[3*MAX_SECTOR_SIZE];
-    bBuffer *cbuf, bufx;
+    char *p;
+    bBuffer bufx;
     bBuffer *buf = &bufx;
+    int result;
 
-    if (h->sectorSize > MAX_SECTOR_SIZE) {
-	DPRINTF("sectorSize exceeds MAX_SECTOR_SIZE; aborting check\n");
+    /* copy the node, since reading the children may reuse its
+       buffer */
+    if ((p = malloc((b->adr == 0 ? 3 : 1) * h->nodeSize)) == NULL) {
+	DPRINTF("out of memory; aborting check\n");
 	return -1;
     }
     memcpy(buf, b, sizeof(bBuffer));
-    memcpy(p, b->p, 3*h->sectorSize);
+    memcpy(p, b->p, (b->adr == 0 ? 3 : 1) * h->nodeSize);
     buf->p = (bNode *)p;
+    result = validateNode(h, buf, visited, level);
+    free(p);
+    return result;
+}
+
+static
+int validateNode(bHandle *h,
+		 bBuffer *buf,
+		 char *visited,
+		 int level) 
+{
+    bKey *k;
+    bError rc;
+    unsigned int i;
+    bBuffer *cbuf;
+    bIdxAddr slot;
+
     dumpBuf(h,"validate", buf);
-    if (visited[buf->adr >> 8]) {
-        DPRINTF("previous visit, buf[%04lx]\n", (unsigned long)buf->adr);
+    slot = buf->adr / h->sectorSize;
+    if (buf->adr % h->sectorSize 
+	|| buf->adr >= h->nextFreeAdr
+	|| visited[slot]) {
+        DPRINTF("invalid or previously visited buf[%04lx]\n", 
+		(unsigned long)buf->adr);
         return -1;
     }
-    visited[buf->adr >> 8] = 1;
+    visited[slot] = 1;
     DPRINTF("\n");
     if (ct(buf)) {
         if (!leaf(buf)) {
@@ -334,46 +1813,43 @@ int _validateTree(bHandle *h,
 			childLT(fkey(buf)));
                 return -1;
             }
-            if (*(unsigned int *)key(lkey(cbuf)) > *(unsigned int *)key(fkey(buf))) {
+            if (ct(cbuf) && compareKeys(h, lkey(cbuf), fkey(buf)) > 0) {
                 DPRINTF("last element in child buf[%04lx] LT "
 			"> first element of parent buf[%04lx]\n", 
 			(unsigned long)cbuf->adr, 
 			(unsigned long)buf->adr);
                 return -1;
             }
-            _validateTree(h, cbuf, visited, level+1);
+            if (_validateTree(h, cbuf, visited, level+1))
+		return -1;
             k = fkey(buf);
             for (i = 0; i < ct(buf); i++) {
                 DPRINTF("level %d: recursing on buf[%04lx] GE[%d]\n", 
-			level, key(childGE(k)), i);
+			level, childGE(k), i);
                 if ((rc = readDisk(h, childGE(k), &cbuf)) != 0) {
                     DPRINTF("unable to read buffer %04lx\n", childGE(k));
                     return -1;
                 }
-                if (*(unsigned int *)key(fkey(cbuf)) < *(unsigned int *)key(k)) {
+                if (ct(cbuf) == 0 || compareKeys(h, fkey(cbuf), k) < 0) {
                     DPRINTF("first element in child buf[%04lx] "
-			    "< parent buf[%04lx] GE (%08x < %08x)\n", 
+			    "< parent buf[%04lx] GE\n", 
 			    (unsigned long)cbuf->adr,
-			    (unsigned long)buf->adr,
-			    *(int *)key(fkey(cbuf)),
-			    *(int *)key(k));
-
+			    (unsigned long)buf->adr);
                     dumpBuf(h,"buf", buf);
                     dumpBuf(h,"cbuf", cbuf);
                     return -1;
                 }
-                if (!leaf(cbuf) && *(unsigned int *)key(fkey(cbuf)) ==  *(unsigned int *)key(k)) {
+                if (!leaf(cbuf) && compareKeys(h, fkey(cbuf), k) == 0) {
                     DPRINTF("first element in child buf[%04lx] "
-			    "= parent buf[%04lx] GE (%08x < %08x)\n",
+			    "= parent buf[%04lx] GE\n",
 			    (unsigned long)cbuf->adr,
-			    (unsigned long)buf->adr,
-			    *(int *)key(fkey(cbuf)),
-			    *(int *)key(k));
+			    (unsigned long)buf->adr);
                     dumpBuf(h,"buf", buf);
                     dumpBuf(h,"cbuf", cbuf);
                     return -1;
                 }
-                _validateTree(h,cbuf,visited,level+1);
+                if (_validateTree(h, cbuf, visited, level+1))
+		    return -1;
                 k += ks(1);
             }
         }
@@ -466,8 +1942,9 @@ int search(bHandle *h,
 	DPRINTF("found dups: cc=%i, lb=%i, ub=%i, key(*mkey)=%i next=%i\n",
 	       cc,lb,ub,*(int*)key(*mkey),*(int*)key((*mkey+ks(1))));
 #endif
-        if (cc == CC_GT)
-	    /* next key is first key */
+        if (cc > 0)
+	    /* next key is first key; compare functions may return
+	       any positive value, not just CC_GT */
 	    *mkey += ks(1);
         return CC_EQ;
     }
@@ -498,7 +1975,8 @@ bError scatter(bHandle *h,
 	       bBuffer *pbuf, 
 	       bKey *pkey, 
 	       int is, 
-	       bBuffer **tmp) 
+	       bBuffer **tmp,
+	       bool deleting) 
 {
     bBuffer *gbuf;              /* gather buf */
     bKey *gkey;              /* gather buf key */
@@ -508,6 +1986,7 @@ bError scatter(bHandle *h,
     int knMin;                  /* min #keys that can be mapped to tmp[1..3] */
     int k0Max;                  /* max #keys that can be mapped to tmp[0] */
     int knMax;                  /* max #keys that can be mapped to tmp[1..3] */
+    int knHard;                 /* #keys that fit into tmp[1..3] */
     int sw;                     /* shift width */
     int len;                    /* length of remainder of buf */
     int base;                   /* base count distributed to tmps */
@@ -521,6 +2000,7 @@ bError scatter(bHandle *h,
      *   pkey                   where we insert a key if needed in parent
      *   is                     number of supplied tmps
      *   tmp                    array of tmp's to be used for scattering
+     *   deleting               true when called from bDeleteKey
      * output:
      *   tmp                    array of tmp's used for scattering
      */
@@ -549,10 +2029,21 @@ bError scatter(bHandle *h,
         k0Max = h->maxCt - 1;
         knMax = h->maxCt;
         k0Min = (h->maxCt / 2) + 1;
-        knMin = ((h->maxCt+1) / 2) + 1;
+        /* plus 1 for the key moved to the parent */
+        knMin = (h->maxCt / 2) + 2;
     }
 
-    /* calculate iu, number of tmps to use */
+    /* calculate iu, number of tmps to use; for small nodes, the
+       limits above can't always be met at the same time: inserting
+       then only needs room in the nodes, deleting only needs them
+       to be more than half full (they may be full, but never
+       overflow: tmp[0] holds at most maxCt keys, the others at most
+       knHard) */
+    knHard = leaf(gbuf) ? h->maxCt : h->maxCt + 1;
+    if (deleting) {
+	k0Max = h->maxCt;
+	knMax = knHard;
+    }
     while(1) {
         if (iu == 0 || ct > (k0Max + (iu-1)*knMax)) {
             /* add a buffer */
@@ -573,7 +2064,8 @@ bError scatter(bHandle *h,
             }
             iu++;
             h->nNodesIns++;
-        } else if (iu > 1 && ct < (k0Min + (iu-1)*knMin)) {
+        } else if (iu > 1 && ct < (k0Min + (iu-1)*knMin)
+		   && ct <= (k0Max + (iu-2)*knMax)) {
             /* del a buffer */
             iu--;
             /* adjust sequential links */
@@ -694,7 +2186,7 @@ bError gatherRoot(bHandle *h)
     /* gather root to gbuf */
     root = &h->root;
     gbuf = &h->gbuf;
-    memcpy(p(gbuf), root->p, 3 * h->sectorSize);
+    memcpy(p(gbuf), root->p, 3 * h->nodeSize);
     leaf(gbuf) = leaf(root);
     ct(root) = 0;
     return bErrOk;
@@ -771,19 +2263,564 @@ bError gather(bHandle *h,
 
 /* --- Interface --------------------------------------------------------- */
 
+static
+bError readHeader(bHandle *h,
+		  bDescription *info,
+		  int *maxCt,
+		  bool *snapshot)
+{
+    /* read the file header; files without header use format 1 */
+    bFileHeader hdr;
+
+    if (readFile(h, 0, &hdr, sizeof(hdr))
+	|| memcmp(hdr.magic, BTR_MAGIC, sizeof(hdr.magic)) != 0) {
+	/* format 1 files use the address size of the platform which
+	   wrote them */
+	h->addr32 = (BTR_ULONG_SIZE == 4);
+	return bErrOk;
+    }
+
+    if (hdr.version < 2
+	|| hdr.version > BTR_SNAPSHOT_FORMAT_VERSION
+	|| (hdr.flags & ~(BTR_FLAG_COMPRESSED | BTR_FLAG_SNAPSHOT
+			  | BTR_FLAG_ADDR64))
+	|| ((hdr.flags & BTR_FLAG_SNAPSHOT) != 0)
+	   != (hdr.version == BTR_SNAPSHOT_FORMAT_VERSION)
+	|| ((hdr.flags & BTR_FLAG_SNAPSHOT) 
+	    && (hdr.flags & BTR_FLAG_COMPRESSED))
+	|| hdr.sectorSize != (unsigned int)info->sectorSize
+	|| hdr.keySize != (unsigned int)info->keySize
+	|| hdr.dupKeys != (unsigned int)info->dupKeys
+	|| hdr.maxCt > MAX_CT)
+	return bErrFormat;
+    h->formatVersion = hdr.version;
+    h->compressed = (hdr.flags & BTR_FLAG_COMPRESSED) != 0;
+    h->addr32 = !(hdr.flags & BTR_FLAG_ADDR64) && BTR_ULONG_SIZE == 4;
+    h->base = h->sectorSize;
+    *maxCt = hdr.maxCt;
+    *snapshot = (hdr.flags & BTR_FLAG_SNAPSHOT) != 0;
+    return bErrOk;
+}
+
+static
+void fillHeader(bHandle *h,
+		bFileHeader *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, BTR_MAGIC, sizeof(hdr->magic));
+    hdr->version = h->formatVersion;
+    hdr->flags = h->addr32 ? 0 : BTR_FLAG_ADDR64;
+    if (h->compressed)
+	hdr->flags |= BTR_FLAG_COMPRESSED;
+    if (h->snap)
+	hdr->flags |= BTR_FLAG_SNAPSHOT;
+    hdr->sectorSize = h->sectorSize;
+    hdr->keySize = h->keySize;
+    hdr->dupKeys = h->dupKeys;
+    hdr->maxCt = h->maxCt;
+}
+
+static
+bError writeHeader(bHandle *h)
+{
+    /* write the file header; it occupies the first sector */
+    bFileHeader hdr;
+    char *p;
+    bError rc;
+
+    fillHeader(h, &hdr);
+    if ((p = calloc(h->sectorSize, 1)) == NULL) return error(bErrMemory);
+    memcpy(p, &hdr, sizeof(hdr));
+    rc = writeBytes(h, 0, p, h->sectorSize);
+    free(p);
+    return rc;
+}
+
+/* --- Snapshot format: versions --- */
+
+static
+unsigned int snapChecksum(const void *data,
+			  size_t len)
+{
+    /* FNV-1a hash of the header fields, which take len bytes */
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+    unsigned int x = 2166136261U;
+
+    for (i = 0; i < len; i++) {
+	x ^= p[i];
+	x *= 16777619U;
+    }
+    return x;
+}
+
+static
+bError readSnapHeader(bHandle *h,
+		      bSnapHeader *sh)
+{
+    /* read the valid header slot with the highest version */
+    bSnapHeader slot;
+    char data[sizeof(bSnapHeader)];
+    unsigned int checksum;
+    bool found = false;
+    bError rc;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	if ((rc = readBytes(h, (bIdxAddr)i * h->sectorSize,
+			    data, sizeof(data))) != 0)
+	    return rc;
+	if (h->addr32) {
+	    /* file, version, nextFreeAdr, pages, top, levels,
+	       checksum */
+	    memcpy(&slot.file, data, 32);
+	    slot.version = getAddr32(data + 32);
+	    slot.nextFreeAdr = getAddr32(data + 36);
+	    slot.pages = getAddr32(data + 40);
+	    slot.top = getAddr32(data + 44);
+	    memcpy(&slot.levels, data + 48, 4);
+	    memcpy(&slot.checksum, data + 52, 4);
+	    checksum = snapChecksum(data, 52);
+	}
+	else {
+	    memcpy(&slot, data, sizeof(slot));
+	    checksum = snapChecksum(&slot, offsetof(bSnapHeader, checksum));
+	}
+	if (memcmp(slot.file.magic, BTR_MAGIC, sizeof(slot.file.magic)) != 0
+	    || !(slot.file.flags & BTR_FLAG_SNAPSHOT)
+	    || slot.checksum != checksum)
+	    continue;
+	if (!found || slot.version > sh->version) {
+	    *sh = slot;
+	    found = true;
+	}
+    }
+    return found ? bErrOk : bErrFormat;
+}
+
+static
+bError writeSnapHeader(bHandle *h,
+		       bAddr64 version)
+{
+    /* write the header slot of version */
+    bSnapshot *s = h->snap;
+    bSnapHeader sh;
+
+    memset(&sh, 0, sizeof(sh));
+    fillHeader(h, &sh.file);
+    sh.version = version;
+    sh.nextFreeAdr = h->nextFreeAdr;
+    sh.pages = s->level[0].n;
+    sh.levels = s->levels;
+    if (sh.pages)
+	sh.top = entryPos(s->level[s->levels].pos[0]);
+    memset(s->page, 0, h->sectorSize);
+    if (h->addr32) {
+	memcpy(s->page, &sh.file, 32);
+	if (putAddr32(s->page + 32, sh.version)
+	    || putAddr32(s->page + 36, sh.nextFreeAdr)
+	    || putAddr32(s->page + 40, sh.pages)
+	    || putAddr32(s->page + 44, sh.top))
+	    return bErrAddrRange;
+	memcpy(s->page + 48, &sh.levels, 4);
+	sh.checksum = snapChecksum(s->page, 52);
+	memcpy(s->page + 52, &sh.checksum, 4);
+    }
+    else {
+	sh.checksum = snapChecksum(&sh, offsetof(bSnapHeader, checksum));
+	memcpy(s->page, &sh, sizeof(sh));
+    }
+    return writeBytes(h, (bIdxAddr)(version & 1) * h->sectorSize,
+		      s->page, h->sectorSize);
+}
+
+static
+bError syncFile(bHandle *h)
+{
+    /* write the stdio buffers and force the data to disk */
+    if (fflush(h->fp)) return error(bErrIO);
+#ifndef _WIN32
+    if (fsync(fileno(h->fp))) return error(bErrIO);
+#endif
+    return bErrOk;
+}
+
+static
+bError snapNew(bHandle *h)
+{
+    /* set up the snapshot format state */
+    bSnapshot *s;
+#ifdef BTR_HAVE_LOCKS
+    struct stat st;
+#endif
+
+    if (h->sectorSize % addrSize(h)
+	|| (size_t)h->sectorSize < sizeof(bSnapHeader))
+	return bErrSectorSize;
+    if ((s = calloc(sizeof(bSnapshot), 1)) == NULL) 
+	return error(bErrMemory);
+    h->snap = s;
+    s->mapEnt = h->sectorSize / addrSize(h);
+    s->physEnd = 2 * h->sectorSize;
+    if ((s->page = malloc(h->sectorSize)) == NULL) 
+	return error(bErrMemory);
+#ifdef BTR_HAVE_LOCKS
+    if (fstat(fileno(h->fp), &st)) return error(bErrIO);
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    if (h->readOnly) {
+	pthread_mutex_lock(&snapReadersMutex);
+	s->nextReader = snapReaders;
+	snapReaders = s;
+	pthread_mutex_unlock(&snapReadersMutex);
+    }
+#endif
+    return bErrOk;
+}
+
+static
+void snapSetLocked(bSnapshot *s,
+		   unsigned long version)
+{
+    /* record the version used by a reader */
+#ifdef BTR_HAVE_LOCKS
+    pthread_mutex_lock(&snapReadersMutex);
+    s->locked = version;
+    pthread_mutex_unlock(&snapReadersMutex);
+#else
+    s->locked = version;
+#endif
+}
+
+static
+void snapRelease(bHandle *h)
+{
+    bSnapshot *s = h->snap;
+
+    if (s == NULL)
+	return;
+#ifdef BTR_HAVE_LOCKS
+    {
+	bSnapshot **r;
+
+	pthread_mutex_lock(&snapReadersMutex);
+	for (r = &snapReaders; *r != NULL; r = &(*r)->nextReader)
+	    if (*r == s) {
+		*r = s->nextReader;
+		break;
+	    }
+	pthread_mutex_unlock(&snapReadersMutex);
+	if (s->locked)
+	    lockVersion(h, s->locked, F_UNLCK);
+    }
+#endif
+    mapFree(s);
+    if (s->page) free(s->page);
+    if (s->freed) free(s->freed);
+    if (s->spare) free(s->spare);
+    if (s->fresh) free(s->fresh);
+    free(s);
+    h->snap = NULL;
+}
+
+static
+bError snapLoad(bHandle *h,
+		const bSnapHeader *sh)
+{
+    /* load the page map of the version described by sh; map pages
+       which are still in use by the current map are not read
+       again. Cached nodes which changed are invalidated. */
+    bSnapshot *s = h->snap;
+    bMapLevel old[MAP_LEVELS];
+    size_t E = s->mapEnt;
+    size_t n, i, j, first, last;
+    bIdxAddr pos;
+    bBuffer *buf;
+    bError rc;
+    int l, top;
+
+    memcpy(old, s->level, sizeof(old));
+    memset(s->level, 0, sizeof(s->level));
+
+    /* size the levels */
+    n = sh->pages;
+    for (l = 0; ; l++) {
+	if (l == MAP_LEVELS) {
+	    rc = bErrFormat;
+	    goto onError;
+	}
+	if ((rc = mapResize(s, l, n)) != 0) goto onError;
+	if (n <= 1)
+	    break;
+	n = (n + E - 1) / E;
+    }
+    top = l;
+    if ((unsigned int)top != sh->levels) {
+	rc = bErrFormat;
+	goto onError;
+    }
+    if (sh->pages)
+	s->level[top].pos[0] = sh->top;
+
+    /* read the map pages top down */
+    for (l = top; l > 0; l--) {
+	bMapLevel *m = &s->level[l];
+	bMapLevel *c = &s->level[l - 1];
+
+	for (j = 0; j < m->n; j++) {
+	    if ((pos = m->pos[j]) == 0)
+		continue;
+	    first = j * E;
+	    last = first + E;
+	    if (last > c->n)
+		last = c->n;
+	    if (j < old[l].n && old[l].pos[j] == pos) {
+		for (i = first; i < last && i < old[l - 1].n; i++)
+		    c->pos[i] = old[l - 1].pos[i];
+		continue;
+	    }
+	    if (pos % h->sectorSize) {
+		rc = bErrFormat;
+		goto onError;
+	    }
+	    if ((rc = readBytes(h, pos, s->page, h->sectorSize)) != 0)
+		goto onError;
+	    for (i = first; i < last; i++)
+		c->pos[i] = h->addr32 
+		    ? getAddr32(s->page + 4 * (i - first))
+		    : ((bIdxAddr *)s->page)[i - first];
+	}
+    }
+
+    /* invalidate cached nodes whose sectors changed */
+    for (buf = h->bufList.next; buf != &h->bufList; buf = buf->next) {
+	i = buf->adr / h->sectorSize;
+	if (buf->valid
+	    && (i >= old[0].n || i >= s->level[0].n 
+		|| old[0].pos[i] != s->level[0].pos[i]))
+	    buf->valid = false;
+    }
+    for (i = 0; i < 3; i++)
+	if (i >= old[0].n || i >= s->level[0].n 
+	    || old[0].pos[i] != s->level[0].pos[i])
+	    h->root.valid = false;
+
+    s->levels = top;
+    for (l = 0; l < MAP_LEVELS; l++) {
+	if (old[l].pos) free(old[l].pos);
+	if (old[l].dirty) free(old[l].dirty);
+    }
+    return bErrOk;
+
+ onError:
+    mapFree(s);
+    memcpy(s->level, old, sizeof(old));
+    return rc;
+}
+
+static
+bError snapAcquire(bHandle *h,
+		   bSnapHeader *sh)
+{
+    /* read the header of the newest version; read-only handles
+       announce that they use it by locking it */
+    bSnapshot *s = h->snap;
+    bool initial = (s->locked == 0);
+    bSnapHeader check;
+    bError rc;
+
+    for (;;) {
+	if ((rc = readSnapHeader(h, sh)) != 0) return rc;
+	if (!h->readOnly || (!initial && sh->version == s->locked))
+	    return bErrOk;
+	/* a new handle announces the version to writers in this
+	   process right away; later ones are covered by the version
+	   in use */
+	if (initial)
+	    snapSetLocked(s, sh->version);
+#ifdef BTR_HAVE_LOCKS
+	if (lockVersion(h, sh->version, F_RDLCK) == -1)
+	    return error(bErrIO);
+#endif
+	/* the writer may have published a newer version and reused
+	   the sectors dropped by it before the lock was set */
+	if ((rc = readSnapHeader(h, &check)) != 0) return rc;
+	if (check.version == sh->version)
+	    return bErrOk;
+#ifdef BTR_HAVE_LOCKS
+	lockVersion(h, sh->version, F_UNLCK);
+#endif
+    }
+}
+
+static
+bError snapScan(bHandle *h,
+		bIdxAddr size)
+{
+    /* writer: make the sectors which are not used by the current
+       version available; readers of older versions may still use
+       them, so they are tagged with the current version */
+    bSnapshot *s = h->snap;
+    unsigned char *used;
+    size_t sectors, i;
+    bIdxAddr pos;
+    bError rc = bErrOk;
+    int l;
+
+    sectors = (size + h->sectorSize - 1) / h->sectorSize;
+    if (sectors < 2)
+	sectors = 2;
+    s->physEnd = (bIdxAddr)sectors * h->sectorSize;
+    if ((used = calloc(sectors, 1)) == NULL) return error(bErrMemory);
+    used[0] = used[1] = 1;
+    for (l = 0; l <= s->levels; l++)
+	for (i = 0; i < s->level[l].n; i++) {
+	    pos = entryPos(s->level[l].pos[i]) / h->sectorSize;
+	    if (pos < sectors)
+		used[pos] = 1;
+	}
+    for (i = 2; i < sectors; i++)
+	if (!used[i])
+	    if ((rc = snapDrop(h, (bIdxAddr)i * h->sectorSize, 
+			       h->version)) != 0)
+		break;
+    free(used);
+    return rc;
+}
+
+static
+bError snapCommit(bHandle *h)
+{
+    /* publish the current state of the tree as a new version */
+    bSnapshot *s = h->snap;
+    size_t E = s->mapEnt;
+    size_t n, i, j, first, last;
+    bIdxAddr pos;
+    bError rc;
+    int l;
+
+    if ((rc = flushAll(h)) != 0) return rc;
+    if (!s->changed)
+	return bErrOk;
+
+    /* size the levels */
+    n = h->nextFreeAdr / h->sectorSize;
+    if (n < s->level[0].n)
+	n = s->level[0].n;
+    for (l = 0; ; l++) {
+	if (l == MAP_LEVELS)
+	    return bErrFormat;
+	if ((rc = mapResize(s, l, n)) != 0) return rc;
+	if (n <= 1)
+	    break;
+	n = (n + E - 1) / E;
+    }
+    s->levels = l;
+
+    /* write the changed map pages bottom up */
+    if ((rc = batchBegin(h)) != 0) return rc;
+    for (l = 0; l < s->levels; l++) {
+	bMapLevel *m = &s->level[l];
+
+	for (j = 0; j * E < m->n; j++) {
+	    if (!m->dirty[j])
+		continue;
+	    m->dirty[j] = 0;
+	    first = j * E;
+	    last = first + E;
+	    if (last > m->n)
+		last = m->n;
+	    memset(s->page, 0, h->sectorSize);
+	    for (i = first; i < last; i++)
+		if (!h->addr32)
+		    ((bIdxAddr *)s->page)[i - first] = entryPos(m->pos[i]);
+		else if (putAddr32(s->page + 4 * (i - first),
+				   entryPos(m->pos[i]))) {
+		    batchEnd(h);
+		    return bErrAddrRange;
+		}
+	    if ((rc = snapPlace(h, l + 1, j, &pos)) != 0
+		|| (rc = writeBytes(h, pos, s->page, h->sectorSize)) != 0) {
+		batchEnd(h);
+		return rc;
+	    }
+	}
+    }
+    if ((rc = batchEnd(h)) != 0) return rc;
+    s->level[s->levels].dirty[0] = 0;
+
+    /* the header may only refer to data which is on disk */
+    if ((rc = syncFile(h)) != 0) return rc;
+    if ((rc = writeSnapHeader(h, h->version + 1)) != 0) return rc;
+    if ((rc = syncFile(h)) != 0) return rc;
+    h->version++;
+
+    /* sectors of the published version must not be overwritten */
+    for (i = 0; i < s->freshCt; i++)
+	s->level[s->fresh[i] % MAP_LEVELS].pos[s->fresh[i] / MAP_LEVELS] 
+	    &= ~FRESH;
+    s->freshCt = 0;
+    s->changed = false;
+    s->safeValid = false;
+    return bErrOk;
+}
+
+static
+void snapUnmap(bHandle *h,
+	       bIdxAddr adr)
+{
+    /* drop the sectors of logical addresses from adr on */
+    bSnapshot *s = h->snap;
+    bMapLevel *m = &s->level[0];
+    size_t i;
+
+    for (i = adr / h->sectorSize; i < m->n; i++)
+	if (m->pos[i]) {
+	    snapDrop(h, m->pos[i], h->version + 1);
+	    m->pos[i] = 0;
+	    m->dirty[i / s->mapEnt] = 1;
+	    s->changed = true;
+	}
+}
+
+static
+void freeHandle(bHandle *h)
+{
+    /* release the snapshot state, close the file and free h */
+    if (h->fp) {
+	snapRelease(h);
+        fclose(h->fp);
+    }
+    batchFree(h);
+#ifdef BTR_HAVE_MMAP
+    if (h->map) munmap(h->map, h->mapSize);
+#endif
+
+    if (h->malloc2) free(h->malloc2);
+    if (h->malloc1) free(h->malloc1);
+    if (h->encBuf) free(h->encBuf);
+    if (h->bufHash) free(h->bufHash);
+    free(h);
+}
+
 bError bOpen(bDescription info,
 	     bHandle **handle) 
 {
     bError rc;                	/* return code */
     int bufCt;                  /* number of tmp buffers */
+    unsigned int hashSize;      /* number of hash table slots */
     bBuffer *buf;               /* buffer */
     int maxCt;                  /* maximum number of keys in a node */
     bBuffer *root;
     int i;
     bNode *p;
     bHandle *h;
+    bool create = false;        /* true if a new file was created */
+    bool snapshot = false;      /* true for the snapshot format */
+    bIdxAddr size;              /* file size */
 
     if ((info.sectorSize < sizeof(bNode)) 
+	|| (info.sectorSize < sizeof(bFileHeader))
 	|| (info.sectorSize % 4)
 	|| (info.sectorSize > MAX_SECTOR_SIZE))
         return bErrSectorSize;
@@ -793,41 +2830,184 @@ bError bOpen(bDescription info,
     /* ensure that there are at least 3 children/parent for gather/scatter */
     maxCt = info.sectorSize - (sizeof(bNode) - sizeof(bKey));
     maxCt /= sizeof(bIdxAddr) + info.keySize + sizeof(bRecAddr);
-    if (maxCt < 6) return bErrSectorSize;
+    if (maxCt > MAX_CT)
+	maxCt = MAX_CT;
+    /* existing files are checked against their header further below */
+    if (maxCt < 6 && info.avgKeySize <= 0 && info.filemode == 2)
+	return bErrSectorSize;
+
+    /* copy parms to bHandle */
+    if ((h = calloc(sizeof(bHandle),1)) == NULL) return error(bErrMemory);
+    h->keySize = info.keySize;
+    h->dupKeys = info.dupKeys;
+    h->sectorSize = info.sectorSize;
+    h->comp = info.comp;
+    h->formatVersion = 1;
+    h->filePos = NOPOS;
+    h->readAhead = info.readAhead;
+
+    /* childLT, key, rec */
+    h->ks = sizeof(bIdxAddr) + h->keySize + sizeof(bRecAddr);
+
+    /* Open the file */
+    switch (info.filemode) {
+
+    case 1: /* Open in read-only mode */
+	if ((h->fp = fopen(info.iName, "rb")) == NULL) {
+	    free(h);
+	    return bErrFileNotOpen;
+	}
+	h->readOnly = true;
+	break;
+
+    case 0: /* Open in update mode, revert to creating a new file */
+    case 3: /* Open an existing file in update mode, fail if non-existing */
+	if ((h->fp = fopen(info.iName, "r+b")) != NULL)
+	    break;
+	else if (info.filemode == 3) {
+	    free(h);
+	    return bErrFileNotOpen;
+	}
+	/* On error and filemode 0: fall through */
 
-    /* copy parms to bHandle */
-    if ((h = calloc(sizeof(bHandle),1)) == NULL) return error(bErrMemory);
-    h->keySize = info.keySize;
-    h->dupKeys = info.dupKeys;
-    h->sectorSize = info.sectorSize;
-    h->comp = info.comp;
+    case 2: /* Create a new file */
+	if ((h->fp = fopen(info.iName, "w+b")) != NULL) {
+	    create = true;
+	    break;
+	}
+	/* On error: fall through */
+	
+    default:
+        /* Something's wrong */
+        free(h);
+        return bErrFileNotOpen;
+    }
 
-    /* childLT, key, rec */
-    h->ks = sizeof(bIdxAddr) + h->keySize + sizeof(bRecAddr);
+    /* Determine the file format */
+    if (create) {
+	if (info.snapshot) {
+	    if (info.avgKeySize > 0) {
+		rc = bErrFormat;
+		goto onError;
+	    }
+	    h->formatVersion = BTR_SNAPSHOT_FORMAT_VERSION;
+	    h->base = 2 * h->sectorSize;
+	    snapshot = true;
+	}
+	else if (info.avgKeySize > 0) {
+	    /* size the nodes for the estimated size of an encoded
+	       entry: prefix and suffix length, key, rec and (for
+	       internal nodes) childGE */
+	    int ct;
+
+	    ct = (info.sectorSize - sizeof(bNodeHeader) - 16) 
+		/ (info.avgKeySize + 8);
+	    if (ct > maxCt)
+		maxCt = ct;
+	    if (maxCt > MAX_CT)
+		maxCt = MAX_CT;
+	    h->formatVersion = BTR_FORMAT_VERSION;
+	    h->compressed = true;
+	    h->base = h->sectorSize;
+	}
+	else {
+	    /* format 2 with plain nodes: the header marks the file as
+	       using 64-bit addresses */
+	    h->formatVersion = BTR_FORMAT_VERSION;
+	    h->base = h->sectorSize;
+	}
+    }
+    else if ((rc = readHeader(h, &info, &maxCt, &snapshot)) != 0)
+	goto onError;
+    else if (h->formatVersion == 1 && h->addr32) {
+	/* size the nodes as done by platforms with 32-bit longs */
+	maxCt = info.sectorSize - (NODE32_SIZE - sizeof(bKey));
+	maxCt /= 4 + info.keySize + 4;
+	if (maxCt > MAX_CT)
+	    maxCt = MAX_CT;
+    }
+    else if (snapshot && h->readOnly) {
+	/* the writer changes the file: reads must not be served from
+	   stale stdio buffers */
+	if ((h->fp = freopen(info.iName, "rb", h->fp)) == NULL) {
+	    rc = bErrFileNotOpen;
+	    goto onError;
+	}
+	setvbuf(h->fp, NULL, _IONBF, 0);
+    }
+    if (snapshot)
+	if ((rc = snapNew(h)) != 0) goto onError;
+    if (maxCt < 6) {
+	rc = bErrSectorSize;
+	goto onError;
+    }
     h->maxCt = maxCt;
 
+    /* Nodes are kept in memory using fixed size key slots and 64-bit
+       addresses */
+    if (h->compressed || h->addr32) {
+	h->nodeSize = (sizeof(bNode) - sizeof(bKey)) + maxCt * h->ks;
+	h->nodeSize += sizeof(bIdxAddr) - 1;
+	h->nodeSize -= h->nodeSize % sizeof(bIdxAddr);
+	if (h->nodeSize < h->sectorSize)
+	    h->nodeSize = h->sectorSize;
+
+	/* worst case encoding of a gathered root, but at least 3
+	   sectors for converting the root */
+	h->encSize = 0;
+	if (h->compressed)
+	    h->encSize = sizeof(bNodeHeader) + 40
+		+ (3 * maxCt + 2) * (h->keySize + 26);
+	if (h->encSize < 3 * (size_t)h->sectorSize)
+	    h->encSize = 3 * h->sectorSize;
+	if ((h->encBuf = malloc(h->encSize)) == NULL) {
+	    rc = error(bErrMemory);
+	    goto onError;
+	}
+    }
+    else
+	h->nodeSize = h->sectorSize;
+
     /* Allocate buflist.
      * During insert/delete, need simultaneous access to 7 buffers:
      *  - 4 adjacent child bufs
      *  - 1 parent buf
      *  - 1 next sequential link
      *  - 1 lastGE
+     * Any additional buffers serve as page cache.
      */
-    bufCt = 7 /*+ EXTRA_BUFFERS*/;
-    if ((h->malloc1 = calloc(bufCt * sizeof(bBuffer),1)) == NULL) 
-        return error(bErrMemory);
+    bufCt = info.cacheSize;
+    if (bufCt < MIN_BUFFERS)
+	bufCt = MIN_BUFFERS;
+    h->bufCt = bufCt;
+    if ((h->malloc1 = calloc(bufCt * sizeof(bBuffer),1)) == NULL) {
+        rc = error(bErrMemory);
+	goto onError;
+    }
     buf = h->malloc1;
 
+    /* Allocate the hash table; use a power of 2 for the size, so that
+       we can mask the slot index */
+    for (hashSize = 8; hashSize < (unsigned int)bufCt; hashSize <<= 1)
+	;
+    if ((h->bufHash = calloc(hashSize * sizeof(bBuffer *),1)) == NULL) {
+        rc = error(bErrMemory);
+	goto onError;
+    }
+    h->bufHashMask = hashSize - 1;
+
     /*
      * Allocate bufs.
      * We need space for the following:
-     *  - bufCt buffers, of size sectorSize
-     *  - 1 buffer for root, of size 3*sectorSize
-     *  - 1 buffer for gbuf, size 3*sectorsize + 2 extra keys
+     *  - bufCt buffers, of size nodeSize
+     *  - 1 buffer for root, of size 3*nodeSize
+     *  - 1 buffer for gbuf, size 3*nodeSize + 2 extra keys
      *    to allow for LT pointers in last 2 nodes when gathering 3 full nodes
      */
-    if ((h->malloc2 = calloc((bufCt+6) * h->sectorSize + 2 * h->ks,1)) == NULL) 
-        return error(bErrMemory);
+    if ((h->malloc2 = calloc((bufCt+6) * h->nodeSize + 2 * h->ks,1)) == NULL) {
+        rc = error(bErrMemory);
+	goto onError;
+    }
     p = h->malloc2;
 
     /* initialize buflist */
@@ -839,7 +3019,8 @@ bError bOpen(bDescription info,
         buf->modified = false;
         buf->valid = false;
         buf->p = p;
-        p = (bNode *)((char *)p + h->sectorSize);
+        buf->mem = p;
+        p = (bNode *)((char *)p + h->nodeSize);
         buf++;
     }
     h->bufList.next->prev = &h->bufList;
@@ -848,61 +3029,75 @@ bError bOpen(bDescription info,
     /* initialize root */
     root = &h->root;
     root->p = p;
-    p = (bNode *)((char *)p + 3*h->sectorSize);
+    root->mem = p;
+    p = (bNode *)((char *)p + 3*h->nodeSize);
     h->gbuf.p = p;      /* done last to include extra 2 keys */
 
-    /* Open the file */
-    switch (info.filemode) {
-
-    case 1: /* Open in read-only mode */
-	if ((h->fp = fopen(info.iName, "rb")) != NULL) {
-	    /* open an existing database */
-	    if ((rc = readDisk(h, 0, &root)) != 0) return rc;
-	    if (fseek(h->fp, 0, SEEK_END)) return error(bErrIO);
-	    if ((h->nextFreeAdr = ftell(h->fp)) == -1) return error(bErrIO);
+    if (create) {
+	/* initialize root */
+	memset(root->p, 0, 3*h->nodeSize);
+	leaf(root) = 1;
+	root->modified = true;
+	h->nextFreeAdr = 3 * h->sectorSize;
+	if (h->snap) {
+	    /* write an empty version 0 and publish the root as
+	       version 1 */
+	    if ((rc = writeSnapHeader(h, 0)) != 0) goto onError;
+	    if ((rc = snapCommit(h)) != 0) goto onError;
 	}
 	else {
-	    free(h);
-	    return bErrFileNotOpen;
+	    if (h->formatVersion > 1)
+		if ((rc = writeHeader(h)) != 0) goto onError;
+	    /* flush buffers to create a valid file stub */
+	    flushAll(h);
 	}
-	break;
-
-    case 0: /* Open in update mode, revert to creating a new file */
-    case 3: /* Open an existing file in update mode, fail if non-existing */
-	if ((h->fp = fopen(info.iName, "r+b")) != NULL) {
-	    /* open an existing database */
-	    if ((rc = readDisk(h, 0, &root)) != 0) return rc;
-	    if (fseek(h->fp, 0, SEEK_END)) return error(bErrIO);
-	    if ((h->nextFreeAdr = ftell(h->fp)) == -1) return error(bErrIO);
-	    break;
+    }
+    else {
+	/* open an existing database */
+	if ((rc = fileSize(h, &size)) != 0) goto onError;
+	if (h->snap) {
+	    bSnapHeader sh;
+
+	    if ((rc = snapAcquire(h, &sh)) != 0) goto onError;
+	    snapSetLocked(h->snap, h->readOnly ? sh.version : 0);
+	    if ((rc = snapLoad(h, &sh)) != 0) goto onError;
+	    h->version = sh.version;
+	    h->nextFreeAdr = sh.nextFreeAdr;
+	    if (!h->readOnly)
+		if ((rc = snapScan(h, (bIdxAddr)size)) != 0) goto onError;
 	}
-	else if (info.filemode == 3) {
-	    free(h);
-	    return bErrFileNotOpen;
+	else {
+	    /* overflow extents may end in a partial sector */
+	    h->nextFreeAdr = size - h->base + h->sectorSize - 1;
+	    h->nextFreeAdr -= h->nextFreeAdr % h->sectorSize;
 	}
-	/* On error and filemode 0: fall through */
-
-    case 2: /* Create a new file */
-	if ((h->fp = fopen(info.iName, "w+b")) != NULL) {
-	    /* initialize root */
-	    memset(root->p, 0, 3*h->sectorSize);
-	    leaf(root) = 1;
-	    root->modified = true;
-	    h->nextFreeAdr = 3 * h->sectorSize;
-	    /* flush buffers to create a valid file stub */
-	    flushAll(h);
-	    break;
+#ifdef BTR_HAVE_MMAP
+	/* Nodes are accessed in place, so they must be properly
+	   aligned in the mapping */
+	if (h->readOnly
+	    && info.useMmap
+	    && size > 0
+	    && size <= (bIdxAddr)(size_t)-1
+	    && (h->sectorSize % sizeof(bIdxAddr)) == 0) {
+	    void *map;
+	    map = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED,
+		       fileno(h->fp), 0);
+	    /* fall back to stdio in case mmap() fails */
+	    if (map != MAP_FAILED) {
+		h->map = (char *)map;
+		h->mapSize = (size_t)size;
+	    }
 	}
-	/* On error: fall through */
-	
-    default:
-        /* Something's wrong */
-        free(h);
-        return bErrFileNotOpen;
+#endif
+	if ((rc = readDisk(h, 0, &root)) != 0) goto onError;
     }
 
     *handle = h;
     return bErrOk;
+
+ onError:
+    freeHandle(h);
+    return rc;
 }
 
 bError bFlush(bHandle *h)
@@ -911,25 +3106,179 @@ bError bFlush(bHandle *h)
 
     /* flush idx */
     if (h->fp) {
-        flushAll(h);
+	if (h->snap && !h->readOnly)
+	    return snapCommit(h);
+        return flushAll(h);
+    }
+    return bErrOk;
+}
+
+bError bRefresh(bHandle *h,
+		bool *changed)
+{
+    bSnapshot *s = h->snap;
+    bSnapHeader sh;
+    bBuffer *root;
+    bError rc;
+
+    *changed = false;
+    checkMap(h);
+    if (s == NULL || !h->readOnly)
+	return bErrOk;
+    if ((rc = snapAcquire(h, &sh)) != 0) return rc;
+    if (sh.version == s->locked)
+	return bErrOk;
+    if ((rc = snapLoad(h, &sh)) != 0) {
+#ifdef BTR_HAVE_LOCKS
+	lockVersion(h, sh.version, F_UNLCK);
+#endif
+	return rc;
+    }
+#ifdef BTR_HAVE_LOCKS
+    lockVersion(h, s->locked, F_UNLCK);
+#endif
+    snapSetLocked(s, sh.version);
+    h->version = sh.version;
+    h->nextFreeAdr = sh.nextFreeAdr;
+    h->raStart = h->raEnd = 0;
+    *changed = true;
+    return readDisk(h, 0, &root);
+}
+
+bError bClear(bHandle *h)
+{
+    bSnapshot *s = h->snap;
+    bBuffer *root = &h->root;
+    bBuffer *buf;
+    bError rc;
+    size_t i;
+    int l;
+
+    if (h->readOnly)
+	return bErrReadOnly;
+    if (s == NULL)
+	return bErrFormat;
+    bBulkLoadAbort(h);
+
+    /* drop all nodes and map pages */
+    for (l = 0; l < MAP_LEVELS; l++) {
+	bMapLevel *m = &s->level[l];
+
+	for (i = 0; i < m->n; i++)
+	    if ((rc = snapDrop(h, m->pos[i], h->version + 1)) != 0)
+		return rc;
+	if (m->alloc)
+	    memset(m->pos, 0, m->alloc * sizeof(bIdxAddr));
+	if (m->dirtyAlloc)
+	    memset(m->dirty, 0, m->dirtyAlloc);
+	m->n = 0;
+    }
+    s->freshCt = 0;
+
+    /* start over with an empty root */
+    for (buf = h->bufList.next; buf != &h->bufList; buf = buf->next) {
+	buf->valid = false;
+	buf->modified = false;
     }
+    memset(root->p, 0, 3 * h->nodeSize);
+    leaf(root) = 1;
+    root->modified = true;
+    h->nextFreeAdr = 3 * h->sectorSize;
+    s->changed = true;
     return bErrOk;
 }
 
 bError bClose(bHandle *h) 
 {
+    bError rc = bErrOk;
+
     if (h == NULL) return bErrOk;
 
+    /* cancel a pending bulk load */
+    bBulkLoadAbort(h);
+
     /* flush idx */
     if (h->fp) {
-        flushAll(h);
-        fclose(h->fp);
+	if (h->snap && !h->readOnly)
+	    rc = snapCommit(h);
+	else
+	    rc = flushAll(h);
     }
+    freeHandle(h);
+    return rc;
+}
 
-    if (h->malloc2) free(h->malloc2);
-    if (h->malloc1) free(h->malloc1);
-    free(h);
-    return bErrOk;
+static
+bIdxAddr findChild(bHandle *h,
+		   bBuffer *buf,
+		   void *key,
+		   bKey **bound)
+{
+    /*
+     * input:
+     *   buf                    internal node
+     *   key                    key to find
+     * output:
+     *   bound                  separator limiting the child's key
+     *                          range from above; NULL for the last
+     *                          child of buf
+     * returns:
+     *   address of the child which has to be searched for key
+     *
+     * With duplicate keys, the first matching key may be stored left
+     * of an equal separator, so the search continues in the LT child
+     * in that case.
+     */
+    bKey *mkey;
+    int cc;
+
+    cc = search(h, buf, key, 0, &mkey, MODE_FIRST);
+    if (cc == CC_LT || (cc == CC_EQ && h->dupKeys)) {
+	*bound = mkey;
+	return childLT(mkey);
+    }
+    *bound = (mkey == lkey(buf)) ? NULL : mkey + ks(1);
+    return childGE(mkey);
+}
+
+static
+bError searchLeaf(bHandle *h,
+		  bBuffer **pbuf,
+		  void *key,
+		  bKey **mkey)
+{
+    /*
+     * input:
+     *   pbuf                   leaf found by descending with findChild()
+     *   key                    key to find
+     * output:
+     *   pbuf                   leaf holding the key
+     *   mkey                   first matching key
+     * returns:
+     *   bErrOk                 key found
+     *   bErrKeyNotFound        key not found
+     */
+    bBuffer *buf = *pbuf;
+    bError rc;
+    int cc;
+
+    cc = search(h, buf, key, 0, mkey, MODE_FIRST);
+    if (cc == CC_EQ)
+	return bErrOk;
+
+    /* With duplicate keys, the descent may end in the leaf left of
+       the one holding the first matching key */
+    if (h->dupKeys && cc == CC_GT && *mkey == lkey(buf) && next(buf)) {
+	if ((rc = readDisk(h, next(buf), &buf)) != 0) 
+	    return rc;
+	if (ct(buf) && h->comp(h->keySize, key, key(fkey(buf))) == 0) {
+	    *pbuf = buf;
+	    *mkey = fkey(buf);
+	    return bErrOk;
+	}
+    }
+    DPRINTF("not found; cc=%i\n", cc);
+    return bErrKeyNotFound;
 }
 
 bError bFindKey(bHandle *h, 
@@ -938,37 +3287,115 @@ bError bFindKey(bHandle *h,
 		bRecAddr *rec) 
 {
     bKey *mkey = 0;            	/* matched key */
+    bKey *bound;		/* upper bound of child */
     bBuffer *buf;               /* buffer */
     bError rc;                	/* return code */
 
+    checkMap(h);
     buf = &h->root;
 
     /* find key, and return address */
-    while (1) {
-        if (leaf(buf)) {
+    while (!leaf(buf)) {
+	if ((rc = readDisk(h, findChild(h, buf, key, &bound), &buf)) != 0) 
+	    return rc;
+    }
+    if ((rc = searchLeaf(h, &buf, key, &mkey)) != 0)
+	return rc;
+    if (rec) 
+	*rec = rec(mkey);
+    c->buffer = buf; 
+    c->key = mkey;
+    return bErrOk;
+}
+
+/* Maximum tree height supported by bFindKeys() */
+#define MAX_LEVELS 32
+
+bError bFindKeys(bHandle *h,
+		 int n,
+		 void **keys,
+		 bRecAddr *recs,
+		 char *found)
+{
+    bIdxAddr adr[MAX_LEVELS];	/* node address per level of the path */
+    bool bounded[MAX_LEVELS];	/* true if the node's range is bounded */
+    char *bounds;		/* upper bounds of the node ranges */
+    int depth = 0;		/* number of levels in the path */
+    int level;
+    int i;
+    bKey *mkey;
+    bKey *bound;
+    bBuffer *buf;
+    bError rc = bErrOk;
+
+    checkMap(h);
+    if ((bounds = malloc(MAX_LEVELS * h->keySize)) == NULL) 
+	return error(bErrMemory);
+
+    for (i = 0; i < n; i++) {
+	void *key = keys[i];
+
+	/* Keys are sorted, so only the upper bounds have to be checked
+	   to find the deepest node on the current path which covers
+	   the key */
+	for (level = depth - 1; level > 0; level--) {
 	    int cc;
-	    
-            if ((cc=search(h, buf, key, 0, &mkey, MODE_FIRST)) == CC_EQ) {
-                if (rec) 
-		    *rec = rec(mkey);
-                c->buffer = buf; 
-		c->key = mkey;
-                return bErrOk;
-            } else {
-		DPRINTF("not found; cc=%i\n", cc);
-		
-                return bErrKeyNotFound;
-            }
-        } else {
-            if (search(h, buf, key, 0, &mkey, MODE_FIRST) == CC_LT) {
-                if ((rc = readDisk(h, childLT(mkey), &buf)) != 0) 
-		    return rc;
-            } else {
-                if ((rc = readDisk(h, childGE(mkey), &buf)) != 0) 
-		    return rc;
-            }
-        }
+
+	    if (!bounded[level])
+		break;
+	    cc = h->comp(h->keySize, key, bounds + level * h->keySize);
+	    if (cc < 0 || (cc == 0 && h->dupKeys))
+		break;
+	}
+	if (level <= 0) {
+	    level = 0;
+	    buf = &h->root;
+	    adr[0] = 0;
+	    bounded[0] = false;
+	}
+	else if ((rc = readDisk(h, adr[level], &buf)) != 0)
+	    goto onError;
+
+	/* Descend from there and remember the path */
+	while (!leaf(buf)) {
+	    if (level + 1 >= MAX_LEVELS) {
+		rc = error(bErrFormat);
+		goto onError;
+	    }
+	    adr[level + 1] = findChild(h, buf, key, &bound);
+	    if (bound) {
+		memcpy(bounds + (level + 1) * h->keySize, key(bound), 
+		       h->keySize);
+		bounded[level + 1] = true;
+	    }
+	    else {
+		if (bounded[level])
+		    memcpy(bounds + (level + 1) * h->keySize, 
+			   bounds + level * h->keySize, h->keySize);
+		bounded[level + 1] = bounded[level];
+	    }
+	    level++;
+	    if ((rc = readDisk(h, adr[level], &buf)) != 0)
+		goto onError;
+	}
+	depth = level + 1;
+
+	rc = searchLeaf(h, &buf, key, &mkey);
+	if (rc == bErrOk) {
+	    recs[i] = rec(mkey);
+	    found[i] = 1;
+	}
+	else if (rc == bErrKeyNotFound) {
+	    found[i] = 0;
+	    rc = bErrOk;
+	}
+	else
+	    goto onError;
     }
+
+ onError:
+    free(bounds);
+    return rc;
 }
 
 bError bInsertKey(bHandle *h, 
@@ -988,6 +3415,11 @@ bError bInsertKey(bHandle *h,
     unsigned int lastGEkey = 0; /* last childGE key traversed */
     int height;                 /* height of tree */
 
+    if (h->readOnly)
+	return bErrReadOnly;
+    if (h->addr32 && rec > ADDR32_MAX)
+	return bErrAddrRange;
+
     root = &h->root;
     lastGEvalid = false;
     lastLTvalid = false;
@@ -997,7 +3429,7 @@ bError bInsertKey(bHandle *h,
         /* gather root and scatter to 4 bufs */
         /* this increases b-tree height by 1 */
         if ((rc = gatherRoot(h)) != 0) return rc;
-        if ((rc = scatter(h, root, fkey(root), 0, tmp)) != 0) return rc;
+        if ((rc = scatter(h, root, fkey(root), 0, tmp, false)) != 0) return rc;
     }
     buf = root;
     height = 0;
@@ -1070,7 +3502,7 @@ bError bInsertKey(bHandle *h,
 
                 /* gather 3 bufs and scatter */
                 if ((rc = gather(h, buf, &mkey, tmp)) != 0) return rc;
-                if ((rc = scatter(h, buf, mkey, 3, tmp)) != 0) return rc;
+                if ((rc = scatter(h, buf, mkey, 3, tmp, false)) != 0) return rc;
 
                 /* read child */
                 if ((cc = search(h, buf, key, rec, &mkey, MODE_MATCH)) == CC_LT) {
@@ -1113,6 +3545,10 @@ bError bUpdateKey(bHandle *h,
 
     if (h->dupKeys)
 	return bErrNotWithDupKeys;
+    if (h->readOnly)
+	return bErrReadOnly;
+    if (h->addr32 && rec > ADDR32_MAX)
+	return bErrAddrRange;
     
     root = &h->root;
 
@@ -1173,6 +3609,9 @@ bError bDeleteKey(bHandle *h,
     bBuffer *root;
     bBuffer *gbuf;
 
+    if (h->readOnly)
+	return bErrReadOnly;
+
     root = &h->root;
     gbuf = &h->gbuf;
     lastGEvalid = false;
@@ -1224,17 +3663,20 @@ bError bDeleteKey(bHandle *h,
                 /* gather 3 bufs and scatter */
                 if ((rc = gather(h, buf, &mkey, tmp)) != 0) return rc;
 
-                /* if last 3 bufs in root, and count is low enough... */
+                /* if last 3 bufs in root, and count is low enough
+                   (for small nodes: too low to fill 3 nodes, since the
+                   root must keep at least 2 keys)... */
                 if (buf == root
                 && ct(root) == 2 
-                && ct(gbuf) < (3*(3*h->maxCt))/4) {
+                && (ct(gbuf) < (3*(3*h->maxCt))/4
+                    || ct(gbuf) < 3*(h->maxCt/2 + 2))) {
                     /* collapse tree by one level */
                     scatterRoot(h);
                     h->nNodesDel += 3;
                     continue;
                 }
 
-                if ((rc = scatter(h, buf, mkey, 3, tmp)) != 0) return rc;
+                if ((rc = scatter(h, buf, mkey, 3, tmp, true)) != 0) return rc;
 
                 /* read child */
                 if ((cc = search(h, buf, key, *rec, &mkey, MODE_MATCH)) == CC_LT) {
@@ -1266,6 +3708,103 @@ bError bDeleteKey(bHandle *h,
     return bErrOk;
 }
 
+static
+void readAhead(bHandle *h,
+	       bIdxAddr adr)
+{
+    /*
+     * Tell the OS that a scan is going to read the leaf at adr and
+     * the nodes following it in the file. Leaves written by the bulk
+     * loader, and many of those created when adding keys in order,
+     * are stored sequentially, so the kernel can fetch them in the
+     * background while the scan processes the current leaf.
+     *
+     * A new hint is only given once the scan has used up half of the
+     * previous read-ahead window.
+     */
+    bIdxAddr start, end;
+
+    /* the sectors of snapshot format files are not kept in order */
+    if (h->readAhead <= 0 || adr == 0 || h->snap)
+	return;
+    end = adr + (bIdxAddr)h->readAhead * h->sectorSize;
+    if (adr >= h->raStart && adr < h->raEnd) {
+	if (h->raEnd - adr > (end - adr) / 2)
+	    return;
+	start = h->raEnd;
+    }
+    else
+	start = adr;
+    h->raStart = adr;
+    h->raEnd = end;
+
+#ifdef BTR_HAVE_MMAP
+    if (h->map) {
+# ifdef MADV_WILLNEED
+	static size_t pageSize = 0;
+	size_t first, last;
+
+	if (pageSize == 0)
+	    pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	first = (size_t)filePos(h, start);
+	last = (size_t)filePos(h, end);
+	if (last > h->mapSize)
+	    last = h->mapSize;
+	first -= first % pageSize;
+	if (first < last)
+	    madvise(h->map + first, last - first, MADV_WILLNEED);
+# endif
+	return;
+    }
+#endif
+#ifdef BTR_HAVE_FADVISE
+    posix_fadvise(fileno(h->fp), (off_t)filePos(h, start), 
+		  (off_t)(end - start), POSIX_FADV_WILLNEED);
+#endif
+}
+
+bError bFindKeyGE(bHandle *h,
+		  bCursor *c,
+		  void *key,
+		  bRecAddr *rec)
+{
+    bKey *mkey = 0;            	/* matched key */
+    bKey *bound;		/* upper bound of child */
+    bBuffer *buf;               /* buffer */
+    bError rc;                	/* return code */
+    int cc;			/* condition code */
+
+    checkMap(h);
+    buf = &h->root;
+    while (!leaf(buf)) {
+	if ((rc = readDisk(h, findChild(h, buf, key, &bound), &buf)) != 0) 
+	    return rc;
+    }
+    if (ct(buf) == 0)
+	return bErrKeyNotFound;
+
+    /* mkey is either the first matching key, the first greater key
+       or the last smaller key in the leaf */
+    cc = search(h, buf, key, 0, &mkey, MODE_FIRST);
+    if (cc > 0) {
+	if (mkey != lkey(buf))
+	    mkey += ks(1);
+	else if (next(buf)) {
+	    if ((rc = readDisk(h, next(buf), &buf)) != 0) 
+		return rc;
+	    mkey = fkey(buf);
+	}
+	else
+	    return bErrKeyNotFound;
+    }
+    readAhead(h, next(buf));
+    if (rec) 
+	*rec = rec(mkey);
+    c->buffer = buf; 
+    c->key = mkey;
+    return bErrOk;
+}
+
 bError bFindFirstKey(bHandle *h, 
 		     bCursor *c,
 		     void *key, 
@@ -1274,11 +3813,13 @@ bError bFindFirstKey(bHandle *h,
     bError rc;                /* return code */
     bBuffer *buf;               /* buffer */
 
+    checkMap(h);
     buf = &h->root;
     while (!leaf(buf)) {
         if ((rc = readDisk(h, childLT(fkey(buf)), &buf)) != 0) return rc;
     }
     if (ct(buf) == 0) return bErrKeyNotFound;
+    readAhead(h, next(buf));
     if (key) memcpy(key, key(fkey(buf)), h->keySize);
     if (rec) *rec = rec(fkey(buf));
     c->buffer = buf; c->key = fkey(buf);
@@ -1293,6 +3834,7 @@ bError bFindLastKey(bHandle *h,
     bError rc;                /* return code */
     bBuffer *buf;               /* buffer */
 
+    checkMap(h);
     buf = &h->root;
     while (!leaf(buf)) {
         if ((rc = readDisk(h, childGE(lkey(buf)), &buf)) != 0) return rc;
@@ -1314,12 +3856,15 @@ bError bFindNextKey(bHandle *h,
     bBuffer *buf;               /* buffer */
 
     if ((buf = c->buffer) == NULL) return bErrKeyNotFound;
+    checkMap(h);
+    if (!buf->valid) return bErrBufferInvalid;
     if (c->key == lkey(buf)) {
         /* current key is last key in leaf node */
         if (next(buf)) {
             /* fetch next set */
             if ((rc = readDisk(h, next(buf), &buf)) != 0) return rc;
             nkey = fkey(buf);
+	    readAhead(h, next(buf));
         } else {
             /* no more sets */
             return bErrKeyNotFound;
@@ -1345,6 +3890,8 @@ bError bFindPrevKey(bHandle *h,
     bBuffer *buf;               /* buffer */
 
     if ((buf = c->buffer) == NULL) return bErrKeyNotFound;
+    checkMap(h);
+    if (!buf->valid) return bErrBufferInvalid;
     fkey = fkey(buf);
     if (c->key == fkey) {
         /* current key is first key in leaf node */
@@ -1371,6 +3918,7 @@ bError bCursorReadData(bHandle *h,
 		       void *key, 
 		       bRecAddr *rec)
 {
+    checkMap(h);
     if (c->buffer == NULL || !c->buffer->valid)
 	return bErrBufferInvalid;
     if (key) memcpy(key, key(c->key), h->keySize);
@@ -1378,17 +3926,395 @@ bError bCursorReadData(bHandle *h,
     return bErrOk;
 }
 
+/* --- Bulk loading ------------------------------------------------------ */
+
+/*
+ *  The bulk loader builds the tree bottom-up: leaves are filled from
+ *  the sorted input and written sequentially. The last three leaves
+ *  are kept in memory, so that the final leaf can be balanced with
+ *  its predecessor and small inputs can be placed into the root.
+ *  For every written node, an entry [key,rec,adr] holding the
+ *  smallest key of the node's subtree is recorded. These entries are
+ *  then used to build the next level, until the entries fit into the
+ *  root. The fill limits are the ones used by insert/delete: nodes
+ *  hold between maxCt/2 and maxCt keys, the root up to 3*maxCt keys.
+ */
+
+typedef struct bBulkLoadTag {
+    unsigned int leafCt;        /* maximum number of keys per leaf */
+    unsigned int nodeCt;        /* number of keys per internal node */
+    size_t leafBytes;           /* estimated encoded size of the last
+				   leaf (compressed format) */
+    size_t leafBudget;          /* number of bytes to fill per leaf
+				   (compressed format) */
+    char *mem;                  /* memory for the pending leaves */
+    bNode *leaf[3];             /* pending leaves, oldest first */
+    bIdxAddr adr[3];            /* addresses of the pending leaves */
+    int nLeaves;                /* number of pending leaves */
+    long nWritten;              /* number of nodes written */
+    char *ent;                  /* [key,rec,adr] entries for the next
+				   level */
+    size_t entCt;               /* number of entries */
+    size_t entAlloc;            /* number of allocated entries */
+    char *lastKey;              /* last key added */
+    bRecAddr lastRec;           /* last record address added */
+    long keyCt;                 /* number of keys added */
+    bIdxAddr startAdr;          /* nextFreeAdr at start of the load */
+} bBulkLoad;
+
+static
+void freeBulkLoad(bHandle *h)
+{
+    bBulkLoad *bl = h->bulk;
+
+    if (bl == NULL)
+	return;
+    if (bl->mem) free(bl->mem);
+    if (bl->ent) free(bl->ent);
+    if (bl->lastKey) free(bl->lastKey);
+    free(bl);
+    h->bulk = NULL;
+}
+
+static
+bError bulkWrite(bHandle *h,
+		 bIdxAddr adr,
+		 bNode *p)
+{
+    /* write a new node */
+    bIdxAddr ovfAdr = 0;
+    unsigned int ovfCt = 0;
+    bError rc;
+
+    if ((rc = writeNode(h, adr, p, &ovfAdr, &ovfCt)) != 0) return rc;
+    h->bulk->nWritten++;
+    h->nDiskWrites++;
+    h->nNodesIns++;
+    return bErrOk;
+}
+
+static
+bError bulkAddEntry(bHandle *h,
+		    bKey *k,
+		    bIdxAddr adr)
+{
+    /* record the entry [key(k),rec(k),adr] for the next level */
+    bBulkLoad *bl = h->bulk;
+    bKey *e;
+
+    if (bl->entCt == bl->entAlloc) {
+	size_t entAlloc = bl->entAlloc ? 2 * bl->entAlloc : 64;
+	char *ent;
+
+	if ((ent = realloc(bl->ent, entAlloc * h->ks)) == NULL)
+	    return error(bErrMemory);
+	bl->ent = ent;
+	bl->entAlloc = entAlloc;
+    }
+    e = bl->ent + ks(bl->entCt);
+    memcpy(key(e), key(k), h->keySize);
+    rec(e) = rec(k);
+    childGE(e) = adr;
+    bl->entCt++;
+    return bErrOk;
+}
+
+static
+bError bulkWriteLeaf(bHandle *h)
+{
+    /* write the oldest pending leaf and remove it from the list */
+    bBulkLoad *bl = h->bulk;
+    bNode *p;
+    bIdxAddr adr;
+    bError rc;
+    int i;
+
+    p = bl->leaf[0];
+    adr = bl->adr[0];
+    if ((rc = bulkWrite(h, adr, p)) != 0) return rc;
+    if ((rc = bulkAddEntry(h, &p->fkey, adr)) != 0) return rc;
+    for (i = 1; i < bl->nLeaves; i++) {
+	bl->leaf[i - 1] = bl->leaf[i];
+	bl->adr[i - 1] = bl->adr[i];
+    }
+    bl->nLeaves--;
+    bl->leaf[bl->nLeaves] = p;
+    return bErrOk;
+}
+
+static
+bError bulkBuildLevel(bHandle *h,
+		      bNode *p)
+{
+    /* build a level of internal nodes on top of the current entries
+       and replace the entries with those for the new nodes */
+    bBulkLoad *bl = h->bulk;
+    size_t n = bl->entCt;
+    size_t minC, maxC;          /* limits for the number of children */
+    size_t m, lo, hi;           /* number of nodes */
+    size_t base, extra;
+    size_t i, j, c;
+    bIdxAddr adr;
+    bKey *e;
+    bError rc;
+
+    minC = h->maxCt / 2 + 1;
+    maxC = h->maxCt + 1;
+    m = (n + bl->nodeCt) / (bl->nodeCt + 1);
+    lo = (n + maxC - 1) / maxC;
+    hi = n / minC;
+    if (m < lo) m = lo;
+    if (m > hi) m = hi;
+    base = n / m;
+    extra = n % m;
+
+    for (i = j = 0; i < m; i++, j += c) {
+	c = base + (i < extra);
+	e = bl->ent + ks(j);
+	memset(p, 0, h->nodeSize);
+	p->leaf = 0;
+	p->ct = c - 1;
+	childLT(&p->fkey) = childGE(e);
+	memcpy(&p->fkey, e + ks(1), ks(c - 1));
+	adr = allocAdr(h);
+	if ((rc = bulkWrite(h, adr, p)) != 0) return rc;
+	/* the node's entry is the one of its first child; i <= j */
+	if (i != j)
+	    memcpy(bl->ent + ks(i), e, h->ks);
+	childGE(bl->ent + ks(i)) = adr;
+    }
+    bl->entCt = m;
+    return bErrOk;
+}
+
+bError bBulkLoadBegin(bHandle *h,
+		      int fillPercent)
+{
+    bBulkLoad *bl;
+    bBuffer *root = &h->root;
+    int i;
+
+    if (h->readOnly)
+	return bErrReadOnly;
+    if (!leaf(root) || ct(root))
+	return bErrNotEmpty;
+    freeBulkLoad(h);
+
+    if ((bl = calloc(sizeof(bBulkLoad), 1)) == NULL)
+	return error(bErrMemory);
+    h->bulk = bl;
+    if ((bl->mem = calloc(3, h->nodeSize)) == NULL ||
+	(bl->lastKey = malloc(h->keySize)) == NULL) {
+	freeBulkLoad(h);
+	return error(bErrMemory);
+    }
+    for (i = 0; i < 3; i++)
+	bl->leaf[i] = (bNode *)(bl->mem + i * h->nodeSize);
+
+    /* keep the node fill within the limits used by insert/delete */
+    if (fillPercent > 100) fillPercent = 100;
+    bl->nodeCt = (h->maxCt * fillPercent) / 100;
+    if (bl->nodeCt < h->maxCt / 2)
+	bl->nodeCt = h->maxCt / 2;
+    if (h->compressed) {
+	/* leaves are filled by size, since keys vary in length */
+	bl->leafCt = h->maxCt;
+	bl->leafBudget = ((size_t)h->sectorSize * fillPercent) / 100;
+    }
+    else
+	bl->leafCt = bl->nodeCt;
+
+    bl->startAdr = h->nextFreeAdr;
+    return bErrOk;
+}
+
+bError bBulkLoadAdd(bHandle *h,
+		    void *key,
+		    bRecAddr rec)
+{
+    bBulkLoad *bl = h->bulk;
+    bNode *p;
+    bKey *k;
+    bError rc;
+    size_t entryBytes = 0;
+
+    if (h->addr32 && rec > ADDR32_MAX)
+	return bErrAddrRange;
+
+    /* check the input order */
+    if (bl->keyCt) {
+	int cc = h->comp(h->keySize, key, bl->lastKey);
+
+	if (cc < 0)
+	    return bErrKeyOrder;
+	if (cc == 0) {
+	    if (!h->dupKeys)
+		return bErrDupKeys;
+	    if (rec <= bl->lastRec)
+		return bErrKeyOrder;
+	}
+    }
+
+    /* estimate the size of the encoded entry */
+    if (h->compressed) {
+	int len, pl;
+
+	p = bl->nLeaves ? bl->leaf[bl->nLeaves - 1] : NULL;
+	len = keyLen(h, key);
+	pl = (p && p->ct) ? prefixLen(bl->lastKey, (bKey *)key, len) : 0;
+	entryBytes = varintSize(pl) + varintSize(len - pl) + (len - pl)
+	    + varintSize(rec);
+    }
+
+    /* start a new leaf, if needed */
+    if (bl->nLeaves == 0 
+	|| bl->leaf[bl->nLeaves - 1]->ct == bl->leafCt
+	|| (h->compressed
+	    && bl->leaf[bl->nLeaves - 1]->ct >= h->maxCt / 2
+	    && bl->leafBytes + entryBytes > bl->leafBudget)) {
+	bIdxAddr adr;
+
+	if (bl->nLeaves == 3)
+	    if ((rc = bulkWriteLeaf(h)) != 0) return rc;
+	adr = allocAdr(h);
+	p = bl->leaf[bl->nLeaves];
+	memset(p, 0, h->nodeSize);
+	p->leaf = 1;
+	if (bl->nLeaves) {
+	    p->prev = bl->adr[bl->nLeaves - 1];
+	    bl->leaf[bl->nLeaves - 1]->next = adr;
+	}
+	bl->adr[bl->nLeaves] = adr;
+	bl->nLeaves++;
+	if (h->compressed) {
+	    /* the first key has no prefix to share */
+	    int len = keyLen(h, key);
+
+	    bl->leafBytes = nodeHdrSize(h) + 2 + varintSize(p->prev) + 
+		varintSize(adr + h->sectorSize) + 1;
+	    entryBytes = 1 + varintSize(len) + len + varintSize(rec);
+	}
+    }
+    bl->leafBytes += entryBytes;
+
+    /* append the key */
+    p = bl->leaf[bl->nLeaves - 1];
+    k = &p->fkey + ks(p->ct);
+    memcpy(key(k), key, h->keySize);
+    rec(k) = rec;
+    childGE(k) = 0;
+    p->ct++;
+
+    memcpy(bl->lastKey, key, h->keySize);
+    bl->lastRec = rec;
+    bl->keyCt++;
+    return bErrOk;
+}
+
+bError bBulkLoadEnd(bHandle *h)
+{
+    bBulkLoad *bl = h->bulk;
+    bBuffer *root = &h->root;
+    bNode *a, *b;
+    bError rc;
+    int i, height;
+
+    memset(root->p, 0, 3 * h->nodeSize);
+    leaf(root) = 1;
+
+    if (bl->nWritten == 0) {
+	/* all keys fit into the root (at most 3 leaves) */
+	for (i = 0; i < bl->nLeaves; i++) {
+	    memcpy(fkey(root) + ks(ct(root)), &bl->leaf[i]->fkey,
+		   ks(bl->leaf[i]->ct));
+	    ct(root) += bl->leaf[i]->ct;
+	}
+	h->nextFreeAdr = bl->startAdr;
+	height = 0;
+    }
+    else {
+	/* balance the last leaf with its predecessor; there are always
+	   3 pending leaves at this point */
+	a = bl->leaf[bl->nLeaves - 2];
+	b = bl->leaf[bl->nLeaves - 1];
+	if (b->ct < h->maxCt / 2) {
+	    unsigned int n = a->ct + b->ct;
+
+	    if (n <= h->maxCt) {
+		/* merge; b was the last node allocated */
+		memcpy(&a->fkey + ks(a->ct), &b->fkey, ks(b->ct));
+		a->ct = n;
+		a->next = 0;
+		bl->nLeaves--;
+		h->nextFreeAdr -= h->sectorSize;
+	    }
+	    else {
+		/* move keys from a to b */
+		unsigned int move = a->ct - n / 2;
+
+		memmove(&b->fkey + ks(move), &b->fkey, ks(b->ct));
+		memcpy(&b->fkey, &a->fkey + ks(a->ct - move), ks(move));
+		a->ct -= move;
+		b->ct += move;
+	    }
+	}
+	while (bl->nLeaves)
+	    if ((rc = bulkWriteLeaf(h)) != 0) goto onError;
+
+	/* build the internal levels until the entries fit into the
+	   root */
+	height = 1;
+	while (bl->entCt > 3 * h->maxCt) {
+	    if ((rc = bulkBuildLevel(h, bl->leaf[0])) != 0) goto onError;
+	    height++;
+	}
+
+	/* the root has at least 3 children */
+	leaf(root) = 0;
+	ct(root) = bl->entCt - 1;
+	childLT(fkey(root)) = childGE(bl->ent);
+	memcpy(fkey(root), bl->ent + ks(1), ks(bl->entCt - 1));
+    }
+
+    if (height > h->maxHeight) h->maxHeight = height;
+    h->nKeysIns += bl->keyCt;
+    freeBulkLoad(h);
+    if ((rc = writeDisk(h, root)) != 0) return rc;
+    return flushAll(h);
+
+ onError:
+    /* leave an empty tree behind */
+    memset(root->p, 0, 3 * h->nodeSize);
+    leaf(root) = 1;
+    bBulkLoadAbort(h);
+    return rc;
+}
+
+void bBulkLoadAbort(bHandle *h)
+{
+    if (h->bulk == NULL)
+	return;
+    if (h->snap)
+	snapUnmap(h, h->bulk->startAdr);
+    h->nextFreeAdr = h->bulk->startAdr;
+    freeBulkLoad(h);
+}
+
 int bValidateTree(bHandle *h) 
 {
     char *visited;
+    int result;
 
-    visited = (char*)calloc(10240,1);
+    /* one flag per sector in use */
+    visited = (char*)calloc(h->nextFreeAdr / h->sectorSize + 1, 1);
     if (!visited)
 	return -1;
     flushAll(h);
     DPRINTF("Validating BTree with handle %0lx, root buffer at %0lx",
 	    (long)h,(long)&h->root);
-    return _validateTree(h,&h->root,visited,1);
+    result = _validateTree(h,&h->root,visited,1);
+    free(visited);
+    return result;
 }
 
 #if 0
@@ -33,6 +33,46 @@
    * added filemode support to bOpen()
    * added a fflush() to flushAll() to make sure the data is really
      written to disk and not just to the cache
+   * made the number of node buffers configurable (info.cacheSize) and
+     turned the buffer list into a hashed LRU page cache with hit, miss
+     and eviction statistics
+   * added support for memory mapping read-only index files
+     (info.useMmap); nodes are then accessed in place
+   * added bErrReadOnly: modifications of read-only indexes are now
+     rejected
+   * added bBulkLoadBegin(), bBulkLoadAdd(), bBulkLoadEnd() and
+     bBulkLoadAbort() which build a B+tree bottom-up from sorted input
+   * added a compressed node format (info.avgKeySize): keys are stored
+     prefix compressed and without trailing zero bytes on disk, so
+     more keys fit into a node. Files using it start with a header
+     giving the format version; files without header (format 1) can
+     still be read and written.
+   * raised MAX_SECTOR_SIZE to 64k and made it configurable at compile
+     time; fixed bValidateTree() to work for all key types and file
+     sizes
+   * added bFindKeys() for batched lookups; fixed bFindKey() to find
+     duplicate keys stored left of an equal separator key and search()
+     to return the first duplicate for compare functions returning
+     values other than CC_LT/CC_EQ/CC_GT
+   * added bFindKeyGE() and read-ahead hints (info.readAhead) for
+     leaf scans using posix_fadvise() or madvise()
+   * added the snapshot format (info.snapshot): nodes are written
+     copy-on-write through a page map and bFlush() publishes a new
+     version of the tree, so that readers (filemode 1) keep a
+     consistent snapshot while a writer updates the file; added
+     bRefresh() and bClear()
+   * made the library usable from several threads: the functions
+     may be called concurrently for different handles (calls using the
+     same handle must be serialized by the caller)
+   * made record and node addresses 64-bit on all platforms (bAddr64)
+     and switched to 64-bit file offsets, so that index files can grow
+     beyond 2GB/4GB on platforms with 32-bit longs; files with header
+     are marked with a flag giving the address size; files written
+     with 32-bit addresses are converted when reading and writing
+     nodes
+   * switched node I/O to pread()/pwrite() on POSIX systems; flushes
+     now write the modified nodes sorted by address and combine runs
+     of adjacent nodes into one pwritev() call
 
 */
 
@@ -51,11 +91,31 @@
  * implementation dependent *
  ****************************/
 
-/* Maximal allowed sectorSize value */
-#define MAX_SECTOR_SIZE	4096
-
-typedef unsigned long bRecAddr; /* record address for external record */
-typedef unsigned long bIdxAddr; /* record address for btree node */
+/* Maximal allowed sectorSize value; can be overridden at compile
+   time, e.g. using -DMAX_SECTOR_SIZE=262144. Large sectors result in
+   flat trees and fewer I/O calls per lookup and range scan, which pays
+   off on SSDs and memory backed file systems. */
+#ifndef MAX_SECTOR_SIZE
+# define MAX_SECTOR_SIZE	65536
+#endif
+
+/* Addresses are stored as 64-bit integers on all platforms */
+#ifdef _MSC_VER
+typedef unsigned __int64 bAddr64;
+#else
+typedef unsigned long long bAddr64;
+#endif
+
+typedef bAddr64 bRecAddr;       /* record address for external record */
+typedef bAddr64 bIdxAddr;       /* record address for btree node */
+
+/* Files without BTR_FLAG_ADDR64 store addresses as unsigned longs
+   of the platform which wrote them. This is assumed to be the
+   platform's own unsigned long; BTR_ULONG_SIZE can be set to 4 or 8
+   at compile time to use files written on another platform. */
+#ifndef BTR_ULONG_SIZE
+# define BTR_ULONG_SIZE sizeof(unsigned long)
+#endif
 
 #define CC_EQ           0
 #define CC_GT           1
@@ -73,6 +133,11 @@ typedef int (*bCompFunc)(size_t keysize, const void *key1, const void *key2);
    sequences from the index or use many cursors. */
 #define EXTRA_BUFFERS 10
 
+/* Minimum number of node buffers needed by the implementation; see
+   bOpen() for details. The page cache never uses less buffers than
+   this. */
+#define MIN_BUFFERS 7
+
 /******************************
  * implementation independent *
  ******************************/
@@ -88,7 +153,12 @@ typedef enum {
     bErrNotWithDupKeys,
     bErrBufferInvalid,
     bErrIO,
-    bErrMemory 
+    bErrMemory,
+    bErrReadOnly,
+    bErrNotEmpty,
+    bErrKeyOrder,
+    bErrFormat,
+    bErrAddrRange
 } bError;
 
 typedef struct {                /* info for bOpen() */
@@ -106,6 +176,26 @@ typedef struct {                /* info for bOpen() */
     bool dupKeys;               /* true if duplicate keys allowed */
     int sectorSize;             /* size of sector on disk */
     bCompFunc comp;             /* pointer to compare function */
+    int cacheSize;              /* number of node buffers to use for
+				   the page cache; values below
+				   MIN_BUFFERS are raised to
+				   MIN_BUFFERS */
+    bool useMmap;               /* true to memory map the file in
+				   read-only mode (filemode 1); this
+				   is ignored for the other modes and
+				   on platforms without mmap() */
+    int avgKeySize;             /* if > 0, new files are created using
+				   the compressed node format; the
+				   value gives the expected average
+				   key length on disk and is used to
+				   size the nodes */
+    int readAhead;              /* number of sectors to read ahead
+				   when a scan moves on to the next
+				   leaf; 0 disables read-ahead */
+    bool snapshot;              /* if true, new files are created
+				   using the snapshot format; this
+				   cannot be combined with
+				   avgKeySize */
 } bDescription;
 
 typedef char bKey;           	/* keys entries are treated as char arrays */
@@ -125,8 +215,15 @@ typedef struct bBufferTag {     /* location of node */
     struct bBufferTag *prev;    /* previous */
     bIdxAddr adr;               /* on disk */
     bNode *p;                	/* in memory */
+    bNode *mem;                 /* buffer memory; p may point into
+				   the file mapping instead */
     bool valid;                 /* true if buffer contents valid */
     bool modified;              /* true if buffer modified */
+    struct bBufferTag *hnext;   /* next buffer in hash chain */
+    bIdxAddr ovfAdr;            /* overflow extent of the node on disk
+				   (compressed format only) */
+    unsigned int ovfCt;         /* size of the overflow extent in
+				   sectors */
 } bBuffer;
 
 typedef struct bHandle {
@@ -136,13 +233,39 @@ typedef struct bHandle {
     int sectorSize;             /* block size for idx records */
     bCompFunc comp;             /* pointer to compare routine */
     bBuffer root;               /* root of b-tree, room for 3 sets */
-    bBuffer bufList;            /* head of buf list */
+    bBuffer bufList;            /* head of buf list (LRU order) */
+    int bufCt;                  /* number of buffers in buf list */
+    bBuffer **bufHash;          /* hash table of buffers, by adr */
+    unsigned int bufHashMask;   /* size of hash table - 1 */
     void *malloc1;              /* malloc'd resources */
     void *malloc2;              /* malloc'd resources */
     bBuffer gbuf;               /* gather buffer, room for 3 sets */
     unsigned int maxCt;         /* minimum # keys in node */
     int ks;                     /* sizeof key entry */
     bIdxAddr nextFreeAdr;       /* next free b-tree record address */
+    bool readOnly;              /* true if opened in read-only mode */
+    char *map;                  /* memory mapped file or NULL */
+    size_t mapSize;             /* size of the mapping in bytes */
+    struct bBulkLoadTag *bulk;  /* bulk load state or NULL */
+    int formatVersion;          /* file format version */
+    bool compressed;            /* true if nodes are compressed on disk */
+    bool addr32;                /* true if addresses are stored as
+				   32-bit integers */
+    int nodeSize;               /* size of a node in memory */
+    bIdxAddr base;              /* file position of address 0 */
+    bIdxAddr filePos;           /* current stdio file position after
+				   a write, (bIdxAddr)-1 if unknown */
+    char *encBuf;               /* buffer for encoding nodes */
+    size_t encSize;             /* size of encBuf */
+    int readAhead;              /* read-ahead window in sectors */
+    bIdxAddr raStart;           /* start of the current read-ahead
+				   window */
+    bIdxAddr raEnd;             /* end of the current read-ahead
+				   window */
+    struct bSnapshotTag *snap;  /* snapshot format state or NULL */
+    struct bBatchTag *batch;    /* write-back batch state or NULL */
+    unsigned long version;      /* version of the tree in use
+				   (snapshot format only) */
 
     /* statistics */
     int maxHeight;          	/* maximum height attained */
@@ -153,6 +276,12 @@ typedef struct bHandle {
     int nKeysUpd;           	/* number of key updates */
     int nDiskReads;         	/* number of disk reads */
     int nDiskWrites;        	/* number of disk writes */
+    unsigned long nCacheHits;	/* number of node reads served by
+				   the page cache */
+    unsigned long nCacheMisses;	/* number of node reads which had to
+				   go to disk */
+    unsigned long nCacheEvictions; /* number of valid buffers which
+				   were reused for other nodes */
 
 } bHandle;
 
@@ -182,6 +311,41 @@ bError bOpen(bDescription info, bHandle **handle);
      *   bErrMemory             insufficient memory
      *   bErrSectorSize         sector size too small or not 0 mod 4
      *   bErrFileNotOpen        unable to open index file
+     *   bErrFormat             unsupported file format or the file
+     *                          doesn't match info
+     * notes:
+     *   info.cacheSize buffers are allocated for the node cache (at
+     *   least MIN_BUFFERS). Nodes are kept in LRU order and looked up
+     *   through a hash table, so large caches don't slow down
+     *   lookups.
+     *
+     *   If info.useMmap is set and the file is opened read-only, the
+     *   file is mapped into memory and nodes are accessed in place,
+     *   so that processes reading the same index share the OS page
+     *   cache. Nodes beyond the end of the mapping (the file may
+     *   have grown) are read using stdio.
+     *
+     *   New files are created in the compressed node format, if
+     *   info.avgKeySize is set. Nodes then hold as many keys as
+     *   sectors of info.sectorSize bytes can store on average; nodes
+     *   whose encoding doesn't fit into their sector(s) continue in
+     *   an overflow extent. Existing files are opened in the format
+     *   they were written in; info.avgKeySize is ignored for them.
+     *
+     *   New files are created in the snapshot format, if
+     *   info.snapshot is set. Read-only handles of such files use
+     *   the version of the tree which was published last when they
+     *   were opened or refreshed (bRefresh()). They announce the
+     *   version using a shared fcntl() lock, so that the writer
+     *   doesn't reuse sectors which the version still refers to.
+     *   There must only be one writer at a time.
+     *
+     *   New files are always created with a header marking them as
+     *   using 64-bit addresses. Older files without this mark used
+     *   the size of the platform's unsigned long. Where that is 32
+     *   bits, addresses are converted when reading and writing such
+     *   files, which keeps them readable by older versions; storing
+     *   an address beyond 32 bits fails with bErrAddrRange.
      */
 
 bError bFlush(bHandle *handle);
@@ -190,8 +354,46 @@ bError bFlush(bHandle *handle);
      *   handle                 handle returned by bOpen
      * returns:
      *   bErrOk                 file closed, resources deleted
+     *   bErrIO                 write error (snapshot format only)
      * notes:
-     *   Flushes all buffers to disk
+     *   Flushes all buffers to disk. For files in the snapshot
+     *   format, this publishes a new version of the tree: the
+     *   changed page map entries are written, synced to disk and
+     *   a new header is written and synced. Readers only see
+     *   published versions.
+     */
+
+bError bRefresh(bHandle *handle, bool *changed);
+    /*
+     * input:
+     *   handle                 handle returned by bOpen
+     * output:
+     *   changed                true if a newer version was loaded
+     * returns:
+     *   bErrOk                 operation successful
+     *   bErrIO                 read or lock error
+     *   bErrMemory             insufficient memory
+     * notes:
+     *   Moves a read-only handle of a file in the snapshot format
+     *   on to the most recently published version of the tree.
+     *   Cached nodes which did not change are kept; cursors become
+     *   invalid. For all other handles, this does nothing.
+     */
+
+bError bClear(bHandle *handle);
+    /*
+     * input:
+     *   handle                 handle returned by bOpen
+     * returns:
+     *   bErrOk                 operation successful
+     *   bErrReadOnly           the file was opened read-only
+     *   bErrFormat             the file doesn't use the snapshot
+     *                          format
+     * notes:
+     *   Removes all keys from the tree. The empty tree is published
+     *   by the next bFlush(); readers using older versions are not
+     *   affected. Files in other formats are cleared by creating
+     *   them anew (filemode 2).
      */
 
 bError bClose(bHandle *handle);
@@ -211,6 +413,9 @@ bError bInsertKey(bHandle *handle, void *key, bRecAddr rec);
      * returns:
      *   bErrOk                 operation successful
      *   bErrDupKeys            duplicate keys (and info.dupKeys = false)
+     *   bErrReadOnly           index was opened in read-only mode
+     *   bErrAddrRange          rec or a new node address doesn't fit
+     *                          into the file's 32-bit addresses
      * notes:
      *   If dupKeys is false, then all records inserted must have a
      *   unique key.  If dupkeys is true, then duplicate keys are
@@ -229,6 +434,9 @@ bError bUpdateKey(bHandle *handle, void *key, bRecAddr rec);
      *   bErrOk                 operation successful
      *   bErrNotFound           key not found
      *   bErrNotAllowed         operation not allowed
+     *   bErrReadOnly           index was opened in read-only mode
+     *   bErrAddrRange          rec doesn't fit into the file's 32-bit
+     *                          addresses
      * notes:
      *   This operation is only possible if dupKeys is false due to
      *   the way duplicate keys are handled by the implementation.
@@ -245,6 +453,7 @@ bError bDeleteKey(bHandle *handle, void *key, bRecAddr *rec);
      * returns:
      *   bErrOk                 operation successful
      *   bErrKeyNotFound        key not found
+     *   bErrReadOnly           index was opened in read-only mode
      * notes:
      *   If dupKeys is false, all keys are unique, and rec is not used
      *   to determine which key to delete.  If dupKeys is true, then
@@ -264,6 +473,40 @@ bError bFindKey(bHandle *handle, bCursor *c, void *key, bRecAddr *rec);
      *   bErrKeyNotFound        key not found
      */
 
+bError bFindKeys(bHandle *handle, int n, void **keys, bRecAddr *recs, 
+		 char *found);
+    /*
+     * input:
+     *   handle                 handle returned by bOpen
+     *   n                      number of keys
+     *   keys                   keys to find, sorted in ascending
+     *                          order of the index's compare function
+     * output:
+     *   recs                   record address for each found key
+     *   found                  1 for each found key, 0 otherwise
+     * returns:
+     *   bErrOk                 operation successful
+     * notes:
+     *   Looks up all keys in a single pass: the search for a key
+     *   starts at the deepest node on the path of the previous key
+     *   which still covers it, instead of at the root. With dupKeys,
+     *   the record address of the first matching key is returned,
+     *   as for bFindKey().
+     */
+
+bError bFindKeyGE(bHandle *handle, bCursor *c, void *key, bRecAddr *rec);
+    /*
+     * input:
+     *   handle                 handle returned by bOpen
+     *   key                    key to find
+     * output:
+     *   cursor			cursor pointing to the first key >= key
+     *   rec                    record address (if != NULL)
+     * returns:
+     *   bErrOk                 operation successful
+     *   bErrKeyNotFound        all keys are < key
+     */
+
 bError bFindFirstKey(bHandle *handle, bCursor *c, void *key, bRecAddr *rec);
     /*
      * input:
@@ -331,6 +574,73 @@ bError bCursorReadData(bHandle *handle, bCursor *c, void *key, bRecAddr *rec);
      *   bErrBufferInvalid      cursor buffer is invalid
      */
 
+bError bBulkLoadBegin(bHandle *handle, int fillPercent);
+    /*
+     * input:
+     *   handle                 handle returned by bOpen
+     *   fillPercent            percentage of the node capacity to
+     *                          fill (1-100)
+     * returns:
+     *   bErrOk                 operation successful
+     *   bErrNotEmpty           the index is not empty
+     *   bErrReadOnly           index was opened in read-only mode
+     *   bErrMemory             insufficient memory
+     * notes:
+     *   Starts loading an empty index from sorted input. Keys are
+     *   then passed to bBulkLoadAdd() and the load is completed by
+     *   bBulkLoadEnd() or cancelled by bBulkLoadAbort(). The index
+     *   must not be modified or searched while loading.
+     *
+     *   Leaves are filled up to fillPercent and written sequentially
+     *   to the end of the file; the internal levels are then built
+     *   on top of them. Node fill levels are kept within the limits
+     *   used by bInsertKey() and bDeleteKey(), so the index can be
+     *   updated normally afterwards. Use a lower fillPercent for
+     *   indexes which will see many inserts after loading.
+     */
+
+bError bBulkLoadAdd(bHandle *handle, void *key, bRecAddr rec);
+    /*
+     * input:
+     *   handle                 handle returned by bOpen
+     *   key                    key to add
+     *   rec                    record address
+     * returns:
+     *   bErrOk                 operation successful
+     *   bErrKeyOrder           key is not greater than the previous one
+     *   bErrDupKeys            duplicate keys (and info.dupKeys = false)
+     *   bErrIO                 write error
+     *   bErrMemory             insufficient memory
+     *   bErrAddrRange          rec or a node address doesn't fit into
+     *                          the file's 32-bit addresses
+     * notes:
+     *   Keys must be passed in ascending order. If dupKeys is true,
+     *   duplicate keys must be passed in ascending record address
+     *   order.
+     */
+
+bError bBulkLoadEnd(bHandle *handle);
+    /*
+     * input:
+     *   handle                 handle returned by bOpen
+     * returns:
+     *   bErrOk                 operation successful
+     *   bErrIO                 write error
+     * notes:
+     *   Writes the remaining leaves, builds the internal levels and
+     *   the new root and flushes the index. The bulk load state is
+     *   released in all cases.
+     */
+
+void bBulkLoadAbort(bHandle *handle);
+    /*
+     * input:
+     *   handle                 handle returned by bOpen
+     * notes:
+     *   Cancels a bulk load. The index stays empty; nodes which were
+     *   already written remain in the file as unused space.
+     */
+
 /* Debugging function which validates an open BTree pointed to by
    handle and returns 0 for a valid tree structure and a negative
    result for an invalid structure. */
@@ -14,7 +14,8 @@
     maxCt /= sizeof(bIdxAddr) + info.keySize + sizeof(bRecAddr);
     if (maxCt < 6) return bErrSectorSize;
 
-    MAX_SECTOR_SIZE is 1024.
+    MAX_SECTOR_SIZE defaults to 65536 and is available as
+    BeeIndex.MAX_SECTOR_SIZE.
 
     For keysize = 25 on a 64-bit platform:
 
@@ -53,7 +54,13 @@ SECTOR_SIZES = (
     1024,
     2048,
     4096,
+    8192,
+    16384,
+    32768,
+    65536,
     )
+SECTOR_SIZES = tuple([x for x in SECTOR_SIZES
+                      if x <= BeeIndex.MAX_SECTOR_SIZE])
 
 ###
 
@@ -98,6 +98,57 @@ mxBeeCursorObject *mxBeeCursor_New(mxBeeIndexObject *beeindex,   /* Index object
 #define _mxBeeCursor_Check(v) \
         (((mxBeeCursorObject *)(v))->ob_type == &mxBeeCursor_Type)
 
+/* Run the B+Tree call stmt without holding the GIL; the index lock
+   must be held */
+#define mxBeeIndex_NOGIL(stmt) \
+        do {Py_BEGIN_ALLOW_THREADS stmt; Py_END_ALLOW_THREADS} while (0)
+
+/* --- thread support ----------------------------------------------------- */
+
+/* The B+Tree functions are run without holding the GIL, so that other
+   threads can continue while an index operation waits for the
+   disk. All uses of an index handle and its key buffer are serialized
+   by the index lock.
+
+   The lock is recursive, since the owner may run Python code while
+   holding it (e.g. a record address' __int__ method), which could use
+   the index again. Threads never wait for the lock while holding the
+   GIL. */
+
+#ifdef WITH_THREAD
+
+static
+void mxBeeIndex_Lock(mxBeeIndexObject *self)
+{
+    long me = PyThread_get_thread_ident();
+
+    /* lock_owner and lock_count are only changed while holding the
+       GIL */
+    if (self->lock_count > 0 && self->lock_owner == me) {
+	self->lock_count++;
+	return;
+    }
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	Py_END_ALLOW_THREADS
+    }
+    self->lock_owner = me;
+    self->lock_count = 1;
+}
+
+static
+void mxBeeIndex_Unlock(mxBeeIndexObject *self)
+{
+    if (--self->lock_count == 0)
+	PyThread_release_lock(self->lock);
+}
+
+#else
+# define mxBeeIndex_Lock(self)
+# define mxBeeIndex_Unlock(self)
+#endif
+
 /* --- module helpers ----------------------------------------------------- */
 
 /* Create an exception object, insert it into the module dictionary
@@ -228,6 +279,28 @@ void mxBeeBase_ReportError(bError rc)
 	Py_ErrorWithArg(PyExc_MemoryError,
 			"in BeeIndex (line %i)",bErrLineNo);
 
+    case bErrReadOnly:
+	Py_Error(PyExc_IOError,
+		 "beeindex is read-only");
+
+    case bErrNotEmpty:
+	Py_Error(mxBeeIndex_Error,
+		 "beeindex is not empty");
+
+    case bErrKeyOrder:
+	Py_Error(PyExc_ValueError,
+		 "keys are not in ascending order");
+
+    case bErrFormat:
+	Py_Error(PyExc_IOError,
+		 "unsupported index file format or the file doesn't "
+		 "match the index parameters");
+
+    case bErrAddrRange:
+	Py_Error(PyExc_OverflowError,
+		 "address too large for the 32-bit addresses of the "
+		 "index file");
+
     default:
 	Py_Error(PyExc_SystemError,
 		 "unknown error");
@@ -253,8 +326,19 @@ mxBeeIndexObject *mxBeeIndex_New(char *filename,   /* name of beeindex file */
 				 mxObjectFromKeyFunc ofk, /* key
 							     conversion */
 				 mxKeyFromObjectFunc kfo, /* functions */
-				 int allow_dupkeys /* allow duplicate
+				 int allow_dupkeys, /* allow duplicate
 						      keys ? */
+				 long cacheSize,   /* size of the node
+						      cache in bytes */
+				 int useMmap,	   /* memory map the file
+						      in read-only mode ? */
+				 int avgKeySize,   /* create compressed
+						      nodes sized for this
+						      key length, if > 0 */
+				 long readAhead,   /* read-ahead window
+						      for scans in bytes */
+				 int snapshot	   /* create a snapshot
+						      format file ? */
 				 )
 {
     mxBeeIndexObject *beeindex = 0;
@@ -296,6 +380,33 @@ mxBeeIndexObject *mxBeeIndex_New(char *filename,   /* name of beeindex file */
     info->sectorSize = sectorSize;
     info->comp = comp;
     info->filemode = filemode;
+    info->cacheSize = (sectorSize > 0) ? (int)(cacheSize / sectorSize) : 0;
+    info->useMmap = (useMmap != 0);
+    info->avgKeySize = avgKeySize;
+    info->readAhead = (sectorSize > 0) ? (int)(readAhead / sectorSize) : 0;
+    info->snapshot = (snapshot != 0);
+
+    /* Scratch buffer for key conversions */
+    beeindex->handle = NULL;
+#ifdef WITH_THREAD
+    beeindex->lock = NULL;
+    beeindex->lock_count = 0;
+#endif
+    beeindex->keybuf = NULL;
+    beeindex->keyformat = NULL;
+    beeindex->keyfields = 0;
+    beeindex->keybuf = new(char, keySize);
+    if (beeindex->keybuf == NULL)
+	Py_Error(PyExc_MemoryError,
+		 "Out of memory");
+
+#ifdef WITH_THREAD
+    /* Index lock */
+    beeindex->lock = PyThread_allocate_lock();
+    if (beeindex->lock == NULL)
+	Py_Error(PyExc_MemoryError,
+		 "Out of memory");
+#endif
 
     /* Conversion routines */
     beeindex->ObjectFromKey = ofk;
@@ -308,8 +419,8 @@ mxBeeIndexObject *mxBeeIndex_New(char *filename,   /* name of beeindex file */
     beeindex->length = -1;
     beeindex->length_state = -1;
     
-    /* Open the beeindex */
-    rc = bOpen(beeindex->info, &(beeindex->handle));
+    /* Open the beeindex; nobody else can use it yet */
+    mxBeeIndex_NOGIL(rc = bOpen(beeindex->info, &(beeindex->handle)));
     if (rc != bErrOk) {
 	beeindex->handle = 0;
 	mxBeeBase_ReportError(rc);
@@ -334,11 +445,29 @@ void mxBeeIndex_Free(mxBeeIndexObject *beeindex)
 
     if (beeindex->handle)
 	/* Close beeindex file, flushing any unsaved data */
-	bClose(beeindex->handle);
+	mxBeeIndex_NOGIL(bClose(beeindex->handle));
+
+#ifdef WITH_THREAD
+    /* Free the lock */
+    if (beeindex->lock) {
+	PyThread_free_lock(beeindex->lock);
+	beeindex->lock = NULL;
+    }
+#endif
 
     /* Free filename */
     free(beeindex->info.iName);
     beeindex->info.iName = NULL;
+
+    /* Free key buffer */
+    if (beeindex->keybuf) {
+	free(beeindex->keybuf);
+	beeindex->keybuf = NULL;
+    }
+    if (beeindex->keyformat) {
+	free(beeindex->keyformat);
+	beeindex->keyformat = NULL;
+    }
     
 #ifdef MXBEEINDEX_FREELIST
     /* Append to free list */
@@ -367,7 +496,14 @@ void *mxBeeIndex_KeyFromString(mxBeeIndexObject *beeindex,
 	      PyExc_TypeError,
 	      "keys may not have embedded null bytes");
 
-    return (void*)PyString_AS_STRING(key);
+    /* Pad the key with null bytes to the full key size; the index
+       always reads keySize bytes and only stores the used part in
+       compressed nodes */
+    memcpy(beeindex->keybuf, PyString_AS_STRING(key), 
+	   PyString_GET_SIZE(key));
+    memset(beeindex->keybuf + PyString_GET_SIZE(key), 0,
+	   beeindex->info.keySize - PyString_GET_SIZE(key));
+    return (void*)beeindex->keybuf;
     
  onError:
     return NULL;
@@ -486,6 +622,282 @@ int mxBeeIndex_CompareDoubles(size_t keysize,
     return (a == b) ? CC_EQ : (a > b) ? CC_GT : CC_LT;
 }
 
+/* Use tuples as composite keys. The fields of the tuples are given by
+   a format string using these codes:
+
+   q  - 64-bit signed integer
+   d  - float; NaNs are not allowed
+   Ns - string of up to N bytes (which may not contain null bytes)
+
+   Each field is converted to a normalized encoding which sorts in the
+   same order as the field's values when compared using memcmp(), so
+   the keys can be compared with a single memcmp() call. Integers are
+   stored in big endian byte order with the sign bit flipped. Floats
+   are stored as big endian IEEE 754 doubles with the sign bit
+   flipped for positive values and all bits flipped for negative
+   ones; -0.0 is stored as 0.0. Strings are padded with null bytes. */
+
+#define MXBEEINDEX_MAXFIELDS	32
+
+/* Parse format and return the key size in bytes; sets *fields to the
+   number of fields. Returns -1 with an exception set in case the
+   format is invalid. */
+
+static
+int mxBeeIndex_ParseKeyFormat(const char *format,
+			      int *fields)
+{
+    const char *f = format;
+    long keysize = 0;
+    int n = 0;
+
+    while (*f) {
+	long size = 0;
+
+	while (*f >= '0' && *f <= '9') {
+	    size = size * 10 + (*f++ - '0');
+	    if (size > 0xffff)
+		Py_Error(PyExc_ValueError,
+			 "string field size too large");
+	}
+	switch (*f) {
+	case 'q':
+	case 'd':
+	    if (size != 0)
+		Py_ErrorWithArg(PyExc_ValueError,
+				"no size allowed for key format code '%c'",
+				*f);
+	    keysize += 8;
+	    break;
+	case 's':
+	    if (size == 0)
+		Py_Error(PyExc_ValueError,
+			 "string fields need a size > 0");
+	    keysize += size;
+	    break;
+	default:
+	    Py_ErrorWithArg(PyExc_ValueError,
+			    "unknown key format code: '%c'",*f);
+	}
+	f++;
+	n++;
+	Py_Assert(n <= MXBEEINDEX_MAXFIELDS,
+		  PyExc_ValueError,
+		  "too many fields in key format");
+    }
+    Py_Assert(n > 0,
+	      PyExc_ValueError,
+	      "empty key format");
+    *fields = n;
+    return (int)keysize;
+
+ onError:
+    return -1;
+}
+
+/* Store value in big endian byte order at p */
+
+static
+void mxBeeIndex_PackBigEndian(unsigned char *p,
+			      unsigned PY_LONG_LONG value)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+	p[i] = (unsigned char)(value & 0xFF);
+	value >>= 8;
+    }
+}
+
+static
+unsigned PY_LONG_LONG mxBeeIndex_UnpackBigEndian(const unsigned char *p)
+{
+    unsigned PY_LONG_LONG value = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+	value = (value << 8) | p[i];
+    return value;
+}
+
+static
+void *mxBeeIndex_KeyFromComposite(mxBeeIndexObject *beeindex,
+				  PyObject *key)
+{
+    const char *f = beeindex->keyformat;
+    unsigned char *p = (unsigned char *)beeindex->keybuf;
+    Py_ssize_t i = 0;
+
+    Py_AssertWithArg(PyTuple_Check(key) &&
+		     PyTuple_GET_SIZE(key) == beeindex->keyfields,
+		     PyExc_TypeError,
+		     "keys must be tuples of %i items",
+		     beeindex->keyfields);
+
+    while (*f) {
+	PyObject *item = PyTuple_GET_ITEM(key,i);
+	long size = 0;
+
+	while (*f >= '0' && *f <= '9')
+	    size = size * 10 + (*f++ - '0');
+	switch (*f) {
+
+	case 'q': {
+	    PY_LONG_LONG value;
+
+	    Py_AssertWithArg(PyInt_Check(item) || PyLong_Check(item),
+			     PyExc_TypeError,
+			     "key item %i must be an integer",(int)i);
+	    value = PyLong_AsLongLong(item);
+	    if (value == -1 && PyErr_Occurred())
+		goto onError;
+	    mxBeeIndex_PackBigEndian(p,
+		(unsigned PY_LONG_LONG)value ^ 0x8000000000000000ULL);
+	    p += 8;
+	    break;
+	}
+
+	case 'd': {
+	    union {
+		double d;
+		unsigned PY_LONG_LONG u;
+	    } value;
+
+	    Py_AssertWithArg(PyFloat_Check(item) || PyInt_Check(item) ||
+			     PyLong_Check(item),
+			     PyExc_TypeError,
+			     "key item %i must be a float",(int)i);
+	    value.d = PyFloat_AsDouble(item);
+	    if (value.d == -1.0 && PyErr_Occurred())
+		goto onError;
+	    Py_AssertWithArg(value.d == value.d,
+			     PyExc_ValueError,
+			     "key item %i is NaN",(int)i);
+	    if (value.d == 0.0)
+		value.d = 0.0;
+	    if (value.u & 0x8000000000000000ULL)
+		value.u = ~value.u;
+	    else
+		value.u |= 0x8000000000000000ULL;
+	    mxBeeIndex_PackBigEndian(p,value.u);
+	    p += 8;
+	    break;
+	}
+
+	case 's': {
+	    Py_ssize_t len;
+
+	    Py_AssertWithArg(PyString_Check(item),
+			     PyExc_TypeError,
+			     "key item %i must be a string",(int)i);
+	    len = PyString_GET_SIZE(item);
+	    Py_AssertWith2Args(len <= size,
+			       PyExc_TypeError,
+			       "key item %i must not exceed length %ld",
+			       (int)i,size);
+	    Py_AssertWithArg((size_t)len == strlen(PyString_AS_STRING(item)),
+			     PyExc_TypeError,
+			     "key item %i may not have embedded null bytes",
+			     (int)i);
+	    memcpy(p,PyString_AS_STRING(item),len);
+	    memset(p + len,0,size - len);
+	    p += size;
+	    break;
+	}
+	}
+	f++;
+	i++;
+    }
+    return (void *)beeindex->keybuf;
+
+ onError:
+    return NULL;
+}
+
+static
+PyObject *mxBeeIndex_CompositeFromKey(mxBeeIndexObject *beeindex,
+				      void *key)
+{
+    const char *f = beeindex->keyformat;
+    const unsigned char *p = (const unsigned char *)key;
+    PyObject *v;
+    Py_ssize_t i = 0;
+
+    v = PyTuple_New(beeindex->keyfields);
+    if (v == NULL)
+	goto onError;
+
+    while (*f) {
+	PyObject *item = NULL;
+	long size = 0;
+
+	while (*f >= '0' && *f <= '9')
+	    size = size * 10 + (*f++ - '0');
+	switch (*f) {
+
+	case 'q':
+	    item = PyLong_FromLongLong((PY_LONG_LONG)
+		(mxBeeIndex_UnpackBigEndian(p) ^ 0x8000000000000000ULL));
+	    if (item != NULL && PyLong_Check(item)) {
+		/* Return integers where possible */
+		long value = PyLong_AsLong(item);
+
+		if (value != -1 || !PyErr_Occurred()) {
+		    Py_DECREF(item);
+		    item = PyInt_FromLong(value);
+		}
+		else
+		    PyErr_Clear();
+	    }
+	    p += 8;
+	    break;
+
+	case 'd': {
+	    union {
+		double d;
+		unsigned PY_LONG_LONG u;
+	    } value;
+
+	    value.u = mxBeeIndex_UnpackBigEndian(p);
+	    if (value.u & 0x8000000000000000ULL)
+		value.u &= ~0x8000000000000000ULL;
+	    else
+		value.u = ~value.u;
+	    item = PyFloat_FromDouble(value.d);
+	    p += 8;
+	    break;
+	}
+
+	case 's': {
+	    const unsigned char *end = memchr(p,0,size);
+
+	    item = PyString_FromStringAndSize((const char *)p,
+					      end ? end - p : size);
+	    p += size;
+	    break;
+	}
+	}
+	if (item == NULL)
+	    goto onError;
+	PyTuple_SET_ITEM(v,i,item);
+	f++;
+	i++;
+    }
+    return v;
+
+ onError:
+    Py_XDECREF(v);
+    return NULL;
+}
+
+static
+int mxBeeIndex_CompareComposites(size_t keysize, 
+				 const void *key1, 
+				 const void *key2) 
+{
+    return memcmp(key1, key2, keysize);
+}
+
 /* Python object to record address conversion.
 
    Returns 0 and raises an exception in case of an error. 
@@ -493,7 +905,7 @@ int mxBeeIndex_CompareDoubles(size_t keysize,
 static
 bRecAddr mxBeeIndex_RecordAddressFromObject(PyObject *address)
 {
-    unsigned long value;
+    unsigned PY_LONG_LONG value;
     
     if (!address)
 	goto onError;
@@ -503,12 +915,12 @@ bRecAddr mxBeeIndex_RecordAddressFromObject(PyObject *address)
 	return (bRecAddr)PyInt_AS_LONG(address);
 
     /* file.tell() will return longs on platforms which have long file
-       support */
+       support; record addresses are 64-bit on all platforms */
     if (PyLong_Check(address))
-	value = PyLong_AsUnsignedLong(address);
+	value = PyLong_AsUnsignedLongLong(address);
     else
-	value = (unsigned long) PyInt_AsLong(address);
-    if (value == (unsigned long) -1 && PyErr_Occurred())
+	value = (unsigned PY_LONG_LONG) PyInt_AsLong(address);
+    if (value == (unsigned PY_LONG_LONG) -1 && PyErr_Occurred())
 	goto onError;
     return (bRecAddr)value;
     
@@ -529,32 +941,34 @@ bRecAddr mxBeeIndex_RecordAddressFromObject(PyObject *address)
 static
 PyObject *mxBeeIndex_ObjectFromRecordAddress(bRecAddr recaddr)
 {
-    if ((unsigned long)recaddr > INT_MAX)
-	return PyLong_FromUnsignedLong((unsigned long)recaddr);
+    if (recaddr > (bRecAddr)LONG_MAX)
+	return PyLong_FromUnsignedLongLong((unsigned PY_LONG_LONG)recaddr);
     else
 	return PyInt_FromLong((long)recaddr);
 }
 
 /* --- API functions --- */
 
+/* These must be called with the index lock held. */
+
 static
-long mxBeeIndex_FindKey(mxBeeIndexObject *self,
-			PyObject *obj)
+int mxBeeIndex_FindKey(mxBeeIndexObject *self,
+		       PyObject *obj,
+		       bRecAddr *record)
 {
     bError rc;
     bCursor c;
-    bRecAddr record = 0;
     void *key = self->KeyFromObject(self,obj);
     
     if (!key)
 	goto onError;
 
-    rc = bFindKey(self->handle,&c,key,&record);
+    mxBeeIndex_NOGIL(rc = bFindKey(self->handle,&c,key,record));
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
     }
-    return (long)record;
+    return 0;
 
  onError:
     return -1;
@@ -571,7 +985,7 @@ int mxBeeIndex_DeleteKey(mxBeeIndexObject *self,
     if (!key)
 	goto onError;
     
-    rc = bDeleteKey(self->handle,key,&record);
+    mxBeeIndex_NOGIL(rc = bDeleteKey(self->handle,key,&record));
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
@@ -605,6 +1019,7 @@ int mxBeeIndex_SetKey(mxBeeIndexObject *self,
 
     /* Either insert or update the key; if dupkeys are allowed, only
        inserts are possible */
+    Py_BEGIN_ALLOW_THREADS
     if (!self->info.dupKeys) {
 	rc = bUpdateKey(self->handle,key,record);
 	if (rc == bErrKeyNotFound)
@@ -612,6 +1027,7 @@ int mxBeeIndex_SetKey(mxBeeIndexObject *self,
     }
     else
 	rc = bInsertKey(self->handle,key,record);
+    Py_END_ALLOW_THREADS
     
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
@@ -627,7 +1043,9 @@ int mxBeeIndex_SetKey(mxBeeIndexObject *self,
     return -1;
 }
 
-/* Clear the beeindex by reopening the file as new file. */
+/* Clear the beeindex by reopening the file as new file. Snapshot
+   format files are cleared in place, since readers may still use
+   older versions. */
 
 static
 int mxBeeIndex_Clear(mxBeeIndexObject *self)
@@ -639,15 +1057,27 @@ int mxBeeIndex_Clear(mxBeeIndexObject *self)
 	      PyExc_IOError,
 	      "beeindex is read-only");
 
+    if (self->handle && self->handle->snap) {
+	mxBeeIndex_NOGIL(rc = bClear(self->handle));
+	if (rc != bErrOk) {
+	    mxBeeBase_ReportError(rc);
+	    goto onError;
+	}
+	self->updates++;
+	self->length = -1;
+	self->length_state = -1;
+	return 0;
+    }
+
     /* Close the file */
     if (self->handle)
-	bClose(self->handle);
+	mxBeeIndex_NOGIL(bClose(self->handle));
 
     /* Reopen the file as new file */
     self->info.filemode = 2;
 
     /* Open the beeindex */
-    rc = bOpen(self->info,&(self->handle));
+    mxBeeIndex_NOGIL(rc = bOpen(self->info,&(self->handle)));
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
@@ -682,19 +1112,55 @@ Py_C_Function( mxBeeIndex_flush,
 {
     bError rc;
     
+    mxBeeIndex_Lock(beeindex);
     Py_NoArgsCheck();
 
     Py_Assert(beeindex->handle != NULL,
 	      mxBeeIndex_Error,
 	      "index is closed");
-    rc = bFlush(beeindex->handle);
+    mxBeeIndex_NOGIL(rc = bFlush(beeindex->handle));
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
     }
+    mxBeeIndex_Unlock(beeindex);
     Py_ReturnNone();
 
  onError:
+    mxBeeIndex_Unlock(beeindex);
+    return NULL;
+}
+
+Py_C_Function( mxBeeIndex_refresh,
+	       "refresh()\n\n"
+	       "Move a read-only snapshot format index on to the version\n"
+	       "which was flushed last by the writer. Returns 1 if the\n"
+	       "index changed, 0 otherwise. Cursors become invalid if it\n"
+	       "changed. For other indexes, this does nothing."
+	       )
+{
+    bError rc;
+    bool changed;
+    
+    mxBeeIndex_Lock(beeindex);
+    Py_NoArgsCheck();
+
+    Py_Assert(beeindex->handle != NULL,
+	      mxBeeIndex_Error,
+	      "index is closed");
+    mxBeeIndex_NOGIL(rc = bRefresh(beeindex->handle, &changed));
+    if (rc != bErrOk) {
+	mxBeeBase_ReportError(rc);
+	goto onError;
+    }
+    if (changed)
+	/* Invalidate cursors and the length cache */
+	beeindex->updates++;
+    mxBeeIndex_Unlock(beeindex);
+    return PyInt_FromLong(changed);
+
+ onError:
+    mxBeeIndex_Unlock(beeindex);
     return NULL;
 }
 
@@ -705,19 +1171,23 @@ Py_C_Function( mxBeeIndex_close,
 {
     bError rc;
     
+    mxBeeIndex_Lock(beeindex);
     Py_NoArgsCheck();
 
     if (beeindex->handle) {
-	rc = bClose(beeindex->handle);
+	/* the handle is freed even if flushing failed */
+	mxBeeIndex_NOGIL(rc = bClose(beeindex->handle));
+	beeindex->handle = NULL;
 	if (rc != bErrOk) {
 	    mxBeeBase_ReportError(rc);
 	    goto onError;
 	}
-	beeindex->handle = NULL;
     }
+    mxBeeIndex_Unlock(beeindex);
     Py_ReturnNone();
     
  onError:
+    mxBeeIndex_Unlock(beeindex);
     return NULL;
 }
 
@@ -726,13 +1196,16 @@ Py_C_Function( mxBeeIndex_clear,
 	       "Clear the index"
 	       )
 {
+    mxBeeIndex_Lock(beeindex);
     Py_NoArgsCheck();
 
     if (mxBeeIndex_Clear(beeindex))
 	goto onError;
+    mxBeeIndex_Unlock(beeindex);
     Py_ReturnNone();
     
  onError:
+    mxBeeIndex_Unlock(beeindex);
     return NULL;
 }
 
@@ -749,6 +1222,7 @@ Py_C_Function( mxBeeIndex_get,
     void *key;
     bRecAddr record = 0;
 
+    mxBeeIndex_Lock(beeindex);
     Py_Get2Args("O|O",obj,def);
 
     Py_Assert(beeindex->handle != NULL,
@@ -759,21 +1233,168 @@ Py_C_Function( mxBeeIndex_get,
     key = beeindex->KeyFromObject(beeindex,obj);
     if (!key)
 	goto onError;
-    rc = bFindKey(beeindex->handle,&c,key,&record);
+    mxBeeIndex_NOGIL(rc = bFindKey(beeindex->handle,&c,key,&record));
+    mxBeeIndex_Unlock(beeindex);
     if (rc == bErrKeyNotFound) {
 	Py_INCREF(def);
 	return def;
     }
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
-	goto onError;
+	return NULL;
     }
     return mxBeeIndex_ObjectFromRecordAddress(record);
     
  onError:
+    mxBeeIndex_Unlock(beeindex);
     return NULL;
 }
 
+/* Probe entry used by get_many() */
+typedef struct {
+    char *key;			/* key in index format */
+    Py_ssize_t pos;		/* position in the input sequence */
+} mxBeeIndexProbe;
+
+/* Compare function and key size used by mxBeeIndex_CompareProbes();
+   these are only set and used while holding the GIL */
+static bCompFunc mxBeeIndex_ProbeComp;
+static size_t mxBeeIndex_ProbeKeySize;
+
+static
+int mxBeeIndex_CompareProbes(const void *a,
+			     const void *b)
+{
+    const mxBeeIndexProbe *p1 = (const mxBeeIndexProbe *)a;
+    const mxBeeIndexProbe *p2 = (const mxBeeIndexProbe *)b;
+    int cc;
+
+    cc = mxBeeIndex_ProbeComp(mxBeeIndex_ProbeKeySize, p1->key, p2->key);
+    if (cc != 0)
+	return cc;
+    /* Keep the sort stable */
+    return (p1->pos < p2->pos) ? -1 : (p1->pos > p2->pos);
+}
+
+Py_C_Function( mxBeeIndex_get_many,
+	       "get_many(keys,default=None)\n\n"
+	       "Find the values for all keys in the sequence keys and\n"
+	       "return them as list in the order of keys. default is\n"
+	       "used for keys which are not found. The keys are looked\n"
+	       "up in index order in a single pass over the tree."
+	       )
+{
+    PyObject *keys,*def = Py_None;
+    PyObject *seq = NULL;
+    PyObject *result = NULL;
+    mxBeeIndexProbe *probes = NULL;
+    char *keydata = NULL;
+    void **keyptrs = NULL;
+    bRecAddr *recs = NULL;
+    char *found = NULL;
+    size_t keysize;
+    Py_ssize_t n, i;
+    int sorted = 1;
+    bError rc;
+
+    mxBeeIndex_Lock(beeindex);
+    Py_Get2Args("O|O",keys,def);
+
+    Py_Assert(beeindex->handle != NULL,
+	      mxBeeIndex_Error,
+	      "index is closed");
+
+    seq = PySequence_Fast(keys, "keys must be a sequence");
+    if (seq == NULL)
+	goto onError;
+    n = PySequence_Fast_GET_SIZE(seq);
+    Py_Assert(n <= INT_MAX,
+	      PyExc_ValueError,
+	      "too many keys");
+    result = PyList_New(n);
+    if (result == NULL || n == 0)
+	goto done;
+    keysize = beeindex->info.keySize;
+
+    /* Convert the keys */
+    keydata = new(char, n * keysize);
+    probes = new(mxBeeIndexProbe, n);
+    keyptrs = new(void *, n);
+    recs = new(bRecAddr, n);
+    found = new(char, n);
+    if (keydata == NULL || probes == NULL || keyptrs == NULL ||
+	recs == NULL || found == NULL)
+	Py_Error(PyExc_MemoryError,
+		 "Out of memory");
+    for (i = 0; i < n; i++) {
+	void *key = beeindex->KeyFromObject(beeindex,
+					    PySequence_Fast_GET_ITEM(seq, i));
+	if (!key)
+	    goto onError;
+	probes[i].key = keydata + i * keysize;
+	probes[i].pos = i;
+	memcpy(probes[i].key, key, keysize);
+	if (i > 0 && sorted &&
+	    beeindex->info.comp(keysize, probes[i-1].key, probes[i].key) > 0)
+	    sorted = 0;
+    }
+
+    /* Sort them in index order */
+    if (!sorted) {
+	mxBeeIndex_ProbeComp = beeindex->info.comp;
+	mxBeeIndex_ProbeKeySize = keysize;
+	qsort(probes, n, sizeof(mxBeeIndexProbe), mxBeeIndex_CompareProbes);
+    }
+    for (i = 0; i < n; i++)
+	keyptrs[i] = probes[i].key;
+
+    mxBeeIndex_NOGIL(rc = bFindKeys(beeindex->handle, (int)n,
+				    keyptrs, recs, found));
+    if (rc != bErrOk) {
+	mxBeeBase_ReportError(rc);
+	goto onError;
+    }
+
+    /* Build the result list in input order */
+    for (i = 0; i < n; i++) {
+	PyObject *v;
+
+	if (found[i])
+	    v = mxBeeIndex_ObjectFromRecordAddress(recs[i]);
+	else {
+	    v = def;
+	    Py_INCREF(v);
+	}
+	if (v == NULL)
+	    goto onError;
+	PyList_SET_ITEM(result, probes[i].pos, v);
+    }
+
+ done:
+    if (found)
+	free(found);
+    if (recs)
+	free(recs);
+    if (keyptrs)
+	free(keyptrs);
+    if (probes)
+	free(probes);
+    if (keydata)
+	free(keydata);
+    Py_DECREF(seq);
+    mxBeeIndex_Unlock(beeindex);
+    return result;
+    
+ onError:
+    Py_XDECREF(result);
+    result = NULL;
+    if (seq == NULL) {
+	mxBeeIndex_Unlock(beeindex);
+	return NULL;
+    }
+    goto done;
+}
+
 Py_C_Function( mxBeeIndex_has_key,
 	       "has_key(key)\n\n"
 	       "Returns 1/0 depending on whether the key is found or not."
@@ -785,6 +1406,7 @@ Py_C_Function( mxBeeIndex_has_key,
     void *key;
     bRecAddr record = 0;
 
+    mxBeeIndex_Lock(beeindex);
     Py_GetArg("O",obj);
 
     Py_Assert(beeindex->handle != NULL,
@@ -795,19 +1417,21 @@ Py_C_Function( mxBeeIndex_has_key,
     key = beeindex->KeyFromObject(beeindex,obj);
     if (!key)
 	goto onError;
-    rc = bFindKey(beeindex->handle,&c,key,&record);
+    mxBeeIndex_NOGIL(rc = bFindKey(beeindex->handle,&c,key,&record));
+    mxBeeIndex_Unlock(beeindex);
     if (rc == bErrKeyNotFound) {
 	Py_INCREF(Py_False);
 	return Py_False;
     }
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
-	goto onError;
+	return NULL;
     }
     Py_INCREF(Py_True);
     return Py_True;
     
  onError:
+    mxBeeIndex_Unlock(beeindex);
     return NULL;
 }
 
@@ -825,6 +1449,7 @@ Py_C_Function( mxBeeIndex_cursor,
     bCursor c;
     bError rc;
 
+    mxBeeIndex_Lock(beeindex);
     Py_Get2Args("O|O",obj,def);
 
     Py_Assert(beeindex->handle != NULL,
@@ -833,17 +1458,18 @@ Py_C_Function( mxBeeIndex_cursor,
 
     /* Find key */
     if (obj == mxBeeIndex_FirstKey)
-	rc = bFindFirstKey(beeindex->handle,&c,NULL,NULL);
+	mxBeeIndex_NOGIL(rc = bFindFirstKey(beeindex->handle,&c,NULL,NULL));
     else if (obj == mxBeeIndex_LastKey)
-	rc = bFindLastKey(beeindex->handle,&c,NULL,NULL);
+	mxBeeIndex_NOGIL(rc = bFindLastKey(beeindex->handle,&c,NULL,NULL));
     else {
 	void *key;
 	key = beeindex->KeyFromObject(beeindex,obj);
 	if (!key)
 	    goto onError;
-	rc = bFindKey(beeindex->handle,&c,key,NULL);
+	mxBeeIndex_NOGIL(rc = bFindKey(beeindex->handle,&c,key,NULL));
     }
     if (rc == bErrKeyNotFound && def) {
+	mxBeeIndex_Unlock(beeindex);
 	Py_INCREF(def);
 	return def;
     }
@@ -857,25 +1483,190 @@ Py_C_Function( mxBeeIndex_cursor,
     if (!v)
 	goto onError;
 
+    mxBeeIndex_Unlock(beeindex);
     return v;
     
  onError:
+    mxBeeIndex_Unlock(beeindex);
     return NULL;
 }
 
-Py_C_Function( mxBeeIndex_keys,
-	       "keys()\n\n"
-	       "Return a list of keys stored in the index. The list is\n"
-	       "sorted ascending."
-	       )
+/* What mxBeeIndex_ReadItems() appends to the list */
+#define MXBEEINDEX_KEYS		0
+#define MXBEEINDEX_VALUES	1
+#define MXBEEINDEX_ITEMS	2
+
+/* Number of entries read per chunk while scanning */
+#ifndef MXBEEINDEX_SCANCHUNK
+# define MXBEEINDEX_SCANCHUNK	256
+#endif
+
+/* Copy up to n entries into keys (keysize bytes each) and recs,
+   starting with the entry at cursor c, or the one following it if
+   advance is set, and stopping before the first key >= hikey (if
+   hikey is not NULL). c is left pointing to the last copied
+   entry. *more is set if the chunk was filled before reaching the end
+   of the range.
+
+   This does not use the Python API and is run without holding the
+   GIL.
+
+*/
+static
+bError mxBeeIndex_ReadChunk(bHandle *handle,
+			    bCursor *c,
+			    int advance,
+			    bCompFunc comp,
+			    size_t keysize,
+			    void *hikey,
+			    char *keys,
+			    bRecAddr *recs,
+			    long n,
+			    long *count,
+			    int *more)
+{
+    bCursor next = *c;
+    bRecAddr rec;
+    bError rc;
+    long i = 0;
+
+    *count = 0;
+    *more = 0;
+    if (advance)
+	rc = bFindNextKey(handle,&next,NULL,&rec);
+    else
+	rc = bCursorReadData(handle,&next,NULL,&rec);
+    while (1) {
+	if (rc == bErrKeyNotFound)
+	    break;
+	if (rc != bErrOk)
+	    return rc;
+	if (hikey && comp(keysize, next.key, hikey) >= 0)
+	    break;
+	memcpy(keys + i * keysize, next.key, keysize);
+	recs[i++] = rec;
+	*c = next;
+	if (i >= n) {
+	    *more = 1;
+	    break;
+	}
+	rc = bFindNextKey(handle,&next,NULL,&rec);
+    }
+    *count = i;
+    return bErrOk;
+}
+
+/* Append keys, values or (key,value) tuples (depending on kind) to
+   list, starting with the entry at cursor c. Stops after limit
+   entries (if limit > 0) and before the first key >= hikey (if hikey
+   is not NULL). c is left pointing to the last appended entry.
+
+   The entries are read in chunks without holding the GIL; the Python
+   objects are then created with the GIL held. Must be called with the
+   index lock held.
+
+   Returns the number of appended entries or -1 in case of an error.
+
+*/
+static
+long mxBeeIndex_ReadItems(mxBeeIndexObject *self,
+			  bCursor *c,
+			  PyObject *list,
+			  void *hikey,
+			  long limit,
+			  int kind)
+{
+    size_t keysize = beeindex->info.keySize;
+    char *keys = NULL;
+    bRecAddr *recs = NULL;
+    bError rc;
+    long count = 0;
+    long n, got, i;
+    int advance = 0;
+    int more;
+
+    keys = new(char, MXBEEINDEX_SCANCHUNK * keysize);
+    recs = new(bRecAddr, MXBEEINDEX_SCANCHUNK);
+    if (keys == NULL || recs == NULL)
+	Py_Error(PyExc_MemoryError,
+		 "Out of memory");
+
+    do {
+	n = MXBEEINDEX_SCANCHUNK;
+	if (limit > 0 && limit - count < n)
+	    n = limit - count;
+	mxBeeIndex_NOGIL(rc = mxBeeIndex_ReadChunk(beeindex->handle,c,advance,
+						    beeindex->info.comp,
+						    keysize,hikey,
+						    keys,recs,n,
+						    &got,&more));
+	if (rc != bErrOk) {
+	    mxBeeBase_ReportError(rc);
+	    goto onError;
+	}
+
+	for (i = 0; i < got; i++) {
+	    PyObject *key = NULL,*value = NULL,*v;
+
+	    if (kind != MXBEEINDEX_VALUES) {
+		key = beeindex->ObjectFromKey(beeindex,keys + i * keysize);
+		if (!key)
+		    goto onError;
+	    }
+	    if (kind != MXBEEINDEX_KEYS) {
+		value = mxBeeIndex_ObjectFromRecordAddress(recs[i]);
+		if (!value) {
+		    Py_XDECREF(key);
+		    goto onError;
+		}
+	    }
+	    if (kind == MXBEEINDEX_KEYS)
+		v = key;
+	    else if (kind == MXBEEINDEX_VALUES)
+		v = value;
+	    else {
+		v = PyTuple_New(2);
+		if (!v) {
+		    Py_DECREF(key);
+		    Py_DECREF(value);
+		    goto onError;
+		}
+		PyTuple_SET_ITEM(v,0,key);
+		PyTuple_SET_ITEM(v,1,value);
+	    }
+	    if (PyList_Append(list,v)) {
+		Py_DECREF(v);
+		goto onError;
+	    }
+	    Py_DECREF(v);
+	}
+	count += got;
+	advance = 1;
+    } while (more && (limit <= 0 || count < limit));
+
+    free(recs);
+    free(keys);
+    return count;
+
+ onError:
+    if (recs)
+	free(recs);
+    if (keys)
+	free(keys);
+    return -1;
+}
+
+/* Return a list with the keys, values or items of the index, sorted
+   ascending by key */
+static
+PyObject *mxBeeIndex_ReadAll(mxBeeIndexObject *self,
+			     int kind)
 {
     bError rc;
     bCursor c;
     PyObject *v = 0;
-    PyObject *w;
-
-    Py_NoArgsCheck();
 
+    mxBeeIndex_Lock(beeindex);
     Py_Assert(beeindex->handle != NULL,
 	      mxBeeIndex_Error,
 	      "index is closed");
@@ -885,88 +1676,47 @@ Py_C_Function( mxBeeIndex_keys,
 	goto onError;
     
     /* Find first */
-    rc = bFindFirstKey(beeindex->handle,&c,NULL,NULL);
-    if (rc == bErrKeyNotFound)
-	return v;
-    if (rc != bErrOk) {
+    mxBeeIndex_NOGIL(rc = bFindFirstKey(beeindex->handle,&c,NULL,NULL));
+    if (rc != bErrOk && rc != bErrKeyNotFound) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
     }
+    if (rc == bErrOk &&
+	mxBeeIndex_ReadItems(beeindex,&c,v,NULL,0,kind) < 0)
+	goto onError;
 
-    while (1) {
-	w = beeindex->ObjectFromKey(beeindex,c.key);
-	if (!w)
-	    goto onError;
-	PyList_Append(v,w);
-	Py_DECREF(w);
-
-	rc = bFindNextKey(beeindex->handle,&c,NULL,NULL);
-	if (rc == bErrKeyNotFound)
-	    break;
-	if (rc != bErrOk) {
-	    mxBeeBase_ReportError(rc);
-	    goto onError;
-	}
-    }
-    
+    mxBeeIndex_Unlock(beeindex);
     return v;
     
  onError:
+    mxBeeIndex_Unlock(beeindex);
     Py_XDECREF(v);
     return NULL;
 }
 
+Py_C_Function( mxBeeIndex_keys,
+	       "keys()\n\n"
+	       "Return a list of keys stored in the index. The list is\n"
+	       "sorted ascending."
+	       )
+{
+    Py_NoArgsCheck();
+    return mxBeeIndex_ReadAll(beeindex,MXBEEINDEX_KEYS);
+
+ onError:
+    return NULL;
+}
+
 Py_C_Function( mxBeeIndex_values,
 	       "values()\n\n"
 	       "Return a list of values stored in the index. The list is\n"
 	       "sorted in ascending key order."
 	       )
 {
-    bError rc;
-    bCursor c;
-    PyObject *v = 0;
-    PyObject *w;
-    bRecAddr rec;
-
     Py_NoArgsCheck();
+    return mxBeeIndex_ReadAll(beeindex,MXBEEINDEX_VALUES);
 
-    Py_Assert(beeindex->handle != NULL,
-	      mxBeeIndex_Error,
-	      "index is closed");
-
-    v = PyList_New(0);
-    if (!v)
-	goto onError;
-
-    /* Find first */
-    rc = bFindFirstKey(beeindex->handle,&c,NULL,&rec);
-    if (rc == bErrKeyNotFound)
-	return v;
-    if (rc != bErrOk) {
-	mxBeeBase_ReportError(rc);
-	goto onError;
-    }
-
-    while (1) {
-	w = mxBeeIndex_ObjectFromRecordAddress(rec);
-	if (!w)
-	    goto onError;
-	PyList_Append(v,w);
-	Py_DECREF(w);
-
-	rc = bFindNextKey(beeindex->handle,&c,NULL,&rec);
-	if (rc == bErrKeyNotFound)
-	    break;
-	if (rc != bErrOk) {
-	    mxBeeBase_ReportError(rc);
-	    goto onError;
-	}
-    }
-    
-    return v;
-    
  onError:
-    Py_XDECREF(v);
     return NULL;
 }
 
@@ -976,64 +1726,82 @@ Py_C_Function( mxBeeIndex_items,
 	       "in the index. The list is sorted ascending by key."
 	       )
 {
-    bError rc;
+    Py_NoArgsCheck();
+    return mxBeeIndex_ReadAll(beeindex,MXBEEINDEX_ITEMS);
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxBeeIndex_range,
+	       "range(lo=FirstKey,hi=LastKey,limit=0)\n\n"
+	       "Return a list of (key,value) tuples for all entries with\n"
+	       "lo <= key < hi, sorted ascending by key. hi may be LastKey\n"
+	       "to scan to the end of the index. If limit is given, at most\n"
+	       "limit entries are returned; use cursor.nextitems() to\n"
+	       "continue a scan in chunks. While scanning, the OS is asked\n"
+	       "to read ahead the following leaf nodes."
+	       )
+{
+    PyObject *lo = mxBeeIndex_FirstKey;
+    PyObject *hi = mxBeeIndex_LastKey;
+    long limit = 0;
+    PyObject *v = NULL;
+    char *hikey = NULL;
     bCursor c;
-    PyObject *v = 0;
-    bRecAddr rec;
+    bError rc;
 
-    Py_NoArgsCheck();
+    mxBeeIndex_Lock(beeindex);
+    Py_Get3Args("|OOl",lo,hi,limit);
 
     Py_Assert(beeindex->handle != NULL,
 	      mxBeeIndex_Error,
 	      "index is closed");
 
+    /* Convert the upper bound first: the key conversion may reuse its
+       buffer for lo */
+    if (hi != mxBeeIndex_LastKey) {
+	void *key = beeindex->KeyFromObject(beeindex,hi);
+	if (!key)
+	    goto onError;
+	hikey = new(char, beeindex->info.keySize);
+	if (hikey == NULL)
+	    Py_Error(PyExc_MemoryError,
+		     "Out of memory");
+	memcpy(hikey, key, beeindex->info.keySize);
+    }
+
     v = PyList_New(0);
     if (!v)
 	goto onError;
 
-    /* Find first */
-    rc = bFindFirstKey(beeindex->handle,&c,NULL,&rec);
-    if (rc == bErrKeyNotFound)
-	return v;
-    if (rc != bErrOk) {
+    /* Find the first entry in range */
+    if (lo == mxBeeIndex_FirstKey)
+	mxBeeIndex_NOGIL(rc = bFindFirstKey(beeindex->handle,&c,NULL,NULL));
+    else {
+	void *key = beeindex->KeyFromObject(beeindex,lo);
+	if (!key)
+	    goto onError;
+	mxBeeIndex_NOGIL(rc = bFindKeyGE(beeindex->handle,&c,key,NULL));
+    }
+    if (rc != bErrOk && rc != bErrKeyNotFound) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
     }
+    if (rc == bErrOk &&
+	mxBeeIndex_ReadItems(beeindex,&c,v,hikey,limit,
+			     MXBEEINDEX_ITEMS) < 0)
+	goto onError;
 
-    while (1) {
-	PyObject *key,*value,*t;
-	
-	key = beeindex->ObjectFromKey(beeindex,c.key);
-	if (!key)
-	    goto onError;
-	value = mxBeeIndex_ObjectFromRecordAddress(rec);
-	if (!value) {
-	    Py_DECREF(key);
-	    goto onError;
-	}
-	t = PyTuple_New(2);
-	if (!t) {
-	    Py_DECREF(key);
-	    Py_DECREF(value);
-	    goto onError;
-	}
-	PyTuple_SET_ITEM(t,0,key);
-	PyTuple_SET_ITEM(t,1,value);
-	PyList_Append(v,t);
-	Py_DECREF(t);
-
-	rc = bFindNextKey(beeindex->handle,&c,NULL,&rec);
-	if (rc == bErrKeyNotFound)
-	    break;
-	if (rc != bErrOk) {
-	    mxBeeBase_ReportError(rc);
-	    goto onError;
-	}
-    }
-    
+    mxBeeIndex_Unlock(beeindex);
+    if (hikey)
+	free(hikey);
     return v;
-    
+
  onError:
+    mxBeeIndex_Unlock(beeindex);
+    if (hikey)
+	free(hikey);
     Py_XDECREF(v);
     return NULL;
 }
@@ -1050,6 +1818,7 @@ Py_C_Function( mxBeeIndex_delete,
     bRecAddr record;
     void *key = NULL;
     
+    mxBeeIndex_Lock(beeindex);
     Py_Get2Args("O|O",obj,recaddr);
 
     Py_Assert(beeindex->handle != NULL,
@@ -1069,7 +1838,7 @@ Py_C_Function( mxBeeIndex_delete,
 	goto onError;
 
     /* Delete key using record address if dupkeys is enabled */
-    rc = bDeleteKey(beeindex->handle,key,&record);
+    mxBeeIndex_NOGIL(rc = bDeleteKey(beeindex->handle,key,&record));
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
@@ -1078,9 +1847,11 @@ Py_C_Function( mxBeeIndex_delete,
     /* Increment update count */
     beeindex->updates++;
 
+    mxBeeIndex_Unlock(beeindex);
     Py_ReturnNone();
 
  onError:
+    mxBeeIndex_Unlock(beeindex);
     return NULL;
 }
 
@@ -1097,6 +1868,7 @@ Py_C_Function( mxBeeIndex_update,
     bRecAddr record, oldrecord;
     void *key = NULL;
     
+    mxBeeIndex_Lock(beeindex);
     Py_Get3Args("OO|O",obj,value,oldvalue);
 
     Py_Assert(beeindex->handle != NULL,
@@ -1123,14 +1895,14 @@ Py_C_Function( mxBeeIndex_update,
 	goto onError;
 
     /* Delete key using oldrecord address if dupkeys is enabled */
-    rc = bDeleteKey(beeindex->handle,key,&oldrecord);
+    mxBeeIndex_NOGIL(rc = bDeleteKey(beeindex->handle,key,&oldrecord));
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
     }
 
     /* Insert the new key,value pair */
-    rc = bInsertKey(beeindex->handle,key,record);
+    mxBeeIndex_NOGIL(rc = bInsertKey(beeindex->handle,key,record));
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
@@ -1139,9 +1911,103 @@ Py_C_Function( mxBeeIndex_update,
     /* Increment update count */
     beeindex->updates++;
 
+    mxBeeIndex_Unlock(beeindex);
     Py_ReturnNone();
 
  onError:
+    mxBeeIndex_Unlock(beeindex);
+    return NULL;
+}
+
+Py_C_Function( mxBeeIndex_bulkload,
+	       "bulkload(items,fillfactor=0.9)\n\n"
+	       "Load the empty index from items, an iterable of (key,value)\n"
+	       "tuples in ascending key order (the order used by .keys()).\n"
+	       "With dupkeys enabled, duplicate keys must be given in\n"
+	       "ascending value order. The tree is built bottom-up with its\n"
+	       "nodes filled up to fillfactor (0.5-1.0); use lower values for\n"
+	       "indexes which will see many inserts. Returns the number of\n"
+	       "keys loaded. On error, the index is left empty."
+	       )
+{
+    PyObject *items;
+    PyObject *iterator = NULL;
+    PyObject *item = NULL;
+    double fillfactor = 0.9;
+    bError rc;
+    bRecAddr record;
+    void *key;
+    long count = 0;
+    int loading = 0;
+    int locked = 0;
+    
+    Py_Get2Args("O|d",items,fillfactor);
+
+    Py_Assert(fillfactor > 0.0 && fillfactor <= 1.0,
+	      PyExc_ValueError,
+	      "fillfactor must be in the range (0.0, 1.0]");
+
+    iterator = PyObject_GetIter(items);
+    if (iterator == NULL)
+	goto onError;
+
+    /* The index stays locked while loading, since the tree is
+       incomplete until bBulkLoadEnd() */
+    mxBeeIndex_Lock(beeindex);
+    locked = 1;
+    Py_Assert(beeindex->handle != NULL,
+	      mxBeeIndex_Error,
+	      "index is closed");
+    mxBeeIndex_NOGIL(rc = bBulkLoadBegin(beeindex->handle,
+					 (int)(fillfactor * 100.0 + 0.5)));
+    if (rc != bErrOk) {
+	mxBeeBase_ReportError(rc);
+	goto onError;
+    }
+    loading = 1;
+
+    while ((item = PyIter_Next(iterator)) != NULL) {
+	Py_Assert(PyTuple_Check(item) && PyTuple_GET_SIZE(item) == 2,
+		  PyExc_TypeError,
+		  "items must be (key,value) tuples");
+	key = beeindex->KeyFromObject(beeindex,PyTuple_GET_ITEM(item,0));
+	if (!key)
+	    goto onError;
+	record = mxBeeIndex_RecordAddressFromObject(PyTuple_GET_ITEM(item,1));
+	if (record == 0 && PyErr_Occurred())
+	    goto onError;
+	rc = bBulkLoadAdd(beeindex->handle,key,record);
+	if (rc != bErrOk) {
+	    mxBeeBase_ReportError(rc);
+	    goto onError;
+	}
+	Py_DECREF(item);
+	count++;
+    }
+    if (PyErr_Occurred())
+	goto onError;
+
+    loading = 0;
+    mxBeeIndex_NOGIL(rc = bBulkLoadEnd(beeindex->handle));
+
+    /* Increment update count */
+    beeindex->updates++;
+
+    if (rc != bErrOk) {
+	mxBeeBase_ReportError(rc);
+	goto onError;
+    }
+    mxBeeIndex_Unlock(beeindex);
+    Py_DECREF(iterator);
+    return PyInt_FromLong(count);
+
+ onError:
+    if (loading)
+	mxBeeIndex_NOGIL(bBulkLoadAbort(beeindex->handle));
+    if (locked)
+	mxBeeIndex_Unlock(beeindex);
+    Py_XDECREF(item);
+    Py_XDECREF(iterator);
     return NULL;
 }
 
@@ -1151,15 +2017,21 @@ Py_C_Function( mxBeeIndex_validate,
 	       "failure. This is an internal debugging feature only."
 	       )
 {
+    int rc;
+
+    mxBeeIndex_Lock(beeindex);
     Py_NoArgsCheck();
 
     Py_Assert(beeindex->handle != NULL,
 	      mxBeeIndex_Error,
 	      "index is closed");
 
-    return PyInt_FromLong(bValidateTree(beeindex->handle) == 0);
+    mxBeeIndex_NOGIL(rc = bValidateTree(beeindex->handle));
+    mxBeeIndex_Unlock(beeindex);
+    return PyInt_FromLong(rc == 0);
     
  onError:
+    mxBeeIndex_Unlock(beeindex);
     return NULL;
 }
 
@@ -1172,37 +2044,82 @@ PyObject *mxBeeIndex_Getattr(PyObject *obj,
 			     char *name)
 {
     mxBeeIndexObject *self = (mxBeeIndexObject *)obj;
+    bHandle *handle;
+    PyObject *v;
+
+    /* The handle may only be inspected while holding the index lock */
+    mxBeeIndex_Lock(self);
+    handle = self->handle;
     
     if (Py_WantAttr(name,"closed"))
-	return PyInt_FromLong((self->handle == NULL));
+	v = PyInt_FromLong((handle == NULL));
 
     else if (Py_WantAttr(name,"dupkeys"))
-	return PyInt_FromLong(self->info.dupKeys);
+	v = PyInt_FromLong(self->info.dupKeys);
 
     else if (Py_WantAttr(name,"filename"))
-	return PyString_FromString(self->info.iName);
+	v = PyString_FromString(self->info.iName);
 
     else if (Py_WantAttr(name,"statistics")) {
-	bHandle *handle = self->handle;
-	Py_Assert(self->handle != NULL,
+	Py_Assert(handle != NULL,
+		  mxBeeIndex_Error,
+		  "index is closed");
+	v = Py_BuildValue("iiiiiiiii",
+			  self->updates,
+			  handle->maxHeight,handle->nNodesIns,
+			  handle->nNodesDel,handle->nKeysIns,
+			  handle->nKeysDel,handle->nKeysUpd,
+			  handle->nDiskReads,handle->nDiskWrites);
+    }
+    
+    else if (Py_WantAttr(name,"cachestatistics")) {
+	Py_Assert(handle != NULL,
+		  mxBeeIndex_Error,
+		  "index is closed");
+	v = Py_BuildValue("iikkk",
+			  handle->bufCt,handle->bufCt * handle->sectorSize,
+			  handle->nCacheHits,handle->nCacheMisses,
+			  handle->nCacheEvictions);
+    }
+    
+    else if (Py_WantAttr(name,"format")) {
+	Py_Assert(handle != NULL,
+		  mxBeeIndex_Error,
+		  "index is closed");
+	v = Py_BuildValue("iii",
+			  handle->formatVersion,handle->compressed,
+			  handle->maxCt);
+    }
+    
+    else if (Py_WantAttr(name,"snapshot")) {
+	Py_Assert(handle != NULL,
+		  mxBeeIndex_Error,
+		  "index is closed");
+	v = PyInt_FromLong(handle->snap != NULL);
+    }
+    
+    else if (Py_WantAttr(name,"version")) {
+	Py_Assert(handle != NULL,
 		  mxBeeIndex_Error,
 		  "index is closed");
-	return Py_BuildValue("iiiiiiiii",
-			     self->updates,
-			     handle->maxHeight,handle->nNodesIns,
-			     handle->nNodesDel,handle->nKeysIns,
-			     handle->nKeysDel,handle->nKeysUpd,
-			     handle->nDiskReads,handle->nDiskWrites);
+	v = PyLong_FromUnsignedLong(handle->version);
     }
     
     else if (Py_WantAttr(name,"__members__"))
-	return Py_BuildValue("[ssss]",
-			     "closed","statistics","dupkeys",
-			     "filename");
+	v = Py_BuildValue("[ssssssss]",
+			  "closed","statistics","dupkeys",
+			  "filename","cachestatistics","format",
+			  "snapshot","version");
+
+    else
+	v = Py_FindMethod(mxBeeIndex_Methods,
+			  (PyObject *)self,name);
+
+    mxBeeIndex_Unlock(self);
+    return v;
 
-    return Py_FindMethod(mxBeeIndex_Methods,
-			 (PyObject *)self,name);
  onError:
+    mxBeeIndex_Unlock(self);
     return NULL;
 }
 
@@ -1213,43 +2130,40 @@ Py_ssize_t mxBeeIndex_Length(PyObject *obj)
     mxBeeIndexObject *self = (mxBeeIndexObject *)obj;
     bError rc;
     bCursor c;
-    int i;
+    Py_ssize_t i = 0;
     
+    mxBeeIndex_Lock(self);
     Py_Assert(self->handle != NULL,
 	      mxBeeIndex_Error,
 	      "index is closed");
 
-    if (self->length_state == self->updates)
-	return self->length;
+    if (self->length_state == self->updates) {
+	i = self->length;
+	mxBeeIndex_Unlock(self);
+	return i;
+    }
 
-    /* Find first */
+    /* Count all keys */
+    Py_BEGIN_ALLOW_THREADS
     rc = bFindFirstKey(self->handle,&c,NULL,NULL);
-    if (rc == bErrKeyNotFound)
-	return 0;
-    if (rc != bErrOk) {
+    while (rc == bErrOk) {
+	i++;
+	rc = bFindNextKey(self->handle,&c,NULL,NULL);
+    }
+    Py_END_ALLOW_THREADS
+    if (rc != bErrKeyNotFound) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
     }
-    i = 1;
-
-    /* Scan all others */
-    while (1) {
-	rc = bFindNextKey(self->handle,&c,NULL,NULL);
-	if (rc == bErrKeyNotFound)
-	    break;
-	if (rc != bErrOk) {
-	    mxBeeBase_ReportError(rc);
-	    goto onError;
-	}
-	i++;
-    }
 
-    self->length = i;
+    self->length = (int)i;
     self->length_state = self->updates;
     
+    mxBeeIndex_Unlock(self);
     return i;
 
  onError:
+    mxBeeIndex_Unlock(self);
     return -1;
 }
 
@@ -1260,17 +2174,19 @@ PyObject *mxBeeIndex_Subscript(PyObject *obj,
     mxBeeIndexObject *self = (mxBeeIndexObject *)obj;
     bRecAddr record;
 
+    mxBeeIndex_Lock(self);
     Py_Assert(self->handle != NULL,
 	      mxBeeIndex_Error,
 	      "index is closed");
 
-    record = mxBeeIndex_FindKey(self, key);
-    if (record == -1 && PyErr_Occurred())
+    if (mxBeeIndex_FindKey(self, key, &record))
 	goto onError;
     
+    mxBeeIndex_Unlock(self);
     return mxBeeIndex_ObjectFromRecordAddress(record);
 
  onError:
+    mxBeeIndex_Unlock(self);
     return NULL;
 }
 
@@ -1280,17 +2196,22 @@ int mxBeeIndex_AssignSubscript(PyObject *obj,
 			       PyObject *recaddr)
 {
     mxBeeIndexObject *self = (mxBeeIndexObject *)obj;
+    int rc;
 
+    mxBeeIndex_Lock(self);
     Py_Assert(self->handle != NULL,
 	      mxBeeIndex_Error,
 	      "index is closed");
 
     if (recaddr)
-	return mxBeeIndex_SetKey(self, key, recaddr);
+	rc = mxBeeIndex_SetKey(self, key, recaddr);
     else
-	return mxBeeIndex_DeleteKey(self, key);
+	rc = mxBeeIndex_DeleteKey(self, key);
+    mxBeeIndex_Unlock(self);
+    return rc;
 
  onError:
+    mxBeeIndex_Unlock(self);
     return -1;
 }
 
@@ -1353,15 +2274,19 @@ statichere
 PyMethodDef mxBeeIndex_Methods[] =
 {   
     Py_MethodListEntry("get",mxBeeIndex_get),
+    Py_MethodListEntry("get_many",mxBeeIndex_get_many),
+    Py_MethodListEntry("range",mxBeeIndex_range),
     Py_MethodListEntry("cursor",mxBeeIndex_cursor),
     Py_MethodListEntry("has_key",mxBeeIndex_has_key),
     Py_MethodListEntryNoArgs("flush",mxBeeIndex_flush),
+    Py_MethodListEntryNoArgs("refresh",mxBeeIndex_refresh),
     Py_MethodListEntryNoArgs("close",mxBeeIndex_close),
     Py_MethodListEntryNoArgs("keys",mxBeeIndex_keys),
     Py_MethodListEntryNoArgs("values",mxBeeIndex_values),
     Py_MethodListEntryNoArgs("items",mxBeeIndex_items),
     Py_MethodListEntry("delete",mxBeeIndex_delete),
     Py_MethodListEntry("update",mxBeeIndex_update),
+    Py_MethodListEntry("bulkload",mxBeeIndex_bulkload),
     Py_MethodListEntryNoArgs("clear",mxBeeIndex_clear),
     Py_MethodListEntryNoArgs("validate",mxBeeIndex_validate),
     {NULL,NULL} /* end of list */
@@ -1433,6 +2358,8 @@ void mxBeeCursor_Free(mxBeeCursorObject *cursor)
 
 /* --- API functions --- */
 
+/* These must be called with the index lock held. */
+
 static
 int mxBeeCursor_Invalid(mxBeeCursorObject *self)
 {
@@ -1467,7 +2394,8 @@ int mxBeeCursor_NextKey(mxBeeCursorObject *self)
 	goto onError;
 
     /* Find key (updates cursor only on success) */
-    rc = bFindNextKey(self->beeindex->handle,&self->c,NULL,NULL);
+    mxBeeIndex_NOGIL(rc = bFindNextKey(self->beeindex->handle,
+				       &self->c,NULL,NULL));
     if (rc == bErrKeyNotFound)
 	return 0;
     if (rc != bErrOk) {
@@ -1497,7 +2425,8 @@ int mxBeeCursor_PrevKey(mxBeeCursorObject *self)
 	goto onError;
 
     /* Find key (updates cursor only on success) */
-    rc = bFindPrevKey(self->beeindex->handle,&self->c,NULL,NULL);
+    mxBeeIndex_NOGIL(rc = bFindPrevKey(self->beeindex->handle,
+				       &self->c,NULL,NULL));
     if (rc == bErrKeyNotFound)
 	return 0;
     if (rc != bErrOk) {
@@ -1544,7 +2473,8 @@ PyObject *mxBeeCursor_GetValue(mxBeeCursorObject *self)
 	goto onError;
 
     /* Check that cursor is valid and read record address */
-    rc = bCursorReadData(self->beeindex->handle,&self->c,NULL,&rec);
+    mxBeeIndex_NOGIL(rc = bCursorReadData(self->beeindex->handle,
+					  &self->c,NULL,&rec));
     if (rc != bErrOk) {
 	mxBeeBase_ReportError(rc);
 	goto onError;
@@ -1574,11 +2504,13 @@ Py_C_Function( mxBeeCursor_next,
     int found;
     PyObject *v;
     
+    mxBeeIndex_Lock(cursor->beeindex);
     Py_NoArgsCheck();
 
     found = mxBeeCursor_NextKey(cursor);
     if (found < 0)
 	goto onError;
+    mxBeeIndex_Unlock(cursor->beeindex);
     if (found) 
 	v = Py_True;
     else
@@ -1587,6 +2519,7 @@ Py_C_Function( mxBeeCursor_next,
     return v;
 
  onError:
+    mxBeeIndex_Unlock(cursor->beeindex);
     return NULL;
 }
 
@@ -1600,11 +2533,13 @@ Py_C_Function( mxBeeCursor_prev,
     int found;
     PyObject *v;
 
+    mxBeeIndex_Lock(cursor->beeindex);
     Py_NoArgsCheck();
 
     found = mxBeeCursor_PrevKey(cursor);
     if (found < 0)
 	goto onError;
+    mxBeeIndex_Unlock(cursor->beeindex);
     if (found) 
 	v = Py_True;
     else
@@ -1613,6 +2548,77 @@ Py_C_Function( mxBeeCursor_prev,
     return v;
 
  onError:
+    mxBeeIndex_Unlock(cursor->beeindex);
+    return NULL;
+}
+
+Py_C_Function( mxBeeCursor_nextitems,
+	       "nextitems(limit=0,hi=LastKey)\n\n"
+	       "Return a list of (key,value) tuples for the entries\n"
+	       "following the current one, with at most limit entries (if\n"
+	       "limit > 0) and keys < hi. The cursor is moved to the last\n"
+	       "returned entry, so repeated calls scan the index in\n"
+	       "chunks. An empty list is returned at the end of the range."
+	       )
+{
+    PyObject *hi = mxBeeIndex_LastKey;
+    long limit = 0;
+    PyObject *v = NULL;
+    char *hikey = NULL;
+    bCursor c;
+    bError rc;
+    mxBeeIndexObject *beeindex = cursor->beeindex;
+
+    mxBeeIndex_Lock(beeindex);
+    Py_Get2Args("|lO",limit,hi);
+
+    if (mxBeeCursor_Invalid(cursor))
+	goto onError;
+
+    if (hi != mxBeeIndex_LastKey) {
+	void *key = beeindex->KeyFromObject(beeindex,hi);
+	if (!key)
+	    goto onError;
+	hikey = new(char, beeindex->info.keySize);
+	if (hikey == NULL)
+	    Py_Error(PyExc_MemoryError,
+		     "Out of memory");
+	memcpy(hikey, key, beeindex->info.keySize);
+    }
+
+    v = PyList_New(0);
+    if (!v)
+	goto onError;
+
+    c = cursor->c;
+    mxBeeIndex_NOGIL(rc = bFindNextKey(beeindex->handle,&c,NULL,NULL));
+    if (rc != bErrOk && rc != bErrKeyNotFound) {
+	mxBeeBase_ReportError(rc);
+	goto onError;
+    }
+    if (rc == bErrOk) {
+	long count;
+
+	count = mxBeeIndex_ReadItems(beeindex,&c,v,hikey,limit,
+				     MXBEEINDEX_ITEMS);
+	if (count < 0)
+	    goto onError;
+	if (count > 0) {
+	    cursor->c = c;
+	    cursor->adr = c.buffer->adr;
+	}
+    }
+
+    mxBeeIndex_Unlock(beeindex);
+    if (hikey)
+	free(hikey);
+    return v;
+
+ onError:
+    mxBeeIndex_Unlock(beeindex);
+    if (hikey)
+	free(hikey);
+    Py_XDECREF(v);
     return NULL;
 }
 
@@ -1622,14 +2628,20 @@ Py_C_Function( mxBeeCursor_copy,
 	       "used independently from the original."
 	       )
 {
+    PyObject *v;
+
+    mxBeeIndex_Lock(cursor->beeindex);
     Py_NoArgsCheck();
 
     if (mxBeeCursor_Invalid(cursor))
 	goto onError;
 
-    return (PyObject *)mxBeeCursor_New(cursor->beeindex,&cursor->c);
+    v = (PyObject *)mxBeeCursor_New(cursor->beeindex,&cursor->c);
+    mxBeeIndex_Unlock(cursor->beeindex);
+    return v;
 
  onError:
+    mxBeeIndex_Unlock(cursor->beeindex);
     return NULL;
 }
 
@@ -1642,33 +2654,40 @@ PyObject *mxBeeCursor_Getattr(PyObject *obj,
 			      char *name)
 {
     mxBeeCursorObject *self = (mxBeeCursorObject *)obj;
+    PyObject *v;
+
+    mxBeeIndex_Lock(self->beeindex);
 
     if (Py_WantAttr(name,"closed"))
-	return PyInt_FromLong((self->beeindex->handle == NULL));
+	v = PyInt_FromLong((self->beeindex->handle == NULL));
 
-    if (Py_WantAttr(name,"key"))
-	return mxBeeCursor_GetKey(self);
+    else if (Py_WantAttr(name,"key"))
+	v = mxBeeCursor_GetKey(self);
 
-    if (Py_WantAttr(name,"value"))
-	return mxBeeCursor_GetValue(self);
+    else if (Py_WantAttr(name,"value"))
+	v = mxBeeCursor_GetValue(self);
 
-    if (Py_WantAttr(name,"valid")) {
+    else if (Py_WantAttr(name,"valid")) {
 	if (mxBeeCursor_Invalid(self)) {
 	    PyErr_Clear();
-	    Py_INCREF(Py_False);
-	    return Py_False;
+	    v = Py_False;
 	}
-	Py_INCREF(Py_True);
-	return Py_True;
+	else
+	    v = Py_True;
+	Py_INCREF(v);
     }
     
     else if (Py_WantAttr(name,"__members__"))
-	return Py_BuildValue("[ssss]",
-			     "closed","key","value",
-			     "valid");
+	v = Py_BuildValue("[ssss]",
+			  "closed","key","value",
+			  "valid");
 
-    return Py_FindMethod(mxBeeCursor_Methods,
-			 (PyObject *)self,name);
+    else
+	v = Py_FindMethod(mxBeeCursor_Methods,
+			  (PyObject *)self,name);
+
+    mxBeeIndex_Unlock(self->beeindex);
+    return v;
 }
 
 /* Python Type Tables */
@@ -1725,15 +2744,1012 @@ PyMethodDef mxBeeCursor_Methods[] =
 {   
     Py_MethodListEntryNoArgs("next",mxBeeCursor_next),
     Py_MethodListEntryNoArgs("prev",mxBeeCursor_prev),
+    Py_MethodListEntry("nextitems",mxBeeCursor_nextitems),
     Py_MethodListEntryNoArgs("copy",mxBeeCursor_copy),
     {NULL,NULL} /* end of list */
 };
 
+/* --- BeeStorage Record Layer --------------------------------------------- */
+
+/* These functions implement the record I/O of BeeStorage.py in C,
+   using the same file layout: each record starts at a block boundary
+   with a header made of the ID byte, the record size (4 bytes, little
+   endian, including the header) and the record's state code.
+
+   They work directly on the stdio FILE of the storage's Python file
+   object and do not use the Python API, except where noted. Caching,
+   locking and the HOT/COLD state are left to the BeeStorage
+   methods. */
+
+#ifdef MS_WINDOWS
+# define mxBeeStorage_fseek(fp,offset) _fseeki64(fp,(__int64)(offset),SEEK_SET)
+#else
+# define mxBeeStorage_fseek(fp,offset) fseeko(fp,(off_t)(offset),SEEK_SET)
+#endif
+
+/* Run stmt without holding the GIL; file must be kept open while
+   doing so */
+#define mxBeeStorage_NOGIL(file,stmt) \
+        do {PyFile_IncUseCount((PyFileObject *)file); \
+            Py_BEGIN_ALLOW_THREADS stmt; Py_END_ALLOW_THREADS \
+            PyFile_DecUseCount((PyFileObject *)file);} while (0)
+
+/* Read the record header at position. Returns 1 if a valid header was
+   found, 0 if not and -1 in case of an I/O error (errno is set). The
+   file is left positioned at the record's data area. */
+
+static
+int mxBeeStorage_ReadHeader(FILE *fp,
+			    PY_LONG_LONG position,
+			    long *recordsize,
+			    char *code)
+{
+    unsigned char header[MXBEESTORAGE_HEADERSIZE];
+    unsigned long size;
+
+    if (position < 0 || position % MXBEESTORAGE_BLOCKSIZE != 0)
+	return 0;
+    if (mxBeeStorage_fseek(fp, position))
+	return -1;
+    if (fread(header, 1, MXBEESTORAGE_HEADERSIZE, fp) 
+	!= MXBEESTORAGE_HEADERSIZE)
+	return ferror(fp) ? -1 : 0;
+    if (header[0] != MXBEESTORAGE_ID ||
+	(header[5] != MXBEESTORAGE_VALID && header[5] != MXBEESTORAGE_OLD))
+	return 0;
+    size = ((unsigned long)header[1] |
+	    ((unsigned long)header[2] << 8) |
+	    ((unsigned long)header[3] << 16) |
+	    ((unsigned long)header[4] << 24));
+    /* Sizes are signed 32-bit values; headers with sizes smaller than
+       the header itself are treated as invalid */
+    if (size & 0x80000000UL || size < MXBEESTORAGE_HEADERSIZE)
+	return 0;
+    *recordsize = (long)size;
+    *code = (char)header[5];
+    return 1;
+}
+
+/* Write a record with the given header and data to position and pad
+   it with \0 bytes to recordsize. Returns -1 in case of an I/O error
+   (errno is set), 0 otherwise. */
+
+static
+int mxBeeStorage_WriteRecord(FILE *fp,
+			     PY_LONG_LONG position,
+			     long recordsize,
+			     char code,
+			     const char *data,
+			     size_t datalen)
+{
+    unsigned char header[MXBEESTORAGE_HEADERSIZE];
+    size_t padding = recordsize - MXBEESTORAGE_HEADERSIZE - datalen;
+
+    header[0] = MXBEESTORAGE_ID;
+    header[1] = (unsigned char)(recordsize & 0xFF);
+    header[2] = (unsigned char)((recordsize >> 8) & 0xFF);
+    header[3] = (unsigned char)((recordsize >> 16) & 0xFF);
+    header[4] = (unsigned char)((recordsize >> 24) & 0xFF);
+    header[5] = (unsigned char)code;
+    if (mxBeeStorage_fseek(fp, position))
+	return -1;
+    if (fwrite(header, 1, MXBEESTORAGE_HEADERSIZE, fp) 
+	!= MXBEESTORAGE_HEADERSIZE)
+	return -1;
+    if (datalen > 0 && fwrite(data, 1, datalen, fp) != datalen)
+	return -1;
+    while (padding > 0) {
+	static const char zeros[MXBEESTORAGE_BLOCKSIZE];
+	size_t len = padding;
+
+	if (len > sizeof(zeros))
+	    len = sizeof(zeros);
+	if (fwrite(zeros, 1, len, fp) != len)
+	    return -1;
+	padding -= len;
+    }
+    return 0;
+}
+
+/* Return the stdio FILE of a Python file object; uses the Python
+   API */
+
+static
+FILE *mxBeeStorage_File(PyObject *file)
+{
+    FILE *fp;
+
+    Py_Assert(PyFile_Check(file),
+	      PyExc_TypeError,
+	      "file must be a file object");
+    fp = PyFile_AsFile(file);
+    Py_Assert(fp != NULL,
+	      PyExc_ValueError,
+	      "I/O operation on closed file");
+    return fp;
+
+ onError:
+    return NULL;
+}
+
+/* Raise an IOError for the last failed I/O operation on fp; uses the
+   Python API */
+
+static
+void mxBeeStorage_ReportError(FILE *fp)
+{
+    PyErr_SetFromErrno(PyExc_IOError);
+    clearerr(fp);
+}
+
+/* Return a Python int (or long, if needed) for a file position; uses
+   the Python API */
+
+static
+PyObject *mxBeeStorage_FromPosition(PY_LONG_LONG position)
+{
+    if (position <= LONG_MAX)
+	return PyInt_FromLong((long)position);
+    return PyLong_FromLongLong(position);
+}
+
+Py_C_Function( mxBeeStorage_readheader,
+	       "readheader(file,position,EOF)\n\n"
+	       "Read the BeeStorage record header at position and return\n"
+	       "a tuple (record size, statebyte, data area size). The file\n"
+	       "is positioned to the record's data area. Returns None if\n"
+	       "no valid header can be read at position."
+	       )
+{
+    PyObject *file;
+    PY_LONG_LONG position, eof;
+    FILE *fp;
+    long recordsize;
+    char code;
+    int rc;
+
+    Py_Get3Args("OLL",file,position,eof);
+
+    fp = mxBeeStorage_File(file);
+    if (fp == NULL)
+	goto onError;
+    if (position > eof)
+	Py_ReturnNone();
+    mxBeeStorage_NOGIL(file,
+		       rc = mxBeeStorage_ReadHeader(fp,position,
+						    &recordsize,&code));
+    if (rc < 0) {
+	mxBeeStorage_ReportError(fp);
+	goto onError;
+    }
+    if (rc == 0)
+	Py_ReturnNone();
+    return Py_BuildValue("lcl",
+			 recordsize,code,
+			 recordsize - MXBEESTORAGE_HEADERSIZE);
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxBeeStorage_readrecord,
+	       "readrecord(file,position,EOF)\n\n"
+	       "Read the BeeStorage record at position and return a tuple\n"
+	       "(statebyte, raw data). The raw data includes the record's\n"
+	       "padding. Returns None if no valid header can be read at\n"
+	       "position."
+	       )
+{
+    PyObject *file;
+    PyObject *data = NULL;
+    PY_LONG_LONG position, eof;
+    FILE *fp;
+    long recordsize;
+    size_t datasize, len;
+    char code;
+    int rc;
+
+    Py_Get3Args("OLL",file,position,eof);
+
+    fp = mxBeeStorage_File(file);
+    if (fp == NULL)
+	goto onError;
+    if (position > eof)
+	Py_ReturnNone();
+    mxBeeStorage_NOGIL(file,
+		       rc = mxBeeStorage_ReadHeader(fp,position,
+						    &recordsize,&code));
+    if (rc < 0) {
+	mxBeeStorage_ReportError(fp);
+	goto onError;
+    }
+    if (rc == 0)
+	Py_ReturnNone();
+
+    /* Read the data area; the file is already positioned */
+    datasize = recordsize - MXBEESTORAGE_HEADERSIZE;
+    data = PyString_FromStringAndSize(NULL, datasize);
+    if (data == NULL)
+	goto onError;
+    mxBeeStorage_NOGIL(file,
+		       len = fread(PyString_AS_STRING(data),1,datasize,fp));
+    if (len < datasize) {
+	if (ferror(fp)) {
+	    mxBeeStorage_ReportError(fp);
+	    goto onError;
+	}
+	if (_PyString_Resize(&data, len))
+	    goto onError;
+    }
+    return Py_BuildValue("cN",code,data);
+
+ onError:
+    Py_XDECREF(data);
+    return NULL;
+}
+
+Py_C_Function( mxBeeStorage_writerecord,
+	       "writerecord(file,position,recordsize,statebyte,data)\n\n"
+	       "Write a BeeStorage record of recordsize bytes with the\n"
+	       "given statebyte and data to position. The data is padded\n"
+	       "with \\0 bytes. Returns the file position following the\n"
+	       "record."
+	       )
+{
+    PyObject *file;
+    PY_LONG_LONG position;
+    long recordsize;
+    char code;
+    char *data;
+    Py_ssize_t datalen;
+    FILE *fp;
+    int rc;
+
+    Py_Get6Args("OLlcs#",file,position,recordsize,code,data,datalen);
+
+    fp = mxBeeStorage_File(file);
+    if (fp == NULL)
+	goto onError;
+    Py_Assert(position >= 0 &&
+	      position % MXBEESTORAGE_BLOCKSIZE == 0,
+	      PyExc_ValueError,
+	      "position must be a positive multiple of the block size");
+    Py_Assert(recordsize <= 0x7FFFFFFFL &&
+	      datalen <= recordsize - MXBEESTORAGE_HEADERSIZE,
+	      PyExc_ValueError,
+	      "data does not fit into the record");
+    mxBeeStorage_NOGIL(file,
+		       rc = mxBeeStorage_WriteRecord(fp,position,recordsize,
+						     code,data,datalen));
+    if (rc < 0) {
+	mxBeeStorage_ReportError(fp);
+	goto onError;
+    }
+    return mxBeeStorage_FromPosition(position + recordsize);
+
+ onError:
+    return NULL;
+}
+
+/* Append a (position,size) tuple to list */
+
+static
+int mxBeeStorage_AppendRecord(PyObject *list,
+			      PY_LONG_LONG position,
+			      long size)
+{
+    PyObject *v;
+    int rc;
+
+    v = Py_BuildValue("Nl",mxBeeStorage_FromPosition(position),size);
+    if (v == NULL)
+	return -1;
+    rc = PyList_Append(list,v);
+    Py_DECREF(v);
+    return rc;
+}
+
+Py_C_Function( mxBeeStorage_findrecords,
+	       "findrecords(file,start,stop)\n\n"
+	       "Scan the BeeStorage file from position start to stop for\n"
+	       "valid, old and invalid records and return a tuple of three\n"
+	       "lists (valid,old,invalid) with (position,size) tuples.\n"
+	       "start must be a block boundary."
+	       )
+{
+    PyObject *file;
+    PyObject *valid = NULL, *old = NULL, *invalid = NULL;
+    PY_LONG_LONG position, stop;
+    FILE *fp;
+    long recordsize;
+    char code;
+    int rc;
+
+    Py_Get3Args("OLL",file,position,stop);
+
+    fp = mxBeeStorage_File(file);
+    if (fp == NULL)
+	goto onError;
+    valid = PyList_New(0);
+    old = PyList_New(0);
+    invalid = PyList_New(0);
+    if (valid == NULL || old == NULL || invalid == NULL)
+	goto onError;
+
+    while (position < stop) {
+	mxBeeStorage_NOGIL(file,
+			   rc = mxBeeStorage_ReadHeader(fp,position,
+							&recordsize,&code));
+	if (rc < 0) {
+	    mxBeeStorage_ReportError(fp);
+	    goto onError;
+	}
+	if (rc == 0) {
+	    /* No record found at that position: try next block; note
+	       that the recorded position is the one of the next
+	       block */
+	    position += MXBEESTORAGE_BLOCKSIZE;
+	    if (mxBeeStorage_AppendRecord(invalid,position,
+					  MXBEESTORAGE_BLOCKSIZE))
+		goto onError;
+	    continue;
+	}
+	if (mxBeeStorage_AppendRecord(((unsigned char)code == 
+				       MXBEESTORAGE_VALID) ? valid : old,
+				      position,recordsize))
+	    goto onError;
+	position += recordsize;
+    }
+    return Py_BuildValue("NNN",valid,old,invalid);
+
+ onError:
+    Py_XDECREF(valid);
+    Py_XDECREF(old);
+    Py_XDECREF(invalid);
+    return NULL;
+}
+
+Py_C_Function( mxBeeStorage_collectrecords,
+	       "collectrecords(file,start,EOF,callback,recover=0)\n\n"
+	       "Move all valid BeeStorage records between start and EOF\n"
+	       "to the beginning of that area, calling\n"
+	       "callback(old_position,new_position,raw_data) for every\n"
+	       "moved record (or every valid record, if recover is\n"
+	       "true). Returns a tuple (end of the moved records, list of\n"
+	       "skipped block positions). The file is not truncated."
+	       )
+{
+    PyObject *file, *callback;
+    PyObject *skipped = NULL;
+    PyObject *data = NULL;
+    PY_LONG_LONG source, dest, eof;
+    FILE *fp;
+    long recordsize;
+    size_t datasize, len;
+    char code;
+    int recover = 0;
+    int rc;
+
+    Py_Get5Args("OLLO|i",file,source,eof,callback,recover);
+
+    fp = mxBeeStorage_File(file);
+    if (fp == NULL)
+	goto onError;
+    skipped = PyList_New(0);
+    if (skipped == NULL)
+	goto onError;
+    dest = source;
+
+    while (source < eof) {
+	mxBeeStorage_NOGIL(file,
+			   rc = mxBeeStorage_ReadHeader(fp,source,
+							&recordsize,&code));
+	if (rc < 0) {
+	    mxBeeStorage_ReportError(fp);
+	    goto onError;
+	}
+	if (rc == 0) {
+	    /* Unallocated space: skip */
+	    PyObject *v;
+
+	    source += MXBEESTORAGE_BLOCKSIZE;
+	    v = mxBeeStorage_FromPosition(source);
+	    if (v == NULL || PyList_Append(skipped,v)) {
+		Py_XDECREF(v);
+		goto onError;
+	    }
+	    Py_DECREF(v);
+	    continue;
+	}
+
+	if ((unsigned char)code == MXBEESTORAGE_VALID) {
+	    if (source != dest || recover) {
+		PyObject *v;
+
+		/* Read the data area; the file is already positioned */
+		datasize = recordsize - MXBEESTORAGE_HEADERSIZE;
+		data = PyString_FromStringAndSize(NULL, datasize);
+		if (data == NULL)
+		    goto onError;
+		mxBeeStorage_NOGIL(file,
+				   len = fread(PyString_AS_STRING(data),
+					       1,datasize,fp));
+		if (len < datasize) {
+		    if (ferror(fp)) {
+			mxBeeStorage_ReportError(fp);
+			goto onError;
+		    }
+		    if (_PyString_Resize(&data, len))
+			goto onError;
+		}
+
+		/* Move the record */
+		if (source != dest) {
+		    mxBeeStorage_NOGIL(file,
+				       rc = mxBeeStorage_WriteRecord(
+					   fp,dest,recordsize,code,
+					   PyString_AS_STRING(data),len));
+		    if (rc < 0) {
+			mxBeeStorage_ReportError(fp);
+			goto onError;
+		    }
+		}
+
+		/* Inform the caller */
+		v = PyObject_CallFunction(callback,"NNO",
+					  mxBeeStorage_FromPosition(source),
+					  mxBeeStorage_FromPosition(dest),
+					  data);
+		if (v == NULL)
+		    goto onError;
+		Py_DECREF(v);
+		Py_CLEAR(data);
+	    }
+	    dest += recordsize;
+	}
+
+	/* Process next record */
+	source += recordsize;
+    }
+    return Py_BuildValue("NN",mxBeeStorage_FromPosition(dest),skipped);
+
+ onError:
+    Py_XDECREF(data);
+    Py_XDECREF(skipped);
+    return NULL;
+}
+
+/* --- Bloom Filter -------------------------------------------------------- */
+
+/* Bit operations for the Bloom filters of BeeBloom.py. The filter
+   bits are kept in a Python buffer object (an array('B')); bit n is
+   bit n % 8 of byte n / 8.
+
+   Keys are either integers, which are used as hash value, or
+   strings, which are hashed using 64-bit FNV-1a. The k bit numbers
+   for a key are derived by double hashing from the two halves of
+   the mixed hash value. BeeBloom.py has an equivalent Python
+   implementation. */
+
+static
+int mxBloom_Hash(PyObject *key,
+		 unsigned PY_LONG_LONG *hash)
+{
+    unsigned PY_LONG_LONG h;
+
+    if (PyString_Check(key)) {
+	unsigned char *p = (unsigned char *)PyString_AS_STRING(key);
+	Py_ssize_t len = PyString_GET_SIZE(key);
+
+	h = 0xcbf29ce484222325ULL;
+	while (len-- > 0) {
+	    h ^= *p++;
+	    h *= 0x100000001b3ULL;
+	}
+    }
+    else if (PyInt_Check(key))
+	h = PyInt_AsUnsignedLongLongMask(key);
+    else if (PyLong_Check(key))
+	h = PyLong_AsUnsignedLongLongMask(key);
+    else {
+	PyErr_SetString(PyExc_TypeError,
+			"Bloom filter keys must be strings or integers");
+	return -1;
+    }
+    if (h == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred())
+	return -1;
+
+    /* Mix the bits (MurmurHash3 finalizer) */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    *hash = h;
+    return 0;
+}
+
+static
+int mxBloom_Probe(PyObject *bits,
+		  int k,
+		  PyObject *key,
+		  int add)
+{
+    unsigned char *buffer;
+    Py_ssize_t len;
+    unsigned PY_LONG_LONG hash, h1, h2, nbits, bit;
+    int i;
+
+    if (add) {
+	if (PyObject_AsWriteBuffer(bits,(void **)&buffer,&len))
+	    return -1;
+    }
+    else {
+	if (PyObject_AsReadBuffer(bits,(const void **)&buffer,&len))
+	    return -1;
+    }
+    if (len <= 0 || k <= 0) {
+	PyErr_SetString(PyExc_ValueError,
+			"empty Bloom filter or no hash functions");
+	return -1;
+    }
+    if (mxBloom_Hash(key,&hash))
+	return -1;
+    nbits = (unsigned PY_LONG_LONG)len * 8;
+    h1 = hash >> 32;
+    h2 = (hash & 0xffffffffULL) | 1;
+
+    for (i = 0; i < k; i++) {
+	bit = (h1 + i * h2) % nbits;
+	if (add)
+	    buffer[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+	else if (!(buffer[bit >> 3] & (1 << (bit & 7))))
+	    return 0;
+    }
+    return 1;
+}
+
+Py_C_Function( mxBloom_bloomadd,
+	       "bloomadd(bits,k,key)\n\n"
+	       "Set the k bits for key (a string or integer) in the Bloom\n"
+	       "filter buffer bits."
+	       )
+{
+    PyObject *bits, *key;
+    int k;
+
+    Py_Get3Args("OiO",bits,k,key);
+    if (mxBloom_Probe(bits,k,key,1) < 0)
+	goto onError;
+    Py_ReturnNone();
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxBloom_bloomcheck,
+	       "bloomcheck(bits,k,key)\n\n"
+	       "Return 1 if all k bits for key (a string or integer) are\n"
+	       "set in the Bloom filter buffer bits, 0 otherwise."
+	       )
+{
+    PyObject *bits, *key;
+    int k;
+    int rc;
+
+    Py_Get3Args("OiO",bits,k,key);
+    rc = mxBloom_Probe(bits,k,key,0);
+    if (rc < 0)
+	goto onError;
+    return PyInt_FromLong(rc);
+
+ onError:
+    return NULL;
+}
+
+/* --- Shared Cache -------------------------------------------------------- */
+
+/* Operations on the shared cache segments of SharedCache.py. The
+   segment is passed in as writable buffer object, normally an mmap
+   object mapping the same file in all processes using the cache.
+
+   A record is cached in the set selected by its position and may use
+   any of the set's MXSHAREDCACHE_WAYS slots; if all are used, the
+   least recently accessed one is evicted. A process writing a slot
+   takes it by atomically changing the slot's sequence number from
+   even to odd and releases it by incrementing the number again. A
+   slot that is already taken is not written at all, so no process
+   ever waits for another. Readers copy the data without taking the
+   slot and check that the sequence number did not change meanwhile.
+
+   Invalidating a record increments the version of its set, which
+   invalidates all slots of the set written before. Data read from
+   the storage file must be stored with the set version fetched
+   before reading it, so that data which was invalidated while being
+   read never becomes valid. */
+
+#if defined(__GNUC__)
+# define mxSharedCache_CAS(p,old,new) __sync_bool_compare_and_swap(p,old,new)
+# define mxSharedCache_Increment(p) ((void)__sync_add_and_fetch(p,1))
+# define mxSharedCache_Barrier() __sync_synchronize()
+#elif defined(_MSC_VER)
+# include <windows.h>
+# define mxSharedCache_CAS(p,old,new) \
+        (InterlockedCompareExchange((volatile LONG *)(p),(LONG)(new),\
+				    (LONG)(old)) == (LONG)(old))
+# define mxSharedCache_Increment(p) \
+        ((void)InterlockedIncrement((volatile LONG *)(p)))
+# define mxSharedCache_Barrier() MemoryBarrier()
+#else
+/* No atomic operations available: the functions raise an error */
+# define MXSHAREDCACHE_UNSUPPORTED
+#endif
+
+typedef volatile mxSharedCacheSlot mxSharedCacheSlotPtr;
+
+typedef struct {
+    mxSharedCacheHeader *header;
+    volatile unsigned int *versions;	/* Set versions */
+    char *slots;			/* Start of the first slot */
+    unsigned int slotsize;
+    unsigned int nsets;
+} mxSharedCache;
+
+#define mxSharedCache_Slot(cache,set,way) \
+        ((mxSharedCacheSlotPtr *)((cache)->slots + \
+	  ((size_t)(set) * MXSHAREDCACHE_WAYS + (way)) * (cache)->slotsize))
+#define mxSharedCache_Data(slot) \
+        ((char *)(slot) + sizeof(mxSharedCacheSlot))
+#define mxSharedCache_MaxData(cache) \
+        ((cache)->slotsize - sizeof(mxSharedCacheSlot))
+
+/* Size of a segment with nsets sets of slotsize bytes slots */
+
+static
+unsigned PY_LONG_LONG mxSharedCache_SegmentSize(unsigned PY_LONG_LONG nsets,
+						unsigned PY_LONG_LONG slotsize)
+{
+    unsigned PY_LONG_LONG versions;
+
+    versions = nsets * sizeof(unsigned int);
+    versions = ((versions + MXSHAREDCACHE_HEADERSIZE - 1) /
+		MXSHAREDCACHE_HEADERSIZE * MXSHAREDCACHE_HEADERSIZE);
+    return (MXSHAREDCACHE_HEADERSIZE + versions +
+	    nsets * MXSHAREDCACHE_WAYS * slotsize);
+}
+
+/* Setup cache for the segment in buffer. Returns -1 with an exception
+   set in case buffer does not hold a valid segment. */
+
+static
+int mxSharedCache_Setup(PyObject *buffer,
+			mxSharedCache *cache)
+{
+    char *data;
+    Py_ssize_t len;
+    mxSharedCacheHeader *header;
+
+#ifdef MXSHAREDCACHE_UNSUPPORTED
+    PyErr_SetString(PyExc_NotImplementedError,
+		    "shared caches are not supported on this platform");
+    return -1;
+#endif
+    if (PyObject_AsWriteBuffer(buffer,(void **)&data,&len))
+	return -1;
+    header = (mxSharedCacheHeader *)data;
+    if (len < MXSHAREDCACHE_HEADERSIZE ||
+	memcmp(header->magic,MXSHAREDCACHE_MAGIC,sizeof(header->magic)) ||
+	header->slotsize < 2 * sizeof(mxSharedCacheSlot) ||
+	header->slotsize % 8 != 0 ||
+	header->nsets == 0 ||
+	mxSharedCache_SegmentSize(header->nsets,header->slotsize) >
+	(unsigned PY_LONG_LONG)len) {
+	PyErr_SetString(PyExc_ValueError,
+			"buffer is not a shared cache segment");
+	return -1;
+    }
+    cache->header = header;
+    cache->versions = (unsigned int *)(data + MXSHAREDCACHE_HEADERSIZE);
+    cache->slotsize = header->slotsize;
+    cache->nsets = header->nsets;
+    cache->slots = (data + 
+		    (size_t)mxSharedCache_SegmentSize(header->nsets,0));
+    return 0;
+}
+
+/* Return the set for the record at position */
+
+static
+unsigned int mxSharedCache_Set(mxSharedCache *cache,
+			       PY_LONG_LONG position)
+{
+    unsigned PY_LONG_LONG h = (unsigned PY_LONG_LONG)position;
+
+    /* Positions are multiples of the block size; mix the bits
+       (MurmurHash3 finalizer) */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (unsigned int)(h % cache->nsets);
+}
+
+Py_C_Function( mxSharedCache_sharedcacheinit,
+	       "sharedcacheinit(buffer,slotsize)\n\n"
+	       "Initialize a new shared cache segment in buffer using slots\n"
+	       "of slotsize bytes (rounded up to a multiple of 8). Returns\n"
+	       "the number of slots. Must not be used on a segment which\n"
+	       "is already in use."
+	       )
+{
+    PyObject *buffer;
+    char *data;
+    Py_ssize_t len;
+    long slotsize;
+    unsigned PY_LONG_LONG nsets;
+    mxSharedCacheHeader *header;
+
+    Py_Get2Args("Ol",buffer,slotsize);
+#ifdef MXSHAREDCACHE_UNSUPPORTED
+    Py_Error(PyExc_NotImplementedError,
+	     "shared caches are not supported on this platform");
+#endif
+    if (PyObject_AsWriteBuffer(buffer,(void **)&data,&len))
+	goto onError;
+    slotsize = (slotsize + 7) / 8 * 8;
+    Py_Assert(slotsize >= 2 * (long)sizeof(mxSharedCacheSlot),
+	      PyExc_ValueError,
+	      "slotsize too small");
+    nsets = ((unsigned PY_LONG_LONG)len / 
+	     (MXSHAREDCACHE_WAYS * slotsize + sizeof(unsigned int)));
+    if (nsets > 0xffffffffUL)
+	nsets = 0xffffffffUL;
+    while (nsets > 0 && 
+	   mxSharedCache_SegmentSize(nsets,slotsize) > 
+	   (unsigned PY_LONG_LONG)len)
+	nsets--;
+    Py_Assert(nsets > 0,
+	      PyExc_ValueError,
+	      "buffer too small for a shared cache segment");
+
+    memset(data,0,(size_t)mxSharedCache_SegmentSize(nsets,slotsize));
+    header = (mxSharedCacheHeader *)data;
+    header->slotsize = (unsigned int)slotsize;
+    header->nsets = (unsigned int)nsets;
+    mxSharedCache_Barrier();
+    memcpy(header->magic,MXSHAREDCACHE_MAGIC,sizeof(header->magic));
+    return PyInt_FromLong((long)(nsets * MXSHAREDCACHE_WAYS));
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxSharedCache_sharedcacheget,
+	       "sharedcacheget(buffer,position)\n\n"
+	       "Return the data cached for the record at position in the\n"
+	       "shared cache segment buffer, or None."
+	       )
+{
+    PyObject *buffer, *data;
+    PY_LONG_LONG position;
+    mxSharedCache cache;
+    unsigned int set, version, seq, length;
+    int way;
+
+    Py_Get2Args("OL",buffer,position);
+    if (mxSharedCache_Setup(buffer,&cache))
+	goto onError;
+    set = mxSharedCache_Set(&cache,position);
+    version = cache.versions[set];
+
+    for (way = 0; way < MXSHAREDCACHE_WAYS; way++) {
+	mxSharedCacheSlotPtr *slot = mxSharedCache_Slot(&cache,set,way);
+
+	seq = slot->seq;
+	if (seq & 1)
+	    /* Being written */
+	    continue;
+	mxSharedCache_Barrier();
+	if (slot->address != position + 1 || slot->version != version)
+	    continue;
+	length = slot->length;
+	if (length > mxSharedCache_MaxData(&cache))
+	    continue;
+	data = PyString_FromStringAndSize(mxSharedCache_Data(slot),
+					  (Py_ssize_t)length);
+	if (data == NULL)
+	    goto onError;
+	mxSharedCache_Barrier();
+	if (slot->seq != seq) {
+	    /* Overwritten while copying */
+	    Py_DECREF(data);
+	    continue;
+	}
+	slot->stamp = ++cache.header->clock;
+	cache.header->hits++;
+	return data;
+    }
+    cache.header->misses++;
+    Py_ReturnNone();
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxSharedCache_sharedcacheput,
+	       "sharedcacheput(buffer,position,data,version)\n\n"
+	       "Store data for the record at position in the shared cache\n"
+	       "segment buffer. version must be the set version returned\n"
+	       "by sharedcacheversion() before data was read. Returns 1 if\n"
+	       "the data was stored, 0 if not."
+	       )
+{
+    PyObject *buffer;
+    PY_LONG_LONG position;
+    char *data;
+    Py_ssize_t datalen;
+    unsigned int version;
+    mxSharedCache cache;
+    mxSharedCacheSlotPtr *victim, *unused, *oldest;
+    unsigned int set, seq;
+    int way;
+
+    Py_Get5Args("OLs#I",buffer,position,data,datalen,version);
+    if (mxSharedCache_Setup(buffer,&cache))
+	goto onError;
+    if ((size_t)datalen > mxSharedCache_MaxData(&cache))
+	return PyInt_FromLong(0);
+    set = mxSharedCache_Set(&cache,position);
+    if (cache.versions[set] != version)
+	/* Invalidated since data was read */
+	return PyInt_FromLong(0);
+
+    /* Use the slot already holding the record, an unused one or the
+       least recently accessed one */
+    victim = unused = oldest = NULL;
+    for (way = 0; way < MXSHAREDCACHE_WAYS; way++) {
+	mxSharedCacheSlotPtr *slot = mxSharedCache_Slot(&cache,set,way);
+
+	if (slot->address == position + 1) {
+	    if (slot->version == version && !(slot->seq & 1))
+		/* Already cached */
+		return PyInt_FromLong(1);
+	    victim = slot;
+	    break;
+	}
+	if (slot->seq & 1)
+	    continue;
+	if (slot->address == 0 || slot->version != version) {
+	    if (unused == NULL)
+		unused = slot;
+	}
+	else if (oldest == NULL || (int)(slot->stamp - oldest->stamp) < 0)
+	    oldest = slot;
+    }
+    if (victim == NULL)
+	victim = (unused != NULL) ? unused : oldest;
+    if (victim == NULL)
+	return PyInt_FromLong(0);
+
+    /* Take the slot */
+    seq = victim->seq;
+    if ((seq & 1) || !mxSharedCache_CAS(&victim->seq,seq,seq + 1))
+	return PyInt_FromLong(0);
+    mxSharedCache_Barrier();
+    victim->address = position + 1;
+    victim->version = version;
+    victim->length = (unsigned int)datalen;
+    memcpy(mxSharedCache_Data(victim),data,(size_t)datalen);
+    victim->stamp = ++cache.header->clock;
+    mxSharedCache_Barrier();
+    victim->seq = seq + 2;
+    return PyInt_FromLong(1);
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxSharedCache_sharedcacheversion,
+	       "sharedcacheversion(buffer,position)\n\n"
+	       "Return the version of the set of the record at position\n"
+	       "in the shared cache segment buffer."
+	       )
+{
+    PyObject *buffer;
+    PY_LONG_LONG position;
+    mxSharedCache cache;
+
+    Py_Get2Args("OL",buffer,position);
+    if (mxSharedCache_Setup(buffer,&cache))
+	goto onError;
+    return PyInt_FromLong(
+	(long)cache.versions[mxSharedCache_Set(&cache,position)]);
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxSharedCache_sharedcacheinvalidate,
+	       "sharedcacheinvalidate(buffer,position)\n\n"
+	       "Invalidate the data cached for the record at position in\n"
+	       "the shared cache segment buffer."
+	       )
+{
+    PyObject *buffer;
+    PY_LONG_LONG position;
+    mxSharedCache cache;
+
+    Py_Get2Args("OL",buffer,position);
+    if (mxSharedCache_Setup(buffer,&cache))
+	goto onError;
+    mxSharedCache_Increment(&cache.versions[mxSharedCache_Set(&cache,
+							      position)]);
+    Py_ReturnNone();
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxSharedCache_sharedcacheclear,
+	       "sharedcacheclear(buffer)\n\n"
+	       "Invalidate all data in the shared cache segment buffer."
+	       )
+{
+    PyObject *buffer;
+    mxSharedCache cache;
+    unsigned int set;
+
+    Py_GetArg("O",buffer);
+    if (mxSharedCache_Setup(buffer,&cache))
+	goto onError;
+    for (set = 0; set < cache.nsets; set++)
+	mxSharedCache_Increment(&cache.versions[set]);
+    Py_ReturnNone();
+
+ onError:
+    return NULL;
+}
+
+Py_C_Function( mxSharedCache_sharedcachestats,
+	       "sharedcachestats(buffer)\n\n"
+	       "Return a tuple (slots,slotsize,hits,misses) for the shared\n"
+	       "cache segment buffer. hits and misses are approximate."
+	       )
+{
+    PyObject *buffer;
+    mxSharedCache cache;
+
+    Py_GetArg("O",buffer);
+    if (mxSharedCache_Setup(buffer,&cache))
+	goto onError;
+    return Py_BuildValue("(kkKK)",
+			 (unsigned long)cache.nsets * MXSHAREDCACHE_WAYS,
+			 (unsigned long)cache.slotsize,
+			 cache.header->hits,
+			 cache.header->misses);
+
+ onError:
+    return NULL;
+}
+
 /* --- Module Interface ---------------------------------------------------- */
 
 Py_C_Function_WithKeywords(
     mxBeeIndex_BeeStringIndex,
-    "BeeStringIndex(filename,keysize,dupkeys=0,filemode=0,sectorsize=256)\n\n"
+    "BeeStringIndex(filename,keysize,dupkeys=0,filemode=0,sectorsize=256,\n"
+    "    cachesize=0,mmap=0,avgkeysize=0,readahead=65536,snapshot=0)\n\n"
+    "If avgkeysize is given, a new index file uses the compressed\n"
+    "node format: keys are prefix compressed and stored without\n"
+    "padding and nodes are sized for keys of avgkeysize bytes.\n"
+    "Existing files are always opened in the format they were\n"
+    "created with.\n\n"
+    "readahead gives the number of bytes the OS is asked to read\n"
+    "ahead when a scan moves on to the next leaf; 0 disables it.\n\n"
+    "If snapshot is true, a new index file uses the snapshot\n"
+    "format: read-only instances keep using the version of the\n"
+    "index which was flushed last when they were opened, until\n"
+    "they are refreshed. This cannot be combined with avgkeysize."
     )
 {
     char *filename;
@@ -1741,9 +3757,15 @@ Py_C_Function_WithKeywords(
     int sectorsize = 256;
     int dupkeys = 0;
     int filemode = 0;
+    long cachesize = 0;
+    int mmap = 0;
+    int avgkeysize = 0;
+    long readahead = 65536;
+    int snapshot = 0;
 
-    Py_KeywordsGet5Args("si|iii",
-			filename,keysize,dupkeys,filemode,sectorsize);
+    Py_KeywordsGet10Args("si|iiiliili",
+			 filename,keysize,dupkeys,filemode,sectorsize,
+			 cachesize,mmap,avgkeysize,readahead,snapshot);
 
     return (PyObject *)mxBeeIndex_New(filename,
 				      filemode,
@@ -1752,14 +3774,31 @@ Py_C_Function_WithKeywords(
 				      mxBeeIndex_CompareStrings,
 				      mxBeeIndex_StringFromKey,
 				      mxBeeIndex_KeyFromString,
-				      dupkeys);
+				      dupkeys,
+				      cachesize,
+				      mmap,
+				      avgkeysize,
+				      readahead,
+				      snapshot);
  onError:
     return NULL;
 }
 
 Py_C_Function_WithKeywords(
     mxBeeIndex_BeeFixedLengthStringIndex,
-    "BeeFixedLengthStringIndex(filename,keysize,dupkeys=0,filemode=0,sectorsize=256)\n\n"
+    "BeeFixedLengthStringIndex(filename,keysize,dupkeys=0,filemode=0,sectorsize=256,\n"
+    "    cachesize=0,mmap=0,avgkeysize=0,readahead=65536,snapshot=0)\n\n"
+    "If avgkeysize is given, a new index file uses the compressed\n"
+    "node format: keys are prefix compressed and stored without\n"
+    "padding and nodes are sized for keys of avgkeysize bytes.\n"
+    "Existing files are always opened in the format they were\n"
+    "created with.\n\n"
+    "readahead gives the number of bytes the OS is asked to read\n"
+    "ahead when a scan moves on to the next leaf; 0 disables it.\n\n"
+    "If snapshot is true, a new index file uses the snapshot\n"
+    "format: read-only instances keep using the version of the\n"
+    "index which was flushed last when they were opened, until\n"
+    "they are refreshed. This cannot be combined with avgkeysize."
     )
 {
     char *filename;
@@ -1767,9 +3806,15 @@ Py_C_Function_WithKeywords(
     int sectorsize = 256;
     int dupkeys = 0;
     int filemode = 0;
+    long cachesize = 0;
+    int mmap = 0;
+    int avgkeysize = 0;
+    long readahead = 65536;
+    int snapshot = 0;
 
-    Py_KeywordsGet5Args("si|iii",
-			filename,keysize,dupkeys,filemode,sectorsize);
+    Py_KeywordsGet10Args("si|iiiliili",
+			 filename,keysize,dupkeys,filemode,sectorsize,
+			 cachesize,mmap,avgkeysize,readahead,snapshot);
 
     return (PyObject *)mxBeeIndex_New(filename,
 				      filemode,
@@ -1778,14 +3823,20 @@ Py_C_Function_WithKeywords(
 				      mxBeeIndex_CompareFixedLengthStrings,
 				      mxBeeIndex_FixedLengthStringFromKey,
 				      mxBeeIndex_KeyFromFixedLengthString,
-				      dupkeys);
+				      dupkeys,
+				      cachesize,
+				      mmap,
+				      avgkeysize,
+				      readahead,
+				      snapshot);
  onError:
     return NULL;
 }
 
 Py_C_Function_WithKeywords(
     mxBeeIndex_BeeIntegerIndex,
-    "BeeIntegerIndex(filename,dupkeys=0,filemode=0,sectorsize=256)\n\n"
+    "BeeIntegerIndex(filename,dupkeys=0,filemode=0,sectorsize=256,cachesize=0,\n"
+    "    mmap=0,readahead=65536,snapshot=0)\n\n"
     )
 {
     char *filename;
@@ -1793,9 +3844,14 @@ Py_C_Function_WithKeywords(
     int sectorsize = 256;
     int dupkeys = 0;
     int filemode = 0;
+    long cachesize = 0;
+    int mmap = 0;
+    long readahead = 65536;
+    int snapshot = 0;
 
-    Py_KeywordsGet4Args("s|iii",
-			filename,dupkeys,filemode,sectorsize);
+    Py_KeywordsGet8Args("s|iiilili",
+			filename,dupkeys,filemode,sectorsize,cachesize,
+			mmap,readahead,snapshot);
 
     return (PyObject *)mxBeeIndex_New(filename,
 				      filemode,
@@ -1804,14 +3860,20 @@ Py_C_Function_WithKeywords(
 				      mxBeeIndex_CompareLongs,
 				      mxBeeIndex_IntegerFromKey,
 				      mxBeeIndex_KeyFromInteger,
-				      dupkeys);
+				      dupkeys,
+				      cachesize,
+				      mmap,
+				      0,
+				      readahead,
+				      snapshot);
  onError:
     return NULL;
 }
 
 Py_C_Function_WithKeywords(
     mxBeeIndex_BeeFloatIndex,
-    "BeeFloatIndex(filename,dupkeys=0,filemode=0,sectorsize=256)\n\n"
+    "BeeFloatIndex(filename,dupkeys=0,filemode=0,sectorsize=256,cachesize=0,\n"
+    "    mmap=0,readahead=65536,snapshot=0)\n\n"
     )
 {
     char *filename;
@@ -1819,9 +3881,14 @@ Py_C_Function_WithKeywords(
     int sectorsize = 256;
     int dupkeys = 0;
     int filemode = 0;
+    long cachesize = 0;
+    int mmap = 0;
+    long readahead = 65536;
+    int snapshot = 0;
 
-    Py_KeywordsGet4Args("s|iii",
-			filename,dupkeys,filemode,sectorsize);
+    Py_KeywordsGet8Args("s|iiilili",
+			filename,dupkeys,filemode,sectorsize,cachesize,
+			mmap,readahead,snapshot);
 
     return (PyObject *)mxBeeIndex_New(filename,
 				      filemode,
@@ -1830,7 +3897,83 @@ Py_C_Function_WithKeywords(
 				      mxBeeIndex_CompareDoubles,
 				      mxBeeIndex_FloatFromKey,
 				      mxBeeIndex_KeyFromFloat,
-				      dupkeys);
+				      dupkeys,
+				      cachesize,
+				      mmap,
+				      0,
+				      readahead,
+				      snapshot);
+ onError:
+    return NULL;
+}
+
+Py_C_Function_WithKeywords(
+    mxBeeIndex_BeeCompositeIndex,
+    "BeeCompositeIndex(filename,format,dupkeys=0,filemode=0,sectorsize=0,\n"
+    "    cachesize=0,mmap=0,readahead=65536,snapshot=0)\n\n"
+    "Keys are tuples with the fields given by format: 'q' for 64-bit\n"
+    "integers, 'd' for floats and 'Ns' for strings of up to N bytes,\n"
+    "e.g. 'qq' or '20sd'. The keys are stored in an encoding which\n"
+    "can be compared using memcmp(). The same format has to be used\n"
+    "whenever the index is opened.\n\n"
+    "sectorsize defaults to the smallest multiple of 256 which fits\n"
+    "at least 6 keys into a node."
+    )
+{
+    char *filename;
+    char *format;
+    int keysize;
+    int fields;
+    int sectorsize = 0;
+    int dupkeys = 0;
+    int filemode = 0;
+    long cachesize = 0;
+    int mmap = 0;
+    long readahead = 65536;
+    int snapshot = 0;
+    mxBeeIndexObject *beeindex;
+    char *keyformat;
+
+    Py_KeywordsGet9Args("ss|iiilili",
+			filename,format,dupkeys,filemode,sectorsize,cachesize,
+			mmap,readahead,snapshot);
+
+    keysize = mxBeeIndex_ParseKeyFormat(format,&fields);
+    if (keysize < 0)
+	goto onError;
+    if (sectorsize <= 0) {
+	size_t needed = (sizeof(bNode) - sizeof(bKey) +
+			 6 * (sizeof(bIdxAddr) + keysize + sizeof(bRecAddr)));
+	
+	sectorsize = (int)((needed + 255) / 256 * 256);
+    }
+    keyformat = new(char, strlen(format) + 1);
+    if (keyformat == NULL)
+	Py_Error(PyExc_MemoryError,
+		 "Out of memory");
+    strcpy(keyformat, format);
+
+    beeindex = mxBeeIndex_New(filename,
+			      filemode,
+			      keysize,
+			      sectorsize,
+			      mxBeeIndex_CompareComposites,
+			      mxBeeIndex_CompositeFromKey,
+			      mxBeeIndex_KeyFromComposite,
+			      dupkeys,
+			      cachesize,
+			      mmap,
+			      0,
+			      readahead,
+			      snapshot);
+    if (beeindex == NULL) {
+	free(keyformat);
+	goto onError;
+    }
+    beeindex->keyformat = keyformat;
+    beeindex->keyfields = fields;
+    return (PyObject *)beeindex;
+
  onError:
     return NULL;
 }
@@ -1848,6 +3991,24 @@ PyMethodDef Module_methods[] =
 				   mxBeeIndex_BeeIntegerIndex),
     Py_MethodWithKeywordsListEntry("BeeFloatIndex",
 				   mxBeeIndex_BeeFloatIndex),
+    Py_MethodWithKeywordsListEntry("BeeCompositeIndex",
+				   mxBeeIndex_BeeCompositeIndex),
+    Py_MethodListEntry("readheader",mxBeeStorage_readheader),
+    Py_MethodListEntry("readrecord",mxBeeStorage_readrecord),
+    Py_MethodListEntry("writerecord",mxBeeStorage_writerecord),
+    Py_MethodListEntry("findrecords",mxBeeStorage_findrecords),
+    Py_MethodListEntry("collectrecords",mxBeeStorage_collectrecords),
+    Py_MethodListEntry("bloomadd",mxBloom_bloomadd),
+    Py_MethodListEntry("bloomcheck",mxBloom_bloomcheck),
+    Py_MethodListEntry("sharedcacheinit",mxSharedCache_sharedcacheinit),
+    Py_MethodListEntry("sharedcacheget",mxSharedCache_sharedcacheget),
+    Py_MethodListEntry("sharedcacheput",mxSharedCache_sharedcacheput),
+    Py_MethodListEntry("sharedcacheversion",
+		       mxSharedCache_sharedcacheversion),
+    Py_MethodListEntry("sharedcacheinvalidate",
+		       mxSharedCache_sharedcacheinvalidate),
+    Py_MethodListEntry("sharedcacheclear",mxSharedCache_sharedcacheclear),
+    Py_MethodListEntry("sharedcachestats",mxSharedCache_sharedcachestats),
     {NULL,NULL} /* end of list */
 };
 
@@ -1925,6 +4086,8 @@ MX_EXPORT(void)
     insobj(moddict,"sizeof_bKey",PyInt_FromLong(sizeof(bKey)));
     insobj(moddict,"sizeof_bRecAddr",PyInt_FromLong(sizeof(bRecAddr)));
     insobj(moddict,"sizeof_bIdxAddr",PyInt_FromLong(sizeof(bIdxAddr)));
+    insobj(moddict,"sizeof_legacy_addr",PyInt_FromLong(BTR_ULONG_SIZE));
+    insobj(moddict,"MAX_SECTOR_SIZE",PyInt_FromLong(MAX_SECTOR_SIZE));
 
     /* Errors */
     if (!(mxBeeIndex_Error = insexc(moddict,"BeeIndexError")))
@@ -40,6 +40,10 @@ extern "C" {
 /* Include generic mx extension header file */
 #include "mxh.h"
 
+#ifdef WITH_THREAD
+# include "pythread.h"
+#endif
+
 #ifdef MX_BUILDING_MXBEEBASE
 # define MXBEEBASE_EXTERNALIZE MX_EXPORT
 #else
@@ -63,6 +67,20 @@ typedef struct mxBeeIndexObject {
     long length_state;		/* Update count of last length
 				   calculation */
 
+    char *keybuf;		/* Scratch buffer of keySize bytes used
+				   for key conversions */
+    char *keyformat;		/* Key format of composite key indexes,
+				   NULL for the other index types */
+    int keyfields;		/* Number of fields in keyformat */
+
+#ifdef WITH_THREAD
+    PyThread_type_lock lock;	/* Serializes the use of handle and
+				   keybuf; the B+Tree functions are run
+				   without holding the GIL */
+    long lock_owner;		/* Thread holding the lock */
+    int lock_count;		/* Recursion count of the owner */
+#endif
+
     /* Data conversion routines for key management */
     PyObject *(*ObjectFromKey)(struct mxBeeIndexObject *beeindex, void *key);
     void *(*KeyFromObject)(struct mxBeeIndexObject *beeindex, PyObject *obj);
@@ -90,6 +108,48 @@ typedef struct {
     
 } mxBeeCursorObject;
 
+/* --- BeeStorage Record Format ------------------------------*/
+
+/* These must match the definitions in BeeStorage.py */
+#define MXBEESTORAGE_BLOCKSIZE		32	/* Record alignment */
+#define MXBEESTORAGE_HEADERSIZE		6	/* ID, size, code */
+#define MXBEESTORAGE_ID			0xDB	/* '\333' */
+#define MXBEESTORAGE_VALID		0xF8	/* '\370' */
+#define MXBEESTORAGE_OLD		0xFB	/* '\373' */
+
+/* --- Shared Cache Segment Format ---------------------------*/
+
+/* These must match the definitions in SharedCache.py. A segment
+   starts with the header, followed by the version counters of the
+   sets (padded to MXSHAREDCACHE_HEADERSIZE bytes) and the slots;
+   each set has MXSHAREDCACHE_WAYS slots of slotsize bytes. */
+#define MXSHAREDCACHE_MAGIC		"BeeShm01"
+#define MXSHAREDCACHE_HEADERSIZE	64
+#define MXSHAREDCACHE_WAYS		4
+
+typedef struct {
+    char magic[8];		/* MXSHAREDCACHE_MAGIC */
+    unsigned int slotsize;	/* Size of a slot in bytes, including
+				   the slot header */
+    unsigned int nsets;		/* Number of sets */
+    unsigned int clock;		/* Access clock used for eviction */
+    unsigned int reserved;
+    unsigned PY_LONG_LONG hits;	/* Statistics; not updated atomically */
+    unsigned PY_LONG_LONG misses;
+} mxSharedCacheHeader;
+
+typedef struct {
+    unsigned int seq;		/* Odd while the slot is being written */
+    unsigned int length;	/* Length of the data */
+    PY_LONG_LONG address;	/* Record position + 1; 0 for an empty
+				   slot */
+    unsigned int version;	/* Version of the set the data was read
+				   at; the slot is only valid while the
+				   set has the same version */
+    unsigned int stamp;		/* Clock value of the last access */
+    /* Data follows */
+} mxSharedCacheSlot;
+
 /* EOF */
 #ifdef __cplusplus
 }
@@ -187,6 +187,7 @@ remove(testindex)
 ### Test BeeDicts
 
 from mx.BeeBase.BeeDict import *
+from mx.BeeBase import BeeLog
 
 print 'Testing BeeStringDict...',
 
@@ -368,4 +369,1234 @@ print 'done.'
 
 ###
 
+remove(testindex)
+
+print 'Testing index page cache...',
+idx = BeeIntegerIndex(testindex, dupkeys=0, filemode=2,
+                      cachesize=8192 * 256)
+pages, size, hits, misses, evictions = idx.cachestatistics
+assert pages == 8192 and size == 8192 * 256, idx.cachestatistics
+for i in xrange(count * 10):
+    idx[i] = i+1
+for i in xrange(count * 10):
+    assert idx[i] == i+1
+pages, size, hits, misses, evictions = idx.cachestatistics
+# Everything fits into the cache
+assert evictions == 0 and hits > 0, idx.cachestatistics
+idx.close()
+
+# Minimal cache; the index must still work, but with lots of evictions
+idx = BeeIntegerIndex(testindex, dupkeys=0, filemode=3, cachesize=0)
+pages, size, hits, misses, evictions = idx.cachestatistics
+assert pages == 7, idx.cachestatistics
+for i in xrange(count * 10):
+    assert idx[i] == i+1
+for i in xrange(0, count * 10, 2):
+    del idx[i]
+assert len(idx) == count * 5
+assert idx.validate()
+pages, size, hits, misses, evictions = idx.cachestatistics
+assert misses > 0 and evictions > 0, idx.cachestatistics
+idx.close()
+remove(testindex)
+
+s = BeeStringDict(testdict, autocommit=1, index_cachesize=1024 * 1024)
+for i in range(1000):
+    s[str(i)] = i
+s.commit()
+for i in range(1000):
+    assert s[str(i)] == i
+assert s.index.cachestatistics[0] > 7
+s.close()
+s.remove_files()
+
+print 'done.'
+
+###
+
+remove(testindex)
+
+print 'Testing memory mapped read-only index...',
+idx = BeeStringIndex(testindex, keysize=10, dupkeys=0, filemode=2)
+for i in xrange(count):
+    idx[str(i)] = i+1
+idx.close()
+idx = BeeStringIndex(testindex, keysize=10, filemode=1, mmap=1)
+for i in xrange(count):
+    assert idx[str(i)] == i+1
+keys = idx.keys()
+assert len(keys) == count and keys == sorted(keys)
+c = idx.cursor(FirstKey)
+n = 1
+while c.next():
+    n = n + 1
+assert n == count
+# Nodes are accessed in place, not read through stdio
+assert idx.statistics[7] == 0, idx.statistics
+# Read-only indexes reject modifications
+try:
+    idx['abc'] = 1
+except IOError:
+    pass
+else:
+    raise AssertionError('read-only index accepted a write')
+try:
+    del idx['1']
+except IOError:
+    pass
+else:
+    raise AssertionError('read-only index accepted a delete')
+assert idx['1'] == 2
+# Recreating the file while it is mapped makes the reader fail with
+# errors instead of crashing
+c = idx.cursor(FirstKey)
+assert c.next()
+writer = BeeStringIndex(testindex, keysize=10, dupkeys=0, filemode=2)
+writer['abc'] = 1
+writer.close()
+for i in xrange(0, count, 10):
+    try:
+        idx[str(i)]
+    except (IOError, KeyError):
+        pass
+try:
+    c.next()
+except BeeCursorError:
+    pass
+else:
+    raise AssertionError('cursor survived the recreated file')
+idx.close()
+remove(testindex)
+
+s = BeeDict(testdict)
+for i in range(1000):
+    s[i] = str(i)
+s.commit()
+s.close()
+s = BeeDict(testdict, readonly=1, index_mmap=1)
+for i in range(1000):
+    assert s[i] == str(i)
+s.close()
+s = BeeDict(testdict)
+s.remove_files()
+
+print 'done.'
+
+###
+
+print 'Testing bulk loading...',
+for fillfactor in (0.5, 0.9, 1.0):
+    idx = BeeIntegerIndex(testindex, dupkeys=0, filemode=2)
+    n = idx.bulkload([(i, i+1) for i in xrange(0, count * 10, 2)], fillfactor)
+    assert n == count * 5 and len(idx) == n
+    assert idx.validate()
+    for i in xrange(0, count * 10, 2):
+        assert idx[i] == i+1
+    assert idx.keys() == range(0, count * 10, 2)
+    c = idx.cursor(LastKey)
+    n = 1
+    while c.prev():
+        n = n + 1
+    assert n == count * 5
+    # The tree must support normal updates after loading
+    for i in xrange(1, count * 10, 2):
+        idx[i] = i+1
+    for i in xrange(0, count * 10, 4):
+        del idx[i]
+    assert len(idx) == count * 10 - count * 10 / 4
+    assert idx.validate()
+    idx.close()
+
+# Small inputs end up in the root
+idx = BeeIntegerIndex(testindex, dupkeys=0, filemode=2)
+assert idx.bulkload(iter([(1, 2), (2, 3)])) == 2
+assert idx.items() == [(1, 2), (2, 3)]
+# Only empty indexes can be loaded
+try:
+    idx.bulkload([(3, 4)])
+except BeeIndexError:
+    pass
+else:
+    raise AssertionError('bulkload accepted a non-empty index')
+idx.clear()
+# Unsorted input is rejected and leaves the index empty
+try:
+    idx.bulkload([(i, i) for i in xrange(count)] + [(0, 0)])
+except ValueError:
+    pass
+else:
+    raise AssertionError('bulkload accepted unsorted input')
+assert len(idx) == 0
+idx[1] = 2
+assert idx[1] == 2
+idx.close()
+
+idx = BeeStringIndex(testindex, keysize=10, dupkeys=1, filemode=2)
+items = [('%05i' % (i / 3), i) for i in xrange(count)]
+assert idx.bulkload(items, 0.75) == count
+assert idx.cursor('00100').value == 300
+assert idx.items() == items
+idx.close()
+remove(testindex)
+
+s = BeeStringDict(testdict, keysize=10)
+items = [('%05i' % i, i) for i in xrange(count)]
+assert s.bulkload(iter(items)) == count
+assert len(s) == count
+assert s.items() == items
+assert s['00010'] == 10
+s['00010'] = 'abc'
+s.commit()
+assert s['00010'] == 'abc'
+try:
+    s.bulkload(items)
+except Error:
+    pass
+else:
+    raise AssertionError('bulkload accepted a non-empty dict')
+s.close()
+s.remove_files()
+
+s = BeeDict(testdict)
+items = [(i, str(i)) for i in xrange(-count, count)]
+random.shuffle(items)
+assert s.bulkload(items) == 2 * count
+s.validate_index()
+for key, value in items:
+    assert s[key] == value
+s.close()
+s = BeeDict(testdict)
+assert len(s) == 2 * count
+s.close()
+s.remove_files()
+
+s = BeeDict(testdict)
+try:
+    s.bulkload([(1, 'a'), (2, 'b'), (1, 'c')])
+except KeyError:
+    pass
+else:
+    raise AssertionError('bulkload accepted duplicate keys')
+assert len(s) == 0
+s.close()
+s.remove_files()
+
+print 'done.'
+
+###
+
+print 'Testing compressed index nodes...',
+def url(i):
+    return 'http://www.egenix.com/products/%i/page-%05i.html' % (i % 7, i)
+idx = BeeStringIndex(testindex, keysize=100, dupkeys=0, filemode=2,
+                     sectorsize=1024)
+legacy_format = idx.format
+assert legacy_format[:2] == (2, 0)
+for i in xrange(count):
+    idx[url(i)] = i
+idx.close()
+legacy_size = os.path.getsize(testindex)
+idx = BeeStringIndex(testindex, keysize=100, dupkeys=0, filemode=2,
+                     sectorsize=1024, avgkeysize=20)
+assert idx.format[:2] == (2, 1)
+assert idx.format[2] > legacy_format[2]
+keys = range(count)
+random.shuffle(keys)
+for i in keys:
+    idx[url(i)] = i
+for i in keys[:count / 4]:
+    del idx[url(i)]
+for i in keys[:count / 8]:
+    idx[url(i)] = i
+idx.close()
+assert os.path.getsize(testindex) < legacy_size
+live = keys[:count / 8] + keys[count / 4:]
+items = [(url(i), i) for i in live]
+items.sort()
+# Reopening picks up the format from the file header
+for filemode, mmap in ((0, 0), (1, 0), (1, 1)):
+    idx = BeeStringIndex(testindex, keysize=100, dupkeys=0,
+                         filemode=filemode, sectorsize=1024, mmap=mmap)
+    assert idx.format[:2] == (2, 1)
+    assert idx.items() == items
+    for key, value in items:
+        assert idx[key] == value
+    c = idx.cursor(LastKey)
+    n = 1
+    while c.prev():
+        n = n + 1
+    assert n == len(items)
+    idx.close()
+# The file header must match the index parameters
+try:
+    BeeStringIndex(testindex, keysize=50, dupkeys=0, filemode=0,
+                   sectorsize=1024)
+except IOError:
+    pass
+else:
+    raise AssertionError('opened an index with a different keysize')
+idx = BeeStringIndex(testindex, keysize=100, dupkeys=0, filemode=2,
+                     sectorsize=1024, avgkeysize=20)
+assert idx.bulkload(items, 1.0) == len(items)
+assert idx.items() == items
+idx[url(count)] = count
+assert idx[url(count)] == count
+idx.close()
+remove(testindex)
+
+s = BeeStringDict(testdict, keysize=100, index_avgkeysize=20)
+assert s.index.format[:2] == (2, 1)
+for i in xrange(count):
+    s[url(i)] = i
+s.commit()
+s.close()
+s = BeeStringDict(testdict, keysize=100)
+assert s.index.format[:2] == (2, 1)
+assert len(s) == count
+assert s[url(count / 2)] == count / 2
+s.close()
+s.remove_files()
+print 'done.'
+
+###
+
+print 'Testing large sector sizes...',
+assert MAX_SECTOR_SIZE >= 65536
+for sectorsize in (16384, 65536):
+    idx = BeeStringIndex(testindex, keysize=20, dupkeys=1, filemode=2,
+                         sectorsize=sectorsize)
+    keys = range(count * 10)
+    random.shuffle(keys)
+    for i in keys:
+        idx['%08i' % (i / 2)] = i
+    assert idx.validate()
+    for i in keys[:count * 5]:
+        idx.delete('%08i' % (i / 2), i)
+    assert idx.validate()
+    idx.close()
+    idx = BeeStringIndex(testindex, keysize=20, dupkeys=1, filemode=1,
+                         sectorsize=sectorsize)
+    values = [value for key, value in idx.items()]
+    values.sort()
+    live = keys[count * 5:]
+    live.sort()
+    assert values == live
+    idx.close()
+remove(testindex)
+try:
+    BeeIntegerIndex(testindex, filemode=2, sectorsize=MAX_SECTOR_SIZE + 4)
+except ValueError:
+    pass
+else:
+    raise AssertionError('accepted a sectorsize > MAX_SECTOR_SIZE')
+remove(testindex)
+
+d = BeeDict(testdict, index_sectorsize=16384)
+for i in xrange(count):
+    d[i] = str(i)
+d.commit()
+assert d.index.format[2] > 600
+d.close()
+d = BeeDict(testdict, index_sectorsize=16384)
+assert d[count / 2] == str(count / 2)
+d.validate_index()
+d.close()
+d.remove_files()
+s = BeeStringDict(testdict, keysize=2000)
+assert s.index.format[2] >= 6
+s['abc'] = 1
+s.commit()
+s.close()
+s.remove_files()
+print 'done.'
+
+###
+
+print 'Testing 64-bit record addresses...',
+assert sizeof_bRecAddr == 8 and sizeof_bIdxAddr == 8
+addresses = [0, 1, 2**31 - 1, 2**31, 2**32 - 1, 2**32, 2**40 + 17,
+             2**63 - 1, 2**63, 2**64 - 1]
+for avgkeysize in (0, 8):
+    idx = BeeStringIndex(testindex, keysize=8, dupkeys=0, filemode=2,
+                         avgkeysize=avgkeysize)
+    for i, address in enumerate(addresses):
+        idx['%08i' % i] = address
+    try:
+        idx['overflow'] = 2**64
+    except TypeError:
+        pass
+    else:
+        raise AssertionError('accepted a record address >= 2**64')
+    idx.close()
+    idx = BeeStringIndex(testindex, keysize=8, dupkeys=0, filemode=1)
+    assert idx.format[0] == 2
+    for i, address in enumerate(addresses):
+        assert idx['%08i' % i] == address
+    assert idx.values() == addresses
+    idx.close()
+
+# Older versions stored addresses as the platform's unsigned long:
+# format 1 files without header and format 2 files without the
+# address size flag. Such files are converted on the fly and stay
+# readable by those versions.
+import struct
+A = sizeof_legacy_addr
+addr = {4: 'I', 8: 'Q'}[A]
+
+def legacy_file(index, keys, compressed=0, header=1):
+
+    """ Rewrite the empty index file of index (an integer index
+        unless compressed) into a legacy file whose root leaf holds
+        keys (address = key + 1).
+
+    """
+    index.close()
+    data = open(testindex, 'rb').read()
+    magic, version, flags, sectorsize = struct.unpack('=8s3I', data[:20])
+    assert flags & 4
+    if compressed:
+        # bNodeHeader followed by the encoded empty leaf
+        assert not keys
+        root = struct.pack('=2I' + addr, 8 + A + 4, 0, 0) + '\1\0\0\0'
+    else:
+        # bNode: leaf and ct, prev, next, childLT, then key, rec and
+        # childGE per entry
+        root = struct.pack('=I', 1 | len(keys) << 1).ljust(max(4, A), '\0')
+        root += struct.pack('=3' + addr, 0, 0, 0)
+        for key in keys:
+            root += (struct.pack('l', key)
+                     + struct.pack('=2' + addr, key + 1, 0))
+    root = root.ljust(3 * sectorsize, '\0')
+    if not header:
+        open(testindex, 'wb').write(root)
+        return
+    hdr = data[:12] + struct.pack('=I', flags & ~4) + data[16:sectorsize]
+    open(testindex, 'wb').write(hdr + root)
+
+keys = range(0, 40, 2)
+for format, header in ((1, 0), (2, 1)):
+    idx = BeeIntegerIndex(testindex, dupkeys=0, filemode=2, sectorsize=256)
+    legacy_file(idx, keys, header=header)
+    idx = BeeIntegerIndex(testindex, dupkeys=0, filemode=0, sectorsize=256)
+    assert idx.format[0] == format
+    assert idx.keys() == keys
+    for i in xrange(1, count, 2):
+        idx[i] = i + 1
+    if A == 4:
+        try:
+            idx[count] = 2**32
+        except OverflowError:
+            pass
+        else:
+            raise AssertionError('stored a 64-bit address in a '
+                                 '32-bit file')
+    idx.close()
+    if header:
+        flags, = struct.unpack('=I', open(testindex, 'rb').read()[12:16])
+        assert not flags & 4
+    idx = BeeIntegerIndex(testindex, dupkeys=0, filemode=1, sectorsize=256)
+    assert idx.validate()
+    assert idx.keys() == sorted(keys + range(1, count, 2))
+    for key in idx.keys():
+        assert idx[key] == key + 1
+    idx.close()
+
+idx = BeeStringIndex(testindex, keysize=8, dupkeys=0, filemode=2,
+                     sectorsize=256, avgkeysize=6)
+legacy_file(idx, [], compressed=1)
+idx = BeeStringIndex(testindex, keysize=8, dupkeys=0, filemode=0,
+                     sectorsize=256)
+assert idx.format[:2] == (2, 1)
+for i in xrange(count):
+    idx['%06i' % i] = i
+idx.close()
+idx = BeeStringIndex(testindex, keysize=8, dupkeys=0, filemode=1,
+                     sectorsize=256)
+assert idx.validate()
+for i in xrange(count):
+    assert idx['%06i' % i] == i
+idx.close()
+remove(testindex)
+print 'done.'
+
+###
+
+print 'Testing write-back batching...',
+# Flushes with many modified nodes in a large cache are written as
+# batches sorted by address
+for kws in ({}, {'avgkeysize': 10}, {'snapshot': 1}):
+    idx = BeeStringIndex(testindex, keysize=10, dupkeys=0, filemode=2,
+                         cachesize=4096, **kws)
+    keys = range(count * 20)
+    random.shuffle(keys)
+    for i in keys:
+        idx['%010i' % i] = i
+    idx.flush()
+    for i in keys[:count * 10]:
+        del idx['%010i' % i]
+    for i in keys[:count]:
+        idx['%010i' % i] = i
+    idx.close()
+    idx = BeeStringIndex(testindex, keysize=10, dupkeys=0, filemode=1)
+    assert idx.validate()
+    values = idx.values()
+    values.sort()
+    live = keys[count * 10:] + keys[:count]
+    live.sort()
+    assert values == live
+    idx.close()
+remove(testindex)
+
+# Nodes stay modified if writing the batch fails and are written by
+# the next flush; the file size limit makes writes past the current
+# end of the file fail
+try:
+    import resource, signal
+except ImportError:
+    resource = None
+if resource is not None and hasattr(signal, 'SIGXFSZ'):
+    for kws in ({}, {'avgkeysize': 10}, {'snapshot': 1}):
+        idx = BeeStringIndex(testindex, keysize=10, dupkeys=0, filemode=2,
+                             cachesize=4096, **kws)
+        idx.flush()
+        for i in xrange(count * 20):
+            idx['%010i' % i] = i
+        limits = resource.getrlimit(resource.RLIMIT_FSIZE)
+        handler = signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+        resource.setrlimit(resource.RLIMIT_FSIZE,
+                           (os.path.getsize(testindex), limits[1]))
+        try:
+            try:
+                idx.flush()
+            except IOError:
+                pass
+            else:
+                raise AssertionError('flush did not fail')
+        finally:
+            resource.setrlimit(resource.RLIMIT_FSIZE, limits)
+            signal.signal(signal.SIGXFSZ, handler)
+        idx.flush()
+        idx.close()
+        idx = BeeStringIndex(testindex, keysize=10, dupkeys=0, filemode=1)
+        assert idx.validate()
+        assert idx.values() == range(count * 20)
+        idx.close()
+    remove(testindex)
+print 'done.'
+
+###
+
+print 'Testing batched lookups...',
+idx = BeeIntegerIndex(testindex, dupkeys=0, filemode=2)
+for i in xrange(0, count * 4, 2):
+    idx[i] = i + 1
+probes = range(-2, count * 4 + 2)
+random.shuffle(probes)
+assert idx.get_many(probes) == [idx.get(i) for i in probes]
+assert idx.get_many(probes, -1)[probes.index(1)] == -1
+assert idx.get_many([]) == []
+assert idx.get_many((4, 4, 2)) == [5, 5, 3]
+try:
+    idx.get_many(['abc'])
+except TypeError:
+    pass
+else:
+    raise AssertionError('get_many accepted a string key')
+idx.close()
+
+# With duplicate keys, the first key in index order is found, even if
+# it is stored left of an equal separator key
+idx = BeeStringIndex(testindex, keysize=10, dupkeys=1, filemode=2)
+for i in xrange(count * 4):
+    idx['%05i' % (i % count)] = count * 4 - i
+for i in xrange(count * 2, count * 4, 3):
+    idx.delete('%05i' % (i % count), count * 4 - i)
+assert idx.validate()
+first = {}
+for key, value in idx.items():
+    if not first.has_key(key):
+        first[key] = value
+probes = ['%05i' % i for i in xrange(-10, count + 10)]
+random.shuffle(probes)
+expected = [first.get(key) for key in probes]
+assert idx.get_many(probes) == expected
+assert [idx.get(key) for key in probes] == expected
+idx.close()
+remove(testindex)
+
+s = BeeStringDict(testdict, keysize=10)
+for i in xrange(count):
+    s['%05i' % i] = i
+s.commit()
+s['00001'] = 'changed'
+del s['00002']
+keys = ['%05i' % i for i in xrange(count + 10)]
+random.shuffle(keys)
+values = s.get_many(keys, 'missing')
+for key, value in zip(keys, values):
+    assert value == s.get(key, 'missing'), (key, value)
+assert s.get_many(['00001', '00002', 'xxx']) == ['changed', None, None]
+s.close()
+s.remove_files()
+
+d = BeeDict(testdict)
+for i in xrange(count):
+    d[('key', i)] = i
+d.commit()
+keys = [('key', i) for i in xrange(-10, count)]
+random.shuffle(keys)
+values = d.get_many(keys)
+for key, value in zip(keys, values):
+    assert value == d.get(key)
+d.close()
+d.remove_files()
+print 'done.'
+
+###
+
+print 'Testing range scans...',
+for dupkeys in (0, 1):
+    idx = BeeStringIndex(testindex, keysize=10, dupkeys=dupkeys, filemode=2,
+                         readahead=4096)
+    for i in xrange(count * 2):
+        idx['%05i' % random.randint(0, count)] = i
+    items = idx.items()
+    keys = [key for key, value in items]
+    assert idx.range() == items
+    assert idx.range(FirstKey, LastKey) == items
+    for i in xrange(100):
+        lo = '%05i' % random.randint(-1, count + 1)
+        hi = '%05i' % random.randint(-1, count + 1)
+        limit = random.choice((0, 1, 10))
+        expected = [(key, value) for key, value in items
+                    if lo <= key < hi]
+        if limit:
+            expected = expected[:limit]
+        assert idx.range(lo, hi, limit) == expected, (lo, hi, limit)
+
+    # Chunked scans using a cursor
+    for chunk in (1, 7, count):
+        c = idx.cursor(FirstKey)
+        result = [(c.key, c.value)]
+        while 1:
+            l = c.nextitems(chunk)
+            if not l:
+                break
+            assert len(l) <= chunk
+            assert (c.key, c.value) == l[-1]
+            result.extend(l)
+        assert result == items
+    hi = keys[len(keys) / 2]
+    c = idx.cursor(FirstKey)
+    assert [(c.key, c.value)] + c.nextitems(0, hi) == \
+           [(key, value) for key, value in items if key < hi]
+    idx.close()
+    remove(testindex)
+
+idx = BeeIntegerIndex(testindex, filemode=2)
+assert idx.range() == []
+assert idx.range(1, 10) == []
+idx[5] = 6
+assert idx.range(5) == [(5, 6)]
+assert idx.range(6) == []
+assert idx.range(1, 5) == []
+idx.close()
+remove(testindex)
+print 'done.'
+
+###
+
+print 'Testing composite key indexes...',
+for dupkeys in (0, 1):
+    idx = BeeIntegerPairIndex(testindex, dupkeys=dupkeys, filemode=2)
+    items = {}
+    for i in xrange(count * 2):
+        key = (random.choice((-sys.maxint - 1, -1, 0, 1, sys.maxint,
+                              random.randint(-2**63, 2**63 - 1))),
+               random.randint(-count, count))
+        idx[key] = i
+        items[key] = i
+    keys = items.keys()
+    keys.sort()
+    if not dupkeys:
+        assert idx.keys() == keys
+        for key in keys:
+            assert idx[key] == items[key]
+        assert idx.range((0, 0), (1, 0)) == \
+               [(key, items[key]) for key in keys if (0, 0) <= key < (1, 0)]
+    else:
+        assert len(idx.keys()) == count * 2
+    idx.close()
+    idx = BeeIntegerPairIndex(testindex, dupkeys=dupkeys, filemode=3)
+    assert idx.cursor(FirstKey).key == keys[0]
+    idx.close()
+    remove(testindex)
+idx = BeeStringFloatIndex(testindex, 8, filemode=2)
+floats = (-1e300, -1.5, -1e-300, 0.0, 1e-300, 2.5, 1e300,
+          float('inf'), float('-inf'))
+keys = [(s, f) for s in ('', 'a', 'ab', 'b', 'zzzzzzzz') for f in floats]
+random.shuffle(keys)
+for i in xrange(len(keys)):
+    idx[keys[i]] = i
+keys.sort()
+assert idx.keys() == keys
+# -0.0 and 0.0 are the same key
+assert idx[('a', -0.0)] == idx[('a', 0.0)]
+assert idx.range(('ab', 0.0), ('b', 0.0)) == \
+       [(key, idx[key]) for key in keys if ('ab', 0.0) <= key < ('b', 0.0)]
+for key, error in ((('a',), TypeError),
+                   (('a', float('nan')), ValueError),
+                   (('123456789', 1.0), TypeError),
+                   (('a\0', 1.0), TypeError),
+                   ((1, 1.0), TypeError)):
+    try:
+        idx[key] = 1
+    except error:
+        pass
+    else:
+        raise AssertionError('%r was accepted' % (key,))
+idx.close()
+remove(testindex)
+idx = BeeCompositeIndex(testindex, 'q4sdq', filemode=2)
+idx[(1, 'ab', 0.5, -2)] = 1
+assert idx.keys() == [(1, 'ab', 0.5, -2)]
+idx.close()
+remove(testindex)
+for format in ('', 'x', '4q', 's', 'q' * 33):
+    try:
+        BeeCompositeIndex(testindex, format, filemode=2)
+    except ValueError:
+        pass
+    else:
+        raise AssertionError('format %r was accepted' % format)
+print 'done.'
+
+###
+
+print 'Testing the write-ahead log...',
+for Class, makekey in ((BeeStringDict, lambda i: '%05i' % i),
+                       (BeeDict, lambda i: ('key', i))):
+    d = Class(testdict, wal=1, wal_groupcommit=4, wal_checkpointsize=4096)
+    model = {}
+    for i in xrange(count):
+        key = makekey(random.randint(0, count / 4))
+        if model.has_key(key) and random.random() < 0.2:
+            del d[key]
+            del model[key]
+        else:
+            d[key] = i
+            model[key] = i
+        if i % 3 == 0:
+            d.commit()
+    d.commit()
+    assert d.wal.appends > d.wal.syncs
+    for i in xrange(count / 4 + 1):
+        key = makekey(i)
+        assert d.get(key) == model.get(key)
+    keys = [makekey(i) for i in xrange(count / 4 + 1)]
+    assert d.get_many(keys) == [model.get(key) for key in keys]
+    d.flush()
+    logged = len(d.logged)
+    assert logged and d.wal.size()
+
+    # Crash without closing: the log has to be replayed on open
+    d.wal.close()
+    d.wal = None
+    d.logged = {}
+    d.rollback()
+    d.index.close()
+    d.storage.file.close()
+    d.storage.file = None
+    d.storage.filelock.unlock()
+    d.storage.filelock = None
+    d.closed = 1
+    del d
+    d = Class(testdict, readonly=1)
+    assert len(d.logged) == logged
+    assert d.get_many(keys) == [model.get(key) for key in keys]
+    d.close()
+    d = Class(testdict, wal=1)
+    assert not d.logged and not d.wal.size()
+    assert len(d) == len(model)
+    items = d.items()
+    items.sort()
+    expected = model.items()
+    expected.sort()
+    assert items == expected
+    d.close()
+    assert os.path.getsize(testdict + '.wal') == BeeLog.FILEHEADERSIZE
+    d = Class(testdict)
+    assert not os.path.exists(testdict + '.wal')
+    d.remove_files()
+print 'done.'
+
+###
+
+print 'Testing snapshot readers...',
+remove(testindex)
+idx = BeeStringIndex(testindex, 16, dupkeys=0, filemode=2, snapshot=1)
+assert idx.snapshot
+for i in xrange(count):
+    idx['%05i' % i] = i
+idx.flush()
+reader = BeeStringIndex(testindex, 16, filemode=1)
+assert reader.snapshot and reader.version == idx.version
+assert not reader.refresh()
+size = os.path.getsize(testindex)
+for n in xrange(20):
+    for i in xrange(0, count, 7):
+        idx['%05i' % i] = i + n + 1
+    for i in xrange(n, count, 50):
+        try:
+            del idx['%05i' % i]
+        except KeyError:
+            pass
+    idx.flush()
+    # The reader keeps seeing its version
+    assert len(reader) == count
+    assert reader['%05i' % 7] == 7
+assert os.path.getsize(testindex) > size
+assert reader.refresh()
+assert reader.version == idx.version
+assert len(reader) == len(idx)
+assert reader.items() == idx.items()
+reader.close()
+# Without readers, the freed pages get reused
+size = os.path.getsize(testindex)
+for n in xrange(20):
+    for i in xrange(0, count, 3):
+        idx['%05i' % i] = n
+    idx.flush()
+assert os.path.getsize(testindex) == size
+assert idx.validate()
+idx.close()
+remove(testindex)
+
+# Failing to open a snapshot file must not leak the file and its
+# version lock
+idx = BeeStringIndex(testindex, 16, dupkeys=0, filemode=2, snapshot=1)
+idx.close()
+f = open(testindex, 'r+b')
+sectorsize = struct.unpack('=I', f.read(20)[16:])[0]
+for slot in (0, sectorsize):
+    # break the header checksums by changing the versions
+    f.seek(slot + 32)
+    version = f.read(1)
+    f.seek(slot + 32)
+    f.write(chr(ord(version) ^ 0x55))
+f.close()
+if os.path.isdir('/proc/self/fd'):
+    fds = len(os.listdir('/proc/self/fd'))
+else:
+    fds = None
+for i in xrange(20):
+    for filemode in (0, 1):
+        try:
+            BeeStringIndex(testindex, 16, dupkeys=0, filemode=filemode)
+        except IOError:
+            pass
+        else:
+            raise AssertionError('opened a file without valid header')
+if fds is not None:
+    assert len(os.listdir('/proc/self/fd')) == fds
+remove(testindex)
+
+for Class, makekey in ((BeeStringDict, lambda i: '%05i' % i),
+                       (BeeDict, lambda i: i)):
+    d = Class(testdict, snapshot=1)
+    for i in xrange(100):
+        d[makekey(i)] = 'value %i' % i
+    d.commit()
+    r = Class(testdict, readonly=1)
+    assert r.snapshot
+    d[makekey(1)] = 'updated'
+    del d[makekey(2)]
+    d[makekey(100)] = 'new'
+    d.commit()
+    assert r[makekey(1)] == 'value 1'
+    assert r[makekey(2)] == 'value 2'
+    assert not r.has_key(makekey(100))
+    assert r.refresh()
+    assert r[makekey(1)] == 'updated'
+    assert not r.has_key(makekey(2))
+    assert r[makekey(100)] == 'new'
+    assert len(r) == 100
+    assert not r.refresh()
+    r.close()
+    d.remove_files()
+print 'done.'
+
+###
+
+print 'Testing threaded access...',
+import threading
+count = 5000
+idx = BeeStringIndex(testindex, 8, filemode=2)
+for i in xrange(0, count, 2):
+    idx['%05i' % i] = i
+errors = []
+def reader(n):
+    try:
+        for j in xrange(n):
+            i = random.randrange(0, count, 2)
+            assert idx['%05i' % i] == i
+            items = idx.range('%05i' % i, LastKey, 10)
+            assert items[0] == ('%05i' % i, i)
+            assert len(items) >= min(10, (count - i) // 2)
+    except Exception, why:
+        errors.append(why)
+def writer():
+    try:
+        for i in xrange(1, count, 2):
+            idx['%05i' % i] = i
+            if i % 1000 == 1:
+                idx.flush()
+    except Exception, why:
+        errors.append(why)
+threads = [threading.Thread(target=reader, args=(2000,)) for j in range(4)]
+threads.append(threading.Thread(target=writer))
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+assert not errors, errors
+assert idx.validate()
+assert len(idx) == count
+assert idx.keys() == ['%05i' % i for i in xrange(count)]
+assert idx.values() == range(count)
+idx.close()
+remove(testindex)
+print 'done.'
+
+###
+
+print 'Testing the storage record layer...',
+import struct
+from mx.BeeBase import BeeStorage
+testfile = testdict + '.dat'
+remove(testfile)
+storage = BeeStorage.BeeKeyValueStorage(testfile)
+positions = [storage.write(i, 'x' * (i % 100)) for i in xrange(count)]
+for i in xrange(0, count, 3):
+    positions[i] = storage.write(i, 'y' * 200, positions[i])
+# Check the on-disk layout
+f = storage.file
+for i in (0, 1, 3, count - 1):
+    f.seek(positions[i])
+    header = f.read(6)
+    assert header[0] == BeeStorage.ID and header[5] == BeeStorage.VALID
+    recordsize = struct.unpack('<l', header[1:5])[0]
+    assert recordsize % BeeStorage.BLOCKSIZE == 0
+    assert storage.read_header(positions[i]) == \
+           (recordsize, BeeStorage.VALID, recordsize - 6)
+    data = readrecord(f, positions[i], storage.EOF)[1]
+    f.seek(positions[i] + 6)
+    assert data == f.read(recordsize - 6)
+assert readheader(f, positions[1] + 1, storage.EOF) is None
+assert readrecord(f, storage.EOF + 32, storage.EOF) is None
+for i in xrange(count):
+    key, value = storage.read(positions[i])
+    if i % 3:
+        assert key == i and value == 'x' * (i % 100)
+    else:
+        assert key == i and value == 'y' * 200
+valid, old, invalid = storage.find_records()
+assert len(valid) == count and len(old) == (count + 2) / 3 and not invalid
+assert storage.statistics() == (sum([size for pos, size in valid]),
+                                sum([size for pos, size in old]), 0)
+moved = {}
+def callback(old, new, data):
+    moved[old] = new
+storage.collect(callback)
+positions = [moved.get(pos, pos) for pos in positions]
+for i in xrange(count):
+    assert storage.read_key(positions[i]) == i
+assert storage.statistics()[1:] == (0, 0)
+storage.close()
+remove(testfile)
+remove(testfile + BeeStorage.FREESPACE_EXTENSION)
+print 'done.'
+
+###
+
+print 'Testing free space reuse...',
+freespacefile = testfile + BeeStorage.FREESPACE_EXTENSION
+records = 1000
+d = BeeDict(testdict, autocommit=1)
+for i in xrange(records):
+    d[i] = 'x' * (i % 200)
+d.commit()
+size = os.path.getsize(testfile)
+for n in xrange(10):
+    for i in xrange(0, records, 2):
+        d[i] = 'y' * random.randrange(1, 400)
+    for i in xrange(n, records, 10):
+        if d.has_key(i):
+            del d[i]
+    d.commit()
+    for i in xrange(n, records, 10):
+        d[i] = 'z' * (i % 300)
+    d.commit()
+# Without reuse the file would grow by far more than this
+assert os.path.getsize(testfile) < 3 * size
+valid, old, invalid = d.storage.find_records()
+assert len(valid) == len(d) and not invalid
+freespace = d.storage.freespace.dump()
+d.close()
+# The map is saved on close and dropped with the next change
+assert os.path.exists(freespacefile)
+d = BeeDict(testdict)
+d.storage.load_freespace()
+assert d.storage.freespace.dump() == freespace
+d[0] = 'updated'
+d.commit()
+assert not os.path.exists(freespacefile)
+d.close()
+assert os.path.exists(freespacefile)
+# A missing map gets rebuilt from the storage file
+remove(freespacefile)
+d = BeeDict(testdict)
+d[1] = 'updated'
+d.commit()
+assert d[0] == d[1] == 'updated'
+valid, old, invalid = d.storage.find_records()
+assert len(valid) == len(d) and not invalid
+d.remove_files()
+assert not os.path.exists(freespacefile)
+# Snapshot mode never overwrites records
+d = BeeDict(testdict, snapshot=1)
+for i in xrange(100):
+    d[i] = 'value %i' % i
+d.commit()
+positions = {}
+for i in xrange(100):
+    positions[d.index[i]] = i
+for i in xrange(100):
+    d[i] = 'updated %i' % i
+d.commit()
+for i in xrange(100):
+    assert not positions.has_key(d.index[i])
+d.remove_files()
+print 'done.'
+
+###
+
+print 'Testing incremental garbage collection...',
+d = BeeDict(testdict, autocommit=1)
+for i in xrange(records):
+    d[i] = 'x' * (i % 300)
+d.commit()
+for i in xrange(records):
+    if i % 4:
+        del d[i]
+d.commit()
+size = os.path.getsize(testfile)
+steps = 0
+while not d.collect_step(50):
+    # The dictionary stays usable between the steps
+    d[steps] = 'step %i' % steps
+    d.commit()
+    steps = steps + 1
+assert steps >= records / 50
+assert os.path.getsize(testfile) < size / 2
+valid, old, invalid = d.storage.find_records()
+assert len(valid) == len(d) and not invalid
+for i in xrange(records):
+    if i < steps:
+        assert d[i] == 'step %i' % i
+    elif i % 4:
+        assert not d.has_key(i)
+    else:
+        assert d[i] == 'x' * (i % 300)
+d.close()
+# Run by .commit()
+d = BeeDict(testdict, autocollect=20)
+for i in xrange(0, records, 4):
+    del d[i]
+d.commit()
+size = os.path.getsize(testfile)
+for i in xrange(records):
+    d.commit()
+    if d.storage.collect_source is None and \
+       os.path.getsize(testfile) < size:
+        break
+else:
+    raise AssertionError('autocollect did not finish a pass')
+assert i >= 2
+d.remove_files()
+print 'done.'
+
+###
+
+print 'Testing record compression...',
+def value(i):
+    return {'name': 'value %i' % i, 'data': 'abcdefgh' * (i % 100)}
+sizes = []
+for codec in (None, 'zlib'):
+    d = BeeDict(testdict, codec=codec, autocommit=1)
+    for i in xrange(records):
+        d[i] = value(i)
+    d.commit()
+    sizes.append(os.path.getsize(testfile))
+    d.close()
+    # The setting only affects new records
+    d = BeeDict(testdict, codec=codec and None or 'zlib')
+    for i in xrange(records):
+        assert d[i] == value(i)
+    for i in xrange(0, records, 7):
+        d[i] = value(i + 1)
+    d.commit()
+    for i in xrange(records):
+        if i % 7:
+            assert d[i] == value(i)
+        else:
+            assert d[i] == value(i + 1)
+    d.remove_files()
+assert sizes[1] < sizes[0] / 2
+storage = BeeStorage.BeePickleStorage(testfile, codec='zlib')
+small = storage.write('small')
+large = storage.write(range(1000))
+assert storage.read_record(small)[0] != '\001'
+assert storage.read_record(large)[0] == '\001'
+assert storage.read(small) == 'small'
+assert storage.read(large) == range(1000)
+storage.close()
+remove(testfile)
+remove(testfile + BeeStorage.FREESPACE_EXTENSION)
+print 'done.'
+
+###
+
+print 'Testing Bloom filters...',
+from mx.BeeBase import BeeBloom
+bloom = BeeBloom.BloomFilter(2 * records)
+for i in xrange(records):
+    bloom.add(i)
+    bloom.add('key %i' % i)
+for i in xrange(records):
+    assert i in bloom and ('key %i' % i) in bloom
+falsepositives = len([i for i in xrange(records, 11 * records)
+                      if i in bloom])
+assert falsepositives < records * 10 * 3 * BeeBloom.FALSEPOSITIVES
+assert not bloom.full()
+# The C and the Python implementation set the same bits
+for key in (0, 1, -1, sys.maxint, 2**64 + 3, '', 'key'):
+    bits = BeeBloom.array.array('B', [0]) * 16
+    for bit in BeeBloom.probes(key, 3, 128):
+        bits[bit >> 3] = bits[bit >> 3] | (1 << (bit & 7))
+    bloom = BeeBloom.BloomFilter(1)
+    bloom.bits = BeeBloom.array.array('B', [0]) * 16
+    bloom.k = 3
+    bloom.add(key)
+    assert bloom.bits == bits
+bloomfile = testdict + '.blm'
+for Class, makekey in ((BeeStringDict, lambda i: '%05i' % i),
+                       (BeeDict, lambda i: i)):
+    d = Class(testdict, bloom=1)
+    for i in xrange(0, 200, 2):
+        d[makekey(i)] = i
+    d.commit()
+    for i in xrange(200):
+        assert d.has_key(makekey(i)) == (i % 2 == 0)
+    assert d.get_many([makekey(0), makekey(1)]) == [0, None]
+    d.close()
+    assert os.path.exists(bloomfile)
+    # The file is loaded and removed with the first change
+    d = Class(testdict, bloom=1)
+    assert d.bloom_saved and len(d.bloom) == 100
+    d[makekey(1)] = 1
+    d.commit()
+    assert not os.path.exists(bloomfile)
+    assert d[makekey(1)] == 1
+    d.close()
+    # Also by writers not using the filter
+    d = Class(testdict)
+    d[makekey(3)] = 3
+    d.commit()
+    d.close()
+    assert not os.path.exists(bloomfile)
+    d = Class(testdict, bloom=1)
+    assert not d.bloom_saved
+    assert d[makekey(3)] == 3 and not d.has_key(makekey(5))
+    # Growing the dictionary rebuilds the filter
+    for i in xrange(200, 5000):
+        d[makekey(i)] = i
+        if i % 500 == 0:
+            d.commit()
+    d.commit()
+    assert not d.bloom.full()
+    for i in xrange(200, 5000):
+        assert d[makekey(i)] == i
+    d.remove_files()
+    assert not os.path.exists(bloomfile)
+print 'done.'
+
+###
+
+print 'Testing shared caches...',
+from mx.BeeBase import SharedCache
+cachefile = testfile + BeeStorage.SHAREDCACHE_EXTENSION
+cache = SharedCache.SharedCache(cachefile, 65536, 128)
+stats = cache.statistics()
+assert stats['slotsize'] == 128 and 0 < stats['slots'] * 128 < 65536
+version = cache.version(1056)
+assert cache.get(1056) is None
+assert cache.put(1056, 'data', version) and cache.get(1056) == 'data'
+# Data read before an invalidation is not stored
+cache.invalidate(1056)
+assert cache.get(1056) is None and not cache.put(1056, 'old', version)
+assert not cache.put(1056, 'x' * 128, cache.version(1056))
+# Other instances see the same data; evicted records are missing
+other = SharedCache.SharedCache(cachefile)
+for i in xrange(records):
+    position = BeeStorage.STARTOFDATA + i * BeeStorage.BLOCKSIZE
+    cache.put(position, str(i), cache.version(position))
+found = 0
+for i in xrange(records):
+    data = other.get(BeeStorage.STARTOFDATA + i * BeeStorage.BLOCKSIZE)
+    if data is not None:
+        assert data == str(i)
+        found = found + 1
+assert 0 < found < records
+other.clear()
+assert cache.get(BeeStorage.STARTOFDATA) is None
+cache.close()
+other.close()
+os.remove(cachefile)
+# Dictionaries
+sharedfile = testdict + '.dat' + BeeStorage.SHAREDCACHE_EXTENSION
+for Class, makekey in ((BeeStringDict, lambda i: '%05i' % i),
+                       (BeeDict, lambda i: i)):
+    d = Class(testdict, autocommit=1, codec='zlib', sharedcache=4194304)
+    for i in xrange(records):
+        d[makekey(i)] = ('value %i ' % i) * (i % 10)
+    d.commit()
+    for i in xrange(records):
+        assert d[makekey(i)] == ('value %i ' % i) * (i % 10)
+    # Readers use the records cached by the writer
+    r = Class(testdict, readonly=1, sharedcache=4194304)
+    hits = r.storage.sharedcache.statistics()['hits']
+    for i in xrange(records):
+        assert r[makekey(i)] == ('value %i ' % i) * (i % 10)
+    stats = r.storage.sharedcache.statistics()
+    assert stats['hits'] >= hits + records * 3 / 4
+    # Records updated in place are invalidated
+    d[makekey(1)] = 'new'
+    d.commit()
+    r.cache.clear()
+    assert r[makekey(1)] == 'new'
+    r.close()
+    d.close()
+    # Writers not using the cache remove it
+    d = Class(testdict)
+    assert not os.path.exists(sharedfile)
+    d.close()
+    d = Class(testdict, sharedcache=4194304)
+    assert os.path.exists(sharedfile)
+    d.remove_files()
+    assert not os.path.exists(sharedfile)
+print 'done.'
+
+###
+
 print 'Works.'
@@ -158,6 +158,61 @@ void insint(PyObject *dict,
 
 staticforward PyMethodDef mxTextSearch_Methods[];
 
+/* Build the Aho-Corasick search data for the match strings in the
+   tuple matches. */
+
+static
+mxacse_data *textsearch_ac_init(PyObject *matches)
+{
+    mxacse_data *ac;
+    Py_ssize_t i;
+
+    ac = ac_init();
+    if (ac == NULL) {
+	PyErr_NoMemory();
+	goto onError;
+    }
+    Py_Assert(PyTuple_GET_SIZE(matches) > 0,
+	      PyExc_ValueError,
+	      "need at least one match string");
+    for (i = 0; i < PyTuple_GET_SIZE(matches); i++) {
+	PyObject *m = PyTuple_GET_ITEM(matches, i);
+	int rc;
+
+	if (PyString_Check(m)) {
+	    Py_Assert(PyString_GET_SIZE(m) > 0,
+		      PyExc_ValueError,
+		      "match strings must not be empty");
+	    rc = ac_add(ac, PyString_AS_STRING(m), PyString_GET_SIZE(m));
+	}
+#ifdef HAVE_UNICODE
+	else if (PyUnicode_Check(m)) {
+	    Py_Assert(PyUnicode_GET_SIZE(m) > 0,
+		      PyExc_ValueError,
+		      "match strings must not be empty");
+	    rc = ac_add_unicode(ac, PyUnicode_AS_UNICODE(m),
+				PyUnicode_GET_SIZE(m));
+	}
+#endif
+	else
+	    Py_Error(PyExc_TypeError,
+		     "match strings must be strings or unicode");
+	if (rc) {
+	    PyErr_NoMemory();
+	    goto onError;
+	}
+    }
+    if (ac_compile(ac)) {
+	PyErr_NoMemory();
+	goto onError;
+    }
+    return ac;
+
+ onError:
+    ac_free(ac);
+    return NULL;
+}
+
 /* allocation */
 
 static
@@ -225,6 +280,35 @@ PyObject *mxTextSearch_New(PyObject *match,
 	Py_Assert(so->translate == NULL,
 		  PyExc_TypeError,
 		  "trivial search algorithm does not support translate");
+#ifdef HAVE_UNICODE
+	if (PyUnicode_Check(match)) {
+	    so->data = bm_unicode_init(PyUnicode_AS_UNICODE(match),
+				       PyUnicode_GET_SIZE(match));
+	    Py_Assert(so->data != NULL,
+		      PyExc_TypeError,
+		      "error initializing the search object");
+	}
+#endif
+	break;
+
+    case MXTEXTSEARCH_AHOCORASICK:
+	{
+	    PyObject *matches;
+
+	    /* Keep the match strings as tuple; a single string is
+	       accepted as well */
+	    if (PyString_Check(match) || PyUnicode_Check(match))
+		matches = PyTuple_Pack(1, match);
+	    else
+		matches = PySequence_Tuple(match);
+	    if (matches == NULL)
+		goto onError;
+	    Py_DECREF(so->match);
+	    so->match = matches;
+	}
+	so->data = textsearch_ac_init(so->match);
+	if (so->data == NULL)
+	    goto onError;
 	break;
 
     default:
@@ -244,7 +328,10 @@ Py_C_Function_WithKeywords(
 	       "TextSearch(match[,translate=None,algorithm=default_algorithm])\n\n"
 	       "Create a substring search object for the string match;\n"
 	       "translate is an optional translate-string like the one used\n"
-	       "in the module re."
+	       "in the module re. If match is a tuple or list of strings,\n"
+	       "all of them are searched for in one pass (Aho-Corasick);\n"
+	       "the leftmost match is found, the longest one if several\n"
+	       "start there."
 		)
 {
     PyObject *match = 0;
@@ -256,6 +343,8 @@ Py_C_Function_WithKeywords(
     if (algorithm == -424242) {
 	if (PyUnicode_Check(match))
 	    algorithm = MXTEXTSEARCH_TRIVIAL;
+	else if (PyTuple_Check(match) || PyList_Check(match))
+	    algorithm = MXTEXTSEARCH_AHOCORASICK;
 	else
 #ifdef MXFASTSEARCH
 	    algorithm = MXTEXTSEARCH_BOYERMOORE;
@@ -285,6 +374,13 @@ void mxTextSearch_Free(mxTextSearchObject *so)
 	    break;
 #endif
 	case MXTEXTSEARCH_TRIVIAL:
+#ifdef HAVE_UNICODE
+	    bm_unicode_free(so->data);
+#endif
+	    break;
+
+	case MXTEXTSEARCH_AHOCORASICK:
+	    ac_free(so->data);
 	    break;
 	    
 	}
@@ -328,6 +424,11 @@ Py_ssize_t mxTextSearch_MatchLength(PyObject *self)
 #endif
 	break;
 
+    case MXTEXTSEARCH_AHOCORASICK:
+	/* The match strings have different lengths; use the shortest
+	   one */
+	return AC_MIN_LEN(so->data);
+
     }
 
     Py_Error(mxTextTools_Error,
@@ -376,47 +477,6 @@ Py_ssize_t trivial_search(const char *text,
     return start;
 }
 
-#ifdef HAVE_UNICODE
-static
-Py_ssize_t trivial_unicode_search(const Py_UNICODE *text,
-				  Py_ssize_t start,
-				  Py_ssize_t stop,
-				  const Py_UNICODE *match,
-				  Py_ssize_t match_len)
-{
-    Py_ssize_t ml1 = match_len - 1;
-    register const Py_UNICODE *tx = &text[start];
-    register Py_ssize_t x = start;
-
-    if (ml1 < 0) 
-	return start;
-
-    /* Brute-force method; from right to left */
-    for (;;) {
-	register Py_ssize_t j = ml1;
-	register const Py_UNICODE *mj = &match[j];
-
-	if (x + j >= stop)
-	    /* reached eof: no match */
-	    return start;
-
-	/* scan from right to left */
-	for (tx += j; j >= 0 && *tx == *mj; 
-	     tx--, mj--, j--) ;
-
-	if (j < 0) {
-	    /* found */
-	    x += ml1 + 1;
-	    return x;
-	}
-	/* not found: rewind and advance one char */
-	tx -= j - 1;
-	x++;
-    }
-    return start;
-}
-#endif
-
 /* Search for the match in text[start:stop]. 
 
    Returns 1 in case a match was found and sets sliceleft, sliceright
@@ -509,6 +569,31 @@ int mxTextSearch_SearchBuffer(PyObject *self,
 	}
 	break;
 
+    case MXTEXTSEARCH_AHOCORASICK:
+	{
+	    Py_ssize_t left, right;
+
+	    DPRINTF("mxTextSearch_SearchBuffer: Aho-Corasick search - "
+		    "start=%li, stop=%li\n",
+		    start, stop);
+	    if (ac_search((mxacse_data *)so->data,
+			  text,
+			  start,
+			  stop,
+			  so->translate ? 
+			  PyString_AS_STRING(so->translate) : NULL,
+			  &left,
+			  &right)) {
+		nextpos = right;
+		match_len = right - left;
+	    }
+	    else {
+		nextpos = start;
+		match_len = 0;
+	    }
+	}
+	break;
+
     default:
 	Py_Error(mxTextTools_Error,
 		 "unknown algorithm type in mxTextSearch_SearchBuffer");
@@ -560,28 +645,59 @@ int mxTextSearch_SearchUnicode(PyObject *self,
 #endif
 	
     case MXTEXTSEARCH_TRIVIAL:
-	{
+	if (so->data) {
+	    /* Unicode match string: use the search data prepared by
+	       mxTextSearch_New() */
+	    nextpos = bm_unicode_search((mxbmse_unicode_data *)so->data,
+					text,
+					start,
+					stop);
+	    match_len = BM_UNICODE_MATCH_LEN(so->data);
+	}
+	else {
 	    PyObject *u;
-	    Py_UNICODE *match;
+	    mxbmse_unicode_data *c;
 
-	    if (PyUnicode_Check(so->match)) {
-		u = NULL;
-		match = PyUnicode_AS_UNICODE(so->match);
-		match_len = PyUnicode_GET_SIZE(so->match);
+	    u = PyUnicode_FromEncodedObject(so->match, NULL, NULL);
+	    if (u == NULL)
+		goto onError;
+	    match_len = PyUnicode_GET_SIZE(u);
+	    c = bm_unicode_init(PyUnicode_AS_UNICODE(u), match_len);
+	    if (c == NULL) {
+		Py_DECREF(u);
+		PyErr_NoMemory();
+		goto onError;
+	    }
+	    nextpos = bm_unicode_search(c,
+					text,
+					start,
+					stop);
+	    bm_unicode_free(c);
+	    Py_DECREF(u);
+	}
+	break;
+
+    case MXTEXTSEARCH_AHOCORASICK:
+	{
+	    Py_ssize_t left, right;
+
+	    Py_Assert(so->translate == NULL,
+		      PyExc_TypeError,
+		      "Aho-Corasick search does not support translate "
+		      "for Unicode");
+	    if (ac_unicode_search((mxacse_data *)so->data,
+				  text,
+				  start,
+				  stop,
+				  &left,
+				  &right)) {
+		nextpos = right;
+		match_len = right - left;
 	    }
 	    else {
-		u = PyUnicode_FromEncodedObject(so->match, NULL, NULL);
-		if (u == NULL)
-		    goto onError;
-		match = PyUnicode_AS_UNICODE(u);
-		match_len = PyUnicode_GET_SIZE(u);
+		nextpos = start;
+		match_len = 0;
 	    }
-	    nextpos = trivial_unicode_search(text,
-					     start,
-					     stop,
-					     match,
-					     match_len);
-	    Py_XDECREF(u);
 	}
 	break;
 
@@ -877,6 +993,9 @@ PyObject *mxTextSearch_Repr(PyObject *obj)
     case MXTEXTSEARCH_TRIVIAL:
 	algoname = "Trivial";
 	break;
+    case MXTEXTSEARCH_AHOCORASICK:
+	algoname = "Aho-Corasick";
+	break;
     default:
 	algoname = "";
     }
@@ -1247,11 +1366,16 @@ PyObject *mxCharSet_New(PyObject *definition)
     if (PyString_Check(definition)) {
 	if (init_string_charset(cs, definition))
 	    goto onError;
+	mxscan_init(&cs->scan, ((string_charset *)cs->lookup)->bitmap);
     }
 #ifdef HAVE_UNICODE
     else if (PyUnicode_Check(definition)) {
+	unicode_charset *lookup;
+
 	if (init_unicode_charset(cs, definition))
 	    goto onError;
+	lookup = (unicode_charset *)cs->lookup;
+	mxscan_init(&cs->scan, lookup->bitmaps[lookup->bitmapindex[0]]);
     }
 #endif
     else
@@ -1322,6 +1446,32 @@ int mxCharSet_ContainsChar(PyObject *self,
     return -1;
 }
 
+/* Returns the scan set the CharSet uses for 8-bit characters or NULL
+   in case of an error. The scan set is owned by the CharSet. */
+
+static
+mxscan_set *mxCharSet_8BitScanSet(PyObject *self)
+{
+    if (!mxCharSet_Check(self)) {
+	PyErr_BadInternalCall();
+	goto onError;
+    }
+    
+    if (cs->mode == MXCHARSET_8BITMODE
+#ifdef HAVE_UNICODE
+	|| cs->mode == MXCHARSET_UCS2MODE
+#endif
+	)
+	return &cs->scan;
+    else {
+	Py_Error(mxTextTools_Error,
+		 "unsupported character set mode");
+    }
+
+ onError:
+    return NULL;
+}
+
 #ifdef HAVE_UNICODE
 
 int mxCharSet_ContainsUnicodeChar(PyObject *self,
@@ -1403,66 +1553,16 @@ Py_ssize_t mxCharSet_FindChar(PyObject *self,
 			      const int mode,
 			      const int direction)
 {
-    register Py_ssize_t i;
-    register unsigned int c;
-    register unsigned int block;
-    unsigned char *bitmap;
+    mxscan_set *scan;
 
-    if (!mxCharSet_Check(self)) {
-	PyErr_BadInternalCall();
+    scan = mxCharSet_8BitScanSet(self);
+    if (scan == NULL)
 	goto onError;
-    }
-    
-    if (cs->mode == MXCHARSET_8BITMODE)
-	bitmap = ((string_charset *)cs->lookup)->bitmap;
-#ifdef HAVE_UNICODE
-    else if (cs->mode == MXCHARSET_UCS2MODE) {
-	unicode_charset *lookup = (unicode_charset *)cs->lookup;
-	bitmap = lookup->bitmaps[lookup->bitmapindex[0]];
-    }
-#endif
-    else {
-	Py_Error(mxTextTools_Error,
-		 "unsupported character set mode");
-    }
 
-    if (direction > 0) {
-	if (mode)
-	    /* Find first char in set */
-	    for (i = start; i < stop; i++) {
-		c = text[i];
-		block = bitmap[c >> 3];
-		if (block && ((block & (1 << (c & 7))) != 0))
-		    break;
-	    }
-	else
-	    /* Find first char not in set */
-	    for (i = start; i < stop; i++) {
-		c = text[i];
-		block = bitmap[c >> 3];
-		if (!block || ((block & (1 << (c & 7))) == 0))
-		    break;
-	    }
-    }
-    else {
-	if (mode)
-	    /* Find first char in set, searching from the end */
-	    for (i = stop - 1; i >= start; i--) {
-		c = text[i];
-		block = bitmap[c >> 3];
-		if (block && ((block & (1 << (c & 7))) != 0))
-		    break;
-	    }
-	else
-	    /* Find first char not in set, searching from the end */
-	    for (i = stop - 1; i >= start; i--) {
-		c = text[i];
-		block = bitmap[c >> 3];
-		if (!block || ((block & (1 << (c & 7))) == 0))
-		    break;
-	    }
-    }
-    return i;
+    if (direction > 0)
+	return mxscan_find(scan, text, start, stop, mode);
+    else
+	return mxscan_rfind(scan, text, start, stop, mode);
 
  onError:
     return -2;
@@ -2349,6 +2449,248 @@ PyObject *tc_convert_string_arg(PyObject *arg,
     return NULL;
 }
 
+/* Returns 1 if the TextSearch object can be used by the Tagging
+   Engine for tables of type tabletype without holding the GIL, 0
+   otherwise. */
+
+static
+int tc_textsearch_nogil(PyObject *args,
+			int tabletype)
+{
+    mxTextSearchObject *so = (mxTextSearchObject *)args;
+
+    if (tabletype == MXTAGTABLE_STRINGTYPE)
+	return (so->algorithm != MXTEXTSEARCH_TRIVIAL ||
+		PyString_Check(so->match));
+#ifdef HAVE_UNICODE
+    /* Only the trivial and Aho-Corasick searches support Unicode */
+    return ((so->algorithm == MXTEXTSEARCH_TRIVIAL &&
+	     PyUnicode_Check(so->match)) ||
+	    (so->algorithm == MXTEXTSEARCH_AHOCORASICK &&
+	     so->translate == NULL));
+#else
+    return 0;
+#endif
+}
+
+/* Returns a new set() string for the len characters in s. If logic
+   is 0, the set contains all characters *not* in s. */
+
+static
+PyObject *set_from_chars(const char *s,
+			    Py_ssize_t len,
+			    int logic)
+{
+    PyObject *sto;
+    char *st;
+    Py_ssize_t i;
+
+    sto = PyString_FromStringAndSize(NULL,32);
+    if (sto == NULL)
+	return NULL;
+    
+    st = PyString_AS_STRING(sto);
+
+    if (logic) {
+	memset(st,0x00,32);
+	for (i = 0; i < len; i++,s++) {
+	    int j = (unsigned char)*s;
+	    
+	    st[j >> 3] |= 1 << (j & 7);
+	}
+    }
+    else {
+	memset(st,0xFF,32);
+	for (i = 0; i < len; i++,s++) {
+	    int j = (unsigned char)*s;
+	    
+	    st[j >> 3] &= ~(1 << (j & 7));
+	}
+    }
+    return sto;
+}
+
+/* Returns a new string holding the mxscan_set for the 32-byte set
+   bitmap. */
+
+static
+PyObject *scanset_from_bitmap(const unsigned char *bitmap)
+{
+    PyObject *v;
+
+    v = PyString_FromStringAndSize(NULL, sizeof(mxscan_set));
+    if (v == NULL)
+	return NULL;
+    mxscan_init((mxscan_set *)PyString_AS_STRING(v), bitmap);
+    return v;
+}
+
+/* Lower the compiled tag table entry for the Tagging Engine: set the
+   opcode and resolve the arguments to raw C data. Returns -1 in case
+   of an error, 0 on success. */
+
+static
+int tc_lower_entry(mxTagTableEntry *tagtableentry,
+		   int tabletype)
+{
+    PyObject *args = tagtableentry->args;
+    int logic;
+
+    tagtableentry->op = MXTAGTABLE_OP_HIGHLEVEL;
+    tagtableentry->argdata = NULL;
+    tagtableentry->arglen = 0;
+    tagtableentry->argobj = NULL;
+
+    switch (tagtableentry->cmd) {
+
+    case MATCH_ALLIN:
+    case MATCH_ALLNOTIN:
+    case MATCH_ISIN:
+    case MATCH_ISNOTIN:
+	logic = (tagtableentry->cmd == MATCH_ALLIN ||
+		 tagtableentry->cmd == MATCH_ISIN);
+	if (tabletype == MXTAGTABLE_STRINGTYPE &&
+	    PyString_GET_SIZE(args) > 1) {
+	    PyObject *set;
+
+	    /* Test characters using a set bitmap */
+	    set = set_from_chars(PyString_AS_STRING(args),
+				 PyString_GET_SIZE(args),
+				 logic);
+	    if (set == NULL)
+		goto onError;
+	    tagtableentry->argobj = scanset_from_bitmap(
+				 (unsigned char *)PyString_AS_STRING(set));
+	    Py_DECREF(set);
+	    if (tagtableentry->argobj == NULL)
+		goto onError;
+	    tagtableentry->argdata = PyString_AS_STRING(tagtableentry->argobj);
+	    if (tagtableentry->cmd == MATCH_ALLIN ||
+		tagtableentry->cmd == MATCH_ALLNOTIN)
+		tagtableentry->op = MXTAGTABLE_OP_ALLINSET;
+	    else
+		tagtableentry->op = MXTAGTABLE_OP_ISINSET;
+	    break;
+	}
+	/* Fall through */
+
+    case MATCH_IS:
+    case MATCH_ISNOT:
+    case MATCH_WORD:
+    case MATCH_WORDSTART:
+    case MATCH_WORDEND:
+	if (tabletype == MXTAGTABLE_STRINGTYPE) {
+	    tagtableentry->argdata = PyString_AS_STRING(args);
+	    tagtableentry->arglen = PyString_GET_SIZE(args);
+	}
+#ifdef HAVE_UNICODE
+	else {
+	    tagtableentry->argdata = PyUnicode_AS_UNICODE(args);
+	    tagtableentry->arglen = PyUnicode_GET_SIZE(args);
+	}
+#endif
+	switch (tagtableentry->cmd) {
+	case MATCH_ALLIN:
+	    tagtableentry->op = MXTAGTABLE_OP_ALLIN;
+	    break;
+	case MATCH_ALLNOTIN:
+	    tagtableentry->op = MXTAGTABLE_OP_ALLNOTIN;
+	    break;
+	case MATCH_IS:
+	    tagtableentry->op = MXTAGTABLE_OP_IS;
+	    break;
+	case MATCH_ISNOT:
+	    tagtableentry->op = MXTAGTABLE_OP_ISNOT;
+	    break;
+	case MATCH_ISIN:
+	    /* A single character is tested using Is */
+	    if (tagtableentry->arglen == 1)
+		tagtableentry->op = MXTAGTABLE_OP_IS;
+	    else
+		tagtableentry->op = MXTAGTABLE_OP_ISIN;
+	    break;
+	case MATCH_ISNOTIN:
+	    if (tagtableentry->arglen == 1)
+		tagtableentry->op = MXTAGTABLE_OP_ISNOT;
+	    else
+		tagtableentry->op = MXTAGTABLE_OP_ISNOTIN;
+	    break;
+	case MATCH_WORD:
+	    tagtableentry->op = MXTAGTABLE_OP_WORD;
+	    break;
+	case MATCH_WORDSTART:
+	    tagtableentry->op = MXTAGTABLE_OP_WORDSTART;
+	    break;
+	case MATCH_WORDEND:
+	    tagtableentry->op = MXTAGTABLE_OP_WORDEND;
+	    break;
+	}
+	break;
+
+    case MATCH_ALLINSET:
+    case MATCH_ISINSET:
+	if (tabletype == MXTAGTABLE_STRINGTYPE) {
+	    tagtableentry->argobj = scanset_from_bitmap(
+				 (unsigned char *)PyString_AS_STRING(args));
+	    if (tagtableentry->argobj == NULL)
+		goto onError;
+	    tagtableentry->argdata = PyString_AS_STRING(tagtableentry->argobj);
+	}
+	else
+	    tagtableentry->argdata = PyString_AS_STRING(args);
+	if (tagtableentry->cmd == MATCH_ALLINSET)
+	    tagtableentry->op = MXTAGTABLE_OP_ALLINSET;
+	else
+	    tagtableentry->op = MXTAGTABLE_OP_ISINSET;
+	break;
+
+    case MATCH_ALLINCHARSET:
+    case MATCH_ISINCHARSET:
+	if (tabletype == MXTAGTABLE_STRINGTYPE) {
+	    /* Use the CharSet's scan set directly */
+	    tagtableentry->argdata = mxCharSet_8BitScanSet(args);
+	    if (tagtableentry->argdata == NULL)
+		goto onError;
+	    if (tagtableentry->cmd == MATCH_ALLINCHARSET)
+		tagtableentry->op = MXTAGTABLE_OP_ALLINSET;
+	    else
+		tagtableentry->op = MXTAGTABLE_OP_ISINSET;
+	}
+	else if (tagtableentry->cmd == MATCH_ALLINCHARSET)
+	    tagtableentry->op = MXTAGTABLE_OP_ALLINCHARSET;
+	else
+	    tagtableentry->op = MXTAGTABLE_OP_ISINCHARSET;
+	break;
+
+    case MATCH_FAIL: /* == MATCH_JUMP */
+	tagtableentry->op = MXTAGTABLE_OP_FAIL;
+	break;
+
+    case MATCH_SKIP:
+	tagtableentry->op = MXTAGTABLE_OP_SKIP;
+	tagtableentry->arglen = PyInt_AS_LONG(args);
+	break;
+
+    case MATCH_MOVE:
+	tagtableentry->op = MXTAGTABLE_OP_MOVE;
+	tagtableentry->arglen = PyInt_AS_LONG(args);
+	break;
+
+    case MATCH_EOF:
+	tagtableentry->op = MXTAGTABLE_OP_EOF;
+	break;
+
+    case MATCH_JUMPTARGET:
+	tagtableentry->op = MXTAGTABLE_OP_JUMPTARGET;
+	break;
+
+    }
+    return 0;
+
+ onError:
+    return -1;
+}
+
 /* Cleanup any references in the tag table. */
 
 static
@@ -2362,6 +2704,8 @@ int tc_cleanup(mxTagTableObject *tagtable)
 	tagtableentry->tagobj = NULL;
 	Py_XDECREF(tagtableentry->args);
 	tagtableentry->args = NULL;
+	Py_XDECREF(tagtableentry->argobj);
+	tagtableentry->argobj = NULL;
     }
     return 0;
 }
@@ -2388,6 +2732,7 @@ int init_tag_table(mxTagTableObject *tagtable,
 
     /* Reset to all fields to 0 */
     memset(&tagtable->entry[0], 0, size * sizeof(mxTagTableEntry));
+    tagtable->flags = 0;
     
     /* First pass */
     secondpass = 0;
@@ -2415,6 +2760,7 @@ int init_tag_table(mxTagTableObject *tagtable,
 	    tagtableentry->args = entry;
 	    tagtableentry->jne = 0;
 	    tagtableentry->je = 1;
+	    tagtableentry->op = MXTAGTABLE_OP_JUMPTARGET;
 	    continue;
 	}
 
@@ -2469,6 +2815,16 @@ int init_tag_table(mxTagTableObject *tagtable,
 	tagtableentry->cmd = PyInt_AS_LONG(command) & 0xFF;
 	tagtableentry->flags = PyInt_AS_LONG(command) - tagtableentry->cmd;
 
+	/* Tag objects are only ever appended to the taglist without
+	   calling into Python for these flags */
+	if (tagobj) {
+	    tagtable->flags |= MXTAGTABLE_TAGOBJECTS;
+	    if (tagtableentry->flags & ~(MATCH_APPENDTAGOBJ |
+					 MATCH_APPENDMATCH |
+					 MATCH_LOOKAHEAD))
+		tagtable->flags |= MXTAGTABLE_NEEDSGIL;
+	}
+
 	/* Check command arguments */
 	Py_INCREF(args);
 	own_args = 1;
@@ -2477,9 +2833,14 @@ int init_tag_table(mxTagTableObject *tagtable,
 
 	case MATCH_JUMP: /* == MATCH_FAIL */
 	case MATCH_EOF:
-	case MATCH_LOOP:
 	    /* args is ignored */
 	    break;
+
+	case MATCH_LOOP:
+	    /* The Tagging Engine raises an error for non-integers */
+	    if (!PyInt_Check(args))
+		tagtable->flags |= MXTAGTABLE_NEEDSGIL;
+	    break;
 	
 	case MATCH_SKIP:
 	case MATCH_MOVE:
@@ -2547,6 +2908,8 @@ int init_tag_table(mxTagTableObject *tagtable,
 			     "argument must be a TextSearch search "
 			     "object",
 			     (long)i);
+	    if (!tc_textsearch_nogil(args, tabletype))
+		tagtable->flags |= MXTAGTABLE_NEEDSGIL;
 	    break;
 	
 	case MATCH_TABLE:
@@ -2573,6 +2936,8 @@ int init_tag_table(mxTagTableObject *tagtable,
 		if (args == NULL)
 		    goto onError;
 	    }
+	    if (mxTagTable_Check(args))
+		tagtable->flags |= ((mxTagTableObject *)args)->flags;
 	    break;
 	
 	case MATCH_TABLEINLIST:
@@ -2586,6 +2951,8 @@ int init_tag_table(mxTagTableObject *tagtable,
 			     "TableInList|SubTableInList command argument "
 			     "must be a 2-tuple (list, integer)",
 			     (long)i);
+	    /* The list may change at any time */
+	    tagtable->flags |= MXTAGTABLE_NEEDSGIL;
 	    break;
 
 	case MATCH_CALL:
@@ -2595,6 +2962,7 @@ int init_tag_table(mxTagTableObject *tagtable,
 			     "Call command argument "
 			     "must be a callable object",
 			     (long)i);
+	    tagtable->flags |= MXTAGTABLE_NEEDSGIL;
 	    break;
 
 	case MATCH_CALLARG:
@@ -2606,6 +2974,7 @@ int init_tag_table(mxTagTableObject *tagtable,
 			     "CallArg command argument "
 			     "must be a tuple (fct,[arg0,arg1,...])",
 			     (long)i);
+	    tagtable->flags |= MXTAGTABLE_NEEDSGIL;
 	    break;
 	    
 	default:
@@ -2620,6 +2989,10 @@ int init_tag_table(mxTagTableObject *tagtable,
 	tagtableentry->args = args;
 	own_args = 0;
 
+	/* Lower the entry for the Tagging Engine */
+	if (tc_lower_entry(tagtableentry, tabletype))
+	    goto onError;
+
 	/* Decode jump offsets */
 	if (jne) {
 	    if (PyInt_Check(jne))
@@ -4318,31 +4691,23 @@ PyObject *mxTextTools_SetStrip(char *tx,
 			       int where)
 {
     Py_ssize_t left, right;
+    mxscan_set scan;
 
     Py_Assert(setstr_len == 32,
 	      PyExc_TypeError,
 	      "separator needs to be a set as obtained from set()");
     Py_CheckBufferSlice(tx_len, start, stop);
+    mxscan_init(&scan, (unsigned char *)setstr);
 
     /* Strip left */
-    if (where <= 0) {
-	register Py_ssize_t x;
-	for (x = start; x < stop; x++) 
-	    if (!Py_CharInSet(tx[x], setstr))
-		break;
-	left = x;
-    }
+    if (where <= 0)
+	left = mxscan_find(&scan, (unsigned char *)tx, start, stop, 0);
     else
 	left = start;
 
     /* Strip right */
-    if (where >= 0) {
-	register Py_ssize_t x;
-	for (x = stop - 1; x >= start; x--) 
-	    if (!Py_CharInSet(tx[x], setstr))
-		break;
-	right = x + 1;
-    }
+    if (where >= 0)
+	right = mxscan_rfind(&scan, (unsigned char *)tx, start, stop, 0) + 1;
     else
 	right = stop;
     
@@ -4364,11 +4729,13 @@ PyObject *mxTextTools_SetSplit(char *tx,
     register Py_ssize_t x;
     Py_ssize_t listitem = 0;
     Py_ssize_t listsize = INITIAL_LIST_SIZE;
+    mxscan_set scan;
 
     Py_Assert(setstr_len == 32,
 	      PyExc_TypeError,
 	      "separator needs to be a set as obtained from set()");
     Py_CheckBufferSlice(tx_len,start,text_len);
+    mxscan_init(&scan, (unsigned char *)setstr);
 
     list = PyList_New(listsize);
     if (!list)
@@ -4379,21 +4746,11 @@ PyObject *mxTextTools_SetSplit(char *tx,
 	Py_ssize_t z;
 
 	/* Skip all text in set */
-	for (;x < text_len; x++) {
-	    register unsigned int c = (unsigned char)tx[x];
-	    register unsigned int block = (unsigned char)setstr[c >> 3];
-	    if (!block || ((block & (1 << (c & 7))) == 0))
-		break;
-	}
+	x = mxscan_find(&scan, (unsigned char *)tx, x, text_len, 0);
 
 	/* Skip all text not in set */
 	z = x;
-	for (;x < text_len; x++) {
-	    register unsigned int c = (unsigned char)tx[x];
-	    register unsigned int block = (unsigned char)setstr[c >> 3];
-	    if (block && ((block & (1 << (c & 7))) != 0))
-		break;
-	}
+	x = mxscan_find(&scan, (unsigned char *)tx, x, text_len, 1);
 
 	/* Append the slice to list if it is not empty */
 	if (x > z) {
@@ -4434,11 +4791,13 @@ PyObject *mxTextTools_SetSplitX(char *tx,
     register Py_ssize_t x;
     Py_ssize_t listitem = 0;
     Py_ssize_t listsize = INITIAL_LIST_SIZE;
+    mxscan_set scan;
 
     Py_Assert(setstr_len == 32,
 	      PyExc_TypeError,
 	      "separator needs to be a set as obtained from set()");
     Py_CheckBufferSlice(tx_len,start,text_len);
+    mxscan_init(&scan, (unsigned char *)setstr);
 
     list = PyList_New(listsize);
     if (!list)
@@ -4451,12 +4810,7 @@ PyObject *mxTextTools_SetSplitX(char *tx,
 
 	/* Skip all text not in set */
 	z = x;
-	for (;x < text_len; x++) {
-	    register unsigned int c = (unsigned char)tx[x];
-	    register unsigned int block = (unsigned char)setstr[c >> 3];
-	    if (block && ((block & (1 << (c & 7))) != 0))
-		break;
-	}
+	x = mxscan_find(&scan, (unsigned char *)tx, x, text_len, 1);
 
 	/* Append the slice to list */
 	s = PyString_FromStringAndSize((char *)&tx[z], x - z);
@@ -4475,12 +4829,7 @@ PyObject *mxTextTools_SetSplitX(char *tx,
 
 	/* Skip all text in set */
 	z = x;
-	for (;x < text_len; x++) {
-	    register unsigned int c = (unsigned char)tx[x];
-	    register unsigned int block = (unsigned char)setstr[c >> 3];
-	    if (!block || ((block & (1 << (c & 7))) == 0))
-		break;
-	}
+	x = mxscan_find(&scan, (unsigned char *)tx, x, text_len, 0);
 
 	/* Append the slice to list if it is not empty */
 	s = PyString_FromStringAndSize((char *)&tx[z], x - z);
@@ -5018,38 +5367,14 @@ Py_C_Function( mxTextTools_set,
 	       "- logic can be set to 0 if all characters *not* in string\n"
 	       "  should go into the set")
 {
-    PyObject *sto;
-    char *s,*st;
+    char *s;
     Py_ssize_t len_s;
     int logic = 1;
-    Py_ssize_t i;
 
     Py_Get3Args("s#|i:set",
 		s,len_s,logic);
 
-    sto = PyString_FromStringAndSize(NULL,32);
-    if (sto == NULL)
-	goto onError;
-    
-    st = PyString_AS_STRING(sto);
-
-    if (logic) {
-	memset(st,0x00,32);
-	for (i = 0; i < len_s; i++,s++) {
-	    int j = (unsigned char)*s;
-	    
-	    st[j >> 3] |= 1 << (j & 7);
-	}
-    }
-    else {
-	memset(st,0xFF,32);
-	for (i = 0; i < len_s; i++,s++) {
-	    int j = (unsigned char)*s;
-	    
-	    st[j >> 3] &= ~(1 << (j & 7));
-	}
-    }
-    return sto;
+    return set_from_chars(s, len_s, logic);
 
  onError:
     return NULL;
@@ -5066,9 +5391,8 @@ Py_C_Function( mxTextTools_setfind,
     PyObject *set;
     Py_ssize_t text_len = INT_MAX;
     Py_ssize_t start = 0;
-    register Py_ssize_t x;
-    register char *tx;
-    register unsigned char *setstr;
+    Py_ssize_t x;
+    mxscan_set scan;
     
     Py_Get4Args("OO|"
 		Py_SSIZE_T_PARSERMARKER
@@ -5084,13 +5408,9 @@ Py_C_Function( mxTextTools_setfind,
 	      "second argument needs to be a set");
     Py_CheckStringSlice(text,start,text_len);
 
-    x = start;
-    tx = PyString_AS_STRING(text) + x;
-    setstr = (unsigned char *)PyString_AS_STRING(set);
-
-    for (;x < text_len; tx++, x++) 
-	if (Py_CharInSet(*tx,setstr))
-	    break;
+    mxscan_init(&scan, (unsigned char *)PyString_AS_STRING(set));
+    x = mxscan_find(&scan, (unsigned char *)PyString_AS_STRING(text),
+		    start, text_len, 1);
     
     if (x == text_len)
 	/* Not found */
@@ -5346,6 +5666,9 @@ MX_EXPORT(void)
     PyType_Init(mxCharSet_Type);
     PyType_Init(mxTagTable_Type);
 
+    /* Select the character set scanning kernel */
+    mxscan_setup();
+
     /* create module */
     module = Py_InitModule4(MXTEXTTOOLS_MODULE, /* Module name */
 			    Module_methods, /* Method list */
@@ -5389,6 +5712,7 @@ MX_EXPORT(void)
     insint(moddict, "BOYERMOORE", MXTEXTSEARCH_BOYERMOORE);
     insint(moddict, "FASTSEARCH", MXTEXTSEARCH_FASTSEARCH);
     insint(moddict, "TRIVIAL", MXTEXTSEARCH_TRIVIAL);
+    insint(moddict, "AHOCORASICK", MXTEXTSEARCH_AHOCORASICK);
   
     /* Init exceptions */
     if ((mxTextTools_Error = insexc(moddict,
@@ -14,6 +14,12 @@
 #define BM_LENGTH_TYPE Py_ssize_t
 #include "mxbmse.h"
 
+/* Include character set scanning */
+#include "mxscan.h"
+
+/* Include Aho-Corasick multi-pattern search */
+#include "mxacse.h"
+
 /* Include FastSearch algorithm, if available */
 #ifdef MXFASTSEARCH
 # define FS_LENGTH_TYPE Py_ssize_t
@@ -42,10 +48,12 @@ extern "C" {
 #define MXTEXTSEARCH_BOYERMOORE		0
 #define MXTEXTSEARCH_FASTSEARCH		1
 #define MXTEXTSEARCH_TRIVIAL		2
+#define MXTEXTSEARCH_AHOCORASICK	3
 
 typedef struct {
     PyObject_HEAD
-    PyObject *match; 		/* Match string object */
+    PyObject *match; 		/* Match string object; a tuple of
+				   match strings for Aho-Corasick */
     PyObject *translate;	/* Translate string object or NULL */
     int algorithm;		/* Algorithm to be used */
     void *data; 		/* Internal data used by the algorithm or
@@ -96,6 +104,7 @@ typedef struct {
 				   2 - UCS-4 Unicode lookup
 				*/
     void *lookup;		/* Lookup table */
+    mxscan_set scan;		/* Scan tables for 8-bit characters */
 } mxCharSetObject;
 
 MXTEXTTOOLS_EXTERNALIZE(PyTypeObject) mxCharSet_Type;
@@ -133,11 +142,59 @@ typedef struct {
     PyObject *args;			/* Command arguments */
     Py_ssize_t jne;			/* Non-match jump offset */
     Py_ssize_t je;			/* Match jump offset */
+
+    /* Lowered form of the entry used by the Tagging Engine */
+    int op;				/* Opcode (MXTAGTABLE_OP_*) */
+    void *argdata;			/* Raw argument data: string
+					   data or an mxscan_set (for
+					   the set opcodes); NULL if
+					   not used */
+    Py_ssize_t arglen;			/* Length of argdata in
+					   characters or the value of
+					   an integer argument */
+    PyObject *argobj;			/* Object owning argdata, if
+					   not args, or NULL */
 } mxTagTableEntry;
 
+/* Opcodes of the lowered tag table entries. The Tagging Engine
+   dispatches on these instead of the command integers. For 8-bit
+   tables, the Tag Table compiler turns string arguments of more
+   than one character and CharSets into set bitmaps, using the
+   *INSET opcodes. Commands without an opcode of their own are run
+   via MXTAGTABLE_OP_HIGHLEVEL. */
+#define MXTAGTABLE_OP_HIGHLEVEL		0
+#define MXTAGTABLE_OP_ALLIN		1
+#define MXTAGTABLE_OP_ALLNOTIN		2
+#define MXTAGTABLE_OP_IS		3
+#define MXTAGTABLE_OP_ISNOT		4
+#define MXTAGTABLE_OP_ISIN		5
+#define MXTAGTABLE_OP_ISNOTIN		6
+#define MXTAGTABLE_OP_WORD		7
+#define MXTAGTABLE_OP_WORDSTART		8
+#define MXTAGTABLE_OP_WORDEND		9
+#define MXTAGTABLE_OP_ALLINSET		10
+#define MXTAGTABLE_OP_ISINSET		11
+#define MXTAGTABLE_OP_ALLINCHARSET	12
+#define MXTAGTABLE_OP_ISINCHARSET	13
+#define MXTAGTABLE_OP_FAIL		14
+#define MXTAGTABLE_OP_SKIP		15
+#define MXTAGTABLE_OP_MOVE		16
+#define MXTAGTABLE_OP_EOF		17
+#define MXTAGTABLE_OP_JUMPTARGET	18
+
 #define MXTAGTABLE_STRINGTYPE	0
 #define MXTAGTABLE_UNICODETYPE	1
 
+/* Tag Table compiler flags; these include the flags of all
+   subtables */
+#define MXTAGTABLE_NEEDSGIL	1	/* Matching may call into Python
+					   or raise errors, so the
+					   table must be run with the
+					   GIL held */
+#define MXTAGTABLE_TAGOBJECTS	2	/* Some entries have tag objects
+					   which may be appended to the
+					   taglist */
+
 typedef struct {
     PyObject_VAR_HEAD
     PyObject *definition;		/* Reference to the original
@@ -146,6 +203,8 @@ typedef struct {
     int tabletype;			/* Type of compiled table:
 					   0 - 8-bit string args
 					   1 - Unicode args */
+    int flags;				/* MXTAGTABLE_* flags set by
+					   the Tag Table compiler */
     mxTagTableEntry entry[1];		/* Variable length array of
 					   mxTagTableEntry fields;
 					   ob_size gives the number of
@@ -192,6 +251,9 @@ PyObject *mxTagTable_New(PyObject *definition,
    Notes:
    - doesn't check type of passed arguments !
    - doesn't increment reference counts of passed objects !
+   - releases the GIL while matching on level 0 if the table
+     doesn't need it (see MXTAGTABLE_NEEDSGIL) and no tags are
+     appended to taglist
 
 */
 
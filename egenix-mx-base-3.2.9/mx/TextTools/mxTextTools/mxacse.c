@@ -0,0 +1,475 @@
+/*
+  mxacse -- Aho-Corasick Multi-Pattern Search
+
+  Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+
+                        All Rights Reserved
+
+  See the documentation for copying information or contact the author
+  (mal@lemburg.com).
+*/
+
+/* to turn on the debugging printfs (DPRINTF):*/
+/* #define MAL_DEBUG */
+
+#include "mx.h"
+#include "mxTextTools.h"
+
+/* --- Construction ------------------------------------------------------- */
+
+mxacse_data *ac_init(void)
+{
+    mxacse_data *c;
+
+    c = newstruct(mxacse_data);
+    if (c == NULL)
+	return NULL;
+    memset(c, 0, sizeof(mxacse_data));
+    return c;
+}
+
+void ac_free(mxacse_data *c)
+{
+    if (c == NULL)
+	return;
+    if (c->codes)
+	free(c->codes);
+    if (c->ends)
+	free(c->ends);
+    if (c->wide)
+	free(c->wide);
+    if (c->outlen)
+	free(c->outlen);
+    if (c->delta)
+	free(c->delta);
+    if (c->edge_start)
+	free(c->edge_start);
+    if (c->edge_class)
+	free(c->edge_class);
+    if (c->edge_to)
+	free(c->edge_to);
+    if (c->fail)
+	free(c->fail);
+    free(c);
+}
+
+/* Make room for another match string of match_len characters */
+
+static
+int ac_reserve(mxacse_data *c,
+	       Py_ssize_t match_len)
+{
+    if (c->ncodes + match_len > c->codes_size) {
+	Py_ssize_t size = 2 * c->codes_size + match_len + 64;
+	unsigned int *codes;
+
+	codes = resize(c->codes, unsigned int, size);
+	if (codes == NULL)
+	    return -1;
+	c->codes = codes;
+	c->codes_size = size;
+    }
+    if (c->nmatches == c->ends_size) {
+	Py_ssize_t size = 2 * c->ends_size + 16;
+	Py_ssize_t *ends;
+
+	ends = resize(c->ends, Py_ssize_t, size);
+	if (ends == NULL)
+	    return -1;
+	c->ends = ends;
+	c->ends_size = size;
+    }
+    return 0;
+}
+
+int ac_add(mxacse_data *c,
+	   const char *match,
+	   Py_ssize_t match_len)
+{
+    Py_ssize_t i;
+
+    if (ac_reserve(c, match_len))
+	return -1;
+    for (i = 0; i < match_len; i++)
+	c->codes[c->ncodes++] = (unsigned char)match[i];
+    c->ends[c->nmatches++] = c->ncodes;
+    return 0;
+}
+
+#ifdef HAVE_UNICODE
+int ac_add_unicode(mxacse_data *c,
+		   const Py_UNICODE *match,
+		   Py_ssize_t match_len)
+{
+    Py_ssize_t i;
+
+    if (ac_reserve(c, match_len))
+	return -1;
+    for (i = 0; i < match_len; i++)
+	c->codes[c->ncodes++] = (unsigned int)match[i];
+    c->ends[c->nmatches++] = c->ncodes;
+    return 0;
+}
+#endif
+
+/* Return the class of the character ordinal code */
+
+static
+int ac_class(const mxacse_data *c,
+	     unsigned int code)
+{
+    int lo, hi;
+
+    if (code < 256)
+	return c->byteclass[code];
+    lo = 0;
+    hi = c->nwide;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (c->wide[mid] < code)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < c->nwide && c->wide[lo] == code)
+	return c->wideclass + lo;
+    return 0;
+}
+
+/* Return the next state using the goto and failure links */
+
+static
+int ac_goto(const mxacse_data *c,
+	    int state,
+	    int cls)
+{
+    if (cls == 0)
+	return 0;
+    for (;;) {
+	int lo = c->edge_start[state];
+	int hi = c->edge_start[state + 1];
+	int end = hi;
+
+	while (lo < hi) {
+	    int mid = (lo + hi) / 2;
+	    if (c->edge_class[mid] < cls)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	if (lo < end && c->edge_class[lo] == cls)
+	    return c->edge_to[lo];
+	if (state == 0)
+	    return 0;
+	state = c->fail[state];
+    }
+}
+
+static
+int ac_compare_codes(const void *a,
+		     const void *b)
+{
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    int cls;
+    int to;
+} ac_edge;
+
+static
+int ac_compare_edges(const void *a,
+		     const void *b)
+{
+    return ((const ac_edge *)a)->cls - ((const ac_edge *)b)->cls;
+}
+
+int ac_compile(mxacse_data *c)
+{
+    unsigned char used[256];
+    int *first_child = NULL;	/* Trie as linked lists: first child, */
+    int *sibling = NULL;	/* next sibling and */
+    int *edge = NULL;		/* class of the link to each state */
+    Py_ssize_t *ownlen = NULL;
+    int *queue = NULL;
+    ac_edge *tmp = NULL;
+    Py_ssize_t i, k, begin;
+    int nstates, nclasses, s, v, head, tail;
+
+    if (c->ncodes >= INT_MAX - 1)
+	goto onError;
+
+    /* Assign character classes */
+    memset(used, 0, sizeof(used));
+    k = 0;
+    for (i = 0; i < c->ncodes; i++)
+	if (c->codes[i] < 256)
+	    used[c->codes[i]] = 1;
+	else
+	    k++;
+    if (k > 0) {
+	c->wide = new(unsigned int, k);
+	if (c->wide == NULL)
+	    goto onError;
+	k = 0;
+	for (i = 0; i < c->ncodes; i++)
+	    if (c->codes[i] >= 256)
+		c->wide[k++] = c->codes[i];
+	qsort(c->wide, k, sizeof(unsigned int), ac_compare_codes);
+	c->nwide = 1;
+	for (i = 1; i < k; i++)
+	    if (c->wide[i] != c->wide[c->nwide - 1])
+		c->wide[c->nwide++] = c->wide[i];
+    }
+    nclasses = 1;
+    for (i = 0; i < 256; i++)
+	c->byteclass[i] = used[i] ? nclasses++ : 0;
+    c->wideclass = nclasses;
+    nclasses += c->nwide;
+    c->nclasses = nclasses;
+    for (i = 0; i < c->ncodes; i++)
+	c->codes[i] = ac_class(c, c->codes[i]);
+
+    /* Build the trie; each state except the root has exactly one
+       incoming link, so the links are stored with their target
+       state */
+    first_child = new(int, c->ncodes + 1);
+    sibling = new(int, c->ncodes + 1);
+    edge = new(int, c->ncodes + 1);
+    ownlen = new(Py_ssize_t, c->ncodes + 1);
+    if (first_child == NULL || sibling == NULL || edge == NULL ||
+	ownlen == NULL)
+	goto onError;
+    nstates = 1;
+    first_child[0] = -1;
+    ownlen[0] = 0;
+    c->min_len = -1;
+    c->max_len = 0;
+    begin = 0;
+    for (k = 0; k < c->nmatches; k++) {
+	Py_ssize_t len = c->ends[k] - begin;
+
+	s = 0;
+	for (i = begin; i < c->ends[k]; i++) {
+	    int cls = (int)c->codes[i];
+
+	    for (v = first_child[s]; v >= 0 && edge[v] != cls; v = sibling[v])
+		;
+	    if (v < 0) {
+		v = nstates++;
+		edge[v] = cls;
+		first_child[v] = -1;
+		ownlen[v] = 0;
+		sibling[v] = first_child[s];
+		first_child[s] = v;
+	    }
+	    s = v;
+	}
+	ownlen[s] = len;
+	if (c->min_len < 0 || len < c->min_len)
+	    c->min_len = len;
+	if (len > c->max_len)
+	    c->max_len = len;
+	begin = c->ends[k];
+    }
+    c->nstates = nstates;
+
+    /* Store the goto links sorted by class */
+    c->edge_start = new(int, nstates + 1);
+    c->edge_class = new(int, nstates);
+    c->edge_to = new(int, nstates);
+    tmp = new(ac_edge, nstates);
+    if (c->edge_start == NULL || c->edge_class == NULL ||
+	c->edge_to == NULL || tmp == NULL)
+	goto onError;
+    k = 0;
+    for (s = 0; s < nstates; s++) {
+	int n = 0;
+
+	for (v = first_child[s]; v >= 0; v = sibling[v]) {
+	    tmp[n].cls = edge[v];
+	    tmp[n].to = v;
+	    n++;
+	}
+	if (n > 1)
+	    qsort(tmp, n, sizeof(ac_edge), ac_compare_edges);
+	c->edge_start[s] = (int)k;
+	for (i = 0; i < n; i++, k++) {
+	    c->edge_class[k] = tmp[i].cls;
+	    c->edge_to[k] = tmp[i].to;
+	}
+    }
+    c->edge_start[nstates] = (int)k;
+
+    /* Compute the failure links and outputs in breadth-first order,
+       so that the failure links of shorter prefixes are available */
+    c->fail = new(int, nstates);
+    c->outlen = new(Py_ssize_t, nstates);
+    queue = new(int, nstates);
+    if (c->fail == NULL || c->outlen == NULL || queue == NULL)
+	goto onError;
+    c->fail[0] = 0;
+    c->outlen[0] = 0;
+    head = tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+	int u = queue[head++];
+
+	for (k = c->edge_start[u]; k < c->edge_start[u + 1]; k++) {
+	    v = c->edge_to[k];
+	    if (u == 0)
+		c->fail[v] = 0;
+	    else
+		c->fail[v] = ac_goto(c, c->fail[u], c->edge_class[k]);
+	    c->outlen[v] = ownlen[v] ? ownlen[v] : c->outlen[c->fail[v]];
+	    queue[tail++] = v;
+	}
+    }
+
+    /* Build the complete transition table, if it isn't too large */
+    if ((Py_ssize_t)nstates * nclasses <= AC_DENSE_MAX) {
+	c->delta = new(int, (Py_ssize_t)nstates * nclasses);
+	if (c->delta == NULL)
+	    goto onError;
+	for (i = 0; i < nstates; i++) {
+	    int *row;
+
+	    s = queue[i];
+	    row = c->delta + (Py_ssize_t)s * nclasses;
+	    if (s == 0)
+		memset(row, 0, nclasses * sizeof(int));
+	    else
+		memcpy(row, c->delta + (Py_ssize_t)c->fail[s] * nclasses,
+		       nclasses * sizeof(int));
+	    for (k = c->edge_start[s]; k < c->edge_start[s + 1]; k++)
+		row[c->edge_class[k]] = c->edge_to[k];
+	}
+	free(c->edge_start);
+	free(c->edge_class);
+	free(c->edge_to);
+	free(c->fail);
+	c->edge_start = NULL;
+	c->edge_class = NULL;
+	c->edge_to = NULL;
+	c->fail = NULL;
+    }
+    DPRINTF("ac_compile: %i states, %i classes, %s table\n",
+	    nstates, nclasses, c->delta ? "complete" : "sparse");
+
+    /* The match strings are no longer needed */
+    free(c->codes);
+    free(c->ends);
+    c->codes = NULL;
+    c->ends = NULL;
+
+    free(first_child);
+    free(sibling);
+    free(edge);
+    free(ownlen);
+    free(tmp);
+    free(queue);
+    return 0;
+
+ onError:
+    if (first_child)
+	free(first_child);
+    if (sibling)
+	free(sibling);
+    if (edge)
+	free(edge);
+    if (ownlen)
+	free(ownlen);
+    if (tmp)
+	free(tmp);
+    if (queue)
+	free(queue);
+    return -1;
+}
+
+/* --- Search ------------------------------------------------------------- */
+
+/* Run the automaton over text[start:stop], with CLASS giving the class
+   of the character at index i and NEXT the next state. Matches found
+   later may start further left, so the scan continues until no match
+   starting at or before the leftmost one seen can end anymore. */
+
+#define AC_SEARCH(CLASS, NEXT)						\
+    {									\
+	register int state = 0;						\
+	register Py_ssize_t i;						\
+	Py_ssize_t l = -1, r = -1;					\
+									\
+	for (i = start; i < stop; i++) {				\
+	    register int cls = (CLASS);					\
+									\
+	    state = (NEXT);						\
+	    if (outlen[state]) {					\
+		Py_ssize_t matchleft = i + 1 - outlen[state];		\
+		if (l < 0 || matchleft <= l) {				\
+		    l = matchleft;					\
+		    r = i + 1;						\
+		}							\
+	    }								\
+	    if (l >= 0 && i + 2 > l + c->max_len)			\
+		break;							\
+	}								\
+	if (l < 0)							\
+	    return 0;							\
+	*left = l;							\
+	*right = r;							\
+	return 1;							\
+    }
+
+#define AC_DENSE_NEXT	delta[(Py_ssize_t)state * nclasses + cls]
+#define AC_SPARSE_NEXT	ac_goto(c, state, cls)
+
+int ac_search(mxacse_data *c,
+	      const char *text,
+	      Py_ssize_t start,
+	      Py_ssize_t stop,
+	      const char *tr,
+	      Py_ssize_t *left,
+	      Py_ssize_t *right)
+{
+    const int *delta = c->delta;
+    const int *byteclass = c->byteclass;
+    const Py_ssize_t *outlen = c->outlen;
+    const Py_ssize_t nclasses = c->nclasses;
+    const unsigned char *tx = (const unsigned char *)text;
+    const unsigned char *t = (const unsigned char *)tr;
+
+    if (t == NULL) {
+	if (delta)
+	    AC_SEARCH(byteclass[tx[i]], AC_DENSE_NEXT)
+	else
+	    AC_SEARCH(byteclass[tx[i]], AC_SPARSE_NEXT)
+    }
+    else {
+	if (delta)
+	    AC_SEARCH(byteclass[t[tx[i]]], AC_DENSE_NEXT)
+	else
+	    AC_SEARCH(byteclass[t[tx[i]]], AC_SPARSE_NEXT)
+    }
+}
+
+#ifdef HAVE_UNICODE
+int ac_unicode_search(mxacse_data *c,
+		      const Py_UNICODE *text,
+		      Py_ssize_t start,
+		      Py_ssize_t stop,
+		      Py_ssize_t *left,
+		      Py_ssize_t *right)
+{
+    const int *delta = c->delta;
+    const Py_ssize_t *outlen = c->outlen;
+    const Py_ssize_t nclasses = c->nclasses;
+
+    if (delta)
+	AC_SEARCH(ac_class(c, (unsigned int)text[i]), AC_DENSE_NEXT)
+    else
+	AC_SEARCH(ac_class(c, (unsigned int)text[i]), AC_SPARSE_NEXT)
+}
+#endif
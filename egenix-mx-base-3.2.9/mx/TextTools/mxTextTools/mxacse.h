@@ -0,0 +1,114 @@
+#ifndef MXACSE_H
+#define MXACSE_H
+/*
+  mxacse -- Aho-Corasick Multi-Pattern Search
+
+  Finds the leftmost occurrence of any of a set of match strings in
+  a single pass over the text. Of the match strings starting at the
+  leftmost position, the longest one is reported.
+
+  The automaton works on character ordinals: 8-bit strings use their
+  byte values, Unicode their code units. It is built into a complete
+  state transition table over the characters appearing in the match
+  strings, unless that table would get too large (see AC_DENSE_MAX);
+  goto and failure links are used in that case.
+
+  Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+
+                        All Rights Reserved
+
+  See the documentation for copying information or contact the author
+  (mal@lemburg.com).
+
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of entries of the complete transition table */
+#ifndef AC_DENSE_MAX
+# define AC_DENSE_MAX (4 * 1024 * 1024)
+#endif
+
+typedef struct {
+    /* Match strings as added by ac_add*(); freed by ac_compile() */
+    unsigned int *codes;	/* Characters of all match strings */
+    Py_ssize_t ncodes;
+    Py_ssize_t codes_size;
+    Py_ssize_t *ends;		/* End index in codes of each string */
+    Py_ssize_t nmatches;
+    Py_ssize_t ends_size;
+
+    /* Character classes: 0 is used for characters not appearing in
+       any of the match strings */
+    int byteclass[256];		/* Class of the ordinals 0-255 */
+    unsigned int *wide;		/* Sorted ordinals >= 256 ... */
+    int nwide;
+    int wideclass;		/* ... and the class of wide[0] */
+    int nclasses;
+
+    /* Automaton */
+    int nstates;
+    Py_ssize_t *outlen;		/* Length of the longest match string
+				   ending in a state, or 0 */
+    int *delta;			/* Complete transition table:
+				   nstates x nclasses; or NULL */
+    int *edge_start;		/* Goto links of a state: edge_start[s]
+				   to edge_start[s+1] - 1 (sorted by
+				   class) */
+    int *edge_class;
+    int *edge_to;
+    int *fail;			/* Failure links */
+
+    Py_ssize_t min_len;		/* Length of the shortest and ... */
+    Py_ssize_t max_len;		/* ... longest match string */
+} mxacse_data;
+
+/* Create a new empty search object, NULL on memory errors */
+extern mxacse_data *ac_init(void);
+
+/* Add an 8-bit or Unicode match string. Returns -1 on memory errors,
+   0 otherwise. */
+extern int ac_add(mxacse_data *c,
+		  const char *match,
+		  Py_ssize_t match_len);
+#ifdef HAVE_UNICODE
+extern int ac_add_unicode(mxacse_data *c,
+			  const Py_UNICODE *match,
+			  Py_ssize_t match_len);
+#endif
+
+/* Build the automaton after all match strings were added. Returns -1
+   on memory errors, 0 otherwise. */
+extern int ac_compile(mxacse_data *c);
+
+extern void ac_free(mxacse_data *c);
+
+/* Search text[start:stop] for the leftmost match. Returns 1 and sets
+   *left, *right to the matching slice if one is found, 0
+   otherwise. tr is an optional 256 character translate string
+   applied to the text, or NULL. */
+extern int ac_search(mxacse_data *c,
+		     const char *text,
+		     Py_ssize_t start,
+		     Py_ssize_t stop,
+		     const char *tr,
+		     Py_ssize_t *left,
+		     Py_ssize_t *right);
+#ifdef HAVE_UNICODE
+extern int ac_unicode_search(mxacse_data *c,
+			     const Py_UNICODE *text,
+			     Py_ssize_t start,
+			     Py_ssize_t stop,
+			     Py_ssize_t *left,
+			     Py_ssize_t *right);
+#endif
+
+#define AC_MIN_LEN(ac) ((mxacse_data *)ac)->min_len
+
+/* EOF */
+#ifdef __cplusplus
+}
+#endif
+#endif
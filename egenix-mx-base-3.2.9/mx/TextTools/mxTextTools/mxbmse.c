@@ -221,3 +221,229 @@ BM_INDEX_TYPE bm_tr_search(mxbmse_data *c,
     return start; /* no match */
 }
 
+
+#ifdef HAVE_UNICODE
+
+/* --- Unicode Search (Horspool / Two-Way) -------------------------------- */
+
+/* Compute the critical factorization of match using the maximal
+   suffixes for both orderings of the alphabet. Returns the start of
+   the right half and sets *period to its period. See Crochemore,
+   Perrin: "Two-way string-matching", JACM 38(3), 1991. */
+
+static
+BM_LENGTH_TYPE bm_critical_factorization(const Py_UNICODE *match,
+					 BM_LENGTH_TYPE match_len,
+					 BM_LENGTH_TYPE *period)
+{
+    BM_INDEX_TYPE max_suffix, max_suffix_rev;
+    BM_INDEX_TYPE j, k, p;
+    Py_UNICODE a, b;
+
+    /* Maximal suffix for <= */
+    max_suffix = -1;
+    j = 0;
+    k = p = 1;
+    while (j + k < match_len) {
+	a = match[j + k];
+	b = match[max_suffix + k];
+	if (a < b) {
+	    j += k;
+	    k = 1;
+	    p = j - max_suffix;
+	}
+	else if (a == b) {
+	    if (k != p)
+		k++;
+	    else {
+		j += p;
+		k = 1;
+	    }
+	}
+	else {
+	    max_suffix = j++;
+	    k = p = 1;
+	}
+    }
+    *period = p;
+
+    /* Maximal suffix for >= */
+    max_suffix_rev = -1;
+    j = 0;
+    k = p = 1;
+    while (j + k < match_len) {
+	a = match[j + k];
+	b = match[max_suffix_rev + k];
+	if (b < a) {
+	    j += k;
+	    k = 1;
+	    p = j - max_suffix_rev;
+	}
+	else if (a == b) {
+	    if (k != p)
+		k++;
+	    else {
+		j += p;
+		k = 1;
+	    }
+	}
+	else {
+	    max_suffix_rev = j++;
+	    k = p = 1;
+	}
+    }
+
+    /* Use the longer of the two suffixes */
+    if (max_suffix_rev < max_suffix)
+	return max_suffix + 1;
+    *period = p;
+    return max_suffix_rev + 1;
+}
+
+mxbmse_unicode_data *bm_unicode_init(Py_UNICODE *match,
+				     BM_LENGTH_TYPE match_len)
+{
+    mxbmse_unicode_data *c;
+    BM_INDEX_TYPE i;
+
+    c = newstruct(mxbmse_unicode_data);
+    if (c == NULL)
+	return NULL;
+    c->match = match;
+    c->match_len = match_len;
+
+    /* Horspool shift table for the first match_len - 1 characters */
+    for (i = 0; i < 256; i++)
+	c->shift[i] = (BM_SHIFT_TYPE) match_len;
+    for (i = 0; i < match_len - 1; i++)
+	c->shift[match[i] & 0xFF] = (BM_SHIFT_TYPE) (match_len - 1 - i);
+
+    /* Two-Way factorization */
+    c->suffix = 0;
+    c->period = 1;
+    c->periodic = 0;
+    if (match_len >= BM_TWOWAY_MIN) {
+	c->suffix = bm_critical_factorization(match, match_len, &c->period);
+	if (memcmp(match, match + c->period,
+		   c->suffix * sizeof(Py_UNICODE)) == 0)
+	    c->periodic = 1;
+	else
+	    c->period = ((c->suffix > match_len - c->suffix) ? 
+			 c->suffix : match_len - c->suffix) + 1;
+    }
+    DPRINTF("bm_unicode_init: match_len=%li, suffix=%li, period=%li, "
+	    "periodic=%i\n",
+	    (long)match_len, (long)c->suffix, (long)c->period, c->periodic);
+    return c;
+}
+
+void bm_unicode_free(mxbmse_unicode_data *c)
+{
+    if (c)
+	free(c);
+}
+
+static
+BM_INDEX_TYPE bm_unicode_horspool(mxbmse_unicode_data *c,
+				  Py_UNICODE *text,
+				  BM_INDEX_TYPE start,
+				  BM_LENGTH_TYPE text_len)
+{
+    register const Py_UNICODE *pt;
+    register const Py_UNICODE *eot = text + text_len;
+    const Py_UNICODE *match = c->match;
+    const BM_LENGTH_TYPE ml1 = c->match_len - 1;
+    const Py_UNICODE last = match[ml1];
+
+    for (pt = text + start + ml1; pt < eot; ) {
+	register Py_UNICODE ch = *pt;
+
+	if (ch == last) {
+	    /* Last char matches.. what about the others ? */
+	    register const Py_UNICODE *p0 = pt - ml1;
+	    register BM_INDEX_TYPE i;
+
+	    for (i = 0; i < ml1 && p0[i] == match[i]; i++) ;
+	    if (i == ml1)
+		/* Match */
+		return pt - text + 1;
+	}
+	pt += c->shift[ch & 0xFF];
+    }
+    return start; /* no match */
+}
+
+/* Two-Way search; the shift table is used to skip ahead as long as
+   the last character doesn't match */
+
+static
+BM_INDEX_TYPE bm_unicode_twoway(mxbmse_unicode_data *c,
+				Py_UNICODE *text,
+				BM_INDEX_TYPE start,
+				BM_LENGTH_TYPE text_len)
+{
+    const Py_UNICODE *match = c->match;
+    const BM_LENGTH_TYPE m = c->match_len;
+    const BM_LENGTH_TYPE suffix = c->suffix;
+    const BM_LENGTH_TYPE period = c->period;
+    const Py_UNICODE last = match[m - 1];
+    BM_LENGTH_TYPE memory = 0;
+    register BM_INDEX_TYPE i, j;
+
+    for (j = start; j + m <= text_len; ) {
+	register Py_UNICODE ch = text[j + m - 1];
+
+	if (ch != last) {
+	    BM_INDEX_TYPE shift = c->shift[ch & 0xFF];
+
+	    /* The last period is out of place in a periodic match
+	       string: no match before the mismatch */
+	    if (memory && shift < period)
+		shift = m - period;
+	    memory = 0;
+	    j += shift;
+	    continue;
+	}
+
+	/* Scan the right half; the last char is already known to match */
+	i = (suffix > memory) ? suffix : memory;
+	while (i < m - 1 && match[i] == text[j + i])
+	    i++;
+	if (i < m - 1) {
+	    j += i - suffix + 1;
+	    memory = 0;
+	    continue;
+	}
+
+	/* Scan the left half */
+	i = suffix - 1;
+	while (i >= memory && match[i] == text[j + i])
+	    i--;
+	if (i < memory)
+	    /* Match */
+	    return j + m;
+	j += period;
+	if (c->periodic)
+	    /* Remember how much of the right half is known to match */
+	    memory = m - period;
+    }
+    return start; /* no match */
+}
+
+BM_INDEX_TYPE bm_unicode_search(mxbmse_unicode_data *c,
+				Py_UNICODE *text,
+				BM_INDEX_TYPE start,
+				BM_LENGTH_TYPE text_len)
+{
+    /* Error check */
+    if (c == NULL)
+	return -1;
+
+    if (c->match_len == 0)
+	return start;
+    if (c->match_len >= BM_TWOWAY_MIN)
+	return bm_unicode_twoway(c, text, start, text_len);
+    return bm_unicode_horspool(c, text, start, text_len);
+}
+
+#endif
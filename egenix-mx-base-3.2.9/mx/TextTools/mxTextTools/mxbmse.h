@@ -65,6 +65,41 @@ extern BM_INDEX_TYPE bm_tr_search(mxbmse_data *c,
 
 #define BM_MATCH_LEN(bm) ((mxbmse_data *)bm)->match_len
 
+#ifdef HAVE_UNICODE
+
+/* --- Unicode Search (Horspool / Two-Way) -------------------------------- */
+
+/* Match strings with at least this many characters are searched for
+   using the Two-Way algorithm, which runs in linear time for all
+   inputs; shorter ones use Horspool's algorithm */
+#ifndef BM_TWOWAY_MIN
+# define BM_TWOWAY_MIN 16
+#endif
+
+typedef struct {
+    Py_UNICODE *match;
+    BM_LENGTH_TYPE match_len;
+    BM_SHIFT_TYPE shift[256]; /* shift table indexed by the low byte
+				 of a character; characters sharing it
+				 use the smallest shift */
+    BM_LENGTH_TYPE suffix;    /* Two-Way: critical factorization, */
+    BM_LENGTH_TYPE period;    /* period of the match string and */
+    int periodic;	      /* whether the left half repeats at
+				 period */
+} mxbmse_unicode_data;
+
+extern mxbmse_unicode_data *bm_unicode_init(Py_UNICODE *match,
+					    BM_LENGTH_TYPE match_len);
+extern void bm_unicode_free(mxbmse_unicode_data *c);
+extern BM_INDEX_TYPE bm_unicode_search(mxbmse_unicode_data *c,
+				       Py_UNICODE *text,
+				       BM_INDEX_TYPE start,
+				       BM_LENGTH_TYPE text_len);
+
+#define BM_UNICODE_MATCH_LEN(bm) ((mxbmse_unicode_data *)bm)->match_len
+
+#endif
+
 /* EOF */
 #ifdef __cplusplus
 }
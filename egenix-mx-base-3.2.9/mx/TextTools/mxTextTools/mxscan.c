@@ -0,0 +1,320 @@
+/*
+  mxscan -- Character set scanning for 8-bit text
+
+  Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+
+                        All Rights Reserved
+
+  See the documentation for copying information or contact the author
+  (mal@lemburg.com).
+*/
+
+/* to turn on the debugging printfs (DPRINTF):*/
+/* #define MAL_DEBUG */
+
+#include "mx.h"
+#include "mxTextTools.h"
+
+#ifdef MXSCAN_SIMD
+# include <immintrin.h>
+#endif
+
+/* --- Byte loop ---------------------------------------------------------- */
+
+#define MXSCAN_ISSET(bitmap, c) \
+    (((bitmap)[(c) >> 3] & (1 << ((c) & 7))) != 0)
+
+static
+Py_ssize_t scan_find_scalar(const mxscan_set *set,
+			    const unsigned char *text,
+			    Py_ssize_t start,
+			    Py_ssize_t stop,
+			    int member)
+{
+    register const unsigned char *bitmap = set->bitmap;
+    register Py_ssize_t i;
+    register unsigned int c;
+
+    if (member) {
+	for (i = start; i < stop; i++) {
+	    c = text[i];
+	    if (MXSCAN_ISSET(bitmap, c))
+		break;
+	}
+    }
+    else {
+	for (i = start; i < stop; i++) {
+	    c = text[i];
+	    if (!MXSCAN_ISSET(bitmap, c))
+		break;
+	}
+    }
+    return i;
+}
+
+static
+Py_ssize_t scan_rfind_scalar(const mxscan_set *set,
+			     const unsigned char *text,
+			     Py_ssize_t start,
+			     Py_ssize_t stop,
+			     int member)
+{
+    register const unsigned char *bitmap = set->bitmap;
+    register Py_ssize_t i;
+    register unsigned int c;
+
+    if (member) {
+	for (i = stop - 1; i >= start; i--) {
+	    c = text[i];
+	    if (MXSCAN_ISSET(bitmap, c))
+		break;
+	}
+    }
+    else {
+	for (i = stop - 1; i >= start; i--) {
+	    c = text[i];
+	    if (!MXSCAN_ISSET(bitmap, c))
+		break;
+	}
+    }
+    return i;
+}
+
+#ifdef MXSCAN_SIMD
+
+/* --- SSSE3 kernel ------------------------------------------------------- */
+
+/* Classify the 16 characters in block: returns a bit mask with one
+   bit per character whose membership equals member. */
+
+#define SCAN_SSSE3_CLASSIFY(block, mask)				\
+    {									\
+	__m128i row = _mm_or_si128(					\
+	    _mm_shuffle_epi8(lower, block),				\
+	    _mm_shuffle_epi8(upper, _mm_xor_si128(block, topbit)));	\
+	__m128i bit = _mm_shuffle_epi8(					\
+	    bits, _mm_and_si128(_mm_srli_epi16(block, 4), nibble));	\
+	mask = (unsigned int)_mm_movemask_epi8(				\
+	    _mm_cmpeq_epi8(_mm_and_si128(row, bit),			\
+			   _mm_setzero_si128())) ^ invert;		\
+    }
+
+#define SCAN_SSSE3_SETUP()						\
+    const __m128i lower = _mm_loadu_si128((const __m128i *)set->lower); \
+    const __m128i upper = _mm_loadu_si128((const __m128i *)set->upper); \
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,	\
+				       1, 2, 4, 8, 16, 32, 64, -128);	\
+    const __m128i nibble = _mm_set1_epi8(0x0F);				\
+    const __m128i topbit = _mm_set1_epi8((char)0x80);			\
+    const unsigned int invert = member ? 0xFFFFU : 0
+
+static __attribute__((target("ssse3")))
+Py_ssize_t scan_find_ssse3(const mxscan_set *set,
+			   const unsigned char *text,
+			   Py_ssize_t start,
+			   Py_ssize_t stop,
+			   int member)
+{
+    SCAN_SSSE3_SETUP();
+    Py_ssize_t i;
+    unsigned int mask;
+
+    for (i = start; i + 16 <= stop; i += 16) {
+	__m128i block = _mm_loadu_si128((const __m128i *)(text + i));
+	SCAN_SSSE3_CLASSIFY(block, mask);
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return scan_find_scalar(set, text, i, stop, member);
+}
+
+static __attribute__((target("ssse3")))
+Py_ssize_t scan_rfind_ssse3(const mxscan_set *set,
+			    const unsigned char *text,
+			    Py_ssize_t start,
+			    Py_ssize_t stop,
+			    int member)
+{
+    SCAN_SSSE3_SETUP();
+    Py_ssize_t i;
+    unsigned int mask;
+
+    for (i = stop; i - 16 >= start; i -= 16) {
+	__m128i block = _mm_loadu_si128((const __m128i *)(text + i - 16));
+	SCAN_SSSE3_CLASSIFY(block, mask);
+	if (mask)
+	    return i - 16 + (31 - __builtin_clz(mask));
+    }
+    return scan_rfind_scalar(set, text, start, i, member);
+}
+
+/* --- AVX2 kernel -------------------------------------------------------- */
+
+/* Same as the SSSE3 kernel, using 32 byte blocks. vpshufb works on
+   the two 128-bit lanes separately, so the tables are duplicated into
+   both lanes. */
+
+#define SCAN_AVX2_CLASSIFY(block, mask)					\
+    {									\
+	__m256i row = _mm256_or_si256(					\
+	    _mm256_shuffle_epi8(lower, block),				\
+	    _mm256_shuffle_epi8(upper, _mm256_xor_si256(block, topbit))); \
+	__m256i bit = _mm256_shuffle_epi8(				\
+	    bits, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble)); \
+	mask = (unsigned int)_mm256_movemask_epi8(			\
+	    _mm256_cmpeq_epi8(_mm256_and_si256(row, bit),		\
+			      _mm256_setzero_si256())) ^ invert;	\
+    }
+
+#define SCAN_AVX2_SETUP()						\
+    const __m256i lower = _mm256_broadcastsi128_si256(			\
+	_mm_loadu_si128((const __m128i *)set->lower));			\
+    const __m256i upper = _mm256_broadcastsi128_si256(			\
+	_mm_loadu_si128((const __m128i *)set->upper));			\
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, \
+					  1, 2, 4, 8, 16, 32, 64, -128, \
+					  1, 2, 4, 8, 16, 32, 64, -128, \
+					  1, 2, 4, 8, 16, 32, 64, -128); \
+    const __m256i nibble = _mm256_set1_epi8(0x0F);			\
+    const __m256i topbit = _mm256_set1_epi8((char)0x80);		\
+    const unsigned int invert = member ? 0xFFFFFFFFU : 0
+
+static __attribute__((target("avx2")))
+Py_ssize_t scan_find_avx2(const mxscan_set *set,
+			  const unsigned char *text,
+			  Py_ssize_t start,
+			  Py_ssize_t stop,
+			  int member)
+{
+    SCAN_AVX2_SETUP();
+    Py_ssize_t i;
+    unsigned int mask;
+
+    for (i = start; i + 32 <= stop; i += 32) {
+	__m256i block = _mm256_loadu_si256((const __m256i *)(text + i));
+	SCAN_AVX2_CLASSIFY(block, mask);
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return scan_find_scalar(set, text, i, stop, member);
+}
+
+static __attribute__((target("avx2")))
+Py_ssize_t scan_rfind_avx2(const mxscan_set *set,
+			   const unsigned char *text,
+			   Py_ssize_t start,
+			   Py_ssize_t stop,
+			   int member)
+{
+    SCAN_AVX2_SETUP();
+    Py_ssize_t i;
+    unsigned int mask;
+
+    for (i = stop; i - 32 >= start; i -= 32) {
+	__m256i block = _mm256_loadu_si256((const __m256i *)(text + i - 32));
+	SCAN_AVX2_CLASSIFY(block, mask);
+	if (mask)
+	    return i - 32 + (31 - __builtin_clz(mask));
+    }
+    return scan_rfind_scalar(set, text, start, i, member);
+}
+
+#endif /* MXSCAN_SIMD */
+
+/* --- Dispatch ----------------------------------------------------------- */
+
+/* Number of characters tested using the byte loop before calling the
+   kernel. Runs matched by the Tagging Engine are often only a few
+   characters long; those are found faster without setting up the
+   vector registers. */
+#ifndef MXSCAN_HEAD
+# define MXSCAN_HEAD 8
+#endif
+
+typedef Py_ssize_t (*scan_function)(const mxscan_set *set,
+				    const unsigned char *text,
+				    Py_ssize_t start,
+				    Py_ssize_t stop,
+				    int member);
+
+static scan_function scan_find = scan_find_scalar;
+static scan_function scan_rfind = scan_rfind_scalar;
+static const char *scan_kernel = "scalar";
+
+void mxscan_setup(void)
+{
+#ifdef MXSCAN_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	scan_find = scan_find_avx2;
+	scan_rfind = scan_rfind_avx2;
+	scan_kernel = "avx2";
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+	scan_find = scan_find_ssse3;
+	scan_rfind = scan_rfind_ssse3;
+	scan_kernel = "ssse3";
+    }
+#endif
+    DPRINTF("mxscan_setup: using the %s kernel\n", scan_kernel);
+}
+
+const char *mxscan_kernel(void)
+{
+    return scan_kernel;
+}
+
+void mxscan_init(mxscan_set *set,
+		 const unsigned char *bitmap)
+{
+    register int lo, hi;
+
+    memcpy(set->bitmap, bitmap, sizeof(set->bitmap));
+    memset(set->lower, 0, sizeof(set->lower));
+    memset(set->upper, 0, sizeof(set->upper));
+
+    /* Character (hi << 4) | lo is bit lo & 7 of bitmap byte
+       2 * hi + (lo >> 3) */
+    for (hi = 0; hi < 16; hi++)
+	for (lo = 0; lo < 16; lo++)
+	    if (bitmap[2 * hi + (lo >> 3)] & (1 << (lo & 7))) {
+		if (hi < 8)
+		    set->lower[lo] |= 1 << hi;
+		else
+		    set->upper[lo] |= 1 << (hi - 8);
+	    }
+}
+
+Py_ssize_t mxscan_find(const mxscan_set *set,
+		       const unsigned char *text,
+		       Py_ssize_t start,
+		       Py_ssize_t stop,
+		       int member)
+{
+    Py_ssize_t head = start + MXSCAN_HEAD;
+    Py_ssize_t i;
+
+    if (head >= stop)
+	return scan_find_scalar(set, text, start, stop, member);
+    i = scan_find_scalar(set, text, start, head, member);
+    if (i < head)
+	return i;
+    return scan_find(set, text, head, stop, member);
+}
+
+Py_ssize_t mxscan_rfind(const mxscan_set *set,
+			const unsigned char *text,
+			Py_ssize_t start,
+			Py_ssize_t stop,
+			int member)
+{
+    Py_ssize_t head = stop - MXSCAN_HEAD;
+    Py_ssize_t i;
+
+    if (head <= start)
+	return scan_rfind_scalar(set, text, start, stop, member);
+    i = scan_rfind_scalar(set, text, head, stop, member);
+    if (i >= head)
+	return i;
+    return scan_rfind(set, text, start, head, member);
+}
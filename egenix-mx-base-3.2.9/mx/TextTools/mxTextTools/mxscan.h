@@ -0,0 +1,81 @@
+#ifndef MXSCAN_H
+#define MXSCAN_H
+/*
+  mxscan -- Character set scanning for 8-bit text
+
+  Finds the first (or last) character in a text slice which is (or is
+  not) a member of a 256-bit character set, as used by set(),
+  CharSet() and the AllInSet/AllInCharSet tagging commands.
+
+  On x86 CPUs the scan is done 16 (SSSE3) or 32 (AVX2) bytes at a
+  time using a nibble lookup: the set is stored as two 16-byte
+  tables indexed by the low nibble of a character, with one bit per
+  high nibble. The kernel is chosen at runtime by mxscan_setup();
+  other platforms and compilers use the plain byte loop.
+
+  Copyright (c) 2000-2015, eGenix.com Software GmbH; mailto:info@egenix.com
+
+                        All Rights Reserved
+
+  See the documentation for copying information or contact the author
+  (mal@lemburg.com).
+
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Compile in the vectorized kernels (GCC 4.9+ and clang on x86);
+   define MXSCAN_NO_SIMD to always use the byte loop */
+#if !defined(MXSCAN_NO_SIMD) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || \
+     (defined(__GNUC__) && \
+      (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+# define MXSCAN_SIMD
+#endif
+
+typedef struct {
+    unsigned char bitmap[32];	/* Set bitmap, one bit per character;
+				   must come first, so that a pointer
+				   to the struct may be used as bitmap */
+    unsigned char lower[16];	/* Characters 0x00-0x7F: bit n of
+				   lower[c & 15] is set if c >> 4 == n
+				   is in the set */
+    unsigned char upper[16];	/* Same for characters 0x80-0xFF */
+} mxscan_set;
+
+/* Select the kernel to use for the running CPU. Called once at
+   module init; the byte loop is used until then. */
+extern void mxscan_setup(void);
+
+/* Name of the kernel in use: "scalar", "ssse3" or "avx2" */
+extern const char *mxscan_kernel(void);
+
+/* Initialize set from a 32-byte set bitmap */
+extern void mxscan_init(mxscan_set *set,
+			const unsigned char *bitmap);
+
+/* Return the index of the first character in text[start:stop] whose
+   set membership equals member (1: in set, 0: not in set), or stop
+   if there is none. */
+extern Py_ssize_t mxscan_find(const mxscan_set *set,
+			      const unsigned char *text,
+			      Py_ssize_t start,
+			      Py_ssize_t stop,
+			      int member);
+
+/* Same, but searching from the right. Returns start - 1 in case no
+   matching character is found. */
+extern Py_ssize_t mxscan_rfind(const mxscan_set *set,
+			       const unsigned char *text,
+			       Py_ssize_t start,
+			       Py_ssize_t stop,
+			       int member);
+
+/* EOF */
+#ifdef __cplusplus
+}
+#endif
+#endif
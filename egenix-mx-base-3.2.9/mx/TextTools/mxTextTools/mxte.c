@@ -34,6 +34,8 @@
 #define TE_HANDLE_MATCH string_handle_match
 #undef TE_ENGINE_API
 #define TE_ENGINE_API mxTextTools_TaggingEngine
+#undef TE_ENGINE_IMPL
+#define TE_ENGINE_IMPL mxTextTools_TaggingEngineImpl
 #undef TE_TABLETYPE
 #define TE_TABLETYPE MXTAGTABLE_STRINGTYPE
 #undef TE_SEARCHAPI
@@ -59,6 +61,8 @@
 #define TE_HANDLE_MATCH unicode_handle_match
 #undef TE_ENGINE_API
 #define TE_ENGINE_API mxTextTools_UnicodeTaggingEngine
+#undef TE_ENGINE_IMPL
+#define TE_ENGINE_IMPL mxTextTools_UnicodeTaggingEngineImpl
 #undef TE_TABLETYPE
 #define TE_TABLETYPE MXTAGTABLE_UNICODETYPE
 #undef TE_SEARCHAPI
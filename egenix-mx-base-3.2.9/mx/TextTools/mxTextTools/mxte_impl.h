@@ -30,6 +30,34 @@
 #ifndef TE_ENGINE_API
 # define TE_ENGINE_API mxTextTools_TaggingEngine
 #endif
+#ifndef TE_ENGINE_IMPL
+# define TE_ENGINE_IMPL mxTextTools_TaggingEngineImpl
+#endif
+
+/* Return code of runs without the GIL which hit an error: the run is
+   then repeated with the GIL held, raising the error */
+#ifndef TE_RC_NEEDGIL
+# define TE_RC_NEEDGIL 3
+# define TE_NOGIL_BAILOUT() {if (nogil) return TE_RC_NEEDGIL;}
+#endif
+
+/* Minimal slice length for which the GIL is released */
+#ifndef TE_NOGIL_MINSIZE
+# define TE_NOGIL_MINSIZE 4096
+#endif
+
+/* Dispatch using computed gotos, if the compiler supports them */
+#if defined(__GNUC__) && !defined(TE_NO_COMPUTED_GOTOS)
+# ifndef TE_COMPUTED_GOTOS
+#  define TE_COMPUTED_GOTOS
+# endif
+#endif
+
+/* Start of the low-level matching commands: save the starting
+   position; these never match the EOF */
+#ifndef TE_LOWLEVEL_START
+# define TE_LOWLEVEL_START() {start = x; if (x == sliceright) goto low_level_done;}
+#endif
 
 
 /* --- Tagging Engine ----------------------------------------------------- */
@@ -45,37 +73,30 @@ int TE_HANDLE_MATCH(int flags,
 		    PyObject *subtags,
 		    PyObject *context);
 
-/* mxTextTools_TaggingEngine(): a table driven parser engine
+/* TE_ENGINE_IMPL(): the matching loop of the Tagging Engine
 
-   Parameters:
-    textobj          - text object to work on
-    text_start       - left text slice index
-    text_stop        - right text slice index
-    table            - tag table object defining the parser
-    taglist          - tag list to append matches to
-    context          - optional context object; may be NULL
-    *next            - output parameter: set to the next index in text
-    level            - stack level; should be 0 on the first level
-  
-   Return codes:
-    rc = 2: match ok
-    rc = 1: match failed
-    rc = 0: error
+   Parameters: as for mxTextTools_TaggingEngine() below, plus
 
-   Notes:
-   - doesn't check type of passed arguments !
-   - doesn't increment reference counts of passed objects !
+    nogil            - if set, the loop is run without holding the
+                       GIL; taglist must be Py_None and the table
+                       must not have MXTAGTABLE_NEEDSGIL set
+
+   Return codes: as for mxTextTools_TaggingEngine() below, plus
+
+    rc = 3: error in a run without the GIL (TE_RC_NEEDGIL)
 
 */
 
-int TE_ENGINE_API(PyObject *textobj,
-		  Py_ssize_t sliceleft,	
-		  Py_ssize_t sliceright,	
-		  mxTagTableObject *table,
-		  PyObject *taglist,
-		  PyObject *context,
-		  Py_ssize_t *next,
-                  int level)
+static
+int TE_ENGINE_IMPL(PyObject *textobj,
+		   Py_ssize_t sliceleft,	
+		   Py_ssize_t sliceright,	
+		   mxTagTableObject *table,
+		   PyObject *taglist,
+		   PyObject *context,
+		   Py_ssize_t *next,
+		   int level,
+		   int nogil)
 {
     register Py_ssize_t x;		/* current (head) position in text */
     Py_ssize_t i = 0; 			/* index of current table entry */
@@ -92,6 +113,30 @@ int TE_ENGINE_API(PyObject *textobj,
 					   matched' */
     Py_ssize_t je;			/* dito on 'matched' */
     PyObject *match;			/* matching parameter */
+#ifdef TE_COMPUTED_GOTOS
+    /* Labels of the opcodes; indexed by MXTAGTABLE_OP_* */
+    static void *dispatch[] = {
+	&&high_level,
+	&&op_allin,
+	&&op_allnotin,
+	&&op_is,
+	&&op_isnot,
+	&&op_isin,
+	&&op_isnotin,
+	&&op_word,
+	&&op_wordstart,
+	&&op_wordend,
+	&&op_allinset,
+	&&op_isinset,
+	&&op_allincharset,
+	&&op_isincharset,
+	&&op_fail,
+	&&op_skip,
+	&&op_move,
+	&&op_eof,
+	&&op_jumptarget,
+    };
+#endif
 
     /* Init */
     Py_AssertWithArg(TE_STRING_CHECK(textobj),
@@ -117,10 +162,12 @@ int TE_ENGINE_API(PyObject *textobj,
 		       (long)sliceleft, (long)sliceright);
 
     /* Protect against stack related segfaults */
-    Py_AssertWithArg(level < Py_GetRecursionLimit(),
-		     PyExc_RuntimeError,
-		     "maximum recursion depth exceeded: %i",
-		     level);
+    if (level >= Py_GetRecursionLimit()) {
+	TE_NOGIL_BAILOUT();
+	Py_ErrorWithArg(PyExc_RuntimeError,
+			"maximum recursion depth exceeded: %i",
+			level);
+    }
 
     /* Main loop */
     for (i = 0, je = 0;;) {
@@ -160,469 +207,472 @@ int TE_ENGINE_API(PyObject *textobj,
 	    Py_DECREF(v);
 	}
 	
-	/* Low-level matching commands */
-
-	if (cmd < MATCH_MAX_LOWLEVEL) {
-	    TE_CHAR *m = TE_STRING_AS_STRING(match);
-
-	    /* save starting position */
-	    start = x;
-
-	    /* Low-level commands never match the EOF */
-	    if (x == sliceright)
-		goto low_level_done;
-
-	    /* Note that the Tag Table Compiler assures that the match
-	       string for all of these low-level commands (except
-	       AllInCharSet and IsInCharSet) are non-empty. */
-
-	    switch (cmd) {
-
-	    case MATCH_ALLIN:
-
-		{
-		    register Py_ssize_t ml = TE_STRING_GET_SIZE(match);
-		    register TE_CHAR *tx = &text[x];
-
-		    DPRINTF("\nAllIn :\n"
-			    " looking for   = '%.40s'\n"
-			    " in string     = '%.40s'\n",m,tx);
-	    
-		    if (ml > 1)
-			for (; x < sliceright; tx++, x++) {
-			    register Py_ssize_t j;
-			    register TE_CHAR *mj = m;
-			    register TE_CHAR ctx = *tx;
-			    for (j=0; j < ml && ctx != *mj; mj++, j++) ;
-			    if (j == ml) 
-				break;
-			}
-		    else
-			/* one char only: use faster variant: */
-			for (; x < sliceright && *tx == *m; tx++, x++) ;
-
-		    break;
-		}
+	/* Dispatch on the opcode set by the Tag Table compiler */
+#ifdef TE_COMPUTED_GOTOS
+	goto *dispatch[entry->op];
+#else
+	switch (entry->op) {
+	case MXTAGTABLE_OP_ALLIN: goto op_allin;
+	case MXTAGTABLE_OP_ALLNOTIN: goto op_allnotin;
+	case MXTAGTABLE_OP_IS: goto op_is;
+	case MXTAGTABLE_OP_ISNOT: goto op_isnot;
+	case MXTAGTABLE_OP_ISIN: goto op_isin;
+	case MXTAGTABLE_OP_ISNOTIN: goto op_isnotin;
+	case MXTAGTABLE_OP_WORD: goto op_word;
+	case MXTAGTABLE_OP_WORDSTART: goto op_wordstart;
+	case MXTAGTABLE_OP_WORDEND: goto op_wordend;
+	case MXTAGTABLE_OP_ALLINSET: goto op_allinset;
+	case MXTAGTABLE_OP_ISINSET: goto op_isinset;
+	case MXTAGTABLE_OP_ALLINCHARSET: goto op_allincharset;
+	case MXTAGTABLE_OP_ISINCHARSET: goto op_isincharset;
+	case MXTAGTABLE_OP_FAIL: goto op_fail;
+	case MXTAGTABLE_OP_SKIP: goto op_skip;
+	case MXTAGTABLE_OP_MOVE: goto op_move;
+	case MXTAGTABLE_OP_EOF: goto op_eof;
+	case MXTAGTABLE_OP_JUMPTARGET: goto op_jumptarget;
+	default: goto high_level;
+	}
+#endif
 
-	    case MATCH_ALLNOTIN:
+	/* Low-level matching commands 
 
-		{
-		    register Py_ssize_t ml = TE_STRING_GET_SIZE(match);
-		    register TE_CHAR *tx = &text[x];
+	   These start with TE_LOWLEVEL_START() and continue at
+	   low_level_done. Note that the Tag Table Compiler assures
+	   that the match string for all of these low-level commands
+	   (except AllInCharSet and IsInCharSet) are non-empty. */
 
-		    DPRINTF("\nAllNotIn :\n"
-			    " looking for   = '%.40s'\n"
-			    " not in string = '%.40s'\n",m,tx);
-	    
-		    if (ml > 1)
-			for (; x < sliceright; tx++, x++) {
-			    register Py_ssize_t j;
-			    register TE_CHAR *mj = m;
-			    register TE_CHAR ctx = *tx;
-			    for (j=0; j < ml && ctx != *mj; mj++, j++) ;
-			    if (j != ml) 
-				break;
-			}
-		    else
-			/* one char only: use faster variant: */
-			for (; x < sliceright && *tx != *m; tx++, x++) ;
-		    break;
-		}
-
-	    case MATCH_IS: 
-		    
-		{
-		    DPRINTF("\nIs :\n"
-			    " looking for   = '%.40s'\n"
-			    " in string     = '%.40s'\n",m,text+x);
-	    
-		    if (*(&text[x]) == *m)
-			x++;
-		    break;
-		}
+    op_allin:
+	TE_LOWLEVEL_START();
+	{
+	    register TE_CHAR *m = (TE_CHAR *)entry->argdata;
+	    register Py_ssize_t ml = entry->arglen;
+	    register TE_CHAR *tx = &text[x];
 
-	    case MATCH_ISNOT: 
-		    
-		{
-		    DPRINTF("\nIsNot :\n"
-			    " looking for   = '%.40s'\n"
-			    " in string     = '%.40s'\n",m,text+x);
+	    DPRINTF("\nAllIn :\n"
+		    " looking for   = '%.40s'\n"
+		    " in string     = '%.40s'\n",m,tx);
 	    
-		    if (*(&text[x]) != *m)
-			x++;
-		    break;
-		}
-
-	    case MATCH_ISIN:
-
-		{
-		    register Py_ssize_t ml = TE_STRING_GET_SIZE(match);
-		    register TE_CHAR ctx = text[x];
+	    if (ml > 1)
+		for (; x < sliceright; tx++, x++) {
 		    register Py_ssize_t j;
 		    register TE_CHAR *mj = m;
-
-		    DPRINTF("\nIsIn :\n"
-			    " looking for   = '%.40s'\n"
-			    " in string     = '%.40s'\n",m,text+x);
-	    
+		    register TE_CHAR ctx = *tx;
 		    for (j=0; j < ml && ctx != *mj; mj++, j++) ;
-		    if (j != ml) 
-			x++;
-		    break;
+		    if (j == ml) 
+			break;
 		}
-
-	    case MATCH_ISNOTIN:
-
-		{
-		    register Py_ssize_t ml = TE_STRING_GET_SIZE(match);
-		    register TE_CHAR ctx = text[x];
+	    else
+		/* one char only: use faster variant: */
+		for (; x < sliceright && *tx == *m; tx++, x++) ;
+	}
+	goto low_level_done;
+
+    op_allnotin:
+	TE_LOWLEVEL_START();
+	{
+	    register TE_CHAR *m = (TE_CHAR *)entry->argdata;
+	    register Py_ssize_t ml = entry->arglen;
+	    register TE_CHAR *tx = &text[x];
+
+	    DPRINTF("\nAllNotIn :\n"
+		    " looking for   = '%.40s'\n"
+		    " not in string = '%.40s'\n",m,tx);
+	    
+	    if (ml > 1)
+		for (; x < sliceright; tx++, x++) {
 		    register Py_ssize_t j;
 		    register TE_CHAR *mj = m;
-
-		    DPRINTF("\nIsNotIn :\n"
-			    " looking for   = '%.40s'\n"
-			    " not in string = '%.40s'\n",m,text+x);
-	    
+		    register TE_CHAR ctx = *tx;
 		    for (j=0; j < ml && ctx != *mj; mj++, j++) ;
-		    if (j == ml) 
-			x++;
-		    break;
+		    if (j != ml) 
+			break;
 		}
-
-	    case MATCH_WORD:
-
-		{
-		    Py_ssize_t ml1 = TE_STRING_GET_SIZE(match) - 1;
-		    register TE_CHAR *tx = &text[x + ml1];
-		    register Py_ssize_t j = ml1;
-		    register TE_CHAR *mj = &m[j];
-
-		    DPRINTF("\nWord :\n"
-			    " looking for   = '%.40s'\n"
-			    " in string     = '%.40s'\n",m,&text[x]);
+	    else
+		/* one char only: use faster variant: */
+		for (; x < sliceright && *tx != *m; tx++, x++) ;
+	}
+	goto low_level_done;
+
+    op_is: 
+	TE_LOWLEVEL_START();
+	DPRINTF("\nIs :\n"
+		" looking for   = '%.40s'\n"
+		" in string     = '%.40s'\n",
+		(TE_CHAR *)entry->argdata,text+x);
+	if (text[x] == *(TE_CHAR *)entry->argdata)
+	    x++;
+	goto low_level_done;
+
+    op_isnot: 
+	TE_LOWLEVEL_START();
+	DPRINTF("\nIsNot :\n"
+		" looking for   = '%.40s'\n"
+		" in string     = '%.40s'\n",
+		(TE_CHAR *)entry->argdata,text+x);
+	if (text[x] != *(TE_CHAR *)entry->argdata)
+	    x++;
+	goto low_level_done;
+
+    op_isin:
+	TE_LOWLEVEL_START();
+	{
+	    register Py_ssize_t ml = entry->arglen;
+	    register TE_CHAR ctx = text[x];
+	    register Py_ssize_t j;
+	    register TE_CHAR *mj = (TE_CHAR *)entry->argdata;
+
+	    DPRINTF("\nIsIn :\n"
+		    " looking for   = '%.40s'\n"
+		    " in string     = '%.40s'\n",mj,text+x);
 	    
-		    if (x+ml1 >= sliceright) 
-			break;
+	    for (j=0; j < ml && ctx != *mj; mj++, j++) ;
+	    if (j != ml) 
+		x++;
+	}
+	goto low_level_done;
+
+    op_isnotin:
+	TE_LOWLEVEL_START();
+	{
+	    register Py_ssize_t ml = entry->arglen;
+	    register TE_CHAR ctx = text[x];
+	    register Py_ssize_t j;
+	    register TE_CHAR *mj = (TE_CHAR *)entry->argdata;
+
+	    DPRINTF("\nIsNotIn :\n"
+		    " looking for   = '%.40s'\n"
+		    " not in string = '%.40s'\n",mj,text+x);
+	    
+	    for (j=0; j < ml && ctx != *mj; mj++, j++) ;
+	    if (j == ml) 
+		x++;
+	}
+	goto low_level_done;
+
+    op_word:
+	TE_LOWLEVEL_START();
+	{
+	    register TE_CHAR *m = (TE_CHAR *)entry->argdata;
+	    Py_ssize_t ml1 = entry->arglen - 1;
+	    register TE_CHAR *tx = &text[x + ml1];
+	    register Py_ssize_t j = ml1;
+	    register TE_CHAR *mj = &m[j];
+
+	    DPRINTF("\nWord :\n"
+		    " looking for   = '%.40s'\n"
+		    " in string     = '%.40s'\n",m,&text[x]);
+	    
+	    if (x+ml1 >= sliceright) 
+		goto low_level_done;
 		    
-		    /* compare from right to left */
-		    for (; j >= 0 && *tx == *mj;
-			 tx--, mj--, j--) ;
+	    /* compare from right to left */
+	    for (; j >= 0 && *tx == *mj;
+		 tx--, mj--, j--) ;
 
-		    if (j >= 0) /* not matched */
-			x = start; /* reset */
-		    else
-			x += ml1 + 1;
-		    break;
-		}
-
-	    case MATCH_WORDSTART:
-	    case MATCH_WORDEND:
-
-		{
-		    Py_ssize_t ml1 = TE_STRING_GET_SIZE(match) - 1;
-		    register TE_CHAR *tx = &text[x];
+	    if (j >= 0) /* not matched */
+		x = start; /* reset */
+	    else
+		x += ml1 + 1;
+	}
+	goto low_level_done;
+
+    op_wordstart:
+    op_wordend:
+	TE_LOWLEVEL_START();
+	{
+	    register TE_CHAR *m = (TE_CHAR *)entry->argdata;
+	    Py_ssize_t ml1 = entry->arglen - 1;
+	    register TE_CHAR *tx = &text[x];
 			    
-		    DPRINTF("\nWordStart/End :\n"
-			    " looking for   = '%.40s'\n"
-			    " in string     = '%.40s'\n",m,tx);
-
-		    /* Brute-force method; from right to left */
-		    for (;;) {
-			register Py_ssize_t j = ml1;
-			register TE_CHAR *mj = &m[j];
-
-			if (x+j >= sliceright) {
-			    /* reached eof: no match, rewind */
-			    x = start;
-			    break;
-			}
+	    DPRINTF("\nWordStart/End :\n"
+		    " looking for   = '%.40s'\n"
+		    " in string     = '%.40s'\n",m,tx);
 
-			/* scan from right to left */
-			for (tx += j; j >= 0 && *tx == *mj; 
-			     tx--, mj--, j--) ;
-			/*
-			DPRINTF("match text[%ld+%ld]: %c == %c\n",
-				x,j,*tx,*mj);
-			*/
-
-			if (j < 0) {
-			    /* found */
-			    if (cmd == MATCH_WORDEND) 
-				x += ml1 + 1;
-			    break;
-			}
-			/* not found: rewind and advance one char */
-			tx -= j - 1;
-			x++;
-		    }
+	    /* Brute-force method; from right to left */
+	    for (;;) {
+		register Py_ssize_t j = ml1;
+		register TE_CHAR *mj = &m[j];
+
+		if (x+j >= sliceright) {
+		    /* reached eof: no match, rewind */
+		    x = start;
 		    break;
 		}
 
-#if (TE_TABLETYPE == MXTAGTABLE_STRINGTYPE)
-
-	    /* Note: These two only work for 8-bit set strings. */
-	    case MATCH_ALLINSET:
-
-		{
-		    register TE_CHAR *tx = &text[x];
-		    unsigned char *m = (unsigned char *)PyString_AS_STRING(match);
+		/* scan from right to left */
+		for (tx += j; j >= 0 && *tx == *mj; 
+		     tx--, mj--, j--) ;
+		/*
+		DPRINTF("match text[%ld+%ld]: %c == %c\n",
+			x,j,*tx,*mj);
+		*/
 
-		    DPRINTF("\nAllInSet :\n"
-			    " looking for   = set at 0x%lx\n"
-			    " in string     = '%.40s'\n",(long)match,tx);
-	    
-		    for (;
-			 x < sliceright &&
-			 (m[((unsigned char)*tx) >> 3] & 
-			  (1 << (*tx & 7))) > 0;
-			 tx++, x++) ;
-		
+		if (j < 0) {
+		    /* found */
+		    if (cmd == MATCH_WORDEND) 
+			x += ml1 + 1;
 		    break;
 		}
+		/* not found: rewind and advance one char */
+		tx -= j - 1;
+		x++;
+	    }
+	}
+	goto low_level_done;
 
-	    case MATCH_ISINSET:
-
-		{
-		    register TE_CHAR *tx = &text[x];
-		    unsigned char *m = (unsigned char *)PyString_AS_STRING(match);
+	/* Note: These two only work for 8-bit set strings; the Tag
+	   Table compiler also uses them for AllIn, AllNotIn, IsIn,
+	   IsNotIn and the CharSet commands in 8-bit tables. */
+    op_allinset:
+	TE_LOWLEVEL_START();
+#if (TE_TABLETYPE == MXTAGTABLE_STRINGTYPE)
+	{
+	    mxscan_set *m = (mxscan_set *)entry->argdata;
 
-		    DPRINTF("\nIsInSet :\n"
-			    " looking for   = set at 0x%lx\n"
-			    " in string     = '%.40s'\n",(long)match,tx);
+	    DPRINTF("\nAllInSet :\n"
+		    " looking for   = set at 0x%lx\n"
+		    " in string     = '%.40s'\n",(long)m,&text[x]);
 	    
-		    if (x < sliceright &&
-			(m[((unsigned char)*tx) >> 3] & 
-			 (1 << (*tx & 7))) > 0)
-			x++;
-		
-		    break;
-		}
-
+	    x = mxscan_find(m, (unsigned char *)text, x, sliceright, 0);
+	}
 #endif
+	goto low_level_done;
 
-	    case MATCH_ALLINCHARSET:
-
-		{
-		    Py_ssize_t matching;
+    op_isinset:
+	TE_LOWLEVEL_START();
+#if (TE_TABLETYPE == MXTAGTABLE_STRINGTYPE)
+	{
+	    register unsigned char *tx = (unsigned char *)&text[x];
+	    register unsigned char *m = (unsigned char *)entry->argdata;
 
-		    DPRINTF("\nAllInCharSet :\n"
-			    " looking for   = CharSet at 0x%lx\n"
-			    " in string     = '%.40s'\n",
-			    (long)match, &text[x]);
+	    DPRINTF("\nIsInSet :\n"
+		    " looking for   = set at 0x%lx\n"
+		    " in string     = '%.40s'\n",(long)m,tx);
+	    
+	    if ((m[*tx >> 3] & (1 << (*tx & 7))) > 0)
+		x++;
+	}
+#endif
+	goto low_level_done;
+
+	/* These two are only used for Unicode tables */
+    op_allincharset:
+	TE_LOWLEVEL_START();
+	{
+	    Py_ssize_t matching;
+
+	    DPRINTF("\nAllInCharSet :\n"
+		    " looking for   = CharSet at 0x%lx\n"
+		    " in string     = '%.40s'\n",
+		    (long)match, &text[x]);
 		    
-		    matching = mxCharSet_Match(match,
-					       textobj,
-					       x,
-					       sliceright,
-					       1);
-		    if (matching < 0)
-			goto onError;
-		    x += matching;
-		    break;
-		}
-
-	    case MATCH_ISINCHARSET:
+	    matching = mxCharSet_Match(match,
+				       textobj,
+				       x,
+				       sliceright,
+				       1);
+	    if (matching < 0)
+		goto onError;
+	    x += matching;
+	}
+	goto low_level_done;
 
-		{
-		    int test;
+    op_isincharset:
+	TE_LOWLEVEL_START();
+	{
+	    int test;
 
-		    DPRINTF("\nIsInCharSet :\n"
-			    " looking for   = CharSet at 0x%lx\n"
-			    " in string     = '%.40s'\n",
-			    (long)match, &text[x]);
+	    DPRINTF("\nIsInCharSet :\n"
+		    " looking for   = CharSet at 0x%lx\n"
+		    " in string     = '%.40s'\n",
+		    (long)match, &text[x]);
 
 #if (TE_TABLETYPE == MXTAGTABLE_STRINGTYPE)
-		    test = mxCharSet_ContainsChar(match, text[x]);
+	    test = mxCharSet_ContainsChar(match, text[x]);
 #else
-		    test = mxCharSet_ContainsUnicodeChar(match, text[x]);
+	    test = mxCharSet_ContainsUnicodeChar(match, text[x]);
 #endif
-		    if (test < 0)
-			goto onError;
-		    if (test)
-			x++;
-		    break;
-		}
-
-	    }
+	    if (test < 0)
+		goto onError;
+	    if (test)
+		x++;
+	}
 
-	low_level_done:
+    low_level_done:
 	    
-	    /* Not matched */
-	    if (x == start) { 
-		DPRINTF(" (no success)\n");
-		if (jne == 0) { 
-		    /* failed */
-		    rc = 1; 
-		    goto finished; 
-		}
-		else 
-		    je = jne;
-		goto next_entry;
+	/* Not matched */
+	if (x == start) { 
+	    DPRINTF(" (no success)\n");
+	    if (jne == 0) { 
+		/* failed */
+		rc = 1; 
+		goto finished; 
 	    }
+	    else 
+		je = jne;
+	    goto next_entry;
+	}
 
-	    /* Matched */
-	    if (entry->tagobj) { 
-		if (TE_HANDLE_MATCH(flags,
-				    textobj,
-				    taglist,
-				    entry->tagobj,
-				    start,x,
-				    NULL,
-				    context) < 0)
-		    goto onError;
-		DPRINTF(" [%ld:%ld] (matched and remembered this slice)\n",
-			(long)start, (long)x);
-	    }
-	    else
-		DPRINTF(" [%ld:%ld] (matched but not saved)\n",
-			(long)start, (long)x);
-
-	    if (flags & MATCH_LOOKAHEAD) {
-		x = start;
-		DPRINTF(" LOOKAHEAD flag set: reseting position to %ld\n",
-			(long)x);
-	    }
+	/* Matched */
+	if (entry->tagobj) { 
+	    if (TE_HANDLE_MATCH(flags,
+				textobj,
+				taglist,
+				entry->tagobj,
+				start,x,
+				NULL,
+				context) < 0)
+		goto onError;
+	    DPRINTF(" [%ld:%ld] (matched and remembered this slice)\n",
+		    (long)start, (long)x);
+	}
+	else
+	    DPRINTF(" [%ld:%ld] (matched but not saved)\n",
+		    (long)start, (long)x);
 
-	    goto next_entry;
+	if (flags & MATCH_LOOKAHEAD) {
+	    x = start;
+	    DPRINTF(" LOOKAHEAD flag set: reseting position to %ld\n",
+		    (long)x);
 	}
-	
-	/* Jumps & low-level special commands */
 
-	if (cmd < MATCH_MAX_SPECIALS) {
+	goto next_entry;
 	
-	    switch (cmd) {
+	/* Jumps & low-level special commands */
 
-	    case MATCH_FAIL: /* == MATCH_JUMP */
+    op_fail: /* == Jump */
 
-		if (jne == 0) { /* match failed */
-		    rc = 1;
-		    goto finished; 
-		}
-		else 
-		    je = jne;
-		goto next_entry;
+	if (jne == 0) { /* match failed */
+	    rc = 1;
+	    goto finished; 
+	}
+	else 
+	    je = jne;
+	goto next_entry;
 	    
-	    case MATCH_SKIP:
+    op_skip:
 
-		DPRINTF("\nSkip %ld characters\n"
-			" in string    = '%.40s'\n",
-			PyInt_AS_LONG(match),text+x);
+	DPRINTF("\nSkip %ld characters\n"
+		" in string    = '%.40s'\n",
+		(long)entry->arglen,text+x);
 
-		start = x;
-		x += PyInt_AS_LONG(match);
-		break;
+	start = x;
+	x += entry->arglen;
+	goto special_done;
 
-	    case MATCH_MOVE:
+    op_move:
 
-		start = x;
-		x = PyInt_AS_LONG(match);
-		if (x < 0)
-		    /* Relative to end of the slice */
-		    x += sliceright + 1;
-		else
-		    /* Relative to beginning of the slice */
-		    x += sliceleft;
+	start = x;
+	x = entry->arglen;
+	if (x < 0)
+	    /* Relative to end of the slice */
+	    x += sliceright + 1;
+	else
+	    /* Relative to beginning of the slice */
+	    x += sliceleft;
 
-		DPRINTF("\nMove to position %ld \n"
-			" string       = '%.40s'\n",
-			(long)x, text+x);
-		break;
+	DPRINTF("\nMove to position %ld \n"
+		" string       = '%.40s'\n",
+		(long)x, text+x);
+	goto special_done;
 		
-	    case MATCH_EOF:
+    op_eof:
 
-		DPRINTF("\nEOF at position %ld ? \n"
-			" string       = '%.40s'\n",
-			(long)x, text+x);
-
-		if (x < sliceright) { /* not matched */
-		    DPRINTF(" (no success)\n");
-		    if (jne == 0) { /* match failed */
-			rc = 1;
-			goto finished; 
-		    }
-		    else 
-			je = jne;
-		    goto next_entry;
-		}
+	DPRINTF("\nEOF at position %ld ? \n"
+		" string       = '%.40s'\n",
+		(long)x, text+x);
 
-		/* Matched & finished */
-		x = sliceright;
-		if (entry->tagobj) {
-		    if (TE_HANDLE_MATCH(flags,
-					textobj,
-					taglist,
-					entry->tagobj,
-					x, x,
-					NULL,
-					context) < 0)
-			goto onError;
-		    DPRINTF(" [%ld:%ld] (matched and remembered this slice)\n",
-			    (long)x, (long)x);
-		}
-		else
-		    DPRINTF(" [%ld:%ld] (matched but not saved)\n",
-			    (long)x, (long)x);
-		rc = 2;
-		goto finished;
+	if (x < sliceright) { /* not matched */
+	    DPRINTF(" (no success)\n");
+	    if (jne == 0) { /* match failed */
+		rc = 1;
+		goto finished; 
+	    }
+	    else 
+		je = jne;
+	    goto next_entry;
+	}
 
-	    case MATCH_JUMPTARGET:
+	/* Matched & finished */
+	x = sliceright;
+	if (entry->tagobj) {
+	    if (TE_HANDLE_MATCH(flags,
+				textobj,
+				taglist,
+				entry->tagobj,
+				x, x,
+				NULL,
+				context) < 0)
+		goto onError;
+	    DPRINTF(" [%ld:%ld] (matched and remembered this slice)\n",
+		    (long)x, (long)x);
+	}
+	else
+	    DPRINTF(" [%ld:%ld] (matched but not saved)\n",
+		    (long)x, (long)x);
+	rc = 2;
+	goto finished;
 
-		DPRINTF("\nJumpTarget '%.40s'\n",
-			PyString_AsString(match));
+    op_jumptarget:
 
-		if (entry->tagobj) {
-		    if (TE_HANDLE_MATCH(flags,
-					textobj,
-					taglist,
-					entry->tagobj,
-					x, x,
-					NULL,
-					context) < 0)
-			goto onError;
-		    DPRINTF(" [%ld:%ld] (matched and remembered this slice)\n",
-			    (long)x, (long)x);
-		}
-		else
-		    DPRINTF(" [%ld:%ld] (matched but not saved)\n",
-			    (long)x, (long)x);
-		goto next_entry;
-	    
-	    }
+	DPRINTF("\nJumpTarget '%.40s'\n",
+		PyString_AsString(match));
 
-	    /* Matched */
-	    if (x < 0)
-		Py_ErrorWithArg(PyExc_TypeError,
-				"Tag Table entry %ld: "
-				"moved/skipped beyond start of text",
-				(long)i);
+	if (entry->tagobj) {
+	    if (TE_HANDLE_MATCH(flags,
+				textobj,
+				taglist,
+				entry->tagobj,
+				x, x,
+				NULL,
+				context) < 0)
+		goto onError;
+	    DPRINTF(" [%ld:%ld] (matched and remembered this slice)\n",
+		    (long)x, (long)x);
+	}
+	else
+	    DPRINTF(" [%ld:%ld] (matched but not saved)\n",
+		    (long)x, (long)x);
+	goto next_entry;
+
+    special_done:
+
+	/* Matched */
+	if (x < 0) {
+	    TE_NOGIL_BAILOUT();
+	    Py_ErrorWithArg(PyExc_TypeError,
+			    "Tag Table entry %ld: "
+			    "moved/skipped beyond start of text",
+			    (long)i);
+	}
 	    
-	    if (entry->tagobj) {
-		if (TE_HANDLE_MATCH(flags,
-				    textobj,
-				    taglist,
-				    entry->tagobj,
-				    start, x,
-				    NULL,
-				    context) < 0)
-		    goto onError;
-		DPRINTF(" [%ld:%ld] (matched and remembered this slice)\n",
-			(long)start, (long)x);
-	    }
-	    else
-		DPRINTF(" [%ld:%ld] (matched but not saved)\n",
-			(long)start, (long)x);
-
-	    if (flags & MATCH_LOOKAHEAD) {
-		x = start;
-		DPRINTF(" LOOKAHEAD flag set: reseting position to %ld\n",
-			(long)x);
-	    }
+	if (entry->tagobj) {
+	    if (TE_HANDLE_MATCH(flags,
+				textobj,
+				taglist,
+				entry->tagobj,
+				start, x,
+				NULL,
+				context) < 0)
+		goto onError;
+	    DPRINTF(" [%ld:%ld] (matched and remembered this slice)\n",
+		    (long)start, (long)x);
+	}
+	else
+	    DPRINTF(" [%ld:%ld] (matched but not saved)\n",
+		    (long)start, (long)x);
 
-	    goto next_entry;
+	if (flags & MATCH_LOOKAHEAD) {
+	    x = start;
+	    DPRINTF(" LOOKAHEAD flag set: reseting position to %ld\n",
+		    (long)x);
 	}
 
+	goto next_entry;
+
 	/* Higher level matching and special commands */
 
+    high_level:
 	switch (cmd) {
 
 	case MATCH_SWORDSTART:
@@ -716,9 +766,12 @@ int TE_ENGINE_API(PyObject *textobj,
 		    taglist_len = 0;
 		}
 		else {
-		    /* Use taglist as subtaglist */
+		    /* Use taglist as subtaglist; taglist is always None
+		       in runs without the GIL, which must not touch
+		       reference counts */
 		    subtags = taglist;
-		    Py_INCREF(subtags);
+		    if (!nogil)
+			Py_INCREF(subtags);
 		    if (taglist != Py_None) {
 			taglist_len = PyList_Size(taglist);
 			if (taglist_len < 0)
@@ -733,11 +786,15 @@ int TE_ENGINE_API(PyObject *textobj,
 		start = x;
 
 		/* match other table */
-		newrc = TE_ENGINE_API(textobj, start, sliceright,
-				      (mxTagTableObject *)match, 
-				      subtags, context, &y,
-				      level + 1);
-		if (newrc == 0) {
+		newrc = TE_ENGINE_IMPL(textobj, start, sliceright,
+				       (mxTagTableObject *)match, 
+				       subtags, context, &y,
+				       level + 1, nogil);
+		if (nogil) {
+		    if (newrc == TE_RC_NEEDGIL)
+			return newrc;
+		}
+		else if (newrc == 0) {
 		    Py_DECREF(subtags);
 		    goto onError;
 		}
@@ -758,7 +815,8 @@ int TE_ENGINE_API(PyObject *textobj,
 		    if (jne == 0) {
 			/* match failed */
 			rc = 1; 
-			Py_DECREF(subtags);
+			if (!nogil)
+			    Py_DECREF(subtags);
 			goto finished;
 		    }
 		    else 
@@ -771,7 +829,7 @@ int TE_ENGINE_API(PyObject *textobj,
 		    x = y;
 
 		    /* Use None as subtaglist for the match entry for SUBTABLE */
-		    if (cmd == MATCH_SUBTABLE) {
+		    if (cmd == MATCH_SUBTABLE && !nogil) {
 			Py_DECREF(subtags);
 			Py_INCREF(Py_None);
 			subtags = Py_None;
@@ -802,7 +860,8 @@ int TE_ENGINE_API(PyObject *textobj,
 				(long)x);
 		    }
 		}
-		Py_DECREF(subtags);
+		if (!nogil)
+		    Py_DECREF(subtags);
 	    }
 	    goto next_entry;
 	    
@@ -872,10 +931,10 @@ int TE_ENGINE_API(PyObject *textobj,
 		start = x;
 
 		/* match other table */
-		newrc = TE_ENGINE_API(textobj, start, sliceright,
-				      (mxTagTableObject *)match, 
-				      subtags, context, &y,
-		                      level + 1);
+		newrc = TE_ENGINE_IMPL(textobj, start, sliceright,
+				       (mxTagTableObject *)match, 
+				       subtags, context, &y,
+				       level + 1, 0);
 		if (newrc == 0) {
 		    Py_DECREF(subtags);
 		    Py_DECREF(match);
@@ -1144,12 +1203,14 @@ int TE_ENGINE_API(PyObject *textobj,
 	    rc = 1; /* Not Ok */
 	else if (x > sliceright)
 	    rc = 1; /* Not Ok */
-	else
+	else {
+	    TE_NOGIL_BAILOUT();
 	    Py_ErrorWithArg(PyExc_StandardError,
 			    "Internal Error: "
 			    "tagging engine finished with no proper result "
 			    "at position %ld in table",
 			    (long)i);
+	}
     }
 
     DPRINTF("\nTag Engine finished: %s; Tag Table entry %ld; position %ld\n",
@@ -1166,6 +1227,67 @@ int TE_ENGINE_API(PyObject *textobj,
     return rc;
 }
 
+/* mxTextTools_TaggingEngine(): a table driven parser engine
+
+   Parameters:
+    textobj          - text object to work on
+    text_start       - left text slice index
+    text_stop        - right text slice index
+    table            - tag table object defining the parser
+    taglist          - tag list to append matches to
+    context          - optional context object; may be NULL
+    *next            - output parameter: set to the next index in text
+    level            - stack level; should be 0 on the first level
+  
+   Return codes:
+    rc = 2: match ok
+    rc = 1: match failed
+    rc = 0: error
+
+   Notes:
+   - doesn't check type of passed arguments !
+   - doesn't increment reference counts of passed objects !
+   - the GIL is released while matching on level 0 if the table
+     doesn't need it and no tags can end up in taglist; other
+     threads may then run, so large texts can be tagged in parallel
+
+*/
+
+int TE_ENGINE_API(PyObject *textobj,
+		  Py_ssize_t sliceleft,	
+		  Py_ssize_t sliceright,	
+		  mxTagTableObject *table,
+		  PyObject *taglist,
+		  PyObject *context,
+		  Py_ssize_t *next,
+                  int level)
+{
+#ifndef MAL_DEBUG
+    /* Tables without tag objects never append to taglist, so they
+       can be run with taglist None just as well */
+    if (level == 0 &&
+	sliceright - sliceleft >= TE_NOGIL_MINSIZE &&
+	TE_STRING_CHECK(textobj) &&
+	mxTagTable_Check(table) &&
+	!(table->flags & MXTAGTABLE_NEEDSGIL) &&
+	(taglist == Py_None ||
+	 !(table->flags & MXTAGTABLE_TAGOBJECTS))) {
+	int rc;
+	
+	Py_BEGIN_ALLOW_THREADS
+	rc = TE_ENGINE_IMPL(textobj, sliceleft, sliceright,
+			    table, Py_None, context, next,
+			    0, 1);
+	Py_END_ALLOW_THREADS
+	if (rc != TE_RC_NEEDGIL)
+	    return rc;
+    }
+#endif
+    return TE_ENGINE_IMPL(textobj, sliceleft, sliceright,
+			  table, taglist, context, next,
+			  level, 0);
+}
+
 /*
   What to do with a successful match depends on the value of flags:
 
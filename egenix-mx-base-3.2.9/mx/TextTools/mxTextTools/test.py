@@ -685,6 +685,190 @@ while 1:
         ts = TextSearch(unicode('test'))
         assert ts.algorithm == TRIVIAL
 
+        print 'TextSearch() object (Trivial; Unicode, long)'
+        # Characters sharing the low byte with 'a' and 't'
+        a = unichr(0x161)
+        t = unichr(0x4e74)
+        match = unicode('abc') * 8
+        ts = TextSearch(match, algorithm=TRIVIAL)
+        text = unicode('ab') + match[:-1] + a + match + match[1:]
+        assert ts.search(text) == (26, 50)
+        assert ts.findall(text) == [(26, 50)]
+        assert ts.search(text, 27) == (27, 27)
+        assert ts.search(match.replace(unicode('a'), a)) == (0, 0)
+        match = unicode('the quick brown fox')
+        ts = TextSearch(match, algorithm=TRIVIAL)
+        text = match.replace(unicode('t'), t) + unicode(' ') + match
+        assert ts.search(text) == (20, 39)
+        assert ts.find(text[:-1]) == -1
+        assert ts.search(str(text[20:])) == (0, 19)
+        ts = TextSearch(a + unicode('x') + a, algorithm=TRIVIAL)
+        assert ts.findall(unicode('ax') + a + unicode('ax') + a +
+                          unicode('x') + a) == [(5, 8)]
+
+    print 'TextSearch() object (Aho-Corasick)'
+    ts = TextSearch(['test', 'tester', 'est', 'xyz'])
+    assert ts.algorithm == AHOCORASICK
+    assert ts.match == ('test', 'tester', 'est', 'xyz')
+    assert ts.search('    test') == (4, 8)
+    assert ts.search('    tester   ') == (4, 10)
+    assert ts.search('    tes xyz') == (8, 11)
+    assert ts.search('    abc   ') == (0, 0)
+    assert ts.search('  test  ', 3) == (3, 6)
+    assert ts.search('  test  ', 0, 5) == (0, 0)
+    assert ts.find('  xyz test') == 2
+    assert ts.find('    abd   ') == -1
+    assert ts.findall('tester test xyzest') == [(0, 6), (7, 11), (12, 15),
+                                                 (15, 18)]
+    assert ts.findall('   abc def  ') == []
+    # The leftmost match wins, even if a shorter one ends earlier
+    ts = TextSearch(('abcd', 'bc'))
+    assert ts.search('xabcd') == (1, 5)
+    assert ts.search('xabce') == (2, 4)
+    ts = TextSearch(('test', 'xyz'), 'x'*256)
+    assert ts.search('    test') == (0, 0)
+    ts = TextSearch(('TEST', 'XYZ'), to_upper)
+    assert ts.findall('  test xyZ') == [(2, 6), (7, 10)]
+    ts = TextSearch('test', algorithm=AHOCORASICK)
+    assert ts.match == ('test',)
+    assert ts.findall('    test  test  ') == [(4, 8), (10, 14)]
+    ts1 = pickle.loads(pickle.dumps(TextSearch(['test', 'xyz'])))
+    assert ts1.algorithm == AHOCORASICK and ts1.match == ('test', 'xyz')
+    for badmatch in ((), ('test', ''), ('test', 1), 1):
+        try:
+            TextSearch(badmatch, algorithm=AHOCORASICK)
+        except (TypeError, ValueError):
+            pass
+        else:
+            raise AssertionError,'accepted %r' % (badmatch,)
+    kwtable = (('kw', sFindWord, TextSearch(('foo', 'bar', 'foobar')),
+                +1, -0),
+               (None, EOF, Here, MatchOk, MatchOk))
+    assert tag('xx foobar y bar', kwtable) == \
+           (1, [('kw', 3, 9, None), ('kw', 12, 15, None)], 15)
+    kwtext = 'hello world foo bar ' * 1000
+    assert len(tag(kwtext, kwtable)[1]) == 2000
+    if HAVE_UNICODE:
+        print 'TextSearch() object (Aho-Corasick; Unicode)'
+        ts = TextSearch([unicode('test'), unicode('\xe4\xf6', 'latin-1'),
+                         'xyz'])
+        assert ts.search(unicode('    test')) == (4, 8)
+        assert ts.search(unicode('  \xe4\xf6 xyz', 'latin-1')) == (2, 4)
+        assert ts.findall(unicode('xyz test  ')) == [(0, 3), (4, 8)]
+        assert ts.find(unicode('    abd   ')) == -1
+        assert ts.search('    test') == (4, 8)
+        assert tag(unicode('xx foobar y bar'), kwtable) == \
+               (1, [('kw', 3, 9, None), ('kw', 12, 15, None)], 15)
+        assert len(tag(unicode(kwtext), kwtable)[1]) == 2000
+        try:
+            TextSearch(('test',), to_upper).search(unicode('test'))
+        except TypeError:
+            pass
+        else:
+            raise AssertionError,'translate works with Unicode'
+
+    print 'Tagging Engine without the GIL'
+    import threading
+    wordtable = (
+        (None, AllIn, whitespace, +1),
+        (None, EOF, Here, +1, MatchOk),
+        ('word', AllNotIn, whitespace, MatchFail, -2),
+        )
+    notagstable = (
+        (None, AllInCharSet, CharSet(whitespace), +1),
+        (None, EOF, Here, +1, MatchOk),
+        (None, Table, ((None, AllNotIn, whitespace),), MatchFail, -2),
+        )
+    words = 'hello world  foo\tbar ' * 1000
+    assert tag(words, wordtable, 0, len(words), None) == (1, None, len(words))
+    assert tag(words, notagstable) == (1, [], len(words))
+    assert len(tag(words, wordtable)[1]) == 4000
+    results = []
+    def tagwords(words=words, results=results):
+        results.append((tag(words, wordtable, 0, len(words), None),
+                        tag(words, notagstable)))
+    threads = [threading.Thread(target=tagwords) for i in range(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert results == [((1, None, len(words)), (1, [], len(words)))] * 4
+    # Errors are raised as usual
+    try:
+        tag('x' * 10000, ((None, Skip, -10),))
+    except TypeError:
+        pass
+    else:
+        raise AssertionError('missing error for Skip')
+    try:
+        tag('x' * 10000, ((None, Is, 'x', MatchFail),
+                          (None, Table, ThisTable)))
+    except RuntimeError:
+        pass
+    else:
+        raise AssertionError('missing recursion limit detection')
+    ts = TextSearch('xy')
+    assert tag('x' * 10000 + 'xy', ((None, sFindWord, ts),),
+               0, 10002, None) == (1, None, 10002)
+    if HAVE_UNICODE:
+        uwords = unicode(words)
+        assert tag(uwords, UnicodeTagTable(wordtable),
+                   0, len(uwords), None) == (1, None, len(uwords))
+
+    print 'Tag Table lowering'
+    # 8-bit tables test multi-character arguments and CharSets
+    # using set bitmaps; results must not differ from Unicode tables
+    lowertable = (
+        ('allin', AllIn, 'ab', +1),
+        ('allnotin', AllNotIn, 'ab', +1),
+        ('isin', IsIn, 'x', +1),
+        ('isin2', IsIn, 'xy', +1),
+        ('isnotin', IsNotIn, 'x', +1),
+        ('isnotin2', IsNotIn, 'ab', +1),
+        ('charset', AllInCharSet, CharSet('^a-c'), +1),
+        ('ischarset', IsInCharSet, CharSet('a-c'), +1),
+        (None, EOF, Here, -8),
+        )
+    for lowertext in ('abba xyz\xe4b', 'xy', 'aaab', '\xff\x00ab', 'c', 'xbx'):
+        result = tag(lowertext, lowertable)
+        if HAVE_UNICODE:
+            assert result == tag(unicode(lowertext, 'latin-1'), lowertable)
+    assert tag('abba xyz\xe4b', lowertable) == \
+           (1, [('allin', 0, 4, None), ('allnotin', 4, 9, None),
+                ('isnotin', 9, 10, None)], 10)
+    assert tag('xbx', lowertable) == \
+           (1, [('allnotin', 0, 1, None), ('isnotin', 1, 2, None),
+                ('isnotin2', 2, 3, None)], 3)
+    assert tag('xaxb', ((None, AllIn, 'ab'),))[0] == 0
+    assert tag('xaxb', ((None, AllNotIn, 'ab'),))[2] == 1
+
+    print 'Set scanning'
+    # Long runs are scanned in blocks of 16 or 32 characters; test
+    # all positions around the block boundaries, with characters
+    # from both halves of the 8-bit range
+    scanset = set('a\xe4')
+    scancharset = CharSet('a\xe4')
+    for length in range(70):
+        for pos in range(length):
+            for fill, other in (('a', 'b'), ('\xe4', '\xfc'),
+                                ('a', '\x00'), ('\xe4', '\x7f')):
+                scantext = fill * pos + other + fill * (length - pos - 1)
+                assert setfind(scantext, set(other)) == pos
+                assert tag(scantext, ((None, AllInSet, scanset),))[2] == pos
+                assert tag(scantext,
+                           ((None, AllInCharSet, scancharset),))[2] == pos
+                assert tag(scantext, ((None, AllIn, 'a\xe4'),))[2] == pos
+                assert scancharset.search(scantext) == 0 or pos == 0
+                assert scancharset.match(scantext) == pos
+                assert scancharset.match(scantext, -1) == length - pos - 1
+                assert setstrip(scantext, scanset) == other
+                assert setsplit(scantext, set(other)) == \
+                       [x for x in (fill * pos, fill * (length - pos - 1))
+                        if x]
+                assert setsplitx(scantext, set(other)) == \
+                       [fill * pos, other] + \
+                       [x for x in (fill * (length - pos - 1),) if x]
+
     print 'is_whitespace()'
     assert is_whitespace('   \t\r') == 1
     assert is_whitespace(' 123  ') == 0